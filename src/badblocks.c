@@ -368,14 +368,17 @@ static int64_t do_read (HANDLE hDrive, unsigned char * buffer, uint64_t tryout,
 					    uint64_t block_size, blk64_t current_block)
 {
 	int64_t got;
+	uint64_t start;
 
 	if (v_flag > 1)
 		print_status();
 
 	/* Try the read */
+	start = IoStatsNow();
 	got = read_sectors(hDrive, block_size, current_block, tryout, buffer);
 	if (got < 0)
 		got = 0;
+	IoStatsAdd(IOSTAT_READ, got, start);
 	if (got & 511)
 		uprintf("%sWeird value (%lld) in do_read\n", bb_prefix, got);
 	got /= block_size;
@@ -390,14 +393,17 @@ static int64_t do_write(HANDLE hDrive, unsigned char * buffer, uint64_t tryout,
 					    uint64_t block_size, blk64_t current_block)
 {
 	int64_t got;
+	uint64_t start;
 
 	if (v_flag > 1)
 		print_status();
 
 	/* Try the write */
+	start = IoStatsNow();
 	got = write_sectors(hDrive, block_size, current_block, tryout, buffer);
 	if (got < 0)
 		got = 0;
+	IoStatsAdd(IOSTAT_WRITE, got, start);
 	if (got & 511)
 		uprintf("%sWeird value (%lld) in do_write\n", bb_prefix, got);
 	got /= block_size;
@@ -231,6 +231,7 @@ typedef struct transformer_state_t {
 
 	/* Source */
 	int      src_fd;
+	struct prefetch_t *src_prefetch; /* if non-NULL, src_fd is read ahead on a separate thread */
 	/* Output */
 	int      dst_fd;
 	const char *dst_dir;            /* if non-NULL, extract to dir */
@@ -256,6 +257,8 @@ void init_transformer_state(transformer_state_t *xstate) FAST_FUNC;
 ssize_t transformer_write(transformer_state_t *xstate, const void *buf, size_t bufsize) FAST_FUNC;
 ssize_t xtransformer_write(transformer_state_t *xstate, const void *buf, size_t bufsize) FAST_FUNC;
 int check_signature16(transformer_state_t *xstate, unsigned magic16) FAST_FUNC;
+int prefetch_open(transformer_state_t *xstate, unsigned depth) FAST_FUNC;
+void prefetch_close(transformer_state_t *xstate) FAST_FUNC;
 
 static inline int transformer_switch_file(transformer_state_t* xstate)
 {
@@ -289,6 +292,7 @@ static inline int transformer_switch_file(transformer_state_t* xstate)
 }
 
 IF_DESKTOP(long long) int inflate_unzip(transformer_state_t *xstate) FAST_FUNC;
+void inflate_cleanup(void) FAST_FUNC;
 IF_DESKTOP(long long) int unpack_zip_stream(transformer_state_t *xstate) FAST_FUNC;
 IF_DESKTOP(long long) int unpack_Z_stream(transformer_state_t *xstate) FAST_FUNC;
 IF_DESKTOP(long long) int unpack_gz_stream(transformer_state_t *xstate) FAST_FUNC;
@@ -297,6 +301,34 @@ IF_DESKTOP(long long) int unpack_lzma_stream(transformer_state_t *xstate) FAST_F
 IF_DESKTOP(long long) int unpack_xz_stream(transformer_state_t *xstate) FAST_FUNC;
 IF_DESKTOP(long long) int unpack_vtsi_stream(transformer_state_t *xstate) FAST_FUNC;
 IF_DESKTOP(long long) int unpack_zstd_stream(transformer_state_t *xstate) FAST_FUNC;
+IF_DESKTOP(long long) int unpack_7z_stream(transformer_state_t *xstate) FAST_FUNC;
+/* Uncompressed size lookup from the metadata of a compressed file */
+#define SIZE_UNKNOWN    0
+#define SIZE_EXACT      1
+#define SIZE_MOD_4GB    2   /* Only the lower 32 bits of the size of the last part are known */
+int get_zip_size(int fd, uint64_t file_size, uint64_t *size) FAST_FUNC;
+int get_gz_size(int fd, uint64_t file_size, uint64_t *size) FAST_FUNC;
+extern uint32_t gz_nb_members; /* Number of members started by the last unpack_gz_stream() */
+int get_lzma_size(int fd, uint64_t file_size, uint64_t *size) FAST_FUNC;
+int get_xz_size(int fd, uint64_t file_size, uint64_t *size) FAST_FUNC;
+int get_vtsi_size(int fd, uint64_t file_size, uint64_t *size) FAST_FUNC;
+int get_zstd_size(int fd, uint64_t file_size, uint64_t *size) FAST_FUNC;
+int get_7z_size(int fd, uint64_t file_size, uint64_t *size) FAST_FUNC;
+/* Random access, for formats that can be split into blocks that decode on their own */
+typedef struct {
+	uint64_t src_offset;    /* Offset of the block in the compressed file */
+	uint64_t src_size;
+	uint64_t dst_offset;    /* Offset of the decoded data in the uncompressed stream */
+	uint64_t dst_size;
+	uint64_t stream_offset; /* xz: Offset of the header of the stream the block belongs to */
+} seek_block_t;
+seek_block_t *add_seek_block(seek_block_t **blocks, uint32_t *nb_blocks) FAST_FUNC;
+int get_xz_blocks(int fd, uint64_t file_size, seek_block_t **blocks, uint32_t *nb_blocks) FAST_FUNC;
+int get_zstd_blocks(int fd, uint64_t file_size, seek_block_t **blocks, uint32_t *nb_blocks) FAST_FUNC;
+int unpack_xz_block(int fd, const seek_block_t *block, uint8_t *dst) FAST_FUNC;
+int unpack_zstd_block(int fd, const seek_block_t *block, uint8_t *dst) FAST_FUNC;
+IF_DESKTOP(long long) int unpack_xpress_chunk(const uint8_t* src, size_t src_len, uint8_t* dst, size_t dst_len) FAST_FUNC;
+IF_DESKTOP(long long) int unpack_lzx_chunk(const uint8_t* src, size_t src_len, uint8_t* dst, size_t dst_len) FAST_FUNC;
 
 char* append_ext(char *filename, const char *expected_ext) FAST_FUNC;
 int bbunpack(char **argv,
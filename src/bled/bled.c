@@ -16,6 +16,10 @@
 #include "bled.h"
 
 typedef long long int(*unpacker_t)(transformer_state_t *xstate);
+typedef int(*sizer_t)(int fd, uint64_t file_size, uint64_t *size);
+
+/* Number of blocks read ahead of the decompressor by default, for triple buffering */
+#define BLED_PREFETCH_DEPTH	3
 
 /* Globals */
 smallint bb_got_signal;
@@ -31,6 +35,8 @@ jmp_buf bb_error_jmp;
 char* bb_virtual_buf = NULL;
 size_t bb_virtual_len = 0, bb_virtual_pos = 0;
 int bb_virtual_fd = -1;
+int bb_prefetch_fd = -1;
+static uint32_t bled_prefetch_depth = BLED_PREFETCH_DEPTH;
 // ZSTD has a minimal buffer size of (1 << ZSTD_BLOCKSIZELOG_MAX) + ZSTD_blockHeaderSize = 128 KB + 3
 // So we set our bufsize to 256 KB
 uint32_t BB_BUFSIZE = 0x40000;
@@ -49,11 +55,38 @@ unpacker_t unpacker[BLED_COMPRESSION_MAX] = {
 	unpack_lzma_stream,
 	unpack_bz2_stream,
 	unpack_xz_stream,
-	unpack_none,
+	unpack_7z_stream,
 	unpack_vtsi_stream,
 	unpack_zstd_stream,
 };
 
+sizer_t sizer[BLED_COMPRESSION_MAX] = {
+	NULL,
+	get_zip_size,
+	NULL,
+	get_gz_size,
+	get_lzma_size,
+	NULL,
+	get_xz_size,
+	get_7z_size,
+	get_vtsi_size,
+	get_zstd_size,
+};
+
+/* The unpackers that never seek on their source, and can therefore have it read ahead */
+static const bool prefetchable[BLED_COMPRESSION_MAX] = {
+	false,
+	false,	/* zip reads the central directory at the end of the archive */
+	true,
+	true,
+	true,
+	true,
+	true,
+	false,	/* 7z reads its header at the end of the archive, then seeks to each folder */
+	false,	/* vtsi reads its trailer first */
+	true,
+};
+
 /* Uncompress file 'src', compressed using 'type', to file 'dst' */
 int64_t bled_uncompress(const char* src, const char* dst, int type)
 {
@@ -87,12 +120,16 @@ int64_t bled_uncompress(const char* src, const char* dst, int type)
 		goto err;
 	}
 
+	if (prefetchable[type])
+		prefetch_open(&xstate, bled_prefetch_depth);
+
 	if (setjmp(bb_error_jmp))
 		goto err;
 
 	ret = unpacker[type](&xstate);
 
 err:
+	prefetch_close(&xstate);
 	free(xstate.dst_name);
 	if (xstate.src_fd > 0)
 		_close(xstate.src_fd);
@@ -105,6 +142,7 @@ err:
 int64_t bled_uncompress_with_handles(HANDLE hSrc, HANDLE hDst, int type)
 {
 	transformer_state_t xstate;
+	int64_t ret = -1;
 
 	if (!bled_initialized) {
 		bb_error_msg("The library has not been initialized");
@@ -133,10 +171,17 @@ int64_t bled_uncompress_with_handles(HANDLE hSrc, HANDLE hDst, int type)
 		return -1;
 	}
 
+	if (prefetchable[type])
+		prefetch_open(&xstate, bled_prefetch_depth);
+
 	if (setjmp(bb_error_jmp))
-		return -1;
+		goto err;
+
+	ret = unpacker[type](&xstate);
 
-	return unpacker[type](&xstate);
+err:
+	prefetch_close(&xstate);
+	return ret;
 }
 
 /* Uncompress file 'src', compressed using 'type', to buffer 'buf' of size 'size' */
@@ -191,6 +236,384 @@ err:
 	return ret;
 }
 
+#define XZ_MAGIC		"\xFD" "7zXZ\0"
+#define SEVENZIP_MAGIC		"7z\xBC\xAF\x27\x1C"
+#define ZSTD_MAGIC		0xFD2FB528
+#define ZSTD_SKIPPABLE_MAGIC	0x184D2A50
+#define ZSTD_SKIPPABLE_MASK	0xFFFFFFF0
+#define ZSTD_MAX_SKIPPABLE	16
+
+/*
+ * LZMA alone has no magic, so it is only probed for when the file is named as such, and the
+ * header must then hold the values that the encoders produce. Any other file could otherwise
+ * end up being identified as LZMA, such as a raw image with the right leading bytes.
+ */
+static bool is_lzma_header(const char* src, const uint8_t* buf)
+{
+	const char* ext = strrchr(src, '.');
+	uint32_t dict_size = get_le32(&buf[1]), d;
+	uint64_t dst_size = get_le32(&buf[5]) | ((uint64_t)get_le32(&buf[9]) << 32);
+
+	if (ext == NULL || (_stricmp(ext, ".lzma") != 0 && _stricmp(ext, ".lz") != 0))
+		return false;
+	if (buf[0] >= (9 * 5 * 5) || dict_size < 4096 || buf[13] != 0)
+		return false;
+	/* Dictionary sizes are either 2^n or 2^n + 2^(n-1) */
+	d = dict_size & (dict_size - 1);
+	if (d != 0 && d != (dict_size & (0 - dict_size)) << 1)
+		return false;
+	return dst_size == UINT64_MAX || dst_size < (1ULL << 38);
+}
+
+/*
+ * Identify the compression used by file 'src' from its content rather than its extension,
+ * except for LZMA alone, which has no magic and is only looked for in .lzma or .lz files.
+ * Returns the BLED_COMPRESSION_XXX type, BLED_COMPRESSION_NONE if the content does not
+ * match any of the formats we support, or a negative value on error.
+ */
+int bled_probe(const char* src)
+{
+	uint8_t buf[16];
+	uint64_t file_size, pos = 0, size;
+	int fd, i, n, type = BLED_COMPRESSION_NONE;
+
+	if (!bled_initialized) {
+		bb_error_msg("The library has not been initialized");
+		return -1;
+	}
+
+	if (src == NULL) {
+		bb_error_msg("Invalid parameter");
+		return -1;
+	}
+
+	fd = _openU(src, _O_RDONLY | _O_BINARY, 0);
+	if (fd < 0) {
+		bb_error_msg("Could not open '%s' (errno: %d)", src, errno);
+		return -1;
+	}
+	file_size = _lseeki64(fd, 0, SEEK_END);
+	if ((int64_t)file_size <= 0)
+		goto out;
+
+	// VTSI images are raw data with a trailer, so they must be checked first
+	if (get_vtsi_size(fd, file_size, &size) == SIZE_EXACT) {
+		type = BLED_COMPRESSION_VTSI;
+		goto out;
+	}
+
+	n = read_at(fd, 0, buf, sizeof(buf));
+	// Skippable frames may precede the first zstd frame
+	for (i = 0; i < ZSTD_MAX_SKIPPABLE && n >= 8 && (get_le32(buf) & ZSTD_SKIPPABLE_MASK) == ZSTD_SKIPPABLE_MAGIC; i++) {
+		pos += 8 + (uint64_t)get_le32(&buf[4]);
+		n = (pos < file_size) ? read_at(fd, pos, buf, (unsigned)MIN(8, file_size - pos)) : 0;
+		if (n >= 4 && get_le32(buf) == ZSTD_MAGIC)
+			type = BLED_COMPRESSION_ZSTD;
+	}
+	if (pos != 0 || n < 4)
+		goto out;
+
+	if (n >= 6 && memcmp(buf, XZ_MAGIC, 6) == 0)
+		type = BLED_COMPRESSION_XZ;
+	else if (n >= 6 && memcmp(buf, SEVENZIP_MAGIC, 6) == 0)
+		type = BLED_COMPRESSION_7ZIP;
+	else if (get_le32(buf) == ZSTD_MAGIC)
+		type = BLED_COMPRESSION_ZSTD;
+	else if (memcmp(buf, "BZh", 3) == 0 && buf[3] >= '1' && buf[3] <= '9' && n >= 10 &&
+		(memcmp(&buf[4], "\x31\x41\x59\x26\x53\x59", 6) == 0 || memcmp(&buf[4], "\x17\x72\x45\x38\x50\x90", 6) == 0))
+		type = BLED_COMPRESSION_BZIP2;
+	else if (buf[0] == 0x1F && buf[1] == 0x8B && buf[2] == 0x08)
+		type = BLED_COMPRESSION_GZIP;
+	else if (buf[0] == 0x1F && buf[1] == 0x9D)
+		type = BLED_COMPRESSION_LZW;
+	else if (memcmp(buf, "PK\x03\x04", 4) == 0)
+		type = BLED_COMPRESSION_ZIP;
+	else if (n >= 14 && is_lzma_header(src, buf))
+		type = BLED_COMPRESSION_LZMA;
+
+out:
+	_close(fd);
+	return type;
+}
+
+/* Size of the sample that gets decompressed when the headers don't provide the uncompressed size */
+#define SIZE_SAMPLE_LEN		(8 * 1024 * 1024)
+#define SIZE_4GB		0x100000000ULL
+
+/*
+ * Find the uncompressed size of file 'src', compressed using 'type', without decompressing it.
+ * The size is read from the container metadata when the format provides it, and estimated by
+ * decompressing a small sample otherwise. Returns 1 if the size is exact, 0 if it is an estimate.
+ */
+int bled_get_uncompressed_size(const char* src, int type, uint64_t* size)
+{
+	uint64_t file_size, isize = 0, estimate, k;
+	int64_t out;
+	char* buf = NULL;
+	int fd, r = SIZE_UNKNOWN, ret = -1;
+
+	if (!bled_initialized) {
+		bb_error_msg("The library has not been initialized");
+		return -1;
+	}
+
+	if ((src == NULL) || (size == NULL) || (type < 0) || (type >= BLED_COMPRESSION_MAX)) {
+		bb_error_msg("Invalid parameter");
+		return -1;
+	}
+
+	fd = _openU(src, _O_RDONLY | _O_BINARY, 0);
+	if (fd < 0) {
+		bb_error_msg("Could not open '%s' (errno: %d)", src, errno);
+		return -1;
+	}
+	file_size = _lseeki64(fd, 0, SEEK_END);
+	if (sizer[type] != NULL && (int64_t)file_size > 0)
+		r = sizer[type](fd, file_size, &isize);
+	_close(fd);
+	if (r == SIZE_EXACT) {
+		*size = isize;
+		return 1;
+	}
+
+	// Estimate the size from the compression ratio of the first few megabytes
+	buf = malloc(SIZE_SAMPLE_LEN);
+	if (buf == NULL) {
+		bb_error_msg("Could not allocate sample buffer");
+		return -1;
+	}
+	out = bled_uncompress_to_buffer(src, buf, SIZE_SAMPLE_LEN, type);
+	if (out < 0 || bb_total_rb == 0)
+		goto out;
+	if (out < SIZE_SAMPLE_LEN) {
+		// The whole stream fit in the sample
+		*size = out;
+		ret = 1;
+		goto out;
+	}
+	estimate = (uint64_t)((double)file_size * out / bb_total_rb);
+	// ISIZE only applies to the last member of a multi-member gzip stream, so it can't be used
+	// if the sample already went past the first member. Otherwise, since there is no telling
+	// whether more members follow without decompressing everything, it still is an estimate.
+	if (r == SIZE_MOD_4GB && gz_nb_members == 1) {
+		// Pick the 4 GB wrap of ISIZE that is closest to the estimate
+		k = (estimate > isize) ? (estimate - isize + SIZE_4GB / 2) / SIZE_4GB : 0;
+		estimate = isize + k * SIZE_4GB;
+	}
+	*size = estimate;
+	ret = 0;
+
+out:
+	free(buf);
+	return ret;
+}
+
+/* Number of decoded blocks kept around by bled_pread(), and largest block we accept */
+#define SEEK_CACHE_SLOTS	4
+#define SEEK_MAX_BLOCK_SIZE	(64 * 1024 * 1024)
+
+struct bled_seekable {
+	int fd;
+	int type;
+	uint64_t size;
+	uint32_t nb_blocks;
+	seek_block_t* blocks;
+	uint32_t tick;
+	struct {
+		uint32_t block;
+		uint32_t last_used;
+		uint8_t* data;
+	} cache[SEEK_CACHE_SLOTS];
+};
+
+/* Append a zeroed entry to a block list, that grows 256 entries at a time */
+seek_block_t* FAST_FUNC add_seek_block(seek_block_t** blocks, uint32_t* nb_blocks)
+{
+	seek_block_t* list = *blocks;
+
+	if (*nb_blocks % 256 == 0) {
+		list = realloc(*blocks, ((size_t)*nb_blocks + 256) * sizeof(seek_block_t));
+		if (list == NULL)
+			return NULL;
+		*blocks = list;
+	}
+	memset(&list[*nb_blocks], 0, sizeof(seek_block_t));
+	return &list[(*nb_blocks)++];
+}
+
+static int seek_block_cmp(const void* a, const void* b)
+{
+	const seek_block_t *ba = a, *bb = b;
+
+	return (ba->src_offset > bb->src_offset) - (ba->src_offset < bb->src_offset);
+}
+
+/*
+ * Open file 'src', compressed using 'type', for random access. This requires an index
+ * of independently decodable blocks, which the zstd seekable format and multi-block xz
+ * files provide. Returns NULL if the file can only be decompressed sequentially.
+ */
+bled_seekable_t* bled_open_seekable(const char* src, int type)
+{
+	bled_seekable_t* ctx = NULL;
+	uint64_t file_size, dst_offset = 0;
+	uint32_t i;
+	int r = -1;
+
+	if (!bled_initialized) {
+		bb_error_msg("The library has not been initialized");
+		return NULL;
+	}
+
+	if ((src == NULL) || (type != BLED_COMPRESSION_XZ && type != BLED_COMPRESSION_ZSTD)) {
+		bb_error_msg("Random access is not supported for this compression format");
+		return NULL;
+	}
+
+	ctx = calloc(1, sizeof(bled_seekable_t));
+	if (ctx == NULL)
+		return NULL;
+	ctx->type = type;
+	ctx->fd = _openU(src, _O_RDONLY | _O_BINARY, 0);
+	if (ctx->fd < 0) {
+		bb_error_msg("Could not open '%s' (errno: %d)", src, errno);
+		goto out;
+	}
+	file_size = _lseeki64(ctx->fd, 0, SEEK_END);
+	if ((int64_t)file_size <= 0)
+		goto out;
+	if (type == BLED_COMPRESSION_XZ)
+		r = get_xz_blocks(ctx->fd, file_size, &ctx->blocks, &ctx->nb_blocks);
+	else
+		r = get_zstd_blocks(ctx->fd, file_size, &ctx->blocks, &ctx->nb_blocks);
+	if (r < 0 || ctx->nb_blocks == 0) {
+		r = -1;
+		goto out;
+	}
+
+	// xz indexes are read from the last stream to the first one
+	qsort(ctx->blocks, ctx->nb_blocks, sizeof(seek_block_t), seek_block_cmp);
+	for (i = 0; i < ctx->nb_blocks; i++) {
+		// Single-threaded xz produces a single large block, which is a regular occurrence
+		// rather than an error, so we just let the caller fall back to sequential access
+		if (ctx->blocks[i].dst_size > SEEK_MAX_BLOCK_SIZE || ctx->blocks[i].src_size > SEEK_MAX_BLOCK_SIZE) {
+			r = -1;
+			goto out;
+		}
+		ctx->blocks[i].dst_offset = dst_offset;
+		dst_offset += ctx->blocks[i].dst_size;
+	}
+	ctx->size = dst_offset;
+	for (i = 0; i < SEEK_CACHE_SLOTS; i++)
+		ctx->cache[i].block = UINT32_MAX;
+
+out:
+	if (r < 0) {
+		bled_close_seekable(ctx);
+		ctx = NULL;
+	}
+	return ctx;
+}
+
+/* Uncompressed size of a file opened for random access */
+uint64_t bled_seekable_size(bled_seekable_t* ctx)
+{
+	return (ctx == NULL) ? 0 : ctx->size;
+}
+
+/* Return the decoded data of block 'index', decoding it into the least recently used slot if needed */
+static uint8_t* seek_load_block(bled_seekable_t* ctx, uint32_t index)
+{
+	const seek_block_t* block = &ctx->blocks[index];
+	int i, slot = 0, r;
+
+	for (i = 0; i < SEEK_CACHE_SLOTS; i++) {
+		if (ctx->cache[i].block == index) {
+			ctx->cache[i].last_used = ++ctx->tick;
+			return ctx->cache[i].data;
+		}
+		if (ctx->cache[i].last_used < ctx->cache[slot].last_used)
+			slot = i;
+	}
+
+	free(ctx->cache[slot].data);
+	ctx->cache[slot].block = UINT32_MAX;
+	ctx->cache[slot].last_used = 0;
+	ctx->cache[slot].data = malloc(MAX((size_t)block->dst_size, 1));
+	if (ctx->cache[slot].data == NULL) {
+		bb_error_msg("Could not allocate block buffer");
+		return NULL;
+	}
+	if (ctx->type == BLED_COMPRESSION_XZ)
+		r = unpack_xz_block(ctx->fd, block, ctx->cache[slot].data);
+	else
+		r = unpack_zstd_block(ctx->fd, block, ctx->cache[slot].data);
+	if (r < 0) {
+		bb_error_msg("Could not decode block at offset 0x%llx", block->src_offset);
+		free(ctx->cache[slot].data);
+		ctx->cache[slot].data = NULL;
+		return NULL;
+	}
+	ctx->cache[slot].block = index;
+	ctx->cache[slot].last_used = ++ctx->tick;
+	return ctx->cache[slot].data;
+}
+
+/*
+ * Read 'len' bytes of uncompressed data, starting at 'offset', into 'buf'.
+ * Returns the number of bytes read, which is only short at the end of the
+ * stream, or a negative value on error.
+ */
+int64_t bled_pread(bled_seekable_t* ctx, uint64_t offset, void* buf, size_t len)
+{
+	const seek_block_t* block;
+	uint32_t lo, hi, mid;
+	uint8_t* data;
+	size_t n, done = 0;
+
+	if ((ctx == NULL) || (buf == NULL)) {
+		bb_error_msg("Invalid parameter");
+		return -1;
+	}
+
+	while (done < len && offset < ctx->size) {
+		if (bled_cancel_request != NULL && *bled_cancel_request != 0)
+			return -1;
+		// Find the last block that starts at or before offset
+		for (lo = 0, hi = ctx->nb_blocks - 1; lo < hi; ) {
+			mid = lo + (hi - lo + 1) / 2;
+			if (ctx->blocks[mid].dst_offset <= offset)
+				lo = mid;
+			else
+				hi = mid - 1;
+		}
+		block = &ctx->blocks[lo];
+		data = seek_load_block(ctx, lo);
+		if (data == NULL)
+			return -1;
+		n = (size_t)MIN(len - done, block->dst_offset + block->dst_size - offset);
+		memcpy((uint8_t*)buf + done, &data[offset - block->dst_offset], n);
+		done += n;
+		offset += n;
+	}
+	return done;
+}
+
+/* Close a file opened with bled_open_seekable() */
+void bled_close_seekable(bled_seekable_t* ctx)
+{
+	int i;
+
+	if (ctx == NULL)
+		return;
+	for (i = 0; i < SEEK_CACHE_SLOTS; i++)
+		free(ctx->cache[i].data);
+	free(ctx->blocks);
+	if (ctx->fd >= 0)
+		_close(ctx->fd);
+	free(ctx);
+}
+
 /* Uncompress all files from archive 'src', compressed using 'type', to destination dir 'dir' */
 int64_t bled_uncompress_to_dir(const char* src, const char* dir, int type)
 {
@@ -215,8 +638,8 @@ int64_t bled_uncompress_to_dir(const char* src, const char* dir, int type)
 
 	xstate.dst_dir = dir;
 
-	// Only zip archives are supported for now
-	if (type != BLED_COMPRESSION_ZIP) {
+	// Only the archive formats can hold more than one file
+	if (type != BLED_COMPRESSION_ZIP && type != BLED_COMPRESSION_7ZIP) {
 		bb_error_msg("This compression format is not supported for directory extraction");
 		goto err;
 	}
@@ -268,6 +691,22 @@ int64_t bled_uncompress_from_buffer_to_buffer(const char* src, const size_t src_
 	return ret;
 }
 
+/* Uncompress WIM chunk 'src' of length 'src_len', compressed using 'type', to buffer 'dst' of size 'dst_len' */
+int64_t bled_uncompress_wim_chunk(const uint8_t* src, const size_t src_len, uint8_t* dst, size_t dst_len, int type)
+{
+	if ((src == NULL) || (dst == NULL))
+		return -1;
+
+	switch (type) {
+	case BLED_WIM_CHUNK_XPRESS:
+		return unpack_xpress_chunk(src, src_len, dst, dst_len);
+	case BLED_WIM_CHUNK_LZX:
+		return unpack_lzx_chunk(src, src_len, dst, dst_len);
+	default:
+		return -1;
+	}
+}
+
 /* Initialize the library.
  * When the parameters are not NULL or zero you can:
  * - specify the buffer size to use (must be larger than 256KB and a power of two)
@@ -298,10 +737,17 @@ int bled_init(uint32_t buffer_size, printf_t print_function, read_t read_functio
 	bled_progress = progress_function;
 	bled_switch = switch_function;
 	bled_cancel_request = cancel_request;
+	bled_prefetch_depth = BLED_PREFETCH_DEPTH;
 	bled_initialized = true;
 	return 0;
 }
 
+/* Set the number of blocks that get read ahead of the decompressor, or 0 to disable read-ahead */
+void bled_set_prefetch_depth(uint32_t depth)
+{
+	bled_prefetch_depth = depth;
+}
+
 /* This call frees any resource used by the library */
 void bled_exit(void)
 {
@@ -309,6 +755,7 @@ void bled_exit(void)
 	bled_progress = NULL;
 	bled_switch = NULL;
 	bled_cancel_request = NULL;
+	inflate_cleanup();
 	if (global_crc32_table) {
 		free(global_crc32_table);
 		global_crc32_table = NULL;
@@ -35,21 +35,63 @@ typedef enum {
 	BLED_COMPRESSION_MAX
 } bled_compression_type;
 
+/* WIM chunk compression. LZMS, as used by ESD images, is not supported */
+typedef enum {
+	BLED_WIM_CHUNK_XPRESS = 0,	// XPRESS Huffman
+	BLED_WIM_CHUNK_LZX,		// LZX, with a 32 KB to 2 MB window
+	BLED_WIM_CHUNK_MAX
+} bled_wim_chunk_type;
+
 /* Uncompress file 'src', compressed using 'type', to file 'dst' */
 int64_t bled_uncompress(const char* src, const char* dst, int type);
 
 /* Uncompress using Windows handles */
 int64_t bled_uncompress_with_handles(HANDLE hSrc, HANDLE hDst, int type);
 
-/* Uncompress file 'src', compressed using 'type', to buffer 'buf' of size 'size' */
+/* Uncompress file 'src', compressed using 'type', to buffer 'buf' of size 'size'.
+ * Decoding stops once the buffer is full, and the lzma, xz and zstd decoders only keep as
+ * much history as 'size' requires, rather than the full window set in the stream headers. */
 int64_t bled_uncompress_to_buffer(const char* src, char* buf, size_t size, int type);
 
+/* Identify the compression used by file 'src' from its content (and its extension for LZMA alone). Returns
+ * a BLED_COMPRESSION_XXX type, which is BLED_COMPRESSION_NONE for content that is not compressed in a format
+ * we support. */
+int bled_probe(const char* src);
+
+/* Find the uncompressed size of file 'src', compressed using 'type', from the container metadata when
+ * available, or by sampling the start of the stream otherwise. Returns 1 if 'size' is exact, 0 if it is
+ * an estimate and a negative value on error. */
+int bled_get_uncompressed_size(const char* src, int type, uint64_t* size);
+
+/* Random access to the uncompressed data of a zstd seekable or multi-block xz file */
+typedef struct bled_seekable bled_seekable_t;
+
+/* Open file 'src', compressed using 'type', for random access. Returns NULL if the file does not
+ * have an index of independently decodable blocks, and must be decompressed sequentially.
+ * This call, as well as the other random access ones, must be issued after bled_init(). */
+bled_seekable_t* bled_open_seekable(const char* src, int type);
+
+/* Uncompressed size of a file opened with bled_open_seekable() */
+uint64_t bled_seekable_size(bled_seekable_t* ctx);
+
+/* Read 'len' uncompressed bytes at 'offset' into 'buf'. Only the blocks that hold the data are
+ * decoded, and the most recently used ones are cached. Returns the number of bytes read. */
+int64_t bled_pread(bled_seekable_t* ctx, uint64_t offset, void* buf, size_t len);
+
+/* Close a file opened with bled_open_seekable() */
+void bled_close_seekable(bled_seekable_t* ctx);
+
 /* Uncompress all files from archive 'src', compressed using 'type', to destination dir 'dir' */
 int64_t bled_uncompress_to_dir(const char* src, const char* dir, int type);
 
 /* Uncompress buffer 'src' of length 'src_len' to buffer 'dst' of size 'dst_len' */
 int64_t bled_uncompress_from_buffer_to_buffer(const char* src, const size_t src_len, char* dst, size_t dst_len, int type);
 
+/* Uncompress WIM chunk 'src' of length 'src_len', compressed using 'type', to buffer 'dst' of size 'dst_len'.
+ * 'dst_len' must be the exact uncompressed size of the chunk. This call does not require bled_init() and,
+ * since it uses no global state, can be issued from multiple threads at once. */
+int64_t bled_uncompress_wim_chunk(const uint8_t* src, const size_t src_len, uint8_t* dst, size_t dst_len, int type);
+
 /* Initialize the library.
  * When the parameters are not NULL or zero you can:
  * - specify the buffer size to use (must be larger than 64KB and a power of two)
@@ -65,5 +107,11 @@ int64_t bled_uncompress_from_buffer_to_buffer(const char* src, const size_t src_
 int bled_init(uint32_t buffer_size, printf_t print_function, read_t read_function, write_t write_function,
     progress_t progress_function, switch_t switch_function, unsigned long* cancel_request);
 
+/* When uncompressing a gz, bz2, xz, lzma, Z or zstd file to a file or handle, the source is read
+ * ahead on a separate thread, into a ring of 'depth' 4 MB blocks, so that reading and decompressing
+ * overlap. The default of 3 is reset by bled_init(), and 0 disables read-ahead. Read-ahead is also
+ * disabled when a custom read function was provided to bled_init(). */
+void bled_set_prefetch_depth(uint32_t depth);
+
 /* This call frees any resource used by the library */
 void bled_exit(void);
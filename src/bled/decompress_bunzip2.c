@@ -755,12 +755,546 @@ static void FAST_FUNC dealloc_bunzip(bunzip_data *bd)
 }
 
 
+/* Multithreaded decompression.
+
+   bzip2 blocks can be decoded independently of one another, but they are not
+   byte aligned and the stream has no index, so they can only be located by
+   looking for the 48-bit block magic at every bit position of the input. As
+   the magic may also occur by chance within compressed data, every candidate
+   position is decoded speculatively by a pool of worker threads, and results
+   are then validated in stream order: a block is only accepted if it starts
+   where the previous one ended and if it ends right at the next candidate.
+   A block that runs past the next candidate (which must then be a false
+   positive) is merged with the following segment and decoded again.
+
+   The workers run get_next_block(), undo the Burrows-Wheeler transform and
+   compute the block CRC, which is where almost all of the time goes. The main
+   thread reads and scans the input, validates the blocks, then undoes the
+   initial run length encoding and writes the output. */
+
+#define BZ_MAX_THREADS      8
+#define BZ_MAX_DBUF_SIZE    900000
+#define BZ_MAX_SEGMENT_SIZE (4 * 1024 * 1024)   /* Much larger than any valid block */
+#define BZ_BLOCK_MAGIC      0x314159265359ULL
+#define BZ_EOS_MAGIC        0x177245385090ULL
+#define BZ_NO_NEXT          UINT64_MAX
+#define BZ_NEED_INPUT       1
+#define BZ_STREAM_END       2
+#define BZ_OUTPUT_FULL      3
+
+/* A segment of input, from a candidate block (or end of stream) magic to the next
+   candidate, and the result of decoding it. Positions are counted from after "BZ". */
+typedef struct bz_job {
+	/* Set by the main thread */
+	uint64_t start;         /* Bit position of the magic */
+	uint64_t next;          /* Bit position of the next candidate magic */
+	uint64_t base;          /* Byte position of data[0] (start / 8) */
+	uint8_t *data;
+	unsigned dataLen, dataSize;
+	unsigned merged;        /* Number of following segments merged into this one */
+	int isEos;
+	HANDLE done;
+
+	/* Set by the worker */
+	int status;
+	uint64_t end;           /* Bit position after the end of block symbol */
+	unsigned count;         /* Number of bytes in out[], before RLE expansion */
+	int first;              /* Initial "previous" byte for the RLE expansion */
+	uint32_t blockCRC;
+	bunzip_data *bd;
+	uint8_t *out;
+} bz_job;
+
+typedef struct bz_ctx {
+	transformer_state_t *xstate;
+
+	/* Input window and bit scanner */
+	uint8_t *win;
+	uint64_t winBase;       /* Byte position of win[0] */
+	unsigned winLen, winSize, scanPos;
+	uint64_t scanBits;
+	int eof;
+	int hasOpen, openIsEos; /* Last candidate found, for which the segment isn't closed yet */
+	uint64_t openStart;
+
+	/* Stream validation state */
+	uint64_t pos;           /* Bit position where the next block must start */
+	unsigned dbufSize;
+	uint32_t totalCRC;
+
+	/* Output */
+	char *outbuf;
+	unsigned outLen;
+	long long totalWritten;
+
+	/* Job ring (head: oldest job, tail: next job to create, nextDecode: next job for the workers) */
+	bz_job jobs[2 * BZ_MAX_THREADS];
+	unsigned numJobs, head, tail, nextDecode;
+	CRITICAL_SECTION lock;
+	HANDLE work;
+	HANDLE threads[BZ_MAX_THREADS];
+	unsigned numThreads;
+	volatile LONG quit;
+} bz_ctx;
+
+/* Decode a block, undo the BWT and compute the CRC of the expanded data */
+static void bz_decode(bz_job *job)
+{
+	bunzip_data *bd = job->bd;
+	const uint32_t *dbuf = bd->dbuf;
+	jmp_buf jmpbuf;
+	uint32_t CRC = ~0;
+	int i, pos, current, previous, countdown = 5;
+	unsigned n, copies;
+
+	bd->jmpbuf = &jmpbuf;
+	bd->inbuf = job->data;
+	bd->inbufCount = job->dataLen;
+	bd->inbufPos = 1;
+	bd->inbufBits = job->data[0];
+	bd->inbufBitCount = 8 - (unsigned)(job->start & 7);
+
+	i = setjmp(jmpbuf);
+	if (i == 0)
+		i = get_next_block(bd);
+	job->status = i;
+	if (i != RETVAL_OK)
+		return;
+	job->end = (job->base + bd->inbufPos) * 8 - bd->inbufBitCount;
+	job->count = bd->writeCount;
+
+	/* Same as read_bunzip(), except that we keep the data before the RLE
+	   expansion, which is done by the main thread when writing the output */
+	pos = bd->writePos;
+	current = job->first = bd->writeCurrent;
+	for (n = 0; n < job->count; n++) {
+		previous = current;
+		pos = dbuf[pos];
+		current = (uint8_t)pos;
+		pos >>= 8;
+		job->out[n] = (uint8_t)current;
+		if (--countdown != 0) {
+			if (current != previous)
+				countdown = 4;
+			CRC = (CRC << 8) ^ bd->crc32Table[(CRC >> 24) ^ current];
+		} else {
+			for (copies = current; copies != 0; copies--)
+				CRC = (CRC << 8) ^ bd->crc32Table[(CRC >> 24) ^ previous];
+			current = previous;
+			countdown = 5;
+		}
+	}
+	job->blockCRC = ~CRC;
+}
+
+static DWORD WINAPI bz_worker(LPVOID param)
+{
+	bz_ctx *ctx = (bz_ctx*)param;
+	bz_job *job;
+
+	for (;;) {
+		WaitForSingleObject(ctx->work, INFINITE);
+		if (ctx->quit)
+			break;
+		EnterCriticalSection(&ctx->lock);
+		job = &ctx->jobs[ctx->nextDecode++ % ctx->numJobs];
+		LeaveCriticalSection(&ctx->lock);
+		if (!job->isEos)
+			bz_decode(job);
+		SetEvent(job->done);
+	}
+	return 0;
+}
+
+/* Close the segment of the open candidate at the current scan position, and queue it */
+static int bz_close_segment(bz_ctx *ctx, uint64_t next)
+{
+	bz_job *job = &ctx->jobs[ctx->tail % ctx->numJobs];
+	unsigned len;
+
+	job->start = ctx->openStart;
+	job->next = next;
+	job->base = ctx->openStart / 8;
+	job->isEos = ctx->openIsEos;
+	job->merged = 0;
+	len = (unsigned)(ctx->winBase + ctx->scanPos - job->base);
+	if (len > job->dataSize) {
+		free(job->data);
+		job->data = malloc(len);
+		job->dataSize = (job->data == NULL) ? 0 : len;
+	}
+	/* The decoding buffers are only allocated when a slot gets used */
+	if (job->bd == NULL) {
+		job->bd = xzalloc(sizeof(bunzip_data));
+		if (job->bd != NULL) {
+			crc32_filltable(job->bd->crc32Table, 1);
+			job->bd->in_fd = -1;
+			job->bd->dbufSize = BZ_MAX_DBUF_SIZE;
+			job->bd->dbuf = malloc(BZ_MAX_DBUF_SIZE * sizeof(job->bd->dbuf[0]));
+		}
+		job->out = malloc(BZ_MAX_DBUF_SIZE);
+	}
+	if (job->data == NULL || job->bd == NULL || job->bd->dbuf == NULL || job->out == NULL)
+		return RETVAL_OUT_OF_MEMORY;
+	memcpy(job->data, &ctx->win[job->base - ctx->winBase], len);
+	job->dataLen = len;
+	ResetEvent(job->done);
+
+	EnterCriticalSection(&ctx->lock);
+	ctx->tail++;
+	LeaveCriticalSection(&ctx->lock);
+	ReleaseSemaphore(ctx->work, 1, NULL);
+	return RETVAL_OK;
+}
+
+/* Scan the input window for the next candidate magic. Returns 1 if one was
+   found, 0 if the whole window has been scanned, or an error. */
+static int bz_scan(bz_ctx *ctx)
+{
+	uint64_t bits = ctx->scanBits, v, start;
+	int k, r = 0;
+
+	while (ctx->scanPos < ctx->winLen) {
+		bits = (bits << 8) | ctx->win[ctx->scanPos++];
+		/* The magics can't overlap, so there is at most one match per byte */
+		for (k = 7; k >= 0; k--) {
+			v = (bits >> k) & 0xffffffffffffULL;
+			if (v != BZ_BLOCK_MAGIC && v != BZ_EOS_MAGIC)
+				continue;
+			if ((ctx->winBase + ctx->scanPos) * 8 < 48 + (unsigned)k)
+				continue;
+			start = (ctx->winBase + ctx->scanPos) * 8 - 48 - k;
+			if (ctx->hasOpen) {
+				r = bz_close_segment(ctx, start);
+				if (r < 0)
+					goto out;
+			}
+			ctx->hasOpen = 1;
+			ctx->openStart = start;
+			ctx->openIsEos = (v == BZ_EOS_MAGIC);
+			r = 1;
+			goto out;
+		}
+		/* The first block (or end of stream) must come right after the header */
+		if (!ctx->hasOpen && ctx->winBase + ctx->scanPos > 8) {
+			r = RETVAL_NOT_BZIP_DATA;
+			goto out;
+		}
+	}
+ out:
+	ctx->scanBits = bits;
+	return r;
+}
+
+/* Read more input into the window. On EOF, close the last segment. */
+static int bz_fill(bz_ctx *ctx)
+{
+	unsigned keep;
+	int r;
+
+	if (ctx->winLen + IOBUF_SIZE > ctx->winSize) {
+		keep = ctx->hasOpen ? (unsigned)(ctx->openStart / 8 - ctx->winBase) : ctx->scanPos;
+		memmove(ctx->win, &ctx->win[keep], ctx->winLen - keep);
+		ctx->winBase += keep;
+		ctx->winLen -= keep;
+		ctx->scanPos -= keep;
+	}
+	/* If there still isn't enough room, there has been no candidate in a
+	   whole window, which can only happen with trailing data */
+	r = 0;
+	if (ctx->winLen + IOBUF_SIZE <= ctx->winSize) {
+		r = safe_read(ctx->xstate->src_fd, &ctx->win[ctx->winLen], IOBUF_SIZE);
+		if (r < 0)
+			return RETVAL_UNEXPECTED_INPUT_EOF;
+		ctx->winLen += r;
+	}
+	if (r == 0) {
+		ctx->eof = 1;
+		if (ctx->hasOpen) {
+			ctx->hasOpen = 0;
+			return bz_close_segment(ctx, BZ_NO_NEXT);
+		}
+	}
+	return RETVAL_OK;
+}
+
+/* Append the next unmerged segment to a job's data */
+static int bz_merge(bz_ctx *ctx, bz_job *job)
+{
+	bz_job *next;
+	unsigned len;
+	uint8_t *data;
+
+	if (job->next == BZ_NO_NEXT)
+		return RETVAL_UNEXPECTED_INPUT_EOF;
+	if (ctx->tail - ctx->head < job->merged + 2)
+		return (ctx->tail - ctx->head == ctx->numJobs) ? RETVAL_DATA_ERROR : BZ_NEED_INPUT;
+	next = &ctx->jobs[(ctx->head + job->merged + 1) % ctx->numJobs];
+	len = (unsigned)(next->base - job->base) + next->dataLen;
+	if (len > 2 * BZ_MAX_SEGMENT_SIZE)
+		return RETVAL_DATA_ERROR;
+	if (len > job->dataSize) {
+		data = realloc(job->data, len);
+		if (data == NULL)
+			return RETVAL_OUT_OF_MEMORY;
+		job->data = data;
+		job->dataSize = len;
+	}
+	/* The worker may still be decoding next, but it only ever reads its data */
+	memcpy(&job->data[next->base - job->base], next->data, next->dataLen);
+	job->dataLen = len;
+	job->next = next->next;
+	job->merged++;
+	return RETVAL_OK;
+}
+
+static uint32_t bz_peek_bits(const uint8_t *buf, uint64_t bit, int count)
+{
+	uint32_t r = 0;
+
+	for (; count > 0; count--, bit++)
+		r = (r << 1) | ((buf[bit >> 3] >> (7 - (bit & 7))) & 1);
+	return r;
+}
+
+static int bz_flush(bz_ctx *ctx)
+{
+	int nwrote;
+
+	if (ctx->outLen == 0)
+		return RETVAL_OK;
+	nwrote = (int)transformer_write(ctx->xstate, ctx->outbuf, ctx->outLen);
+	if (nwrote != (int)ctx->outLen)
+		return (nwrote == -ENOSPC) ? BZ_OUTPUT_FULL : RETVAL_SHORT_WRITE;
+	ctx->totalWritten += ctx->outLen;
+	ctx->outLen = 0;
+	return RETVAL_OK;
+}
+
+/* Undo the initial run length encoding of a block and write it out */
+static int bz_output(bz_ctx *ctx, const bz_job *job)
+{
+	int r, current = job->first, previous, countdown = 5;
+	unsigned n, copies, len;
+
+	for (n = 0; n < job->count; n++) {
+		previous = current;
+		current = job->out[n];
+		if (--countdown != 0) {
+			if (current != previous)
+				countdown = 4;
+			ctx->outbuf[ctx->outLen++] = (char)current;
+			if (ctx->outLen == IOBUF_SIZE && (r = bz_flush(ctx)) != RETVAL_OK)
+				return r;
+		} else {
+			for (copies = current; copies != 0; copies -= len) {
+				len = MIN(copies, IOBUF_SIZE - ctx->outLen);
+				memset(&ctx->outbuf[ctx->outLen], previous, len);
+				ctx->outLen += len;
+				if (ctx->outLen == IOBUF_SIZE && (r = bz_flush(ctx)) != RETVAL_OK)
+					return r;
+			}
+			current = previous;
+			countdown = 5;
+		}
+	}
+	return RETVAL_OK;
+}
+
+/* Validate the oldest job and write out its data if it is the next block.
+   Returns RETVAL_OK, BZ_NEED_INPUT, BZ_STREAM_END, BZ_OUTPUT_FULL or an error. */
+static int bz_retire(bz_ctx *ctx)
+{
+	bz_job *job = &ctx->jobs[ctx->head % ctx->numJobs];
+	uint64_t hdr;
+	uint8_t *p;
+	int r;
+
+	WaitForSingleObject(job->done, INFINITE);
+
+	/* False positive from within a block we already decoded */
+	if (job->start < ctx->pos)
+		goto next;
+	if (job->start > ctx->pos)
+		return RETVAL_DATA_ERROR;
+
+	if (job->isEos) {
+		/* Make sure that we have the stream CRC and the next stream header */
+		hdr = (job->start + 80 + 7) / 8;
+		while (hdr + 4 - job->base > job->dataLen && job->next != BZ_NO_NEXT) {
+			r = bz_merge(ctx, job);
+			if (r != RETVAL_OK)
+				return r;
+		}
+		if ((job->start & 7) + 80 > (uint64_t)job->dataLen * 8)
+			return RETVAL_UNEXPECTED_INPUT_EOF;
+		if (bz_peek_bits(job->data, (job->start & 7) + 48, 32) != ctx->totalCRC) {
+			bb_simple_error_msg("CRC error");
+			return RETVAL_DATA_ERROR;
+		}
+		/* Do we have "BZh" after the end of this stream? pbzip2 produces such files. */
+		p = &job->data[hdr - job->base];
+		if (hdr + 4 - job->base > job->dataLen || p[0] != 'B' || p[1] != 'Z' || p[2] != 'h' ||
+			(unsigned)(p[3] - '1') >= 9)
+			return BZ_STREAM_END;
+		ctx->dbufSize = 100000 * (p[3] - '0');
+		ctx->totalCRC = 0;
+		ctx->pos = (hdr + 4) * 8;
+		goto next;
+	}
+
+	for (;;) {
+		if (job->status == RETVAL_OK && job->end == job->next)
+			break;
+		if (job->status == RETVAL_OK && job->end < job->next)
+			return RETVAL_DATA_ERROR;
+		if (job->status != RETVAL_OK && job->status != RETVAL_UNEXPECTED_INPUT_EOF)
+			return job->status;
+		r = bz_merge(ctx, job);
+		if (r != RETVAL_OK)
+			return r;
+		bz_decode(job);
+	}
+	if (job->count > ctx->dbufSize)
+		return RETVAL_DATA_ERROR;
+	if (job->blockCRC != job->bd->headerCRC) {
+		bb_simple_error_msg("CRC error");
+		return RETVAL_DATA_ERROR;
+	}
+	ctx->totalCRC = ((ctx->totalCRC << 1) | (ctx->totalCRC >> 31)) ^ job->blockCRC;
+	r = bz_output(ctx, job);
+	if (r != RETVAL_OK)
+		return r;
+	ctx->pos = job->end;
+
+ next:
+	ctx->head++;
+	return RETVAL_OK;
+}
+
+static void bz_mt_free(bz_ctx *ctx)
+{
+	unsigned i;
+
+	if (ctx->numThreads != 0) {
+		ctx->quit = 1;
+		ReleaseSemaphore(ctx->work, ctx->numThreads, NULL);
+		WaitForMultipleObjects(ctx->numThreads, ctx->threads, TRUE, INFINITE);
+		for (i = 0; i < ctx->numThreads; i++)
+			CloseHandle(ctx->threads[i]);
+	}
+	for (i = 0; i < ctx->numJobs; i++) {
+		if (ctx->jobs[i].done != NULL)
+			CloseHandle(ctx->jobs[i].done);
+		free(ctx->jobs[i].data);
+		free(ctx->jobs[i].out);
+		if (ctx->jobs[i].bd != NULL)
+			dealloc_bunzip(ctx->jobs[i].bd);
+	}
+	if (ctx->work != NULL)
+		CloseHandle(ctx->work);
+	DeleteCriticalSection(&ctx->lock);
+	free(ctx->win);
+	free(ctx->outbuf);
+	free(ctx);
+}
+
+/* Set up the multithreaded decoder. Returns NULL if there is only one CPU
+   or on error, in which case the caller should use the regular decoder. */
+static bz_ctx *bz_mt_init(transformer_state_t *xstate)
+{
+	SYSTEM_INFO si;
+	bz_ctx *ctx;
+	unsigned i;
+
+	/* Buffer output is used for small reads and size sampling, that expect bb_total_rb to match */
+	if (xstate->mem_output_size_max != 0)
+		return NULL;
+	GetSystemInfo(&si);
+	if (si.dwNumberOfProcessors < 2)
+		return NULL;
+	ctx = xzalloc(sizeof(bz_ctx));
+	if (ctx == NULL)
+		return NULL;
+	InitializeCriticalSection(&ctx->lock);
+	ctx->xstate = xstate;
+	ctx->numJobs = 2 * MIN(si.dwNumberOfProcessors, BZ_MAX_THREADS);
+	ctx->winSize = BZ_MAX_SEGMENT_SIZE + IOBUF_SIZE;
+	ctx->win = malloc(ctx->winSize);
+	ctx->outbuf = malloc(IOBUF_SIZE);
+	ctx->work = CreateSemaphore(NULL, 0, ctx->numJobs + BZ_MAX_THREADS, NULL);
+	if (ctx->win == NULL || ctx->outbuf == NULL || ctx->work == NULL)
+		goto error;
+	for (i = 0; i < ctx->numJobs; i++) {
+		ctx->jobs[i].done = CreateEvent(NULL, TRUE, FALSE, NULL);
+		if (ctx->jobs[i].done == NULL)
+			goto error;
+	}
+	for (i = 0; i < ctx->numJobs / 2; i++) {
+		ctx->threads[ctx->numThreads] = CreateThread(NULL, 0, bz_worker, ctx, 0, NULL);
+		if (ctx->threads[ctx->numThreads] != NULL)
+			ctx->numThreads++;
+	}
+	if (ctx->numThreads != 0)
+		return ctx;
+ error:
+	bz_mt_free(ctx);
+	return NULL;
+}
+
+static IF_DESKTOP(long long) int bz_mt_unpack(bz_ctx *ctx)
+{
+	IF_DESKTOP(long long total_written;)
+	int r;
+
+	/* Read the "h['1'-'9']" that follows "BZ". The first block starts right after. */
+	do {
+		r = bz_fill(ctx);
+	} while (r == RETVAL_OK && !ctx->eof && ctx->winLen < 2);
+	if (r == RETVAL_OK && (ctx->winLen < 2 || ctx->win[0] != 'h' || (unsigned)(ctx->win[1] - '1') >= 9))
+		r = RETVAL_NOT_BZIP_DATA;
+	if (r == RETVAL_OK) {
+		ctx->dbufSize = 100000 * (ctx->win[1] - '0');
+		ctx->pos = 16;
+	}
+
+	while (r == RETVAL_OK) {
+		/* Keep the workers busy */
+		while (!ctx->eof && ctx->tail - ctx->head < ctx->numJobs) {
+			r = bz_scan(ctx);
+			if (r == 0)
+				r = bz_fill(ctx);
+			if (r < 0)
+				goto out;
+		}
+		if (ctx->head == ctx->tail) {
+			r = RETVAL_UNEXPECTED_INPUT_EOF;
+			break;
+		}
+		r = bz_retire(ctx);
+		if (r == BZ_NEED_INPUT)
+			r = RETVAL_OK;
+	}
+	if (r == BZ_STREAM_END)
+		r = bz_flush(ctx);
+
+ out:
+	IF_DESKTOP(total_written = ctx->totalWritten;)
+	if (r == BZ_OUTPUT_FULL)
+		r = (int)ctx->xstate->mem_output_size_max;
+	else if (r < 0)
+		bb_error_msg("bunzip error %d", r);
+	bz_mt_free(ctx);
+	return r ? r : IF_DESKTOP(total_written) + 0;
+}
+
 /* Decompress src_fd to dst_fd.  Stops at end of bzip data, not end of file. */
 IF_DESKTOP(long long) int FAST_FUNC
 unpack_bz2_stream(transformer_state_t *xstate)
 {
 	IF_DESKTOP(long long total_written = 0;)
 	bunzip_data *bd;
+	bz_ctx *ctx;
 	char *outbuf;
 	int i, nwrote;
 	unsigned len;
@@ -768,6 +1302,10 @@ unpack_bz2_stream(transformer_state_t *xstate)
 	if (check_signature16(xstate, BZIP2_MAGIC))
 		return -1;
 
+	ctx = bz_mt_init(xstate);
+	if (ctx != NULL)
+		return bz_mt_unpack(ctx);
+
 	outbuf = xmalloc(IOBUF_SIZE);
 	if (outbuf == NULL)
 		return -1;
@@ -45,6 +45,27 @@ typedef struct huft_t {
 	} v;
 } huft_t;
 
+/*
+ * The Huffman tables are carved out of chunks that are kept from one block
+ * to the next, and from one stream to the next, rather than being malloc'ed
+ * and freed for each table. Resetting the arena makes all its chunks
+ * available again.
+ */
+typedef struct huft_chunk_t {
+	struct huft_chunk_t *next;
+	huft_t *t;
+	unsigned size;		/* number of entries in t[] */
+} huft_chunk_t;
+
+typedef struct huft_arena_t {
+	huft_chunk_t *chunks;
+	huft_chunk_t *cur;	/* chunk tables are being carved out of, NULL after a reset */
+	unsigned used;		/* number of entries used in the current chunk */
+} huft_arena_t;
+
+/* Enough for the tables of a dynamic block, that seldom need more than 800 entries */
+#define HUFT_CHUNK_SIZE 2048
+
 /* gunzip_window size--must be a power of two, and
  * at least 32K for zip's deflate method */
 #define GUNZIP_WSIZE BB_BUFSIZE
@@ -103,6 +124,16 @@ typedef struct state_t {
 	unsigned inflate_codes_nn; /* length and index for copy */
 	unsigned inflate_codes_dd;
 
+	/* tables of the current block, and fixed tables, that are only built once */
+	huft_arena_t huft_arena;
+	huft_arena_t huft_fixed_arena;
+	huft_t *fixed_tl;
+	huft_t *fixed_td;
+	unsigned fixed_bl;
+	unsigned fixed_bd;
+
+	unsigned bufsize; /* BB_BUFSIZE when the buffers were allocated */
+
 	smallint resume_copy;
 
 	/* private data of inflate_get_next_window() */
@@ -145,6 +176,12 @@ typedef struct state_t {
 #define inflate_codes_bd    (S()inflate_codes_bd   )
 #define inflate_codes_nn    (S()inflate_codes_nn   )
 #define inflate_codes_dd    (S()inflate_codes_dd   )
+#define huft_arena          (S()huft_arena         )
+#define huft_fixed_arena    (S()huft_fixed_arena   )
+#define fixed_tl            (S()fixed_tl           )
+#define fixed_td            (S()fixed_td           )
+#define fixed_bl            (S()fixed_bl           )
+#define fixed_bd            (S()fixed_bd           )
 #define resume_copy         (S()resume_copy        )
 #define method              (S()method             )
 #define need_another_block  (S()need_another_block )
@@ -171,8 +208,8 @@ static state_t state;
 
 #if STATE_IN_MALLOC /* Use malloc space */
 #define DECLARE_STATE state_t *state
-#define ALLOC_STATE (state = xzalloc(sizeof(*state)))
-#define DEALLOC_STATE free(state)
+#define ALLOC_STATE (state = alloc_state())
+#define DEALLOC_STATE release_state(state)
 #define S() state->
 #define PASS_STATE state,
 #define PASS_STATE_ONLY state
@@ -215,45 +252,62 @@ static const uint8_t border[] ALIGN1 = {
 };
 
 
-/*
- * Free the malloc'ed tables built by huft_build(), which makes a linked
- * list of the tables it made, with the links in a dummy first entry of
- * each table.
- * t: table to free
- */
 #define BAD_HUFT(p) ((uintptr_t)(p) & 1)
 #define ERR_RET     ((huft_t*)(uintptr_t)1)
-static void huft_free(huft_t *p)
-{
-	huft_t *q;
 
-	/*
-	 * If 'p' has the error bit set we have to clear it, otherwise we might run
-	 * into a segmentation fault or an invalid pointer to free(p)
-	 */
-	//if (BAD_HUFT(p)) // commented out, since bit clearing has effect only if condition is true
-		p = (huft_t*)((uintptr_t)p & ~(uintptr_t)ERR_RET);
-
-	/* Go through linked list, freeing from the malloced (t[-1]) address. */
-	while (p) {
-		q = (--p)->v.t;
-		free(p);
-		p = q;
+/* Get a zeroed table of n entries from the arena. Only fails on out of memory. */
+static huft_t *huft_alloc(huft_arena_t *a, unsigned n)
+{
+	huft_chunk_t **c;
+	huft_t *t;
+
+	if (a->cur == NULL || a->used + n > a->cur->size) {
+		/* Move on to the next chunk that is large enough, or add one */
+		c = (a->cur == NULL) ? &a->chunks : &a->cur->next;
+		while (*c != NULL && (*c)->size < n)
+			c = &(*c)->next;
+		if (*c == NULL) {
+			unsigned size = MAX(n, HUFT_CHUNK_SIZE);
+
+			*c = malloc(sizeof(huft_chunk_t) + size * sizeof(huft_t));
+			if (*c == NULL)
+				return NULL;
+			(*c)->next = NULL;
+			(*c)->t = (huft_t*)(*c + 1);
+			(*c)->size = size;
+		}
+		a->cur = *c;
+		a->used = 0;
 	}
+	t = &a->cur->t[a->used];
+	a->used += n;
+	/* Incomplete codes leave some entries unset, and these must not point to stale subtables */
+	memset(t, 0, n * sizeof(huft_t));
+	return t;
+}
+
+/* Make all the tables of the arena available for reuse */
+static void huft_reset(huft_arena_t *a)
+{
+	a->cur = NULL;
+	a->used = 0;
 }
 
-static void huft_free_all(STATE_PARAM_ONLY)
+static void huft_free(huft_arena_t *a)
 {
-	huft_free(inflate_codes_tl);
-	huft_free(inflate_codes_td);
-	inflate_codes_tl = NULL;
-	inflate_codes_td = NULL;
+	huft_chunk_t *c;
+
+	while (a->chunks != NULL) {
+		c = a->chunks->next;
+		free(a->chunks);
+		a->chunks = c;
+	}
+	huft_reset(a);
 }
 
 static void abort_unzip(STATE_PARAM_ONLY) NORETURN;
 static void abort_unzip(STATE_PARAM_ONLY)
 {
-	huft_free_all(PASS_STATE_ONLY);
 	longjmp(error_jmp, 1);
 }
 
@@ -288,6 +342,7 @@ static unsigned fill_bitbuffer(STATE_PARAM unsigned bitbuffer, unsigned *current
 /* Given a list of code lengths and a maximum table size, make a set of
  * tables to decode that set of codes.
  *
+ * arena: where to allocate the tables from
  * b:	code lengths in bits (all assumed <= BMAX)
  * n:	number of codes (assumed <= N_MAX)
  * s:	number of simple-valued codes (0..s-1)
@@ -300,7 +355,7 @@ static unsigned fill_bitbuffer(STATE_PARAM unsigned bitbuffer, unsigned *current
  * or a valid pointer to a Huffman table, ORed with 0x1 if incompete table
  * is given: "fixed inflate" decoder feeds us such data.
  */
-static huft_t* huft_build(const unsigned *b, const unsigned n,
+static huft_t* huft_build(huft_arena_t *arena, const unsigned *b, const unsigned n,
 			const unsigned s, const struct cp_ext *cp_ext,
 			unsigned *m)
 {
@@ -325,7 +380,6 @@ static huft_t* huft_build(const unsigned *b, const unsigned n,
 	int y;                  /* number of dummy codes added */
 	unsigned z;             /* number of entries in current table */
 	huft_t *result;
-	huft_t **t;
 
 	/* Length of EOB code, if any */
 	eob_len = n > 256 ? b[256] : BMAX;
@@ -341,14 +395,15 @@ static huft_t* huft_build(const unsigned *b, const unsigned n,
 		p++;     /* can't combine with above line (Solaris bug) */
 	} while (--i);
 	if (c[0] == n) {  /* null input - all zero length codes */
-		q = xzalloc(3 * sizeof(*q));
-		//q[0].v.t = NULL;
+		q = huft_alloc(arena, 2);
+		if (q == NULL)
+			return ERR_RET;
+		q[0].e = 99;    /* invalid code marker */
+		q[0].b = 1;
 		q[1].e = 99;    /* invalid code marker */
 		q[1].b = 1;
-		q[2].e = 99;    /* invalid code marker */
-		q[2].b = 1;
 		*m = 1;
-		return q + 1;
+		return q;
 	}
 
 	/* Find minimum and maximum length, bound *m by those */
@@ -396,7 +451,6 @@ static huft_t* huft_build(const unsigned *b, const unsigned n,
 
 	/* Generate the Huffman codes and for each, make the table entries */
 	result = ERR_RET;
-	t = &result;
 	x[0] = i = 0;   /* first Huffman code is zero */
 	p = v;          /* grab values in bit order */
 	htl = -1;       /* no tables yet--level -1 */
@@ -435,11 +489,13 @@ static huft_t* huft_build(const unsigned *b, const unsigned n,
 				z = 1 << j;	/* table entries for j-bit table */
 				ws[htl+1] = w + j;	/* set bits decoded in stack */
 
-				/* allocate and link in new table */
-				q = xzalloc((z + 1) * sizeof(huft_t));
-				*t = q + 1;	/* link to list for huft_free() */
-				t = &(q->v.t);
-				u[htl] = ++q;	/* table starts after link */
+				/* allocate new table */
+				q = huft_alloc(arena, z);
+				if (q == NULL)
+					return ERR_RET;
+				if (htl == 0)
+					result = q;
+				u[htl] = q;
 
 				/* connect to last table, if there is one */
 				if (htl) {
@@ -595,7 +651,13 @@ static NOINLINE int inflate_codes(STATE_PARAM_ONLY)
 			bb >>= t->b;
 			k -= t->b;
 			bb = fill_bitbuffer(PASS_STATE bb, &k, e);
-			dd = w - t->v.n - ((unsigned) bb & mask_bits[e]);
+			dd = t->v.n + ((unsigned) bb & mask_bits[e]);
+			/* The window is reused from one stream to the next, so don't let
+			 * a corrupted stream copy data from before its start */
+			if (dd > gunzip_bytes_out + w) {
+				abort_unzip(PASS_STATE_ONLY);
+			}
+			dd = w - dd;
 			bb >>= e;
 			k -= e;
 
@@ -641,11 +703,7 @@ static NOINLINE int inflate_codes(STATE_PARAM_ONLY)
 	gunzip_bb = bb;			/* restore global bit buffer */
 	gunzip_bk = k;
 
-	/* normally just after call to inflate_codes, but save code by putting it here */
-	/* free the decoding tables (tl and td), return */
-	huft_free_all(PASS_STATE_ONLY);
-
-	/* done */
+	/* done, the decoding tables are reused by the next block */
 	return 0;
 }
 #undef ml
@@ -773,42 +831,14 @@ static int inflate_block(STATE_PARAM smallint *e)
 	}
 	case 1:
 	/* Inflate fixed
-	 * decompress an inflated type 1 (fixed Huffman codes) block. We should
-	 * either replace this with a custom decoder, or at least precompute the
-	 * Huffman tables. TODO */
+	 * decompress an inflated type 1 (fixed Huffman codes) block, with the
+	 * tables that build_fixed_tables() precomputed. */
 	{
-		int i;                  /* temporary variable */
-		unsigned bl;            /* lookup bits for tl */
-		unsigned bd;            /* lookup bits for td */
-		/* gcc 4.2.1 is too dumb to reuse stackspace. Moved up... */
-		//unsigned ll[288];     /* length list for huft_build */
-
-		/* set up literal table */
-		for (i = 0; i < 144; i++)
-			ll[i] = 8;
-		for (; i < 256; i++)
-			ll[i] = 9;
-		for (; i < 280; i++)
-			ll[i] = 7;
-		for (; i < 288; i++) /* make a complete, but wrong code set */
-			ll[i] = 8;
-		bl = 7;
-		inflate_codes_tl = huft_build(ll, 288, 257, &lit, &bl);
-		/* ^^^ never returns error here - we use known data */
-
-		/* set up distance table */
-		for (i = 0; i < 30; i++) /* make an incomplete code set */
-			ll[i] = 5;
-		bd = 5;
-		inflate_codes_td = huft_build(ll, 30, 0, &dist, &bd);
-		/* ^^^ does return error here! (lsb bit is set) - we gave it incomplete code set */
-		/* clearing error bit: */
-		inflate_codes_td = (void*)((uintptr_t)inflate_codes_td & ~(uintptr_t)1);
+		inflate_codes_tl = fixed_tl;
+		inflate_codes_td = fixed_td;
 
 		/* set up data for inflate_codes() */
-		inflate_codes_setup(PASS_STATE bl, bd);
-
-		/* huft_free code moved into inflate_codes */
+		inflate_codes_setup(PASS_STATE fixed_bl, fixed_bd);
 
 		return -2;
 	}
@@ -869,7 +899,8 @@ static int inflate_block(STATE_PARAM smallint *e)
 
 		/* build decoding table for trees - single level, 7 bit lookup */
 		bl = 7;
-		inflate_codes_tl = huft_build(ll, 19, 19, NULL, &bl);
+		huft_reset(&huft_arena);
+		inflate_codes_tl = huft_build(&huft_arena, ll, 19, 19, NULL, &bl);
 		if (BAD_HUFT(inflate_codes_tl)) {
 			abort_unzip(PASS_STATE_ONLY);	/* incomplete code set */
 		}
@@ -925,8 +956,8 @@ static int inflate_block(STATE_PARAM smallint *e)
 			}
 		}
 
-		/* free decoding table for trees */
-		huft_free(inflate_codes_tl);
+		/* the decoding table for trees is no longer needed */
+		huft_reset(&huft_arena);
 
 		/* restore the global bit buffer */
 		gunzip_bb = b_dynamic;
@@ -934,12 +965,12 @@ static int inflate_block(STATE_PARAM smallint *e)
 
 		/* build the decoding tables for literal/length and distance codes */
 		bl = lbits;
-		inflate_codes_tl = huft_build(ll, nl, 257, &lit, &bl);
+		inflate_codes_tl = huft_build(&huft_arena, ll, nl, 257, &lit, &bl);
 		if (BAD_HUFT(inflate_codes_tl)) {
 			abort_unzip(PASS_STATE_ONLY);
 		}
 		bd = dbits;
-		inflate_codes_td = huft_build(ll + nl, nd, 0, &dist, &bd);
+		inflate_codes_td = huft_build(&huft_arena, ll + nl, nd, 0, &dist, &bd);
 		if (BAD_HUFT(inflate_codes_td)) {
 			abort_unzip(PASS_STATE_ONLY);
 		}
@@ -947,8 +978,6 @@ static int inflate_block(STATE_PARAM smallint *e)
 		/* set up data for inflate_codes() */
 		inflate_codes_setup(PASS_STATE bl, bd);
 
-		/* huft_free code moved into inflate_codes */
-
 		return -2;
 	}
 	default:
@@ -1011,8 +1040,7 @@ inflate_unzip_internal(STATE_PARAM transformer_state_t *xstate)
 	IF_DESKTOP(long long) int n = 0;
 	ssize_t nwrote;
 
-	/* Allocate all global buffers (for DYN_ALLOC option) */
-	gunzip_window = xzalloc(GUNZIP_WSIZE);
+	/* The buffers and tables come with the state, from alloc_state() */
 	gunzip_outbuf_count = 0;
 	gunzip_bytes_out = 0;
 	gunzip_src_fd = xstate->src_fd;
@@ -1020,12 +1048,12 @@ inflate_unzip_internal(STATE_PARAM transformer_state_t *xstate)
 	/* (re) initialize state */
 	method = -1;
 	need_another_block = 1;
+	end_reached = 0;
 	resume_copy = 0;
 	gunzip_bk = 0;
 	gunzip_bb = 0;
 
-	/* Create the crc table */
-	gunzip_crc_table = crc32_filltable(NULL, 0);
+	gunzip_crc_table = global_crc32_table;
 	gunzip_crc = ~0;
 
 	error_msg = "corrupted data";
@@ -1040,7 +1068,6 @@ inflate_unzip_internal(STATE_PARAM transformer_state_t *xstate)
 		int r = inflate_get_next_window(PASS_STATE_ONLY);
 		nwrote = transformer_write(xstate, gunzip_window, gunzip_outbuf_count);
 		if (nwrote != (ssize_t)gunzip_outbuf_count) {
-			huft_free_all(PASS_STATE_ONLY);
 			n = (nwrote <0)?nwrote:-1;
 			goto ret;
 		}
@@ -1067,13 +1094,107 @@ inflate_unzip_internal(STATE_PARAM transformer_state_t *xstate)
 		gunzip_bk -= 8;
 	}
  ret:
-	/* Cleanup */
-	free(gunzip_window);
-	free(gunzip_crc_table);
 	return n;
 }
 
 
+/*
+ * Build the tables of the fixed Huffman codes (block type 1). They only depend
+ * on constant data, so they are built once for the lifetime of a state.
+ */
+static int build_fixed_tables(STATE_PARAM_ONLY)
+{
+	unsigned ll[288];       /* length list for huft_build */
+	int i;
+
+	/* set up literal table */
+	for (i = 0; i < 144; i++)
+		ll[i] = 8;
+	for (; i < 256; i++)
+		ll[i] = 9;
+	for (; i < 280; i++)
+		ll[i] = 7;
+	for (; i < 288; i++) /* make a complete, but wrong code set */
+		ll[i] = 8;
+	fixed_bl = 7;
+	fixed_tl = huft_build(&huft_fixed_arena, ll, 288, 257, &lit, &fixed_bl);
+	/* ^^^ only returns an error on out of memory - we use known data */
+	if (BAD_HUFT(fixed_tl))
+		return -1;
+
+	/* set up distance table */
+	for (i = 0; i < 30; i++) /* make an incomplete code set */
+		ll[i] = 5;
+	fixed_bd = 5;
+	fixed_td = huft_build(&huft_fixed_arena, ll, 30, 0, &dist, &fixed_bd);
+	/* ^^^ does return error here! (lsb bit is set) - we gave it incomplete code set */
+	if (fixed_td == ERR_RET)
+		return -1;
+	/* clearing error bit: */
+	fixed_td = (void*)((uintptr_t)fixed_td & ~(uintptr_t)1);
+	return 0;
+}
+
+/*
+ * The state, with its buffers and its Huffman tables, is kept from one stream
+ * to the next, so that zip archives with many small files don't allocate and
+ * set it up again for each of them. inflate_cleanup() releases it.
+ */
+static state_t *cached_state;
+
+static void free_state(STATE_PARAM_ONLY)
+{
+	if (state == NULL)
+		return;
+	huft_free(&huft_arena);
+	huft_free(&huft_fixed_arena);
+	free(gunzip_window);
+	free(bytebuffer);
+	free(state);
+}
+
+static state_t *alloc_state(void)
+{
+	state_t *state = cached_state;
+
+	cached_state = NULL;
+	/* The buffer size may have changed since the state was set up */
+	if (state != NULL && S()bufsize == BB_BUFSIZE)
+		return state;
+	free_state(PASS_STATE_ONLY);
+
+	if (!global_crc32_table)
+		global_crc32_table = crc32_filltable(NULL, 0);
+	state = xzalloc(sizeof(*state));
+	if (state == NULL || global_crc32_table == NULL)
+		goto err;
+	S()bufsize = BB_BUFSIZE;
+	bytebuffer = xmalloc(bytebuffer_max);
+	gunzip_window = xzalloc(GUNZIP_WSIZE);
+	if (bytebuffer == NULL || gunzip_window == NULL || build_fixed_tables(PASS_STATE_ONLY) < 0)
+		goto err;
+	return state;
+
+ err:
+	free_state(PASS_STATE_ONLY);
+	return NULL;
+}
+
+static void release_state(STATE_PARAM_ONLY)
+{
+	if (cached_state == NULL)
+		cached_state = state;
+	else
+		free_state(PASS_STATE_ONLY);
+}
+
+void FAST_FUNC inflate_cleanup(void)
+{
+	free_state(cached_state);
+	cached_state = NULL;
+}
+
+
 /* External entry points */
 
 /* For unzip */
@@ -1091,9 +1212,8 @@ inflate_unzip(transformer_state_t *xstate)
 	to_read = xstate->bytes_in;
 //	bytebuffer_max = 0x8000;
 	bytebuffer_offset = 4;
-	bytebuffer = xmalloc(bytebuffer_max);
+	bytebuffer_size = 0;
 	n = inflate_unzip_internal(PASS_STATE xstate);
-	free(bytebuffer);
 
 	xstate->crc32 = gunzip_crc;
 	xstate->bytes_out = gunzip_bytes_out;
@@ -1269,15 +1389,13 @@ unpack_gz_stream(transformer_state_t *xstate)
 		return -1;
 	}
 	to_read = -1;
-	bytebuffer = xmalloc(bytebuffer_max);
-	if (bytebuffer == NULL) {
-		bb_error_msg("alloc error");
-		total = -1;
-		goto ret;
-	}
+	bytebuffer_offset = 0;
+	bytebuffer_size = 0;
 	gunzip_src_fd = xstate->src_fd;
+	gz_nb_members = 0;
 
  again:
+	gz_nb_members++;
 	if (!check_header_gzip(PASS_STATE xstate)) {
 		bb_simple_error_msg("corrupted data");
 		total = -1;
@@ -1325,7 +1443,22 @@ unpack_gz_stream(transformer_state_t *xstate)
 	/*bb_error_msg("decompression OK, trailing garbage ignored");*/
 
  ret:
-	free(bytebuffer);
 	DEALLOC_STATE;
 	return total;
 }
+
+uint32_t gz_nb_members;
+
+/*
+ * The gzip trailer only holds the size of the last member, modulo 4 GB, and a stream
+ * may hold more than one member, so this is never more than a hint.
+ */
+int FAST_FUNC get_gz_size(int fd, uint64_t file_size, uint64_t *size)
+{
+	uint32_t isize;
+
+	if (file_size < 18 || read_at(fd, file_size - 4, &isize, 4) != 4)
+		return SIZE_UNKNOWN;
+	*size = SWAP_LE32(isize);
+	return SIZE_MOD_4GB;
+}
@@ -0,0 +1,2075 @@
+/*
+ * un7z implementation for Bled/busybox
+ *
+ * Copyright © 2026 agent <agent@local>
+ * Based on the 7z format description (7zFormat.txt) from the LZMA SDK by Igor Pavlov - Public Domain
+ *
+ * Licensed under GPLv2 or later, see file LICENSE in this source tree.
+ */
+
+#include "libbb.h"
+#include "bb_archive.h"
+
+#define XZ_EXTERN static
+#define XZ_DEC_LZMA1
+
+#include "xz_dec_bcj.c"
+#include "xz_dec_lzma2.c"
+
+/* A 7z archive starts with a 32 byte signature header, that points to the
+   main header at the end of the file. The main header, which is usually
+   itself compressed, describes the packed streams that follow the signature
+   header, the folders that decode them and the files that the output of
+   each folder holds, back to back (a "solid" block).
+
+   A folder is a small graph of coders, where each coder has one output and
+   one or more inputs, which are either packed streams or the output of
+   another coder. We decode a folder by pulling data from its main coder,
+   which pulls data from its inputs, and so on. Only the coders that the
+   7-Zip encoder uses by default are supported: LZMA, LZMA2, x86 BCJ, BCJ2
+   and Copy.
+
+   There are two levels of multithreading:
+   - Folders that are small enough to fit in memory are read ahead and
+     decoded in parallel by a pool of worker threads, when extracting to a
+     directory. This is what non-solid archives of many files get.
+   - Within the LZMA2 stream of a large folder, such as the one of an .img.7z,
+     every dictionary reset starts a segment that can be decoded on its own.
+     7-Zip inserts those when compressing with multiple threads. Segments
+     are queued to the same pool, and decoded straight to memory.
+   Both use the pool in turn, since the read ahead stops at the next large
+   folder. If a segment gets too large to be held in memory, we wait for the
+   workers, then decode the rest of the stream sequentially. */
+
+#define SZ_SIGNATURE            "7z\xBC\xAF\x27\x1C"
+#define SZ_SIGNATURE_SIZE       6
+#define SZ_START_HEADER_SIZE    32
+#define SZ_MAX_HEADER_SIZE      (64 * 1024 * 1024)
+#define SZ_MAX_ENTRIES          (1 << 24)
+#define SZ_MAX_CODERS           4
+#define SZ_MAX_CODER_IN         4
+#define SZ_MAX_PACK             4
+#define SZ_MAX_DICT             ((uint32_t)3 << 29)
+#define SZ_WRITE_SIZE           (4 * 1024 * 1024)
+#define SZ_MAX_THREADS          8
+#define SZ_MT_MIN_SEGMENT       (4 * 1024 * 1024)
+#define SZ_MT_MAX_MEMORY        ((sizeof(size_t) > 4) ? ((size_t)1024 * 1024 * 1024) : ((size_t)384 * 1024 * 1024))
+#define SZ_MT_MAX_SEGMENT       (SZ_MT_MAX_MEMORY / 4)
+#define SZ_MT_FALLBACK          2
+
+/* Method IDs */
+#define SZ_METHOD_COPY          0x00
+#define SZ_METHOD_LZMA2         0x21
+#define SZ_METHOD_LZMA          0x030101
+#define SZ_METHOD_BCJ           0x03030103
+#define SZ_METHOD_BCJ2          0x0303011B
+#define SZ_METHOD_AES           0x06F10701
+
+/* Property IDs */
+enum {
+	SZ_ID_END = 0x00,
+	SZ_ID_HEADER,
+	SZ_ID_ARCHIVE_PROPERTIES,
+	SZ_ID_ADDITIONAL_STREAMS_INFO,
+	SZ_ID_MAIN_STREAMS_INFO,
+	SZ_ID_FILES_INFO,
+	SZ_ID_PACK_INFO,
+	SZ_ID_UNPACK_INFO,
+	SZ_ID_SUBSTREAMS_INFO,
+	SZ_ID_SIZE,
+	SZ_ID_CRC,
+	SZ_ID_FOLDER,
+	SZ_ID_CODERS_UNPACK_SIZE,
+	SZ_ID_NUM_UNPACK_STREAM,
+	SZ_ID_EMPTY_STREAM,
+	SZ_ID_EMPTY_FILE,
+	SZ_ID_ANTI,
+	SZ_ID_NAME,
+	SZ_ID_CTIME,
+	SZ_ID_ATIME,
+	SZ_ID_MTIME,
+	SZ_ID_WIN_ATTRIBUTES,
+	SZ_ID_COMMENT,
+	SZ_ID_ENCODED_HEADER,
+	SZ_ID_START_POS,
+	SZ_ID_DUMMY
+};
+
+typedef struct {
+	uint64_t method;
+	unsigned num_in;
+	unsigned in_base;       /* Index of the first input of the coder in the folder */
+	uint8_t props[5];
+	unsigned props_size;
+	uint64_t unpack_size;
+} sz_coder_t;
+
+typedef struct {
+	unsigned num_coders, num_in, num_bonds, num_pack;
+	sz_coder_t coder[SZ_MAX_CODERS];
+	struct {
+		unsigned in, out;   /* Folder input, and coder that feeds it */
+	} bond[SZ_MAX_CODERS - 1];
+	unsigned pack_in[SZ_MAX_PACK];  /* Folder input that each packed stream feeds */
+	unsigned main;          /* Coder that produces the output of the folder */
+	uint64_t pack_pos[SZ_MAX_PACK], pack_size[SZ_MAX_PACK];
+	uint64_t unpack_size;
+	uint32_t crc;
+	bool has_crc;
+	uint64_t num_streams;   /* Number of files in the output */
+} sz_folder_t;
+
+typedef struct {
+	char *name;
+	uint64_t size;
+	uint64_t offset;        /* Offset of the file in the output of its folder */
+	uint32_t folder;
+	uint32_t crc;
+	bool has_stream, has_crc, is_dir;
+} sz_file_t;
+
+typedef struct {
+	uint64_t num_pack;
+	uint64_t *pack_pos, *pack_size;
+	uint32_t num_folders;
+	sz_folder_t *folders;
+	uint64_t num_streams;
+	uint64_t *stream_size;
+	uint32_t *stream_crc;
+	uint8_t *stream_has_crc;
+	uint32_t num_files;
+	sz_file_t *files;
+} sz_archive_t;
+
+/* Reader for the headers, that flags any read past the end */
+typedef struct {
+	const uint8_t *buf;
+	size_t pos, size;
+	bool err;
+} sz_reader_t;
+
+/* Decoding */
+enum {
+	SZ_PACK_FILE,
+	SZ_PACK_MEM,
+	SZ_COPY,
+	SZ_LZMA,
+	SZ_LZMA2,
+	SZ_LZMA2_MT,
+	SZ_BCJ,
+	SZ_BCJ2
+};
+
+typedef struct sz_ctx sz_ctx_t;
+typedef struct sz_job sz_job_t;
+typedef struct sz_stream sz_stream_t;
+
+typedef struct {
+	sz_stream_t *src;
+	uint8_t *buf;
+	size_t pos, len, size;
+} sz_input_t;
+
+struct sz_stream {
+	int type;
+	uint64_t left;          /* Bytes left to produce */
+	sz_ctx_t *ctx;
+	unsigned num_in;
+	sz_input_t in[SZ_MAX_CODER_IN];
+	union {
+		struct {
+			uint64_t offset;
+			const uint8_t *mem;
+		} pack;
+		struct xz_dec_lzma2 *lzma;
+		struct {
+			struct xz_dec_bcj *dec;
+			size_t filtered;    /* End of the filtered data in in[0] */
+		} bcj;
+		struct {
+			uint16_t prob[2 + 256];
+			uint32_t range, code, pos;
+			uint8_t prev;
+			uint8_t dest[4];
+			unsigned dest_left;
+			bool ready;
+		} bcj2;
+		struct {
+			uint8_t props;
+			uint8_t hdr[6];     /* Header of the next chunk, once read */
+			size_t hdr_len;
+			uint32_t chunk_unpack, chunk_pack;
+			uint8_t *seg;       /* Segment being gathered */
+			size_t seg_len, seg_size;
+			uint64_t seg_unpack;
+			bool eof, fallback;
+			sz_job_t *job;      /* Job whose output is being returned */
+			size_t job_pos;
+		} mt;
+	} u;
+};
+
+struct sz_job {
+	sz_folder_t folder;
+	uint8_t *pack[SZ_MAX_PACK];
+	uint8_t *out;
+	size_t mem;             /* Memory used by the job */
+	int status;
+	HANDLE done;
+};
+
+typedef struct {
+	/* Job ring (head: oldest job, tail: next job to create, next_decode: next job for the workers) */
+	sz_job_t jobs[2 * SZ_MAX_THREADS];
+	unsigned num_jobs, head, tail, next_decode;
+	size_t mem;             /* Memory used by the jobs in the ring */
+	CRITICAL_SECTION lock;
+	HANDLE work;
+	HANDLE threads[SZ_MAX_THREADS];
+	unsigned num_threads;
+	volatile LONG quit;
+} sz_mt_t;
+
+struct sz_ctx {
+	transformer_state_t *xstate;
+	int fd;
+	uint64_t fd_pos;
+	sz_archive_t ar;
+	sz_mt_t *mt;
+	uint8_t *buf;
+	uint32_t next_folder;   /* Next folder to read ahead */
+};
+
+static uint32_t sz_crc32(const uint8_t *buf, size_t size, uint32_t crc)
+{
+	return ~crc32_block_endian0(~crc, buf, size, global_crc32_table);
+}
+
+/*
+ * Header parsing
+ */
+static uint8_t sz_byte(sz_reader_t *r)
+{
+	if (r->pos >= r->size) {
+		r->err = true;
+		return 0;
+	}
+	return r->buf[r->pos++];
+}
+
+/* The number of leading 1 bits of the first byte is the number of bytes that follow */
+static uint64_t sz_number(sz_reader_t *r)
+{
+	uint8_t first = sz_byte(r), mask = 0x80;
+	uint64_t value = 0;
+	int i;
+
+	for (i = 0; i < 8; i++, mask >>= 1) {
+		if ((first & mask) == 0)
+			return value | ((uint64_t)(first & (mask - 1)) << (8 * i));
+		value |= (uint64_t)sz_byte(r) << (8 * i);
+	}
+	return value;
+}
+
+/* A number of entries, that we limit to keep allocations sane */
+static uint32_t sz_count(sz_reader_t *r)
+{
+	uint64_t n = sz_number(r);
+
+	if (n > SZ_MAX_ENTRIES) {
+		r->err = true;
+		return 0;
+	}
+	return (uint32_t)n;
+}
+
+static uint32_t sz_uint32(sz_reader_t *r)
+{
+	uint32_t v = 0;
+	int i;
+
+	for (i = 0; i < 4; i++)
+		v |= (uint32_t)sz_byte(r) << (8 * i);
+	return v;
+}
+
+static void sz_skip(sz_reader_t *r, uint64_t size)
+{
+	if (size > r->size - r->pos) {
+		r->err = true;
+		r->pos = r->size;
+	} else {
+		r->pos += (size_t)size;
+	}
+}
+
+/* Read a vector of 'n' bits, most significant bit first, as one byte per bit.
+   If 'all' is set, the vector is preceded by an "all defined" byte. */
+static uint8_t *sz_bits(sz_reader_t *r, uint32_t n, bool all)
+{
+	uint8_t *v = xzalloc(n + 1), b = 0, mask = 0;
+	uint32_t i;
+
+	if (v == NULL) {
+		r->err = true;
+		return NULL;
+	}
+	if (all && sz_byte(r) != 0) {
+		memset(v, 1, n);
+		return v;
+	}
+	for (i = 0; i < n; i++, mask >>= 1) {
+		if (mask == 0) {
+			b = sz_byte(r);
+			mask = 0x80;
+		}
+		v[i] = (b & mask) ? 1 : 0;
+	}
+	return v;
+}
+
+/* Read the CRCs of 'n' items. Returns the vector of the ones that are defined. */
+static uint8_t *sz_digests(sz_reader_t *r, uint32_t n, uint32_t *crc)
+{
+	uint8_t *defined = sz_bits(r, n, true);
+	uint32_t i;
+
+	for (i = 0; defined != NULL && i < n; i++)
+		crc[i] = defined[i] ? sz_uint32(r) : 0;
+	return defined;
+}
+
+/* Read a null terminated UTF-16LE name and convert it to UTF-8 */
+static char *sz_name(sz_reader_t *r, size_t end)
+{
+	size_t start = r->pos, i;
+	uint32_t c, c2;
+	uint8_t *name, *p;
+
+	do {
+		if (r->pos + 2 > end) {
+			r->err = true;
+			return NULL;
+		}
+		r->pos += 2;
+	} while (get_le16(&r->buf[r->pos - 2]) != 0);
+
+	/* A UTF-16 unit converts to at most 3 UTF-8 bytes, and a surrogate pair to 4 */
+	name = malloc((r->pos - start) / 2 * 3 + 1);
+	if (name == NULL) {
+		r->err = true;
+		return NULL;
+	}
+	for (i = start, p = name; i < r->pos - 2; i += 2) {
+		c = get_le16(&r->buf[i]);
+		if (c >= 0xD800 && c < 0xDC00 && i + 4 < r->pos) {
+			c2 = get_le16(&r->buf[i + 2]);
+			if (c2 >= 0xDC00 && c2 < 0xE000) {
+				c = 0x10000 + ((c - 0xD800) << 10) + (c2 - 0xDC00);
+				i += 2;
+			}
+		}
+		if (c < 0x80) {
+			*p++ = (uint8_t)c;
+		} else if (c < 0x800) {
+			*p++ = (uint8_t)(0xC0 | (c >> 6));
+			*p++ = (uint8_t)(0x80 | (c & 0x3F));
+		} else if (c < 0x10000) {
+			*p++ = (uint8_t)(0xE0 | (c >> 12));
+			*p++ = (uint8_t)(0x80 | ((c >> 6) & 0x3F));
+			*p++ = (uint8_t)(0x80 | (c & 0x3F));
+		} else {
+			*p++ = (uint8_t)(0xF0 | (c >> 18));
+			*p++ = (uint8_t)(0x80 | ((c >> 12) & 0x3F));
+			*p++ = (uint8_t)(0x80 | ((c >> 6) & 0x3F));
+			*p++ = (uint8_t)(0x80 | (c & 0x3F));
+		}
+	}
+	*p = 0;
+	return (char*)name;
+}
+
+static void sz_free_archive(sz_archive_t *ar)
+{
+	uint32_t i;
+
+	if (ar->files != NULL) {
+		for (i = 0; i < ar->num_files; i++)
+			free(ar->files[i].name);
+	}
+	free(ar->files);
+	free(ar->pack_pos);
+	free(ar->pack_size);
+	free(ar->folders);
+	free(ar->stream_size);
+	free(ar->stream_crc);
+	free(ar->stream_has_crc);
+	memset(ar, 0, sizeof(*ar));
+}
+
+static void sz_read_pack_info(sz_reader_t *r, sz_archive_t *ar)
+{
+	uint64_t pos, id;
+	uint32_t i, n, *crc;
+
+	pos = SZ_START_HEADER_SIZE + sz_number(r);
+	n = sz_count(r);
+	if (r->err || ar->pack_size != NULL)
+		goto err;
+	ar->num_pack = n;
+	ar->pack_pos = xzalloc((n + 1) * sizeof(uint64_t));
+	ar->pack_size = xzalloc((n + 1) * sizeof(uint64_t));
+	if (ar->pack_pos == NULL || ar->pack_size == NULL)
+		goto err;
+	while ((id = sz_number(r)) != SZ_ID_END && !r->err) {
+		if (id == SZ_ID_SIZE) {
+			for (i = 0; i < n; i++) {
+				ar->pack_pos[i] = pos;
+				ar->pack_size[i] = sz_number(r);
+				pos += ar->pack_size[i];
+				if (pos < ar->pack_size[i])
+					goto err;
+			}
+		} else if (id == SZ_ID_CRC) {
+			/* The packed streams CRCs are not used, but they must still be skipped */
+			crc = xzalloc((n + 1) * sizeof(uint32_t));
+			if (crc == NULL)
+				goto err;
+			free(sz_digests(r, n, crc));
+			free(crc);
+		} else {
+			goto err;
+		}
+	}
+	return;
+
+err:
+	r->err = true;
+}
+
+static void sz_read_folder(sz_reader_t *r, sz_folder_t *f)
+{
+	sz_coder_t *c;
+	uint8_t flags;
+	uint32_t i, j, k, n;
+	bool used[SZ_MAX_CODERS * SZ_MAX_CODER_IN] = { 0 };
+
+	f->num_coders = sz_count(r);
+	if (f->num_coders == 0 || f->num_coders > SZ_MAX_CODERS)
+		goto err;
+	for (i = 0; i < f->num_coders; i++) {
+		c = &f->coder[i];
+		flags = sz_byte(r);
+		/* Alternative methods were never used */
+		if (flags & 0x80)
+			goto err;
+		for (j = 0, n = flags & 0x0F; j < n; j++)
+			c->method = (c->method << 8) | sz_byte(r);
+		if (n > 8)
+			c->method = UINT64_MAX;
+		c->num_in = 1;
+		if (flags & 0x10) {
+			c->num_in = sz_count(r);
+			if (sz_number(r) != 1)
+				goto err;
+		}
+		if (c->num_in == 0 || c->num_in > SZ_MAX_CODER_IN)
+			goto err;
+		c->in_base = f->num_in;
+		f->num_in += c->num_in;
+		if (flags & 0x20) {
+			n = sz_count(r);
+			c->props_size = n;
+			for (j = 0; j < n; j++) {
+				if (j < sizeof(c->props))
+					c->props[j] = sz_byte(r);
+				else
+					sz_byte(r);
+			}
+		}
+	}
+
+	/* Every coder but the main one feeds an input of another coder */
+	f->num_bonds = f->num_coders - 1;
+	for (i = 0; i < f->num_bonds; i++) {
+		f->bond[i].in = sz_count(r);
+		f->bond[i].out = sz_count(r);
+		if (f->bond[i].in >= f->num_in || f->bond[i].out >= f->num_coders ||
+			used[f->bond[i].in])
+			goto err;
+		used[f->bond[i].in] = true;
+		for (j = 0; j < i; j++) {
+			if (f->bond[j].out == f->bond[i].out)
+				goto err;
+		}
+	}
+	f->main = f->num_coders;
+	for (i = 0; i < f->num_coders; i++) {
+		for (j = 0; j < f->num_bonds && f->bond[j].out != i; j++);
+		if (j == f->num_bonds) {
+			f->main = i;
+			break;
+		}
+	}
+	if (f->main == f->num_coders)
+		goto err;
+
+	/* Every coder must lead to the main one, which rules out loops */
+	for (i = 0; i < f->num_coders; i++) {
+		for (k = 0, c = &f->coder[i]; c != &f->coder[f->main] && k < f->num_coders; k++) {
+			for (j = 0; f->bond[j].out != (unsigned)(c - f->coder); j++);
+			for (c = f->coder; f->bond[j].in >= c->in_base + c->num_in; c++);
+		}
+		if (c != &f->coder[f->main])
+			goto err;
+	}
+
+	/* The remaining inputs are packed streams */
+	f->num_pack = f->num_in - f->num_bonds;
+	if (f->num_pack == 0 || f->num_pack > SZ_MAX_PACK)
+		goto err;
+	if (f->num_pack == 1) {
+		for (i = 0; i < f->num_in && used[i]; i++);
+		f->pack_in[0] = i;
+	} else {
+		for (i = 0; i < f->num_pack; i++) {
+			f->pack_in[i] = sz_count(r);
+			if (f->pack_in[i] >= f->num_in || used[f->pack_in[i]])
+				goto err;
+			used[f->pack_in[i]] = true;
+		}
+	}
+	return;
+
+err:
+	r->err = true;
+}
+
+static void sz_read_unpack_info(sz_reader_t *r, sz_archive_t *ar)
+{
+	uint64_t id;
+	uint32_t i, j, n, *crc = NULL;
+	uint8_t *defined = NULL;
+
+	if (sz_number(r) != SZ_ID_FOLDER || ar->folders != NULL)
+		goto err;
+	n = sz_count(r);
+	/* External folders were never used */
+	if (sz_byte(r) != 0 || r->err)
+		goto err;
+	ar->num_folders = n;
+	ar->folders = xzalloc((n + 1) * sizeof(sz_folder_t));
+	if (ar->folders == NULL)
+		goto err;
+	for (i = 0; i < n && !r->err; i++) {
+		sz_read_folder(r, &ar->folders[i]);
+		ar->folders[i].num_streams = 1;
+	}
+
+	if (sz_number(r) != SZ_ID_CODERS_UNPACK_SIZE)
+		goto err;
+	for (i = 0; i < n; i++) {
+		for (j = 0; j < ar->folders[i].num_coders; j++)
+			ar->folders[i].coder[j].unpack_size = sz_number(r);
+		ar->folders[i].unpack_size = ar->folders[i].coder[ar->folders[i].main].unpack_size;
+	}
+
+	while ((id = sz_number(r)) != SZ_ID_END && !r->err) {
+		if (id != SZ_ID_CRC)
+			goto err;
+		crc = malloc((n + 1) * sizeof(uint32_t));
+		if (crc == NULL)
+			goto err;
+		defined = sz_digests(r, n, crc);
+		if (defined == NULL)
+			goto err;
+		for (i = 0; i < n; i++) {
+			ar->folders[i].has_crc = defined[i];
+			ar->folders[i].crc = crc[i];
+		}
+		free(defined);
+		free(crc);
+		defined = NULL;
+		crc = NULL;
+	}
+	return;
+
+err:
+	free(defined);
+	free(crc);
+	r->err = true;
+}
+
+/* Without substreams info, every folder holds one file */
+static void sz_read_substreams_info(sz_reader_t *r, sz_archive_t *ar, bool present)
+{
+	uint64_t id, sum, n = 0;
+	uint32_t i, j, k, num_crc = 0, *crc = NULL;
+	uint8_t *defined = NULL;
+	sz_folder_t *f;
+
+	id = present ? sz_number(r) : SZ_ID_END;
+	if (id == SZ_ID_NUM_UNPACK_STREAM) {
+		for (i = 0; i < ar->num_folders; i++)
+			ar->folders[i].num_streams = sz_count(r);
+		id = sz_number(r);
+	}
+	for (i = 0; i < ar->num_folders; i++)
+		n += ar->folders[i].num_streams;
+	if (r->err || n > SZ_MAX_ENTRIES)
+		goto err;
+	ar->num_streams = n;
+	ar->stream_size = xzalloc((size_t)(n + 1) * sizeof(uint64_t));
+	ar->stream_crc = xzalloc((size_t)(n + 1) * sizeof(uint32_t));
+	ar->stream_has_crc = xzalloc((size_t)(n + 1));
+	if (ar->stream_size == NULL || ar->stream_crc == NULL || ar->stream_has_crc == NULL)
+		goto err;
+
+	/* The size of the last file of each folder is whatever remains */
+	for (i = 0, k = 0; i < ar->num_folders; i++) {
+		f = &ar->folders[i];
+		if (f->num_streams == 0)
+			continue;
+		for (j = 1, sum = 0; j < f->num_streams && id == SZ_ID_SIZE; j++, k++) {
+			ar->stream_size[k] = sz_number(r);
+			sum += ar->stream_size[k];
+			if (sum > f->unpack_size || sum < ar->stream_size[k])
+				goto err;
+		}
+		if (j < f->num_streams)
+			goto err;
+		ar->stream_size[k++] = f->unpack_size - sum;
+	}
+	if (id == SZ_ID_SIZE)
+		id = sz_number(r);
+
+	/* Single file folders that have a CRC don't repeat it */
+	for (i = 0; i < ar->num_folders; i++) {
+		f = &ar->folders[i];
+		if (f->num_streams != 1 || !f->has_crc)
+			num_crc += (uint32_t)f->num_streams;
+	}
+	for (i = 0, k = 0; i < ar->num_folders; i++) {
+		f = &ar->folders[i];
+		if (f->num_streams == 1 && f->has_crc) {
+			ar->stream_has_crc[k] = 1;
+			ar->stream_crc[k] = f->crc;
+		}
+		k += (uint32_t)f->num_streams;
+	}
+	while (id != SZ_ID_END && !r->err) {
+		if (id == SZ_ID_CRC) {
+			crc = malloc((num_crc + 1) * sizeof(uint32_t));
+			defined = (crc == NULL) ? NULL : sz_digests(r, num_crc, crc);
+			if (defined == NULL)
+				goto err;
+			for (i = 0, j = 0, k = 0; i < ar->num_folders; i++) {
+				f = &ar->folders[i];
+				if (f->num_streams == 1 && f->has_crc) {
+					k++;
+					continue;
+				}
+				for (n = 0; n < f->num_streams; n++, j++, k++) {
+					ar->stream_has_crc[k] = defined[j];
+					ar->stream_crc[k] = crc[j];
+				}
+			}
+			free(defined);
+			free(crc);
+			defined = NULL;
+			crc = NULL;
+		} else {
+			sz_skip(r, sz_number(r));
+		}
+		id = sz_number(r);
+	}
+	return;
+
+err:
+	free(defined);
+	free(crc);
+	r->err = true;
+}
+
+static void sz_read_streams_info(sz_reader_t *r, sz_archive_t *ar)
+{
+	uint64_t id = sz_number(r), pack;
+	uint32_t i, j;
+	sz_folder_t *f;
+
+	if (id == SZ_ID_PACK_INFO) {
+		sz_read_pack_info(r, ar);
+		id = sz_number(r);
+	}
+	if (id == SZ_ID_UNPACK_INFO) {
+		sz_read_unpack_info(r, ar);
+		id = sz_number(r);
+	}
+	if (r->err)
+		return;
+
+	/* Folders use the packed streams in order */
+	for (i = 0, pack = 0; i < ar->num_folders; i++) {
+		f = &ar->folders[i];
+		if (pack + f->num_pack > ar->num_pack) {
+			r->err = true;
+			return;
+		}
+		for (j = 0; j < f->num_pack; j++, pack++) {
+			f->pack_pos[j] = ar->pack_pos[pack];
+			f->pack_size[j] = ar->pack_size[pack];
+		}
+	}
+
+	if (id == SZ_ID_SUBSTREAMS_INFO) {
+		sz_read_substreams_info(r, ar, true);
+		id = sz_number(r);
+	} else {
+		sz_read_substreams_info(r, ar, false);
+	}
+	if (id != SZ_ID_END)
+		r->err = true;
+}
+
+static void sz_read_files_info(sz_reader_t *r, sz_archive_t *ar)
+{
+	uint64_t type, size, offset = 0, stream = 0, in_folder = 0;
+	uint32_t i, n, num_empty = 0, empty = 0, folder = 0, *attr = NULL;
+	uint8_t *empty_stream = NULL, *empty_file = NULL, *attr_defined = NULL;
+	sz_file_t *file;
+	size_t end;
+
+	n = sz_count(r);
+	if (r->err || ar->files != NULL)
+		goto err;
+	ar->num_files = n;
+	ar->files = xzalloc((n + 1) * sizeof(sz_file_t));
+	if (ar->files == NULL)
+		goto err;
+	while ((type = sz_number(r)) != SZ_ID_END && !r->err) {
+		size = sz_number(r);
+		if (r->err || size > r->size - r->pos)
+			goto err;
+		end = r->pos + (size_t)size;
+		switch (type) {
+		case SZ_ID_EMPTY_STREAM:
+			free(empty_stream);
+			empty_stream = sz_bits(r, n, false);
+			for (i = 0, num_empty = 0; empty_stream != NULL && i < n; i++)
+				num_empty += empty_stream[i];
+			break;
+		case SZ_ID_EMPTY_FILE:
+			free(empty_file);
+			empty_file = sz_bits(r, num_empty, false);
+			break;
+		case SZ_ID_NAME:
+			/* External names were never used */
+			if (sz_byte(r) != 0)
+				goto err;
+			for (i = 0; i < n && !r->err; i++) {
+				free(ar->files[i].name);
+				ar->files[i].name = sz_name(r, end);
+			}
+			break;
+		case SZ_ID_WIN_ATTRIBUTES:
+			free(attr_defined);
+			free(attr);
+			attr_defined = sz_bits(r, n, true);
+			attr = malloc((n + 1) * sizeof(uint32_t));
+			if (attr_defined == NULL || attr == NULL || sz_byte(r) != 0)
+				goto err;
+			for (i = 0; i < n; i++)
+				attr[i] = attr_defined[i] ? sz_uint32(r) : 0;
+			break;
+		default:
+			break;
+		}
+		if (r->err || r->pos > end)
+			goto err;
+		r->pos = end;
+	}
+
+	/* The files that have data are stored in order, in the folders that have files */
+	for (i = 0; i < n; i++) {
+		file = &ar->files[i];
+		file->has_stream = (empty_stream == NULL || !empty_stream[i]);
+		if (!file->has_stream) {
+			if (attr_defined != NULL && attr_defined[i])
+				file->is_dir = (attr[i] & FILE_ATTRIBUTE_DIRECTORY) != 0;
+			else
+				file->is_dir = (empty_file == NULL || !empty_file[empty]);
+			empty++;
+			continue;
+		}
+		while (folder < ar->num_folders && in_folder == ar->folders[folder].num_streams) {
+			folder++;
+			in_folder = 0;
+			offset = 0;
+		}
+		if (folder >= ar->num_folders || stream >= ar->num_streams)
+			goto err;
+		file->folder = folder;
+		file->offset = offset;
+		file->size = ar->stream_size[stream];
+		file->has_crc = ar->stream_has_crc[stream];
+		file->crc = ar->stream_crc[stream];
+		offset += file->size;
+		in_folder++;
+		stream++;
+	}
+	goto out;
+
+err:
+	r->err = true;
+out:
+	free(empty_stream);
+	free(empty_file);
+	free(attr_defined);
+	free(attr);
+}
+
+static void sz_read_header(sz_reader_t *r, sz_archive_t *ar)
+{
+	uint64_t id = sz_number(r);
+
+	if (id == SZ_ID_ARCHIVE_PROPERTIES) {
+		while ((id = sz_number(r)) != SZ_ID_END && !r->err)
+			sz_skip(r, sz_number(r));
+		id = sz_number(r);
+	}
+	/* Additional streams were never used */
+	if (id == SZ_ID_ADDITIONAL_STREAMS_INFO) {
+		r->err = true;
+		return;
+	}
+	if (id == SZ_ID_MAIN_STREAMS_INFO) {
+		sz_read_streams_info(r, ar);
+		id = sz_number(r);
+	}
+	if (id == SZ_ID_FILES_INFO) {
+		sz_read_files_info(r, ar);
+		id = sz_number(r);
+	}
+	if (id != SZ_ID_END)
+		r->err = true;
+}
+
+/*
+ * Decoding
+ */
+static int sz_decode_folder(const sz_folder_t *f, uint8_t **pack, uint8_t *out);
+
+/* Read 'size' bytes at 'offset' in the archive, with progress reporting */
+static int sz_read_file(sz_ctx_t *ctx, uint64_t offset, uint8_t *buf, size_t size)
+{
+	size_t n;
+	int r;
+
+	if (ctx->fd_pos != offset) {
+		if (_lseeki64(ctx->fd, (int64_t)offset, SEEK_SET) != (int64_t)offset) {
+			bb_error_msg("seek error (errno: %d)", errno);
+			return -1;
+		}
+		ctx->fd_pos = offset;
+	}
+	for (n = 0; n < size; n += r) {
+		r = safe_read(ctx->fd, buf + n, (unsigned int)MIN(size - n, BB_BUFSIZE));
+		if (r <= 0) {
+			if (r < 0)
+				bb_error_msg("read error (errno: %d)", errno);
+			else
+				bb_error_msg("truncated archive");
+			ctx->fd_pos = UINT64_MAX;
+			return -1;
+		}
+		ctx->fd_pos += r;
+	}
+	return 0;
+}
+
+static int sz_read(sz_stream_t *s, uint8_t *buf, size_t size);
+
+/* Move the unread data to the start of the buffer, and read more after it.
+   Returns the number of bytes added, 0 at the end of the source, or an error. */
+static int sz_fill(sz_input_t *in)
+{
+	int r;
+
+	if (in->pos != 0) {
+		memmove(in->buf, in->buf + in->pos, in->len - in->pos);
+		in->len -= in->pos;
+		in->pos = 0;
+	}
+	r = sz_read(in->src, in->buf + in->len, in->size - in->len);
+	if (r > 0)
+		in->len += r;
+	return r;
+}
+
+/* Copy the next 'size' bytes of an input. Returns the number of bytes copied, or an error. */
+static int sz_get(sz_input_t *in, uint8_t *dst, size_t size)
+{
+	size_t n, len;
+	int r;
+
+	for (n = 0; n < size; n += len) {
+		if (in->pos == in->len) {
+			r = sz_fill(in);
+			if (r <= 0)
+				return (r < 0) ? r : (int)n;
+		}
+		len = MIN(size - n, in->len - in->pos);
+		memcpy(dst + n, in->buf + in->pos, len);
+		in->pos += len;
+	}
+	return (int)n;
+}
+
+static int sz_lzma_init(sz_stream_t *s, const uint8_t *props)
+{
+	enum xz_ret ret;
+	uint32_t dict;
+
+	s->u.lzma = xz_dec_lzma2_create(XZ_DYNALLOC, SZ_MAX_DICT);
+	if (s->u.lzma == NULL) {
+		bb_error_msg("memory allocation error");
+		return -1;
+	}
+	if (s->type == SZ_LZMA)
+		dict = get_le32(&props[1]);
+	else
+		dict = (props[0] > 39) ? UINT32_MAX : (uint32_t)(2 | (props[0] & 1)) << (props[0] / 2 + 11);
+	/* We never need more history than the output */
+	if (s->left < dict)
+		xz_dec_lzma2_cap(s->u.lzma, (uint32_t)s->left + 1);
+	if (s->type == SZ_LZMA)
+		ret = xz_dec_lzma1_reset(s->u.lzma, props[0], dict, s->in[0].src->left, s->left);
+	else
+		ret = xz_dec_lzma2_reset(s->u.lzma, props[0]);
+	switch (ret) {
+	case XZ_OK:
+		return 0;
+	case XZ_MEM_ERROR:
+		bb_error_msg("memory allocation error");
+		return -1;
+	case XZ_MEMLIMIT_ERROR:
+		bb_error_msg("LZMA dictionary is too large");
+		return -1;
+	default:
+		bb_error_msg("unsupported LZMA properties");
+		return -1;
+	}
+}
+
+static int sz_lzma_read(sz_stream_t *s, uint8_t *buf, size_t size)
+{
+	sz_input_t *in = &s->in[0];
+	struct xz_buf b;
+	enum xz_ret ret;
+	int r = 1;
+
+	b.out = buf;
+	b.out_pos = 0;
+	b.out_size = size;
+	while (b.out_pos == 0) {
+		if (in->pos == in->len) {
+			r = sz_fill(in);
+			if (r < 0)
+				return r;
+		}
+		b.in = in->buf;
+		b.in_pos = in->pos;
+		b.in_size = in->len;
+		if (s->type == SZ_LZMA)
+			ret = xz_dec_lzma1_run(s->u.lzma, &b);
+		else
+			ret = xz_dec_lzma2_run(s->u.lzma, &b);
+		if (ret == XZ_STREAM_END)
+			break;
+		if (ret != XZ_OK || (r == 0 && b.in_pos == in->pos && b.out_pos == 0)) {
+			bb_error_msg("%s", (ret != XZ_OK) ? "corrupted archive" : "truncated archive");
+			return -1;
+		}
+		in->pos = b.in_pos;
+	}
+	in->pos = b.in_pos;
+	return (int)b.out_pos;
+}
+
+/* The BCJ filter converts all but the last few bytes it is given, which need the data that follows */
+static int sz_bcj_read(sz_stream_t *s, uint8_t *buf, size_t size)
+{
+	sz_input_t *in = &s->in[0];
+	size_t *filtered = &s->u.bcj.filtered;
+	int r;
+
+	while (in->pos == *filtered) {
+		r = sz_fill(in);
+		if (r < 0)
+			return r;
+		*filtered = 0;
+		if (r == 0) {
+			*filtered = in->len;
+			break;
+		}
+		bcj_apply(s->u.bcj.dec, in->buf, filtered, in->len);
+	}
+	size = MIN(size, *filtered - in->pos);
+	memcpy(buf, in->buf + in->pos, size);
+	in->pos += size;
+	return (int)size;
+}
+
+/* Range decoder byte, for BCJ2 */
+static int sz_bcj2_rc(sz_stream_t *s)
+{
+	uint8_t b;
+
+	if (sz_get(&s->in[3], &b, 1) != 1) {
+		bb_error_msg("truncated archive");
+		return -1;
+	}
+	s->u.bcj2.code = (s->u.bcj2.code << 8) | b;
+	return 0;
+}
+
+/* BCJ2 splits the targets of x86 calls and jumps into their own streams, and uses a range
+   coder to tell which E8, E9 and Jcc opcodes they belong to. in[0] is the main stream,
+   in[1] the calls, in[2] the jumps and in[3] the range coder. */
+#define SZ_BCJ2_IS_J(b0, b1)    (((b1) & 0xFE) == 0xE8 || ((b0) == 0x0F && ((b1) & 0xF0) == 0x80))
+
+static int sz_bcj2_read(sz_stream_t *s, uint8_t *buf, size_t size)
+{
+	sz_input_t *in = &s->in[0];
+	uint16_t *prob;
+	uint32_t bound, dest;
+	uint8_t b, src[4];
+	size_t n = 0;
+	int i, r;
+
+	if (!s->u.bcj2.ready) {
+		for (i = 0; i < 5; i++) {
+			if (sz_bcj2_rc(s) < 0)
+				return -1;
+		}
+		s->u.bcj2.range = 0xFFFFFFFF;
+		for (i = 0; i < (int)ARRAYSIZE(s->u.bcj2.prob); i++)
+			s->u.bcj2.prob[i] = 1 << 10;
+		s->u.bcj2.ready = true;
+	}
+
+	while (n < size) {
+		if (s->u.bcj2.dest_left != 0) {
+			buf[n++] = s->u.bcj2.dest[4 - s->u.bcj2.dest_left--];
+			continue;
+		}
+		if (in->pos == in->len) {
+			r = sz_fill(in);
+			if (r <= 0)
+				return (r < 0) ? r : (int)n;
+		}
+		b = in->buf[in->pos++];
+		buf[n++] = b;
+		s->u.bcj2.pos++;
+		/* The last byte is never followed by a target */
+		if (!SZ_BCJ2_IS_J(s->u.bcj2.prev, b) || n == s->left) {
+			s->u.bcj2.prev = b;
+			continue;
+		}
+
+		if (b == 0xE8)
+			prob = &s->u.bcj2.prob[s->u.bcj2.prev];
+		else if (b == 0xE9)
+			prob = &s->u.bcj2.prob[256];
+		else
+			prob = &s->u.bcj2.prob[257];
+		bound = (s->u.bcj2.range >> 11) * *prob;
+		if (s->u.bcj2.code < bound) {
+			s->u.bcj2.range = bound;
+			*prob += ((1 << 11) - *prob) >> 5;
+			s->u.bcj2.prev = b;
+		} else {
+			s->u.bcj2.range -= bound;
+			s->u.bcj2.code -= bound;
+			*prob -= *prob >> 5;
+			r = sz_get(&s->in[(b == 0xE8) ? 1 : 2], src, 4);
+			if (r != 4) {
+				if (r >= 0)
+					bb_error_msg("truncated archive");
+				return -1;
+			}
+			dest = (((uint32_t)src[0] << 24) | ((uint32_t)src[1] << 16) |
+				((uint32_t)src[2] << 8) | src[3]) - (s->u.bcj2.pos + 4);
+			for (i = 0; i < 4; i++)
+				s->u.bcj2.dest[i] = (uint8_t)(dest >> (8 * i));
+			s->u.bcj2.dest_left = 4;
+			s->u.bcj2.pos += 4;
+			s->u.bcj2.prev = (uint8_t)(dest >> 24);
+		}
+		if (s->u.bcj2.range < (1 << 24)) {
+			s->u.bcj2.range <<= 8;
+			if (sz_bcj2_rc(s) < 0)
+				return -1;
+		}
+	}
+	return (int)n;
+}
+
+/*
+ * Worker threads
+ */
+static DWORD WINAPI sz_worker(LPVOID param)
+{
+	sz_mt_t *mt = (sz_mt_t*)param;
+	sz_job_t *job;
+
+	for (;;) {
+		WaitForSingleObject(mt->work, INFINITE);
+		if (mt->quit)
+			break;
+		EnterCriticalSection(&mt->lock);
+		job = &mt->jobs[mt->next_decode++ % mt->num_jobs];
+		LeaveCriticalSection(&mt->lock);
+		job->status = sz_decode_folder(&job->folder, job->pack, job->out);
+		SetEvent(job->done);
+	}
+	return 0;
+}
+
+/* Queue the decoding of a folder, whose packed streams have been read to memory.
+   The job owns the packed streams from then on. */
+static int sz_mt_queue(sz_mt_t *mt, const sz_folder_t *f, uint8_t **pack)
+{
+	sz_job_t *job = &mt->jobs[mt->tail % mt->num_jobs];
+	unsigned i;
+
+	job->folder = *f;
+	job->mem = (size_t)f->unpack_size;
+	for (i = 0; i < SZ_MAX_PACK; i++) {
+		job->pack[i] = (i < f->num_pack) ? pack[i] : NULL;
+		if (i < f->num_pack)
+			job->mem += (size_t)f->pack_size[i];
+	}
+	job->out = malloc((size_t)f->unpack_size + 1);
+	if (job->out == NULL) {
+		for (i = 0; i < SZ_MAX_PACK; i++) {
+			free(job->pack[i]);
+			job->pack[i] = NULL;
+		}
+		bb_error_msg("memory allocation error");
+		return -1;
+	}
+	job->status = -1;
+	ResetEvent(job->done);
+	mt->mem += job->mem;
+	EnterCriticalSection(&mt->lock);
+	mt->tail++;
+	LeaveCriticalSection(&mt->lock);
+	ReleaseSemaphore(mt->work, 1, NULL);
+	return 0;
+}
+
+/* Wait for the oldest job to be decoded */
+static sz_job_t *sz_mt_wait(sz_mt_t *mt)
+{
+	sz_job_t *job = &mt->jobs[mt->head % mt->num_jobs];
+
+	WaitForSingleObject(job->done, INFINITE);
+	if (job->status != 0) {
+		bb_error_msg("corrupted archive");
+		return NULL;
+	}
+	return job;
+}
+
+/* Release the oldest job, once its output has been used */
+static void sz_mt_retire(sz_mt_t *mt)
+{
+	sz_job_t *job = &mt->jobs[mt->head % mt->num_jobs];
+	unsigned i;
+
+	for (i = 0; i < SZ_MAX_PACK; i++) {
+		free(job->pack[i]);
+		job->pack[i] = NULL;
+	}
+	free(job->out);
+	job->out = NULL;
+	mt->mem -= job->mem;
+	mt->head++;
+}
+
+/* Let the workers finish the jobs in the ring, and release them */
+static void sz_mt_drain(sz_mt_t *mt)
+{
+	while (mt->head != mt->tail) {
+		WaitForSingleObject(mt->jobs[mt->head % mt->num_jobs].done, INFINITE);
+		sz_mt_retire(mt);
+	}
+}
+
+static void sz_mt_free(sz_mt_t *mt)
+{
+	unsigned i;
+
+	if (mt == NULL)
+		return;
+	sz_mt_drain(mt);
+	if (mt->num_threads != 0) {
+		mt->quit = 1;
+		ReleaseSemaphore(mt->work, mt->num_threads, NULL);
+		WaitForMultipleObjects(mt->num_threads, mt->threads, TRUE, INFINITE);
+		for (i = 0; i < mt->num_threads; i++)
+			CloseHandle(mt->threads[i]);
+	}
+	for (i = 0; i < mt->num_jobs; i++) {
+		if (mt->jobs[i].done != NULL)
+			CloseHandle(mt->jobs[i].done);
+	}
+	if (mt->work != NULL)
+		CloseHandle(mt->work);
+	DeleteCriticalSection(&mt->lock);
+	free(mt);
+}
+
+/* Set up the worker threads. Returns NULL if there is only one CPU or on error,
+   in which case everything gets decoded sequentially. */
+static sz_mt_t *sz_mt_init(transformer_state_t *xstate)
+{
+	SYSTEM_INFO si;
+	sz_mt_t *mt;
+	unsigned i;
+
+	/* Buffer output is used for small reads and size sampling, that expect bb_total_rb to match */
+	if (xstate->mem_output_size_max != 0)
+		return NULL;
+	GetSystemInfo(&si);
+	if (si.dwNumberOfProcessors < 2)
+		return NULL;
+	mt = xzalloc(sizeof(sz_mt_t));
+	if (mt == NULL)
+		return NULL;
+	InitializeCriticalSection(&mt->lock);
+	mt->num_jobs = 2 * MIN(si.dwNumberOfProcessors, SZ_MAX_THREADS);
+	mt->work = CreateSemaphore(NULL, 0, mt->num_jobs + SZ_MAX_THREADS, NULL);
+	if (mt->work == NULL)
+		goto error;
+	for (i = 0; i < mt->num_jobs; i++) {
+		mt->jobs[i].done = CreateEvent(NULL, TRUE, FALSE, NULL);
+		if (mt->jobs[i].done == NULL)
+			goto error;
+	}
+	for (i = 0; i < mt->num_jobs / 2; i++) {
+		mt->threads[mt->num_threads] = CreateThread(NULL, 0, sz_worker, mt, 0, NULL);
+		if (mt->threads[mt->num_threads] != NULL)
+			mt->num_threads++;
+	}
+	if (mt->num_threads != 0)
+		return mt;
+ error:
+	sz_mt_free(mt);
+	return NULL;
+}
+
+/* The ring has room for another job, and the memory budget for the largest one */
+static bool sz_mt_room(sz_mt_t *mt, size_t mem)
+{
+	return (mt->tail - mt->head < mt->num_jobs) &&
+		(mt->head == mt->tail || mt->mem + mem <= SZ_MT_MAX_MEMORY);
+}
+
+/*
+ * Multithreaded LZMA2
+ */
+
+/* Read the header of the next LZMA2 chunk, unless we already have it.
+   Returns 1, 0 at the end of the stream, or an error. */
+static int sz_mt_chunk(sz_stream_t *s)
+{
+	uint8_t *hdr = s->u.mt.hdr;
+	int r, len;
+
+	if (s->u.mt.hdr_len != 0)
+		return 1;
+	r = sz_get(&s->in[0], hdr, 1);
+	if (r <= 0 || hdr[0] == 0x00)
+		return (r < 0) ? r : 0;
+	if (hdr[0] >= 0xC0)
+		len = 6;
+	else if (hdr[0] >= 0x80)
+		len = 5;
+	else if (hdr[0] <= 0x02)
+		len = 3;
+	else
+		goto corrupted;
+	r = sz_get(&s->in[0], &hdr[1], len - 1);
+	if (r < 0)
+		return r;
+	if (r != len - 1)
+		goto corrupted;
+	if (hdr[0] >= 0x80) {
+		s->u.mt.chunk_unpack = ((uint32_t)(hdr[0] & 0x1F) << 16) + ((uint32_t)hdr[1] << 8) + hdr[2] + 1;
+		s->u.mt.chunk_pack = ((uint32_t)hdr[3] << 8) + hdr[4] + 1;
+	} else {
+		s->u.mt.chunk_unpack = ((uint32_t)hdr[1] << 8) + hdr[2] + 1;
+		s->u.mt.chunk_pack = s->u.mt.chunk_unpack;
+	}
+	s->u.mt.hdr_len = len;
+	return 1;
+
+corrupted:
+	bb_error_msg("corrupted archive");
+	return -1;
+}
+
+/* Gather the chunks up to the next dictionary reset into a segment, and queue it.
+   Returns 1 if a segment was queued, 0 at the end of the stream, SZ_MT_FALLBACK
+   if the segment is too large to be held in memory, or an error. */
+static int sz_mt_segment(sz_stream_t *s)
+{
+	sz_folder_t f = { 0 };
+	uint8_t *seg;
+	size_t need;
+	bool reset;
+	int r;
+
+	while (!s->u.mt.eof) {
+		r = sz_mt_chunk(s);
+		if (r < 0)
+			return r;
+		if (r == 0) {
+			s->u.mt.eof = true;
+			break;
+		}
+		reset = (s->u.mt.hdr[0] == 0x01 || s->u.mt.hdr[0] >= 0xE0);
+		if (reset && s->u.mt.seg_unpack >= SZ_MT_MIN_SEGMENT)
+			break;
+		if (s->u.mt.seg_len == 0 && !reset) {
+			bb_error_msg("corrupted archive");
+			return -1;
+		}
+		need = s->u.mt.seg_len + s->u.mt.hdr_len + s->u.mt.chunk_pack;
+		if (need > s->u.mt.seg_size) {
+			need = MAX(need, 2 * s->u.mt.seg_size);
+			seg = realloc(s->u.mt.seg, need);
+			if (seg == NULL) {
+				bb_error_msg("memory allocation error");
+				return -1;
+			}
+			s->u.mt.seg = seg;
+			s->u.mt.seg_size = need;
+		}
+		memcpy(s->u.mt.seg + s->u.mt.seg_len, s->u.mt.hdr, s->u.mt.hdr_len);
+		s->u.mt.seg_len += s->u.mt.hdr_len;
+		s->u.mt.hdr_len = 0;
+		if (s->u.mt.seg_unpack + s->u.mt.chunk_unpack > SZ_MT_MAX_SEGMENT) {
+			s->u.mt.fallback = true;
+			return SZ_MT_FALLBACK;
+		}
+		r = sz_get(&s->in[0], s->u.mt.seg + s->u.mt.seg_len, s->u.mt.chunk_pack);
+		if (r < 0)
+			return r;
+		if (r != (int)s->u.mt.chunk_pack) {
+			bb_error_msg("truncated archive");
+			return -1;
+		}
+		s->u.mt.seg_len += s->u.mt.chunk_pack;
+		s->u.mt.seg_unpack += s->u.mt.chunk_unpack;
+	}
+	if (s->u.mt.seg_len == 0)
+		return 0;
+
+	/* A segment is a folder with a single LZMA2 coder */
+	f.num_coders = 1;
+	f.num_in = 1;
+	f.num_pack = 1;
+	f.coder[0].method = SZ_METHOD_LZMA2;
+	f.coder[0].num_in = 1;
+	f.coder[0].props[0] = s->u.mt.props;
+	f.coder[0].props_size = 1;
+	f.coder[0].unpack_size = s->u.mt.seg_unpack;
+	f.unpack_size = s->u.mt.seg_unpack;
+	f.pack_size[0] = s->u.mt.seg_len;
+	seg = s->u.mt.seg;
+	s->u.mt.seg = NULL;
+	s->u.mt.seg_len = 0;
+	s->u.mt.seg_size = 0;
+	s->u.mt.seg_unpack = 0;
+	r = sz_mt_queue(s->ctx->mt, &f, &seg);
+	return (r < 0) ? r : 1;
+}
+
+/* Decode the rest of the stream sequentially, from the start of the segment that
+   was too large, by turning this node into a regular LZMA2 one */
+static int sz_mt_sequential(sz_stream_t *s)
+{
+	sz_input_t *in = &s->in[0];
+	uint8_t *seg = s->u.mt.seg, props[1] = { s->u.mt.props };
+	size_t unread = in->len - in->pos, size = MAX(s->u.mt.seg_len + unread, in->size);
+
+	if (size > s->u.mt.seg_size) {
+		seg = realloc(seg, size);
+		if (seg == NULL) {
+			bb_error_msg("memory allocation error");
+			return -1;
+		}
+	}
+	memcpy(seg + s->u.mt.seg_len, in->buf + in->pos, unread);
+	free(in->buf);
+	in->buf = seg;
+	in->pos = 0;
+	in->len = s->u.mt.seg_len + unread;
+	in->size = size;
+	memset(&s->u, 0, sizeof(s->u));
+	s->type = SZ_LZMA2;
+	return sz_lzma_init(s, props);
+}
+
+static int sz_lzma2_mt_read(sz_stream_t *s, uint8_t *buf, size_t size)
+{
+	sz_mt_t *mt = s->ctx->mt;
+	sz_job_t *job;
+	size_t n;
+	int r;
+
+	for (;;) {
+		job = s->u.mt.job;
+		if (job != NULL) {
+			n = MIN(size, (size_t)job->folder.unpack_size - s->u.mt.job_pos);
+			if (n != 0) {
+				memcpy(buf, job->out + s->u.mt.job_pos, n);
+				s->u.mt.job_pos += n;
+				return (int)n;
+			}
+			sz_mt_retire(mt);
+			s->u.mt.job = NULL;
+		}
+		/* Keep the workers busy */
+		while (!s->u.mt.eof && !s->u.mt.fallback && sz_mt_room(mt, 2 * SZ_MT_MAX_SEGMENT)) {
+			r = sz_mt_segment(s);
+			if (r < 0)
+				return r;
+			if (r != 1)
+				break;
+		}
+		if (mt->head == mt->tail)
+			break;
+		s->u.mt.job = sz_mt_wait(mt);
+		if (s->u.mt.job == NULL)
+			return -1;
+		s->u.mt.job_pos = 0;
+	}
+	if (!s->u.mt.fallback)
+		return 0;
+	if (sz_mt_sequential(s) < 0)
+		return -1;
+	return sz_lzma_read(s, buf, size);
+}
+
+/*
+ * Decoding graph
+ */
+static int sz_read(sz_stream_t *s, uint8_t *buf, size_t size)
+{
+	int r;
+
+	if (size > s->left)
+		size = (size_t)s->left;
+	if (size == 0)
+		return 0;
+	switch (s->type) {
+	case SZ_PACK_FILE:
+		size = MIN(size, BB_BUFSIZE);
+		r = sz_read_file(s->ctx, s->u.pack.offset, buf, size);
+		if (r == 0) {
+			s->u.pack.offset += size;
+			r = (int)size;
+		}
+		break;
+	case SZ_PACK_MEM:
+		memcpy(buf, s->u.pack.mem, size);
+		s->u.pack.mem += size;
+		r = (int)size;
+		break;
+	case SZ_COPY:
+		r = sz_read(s->in[0].src, buf, size);
+		break;
+	case SZ_LZMA:
+	case SZ_LZMA2:
+		r = sz_lzma_read(s, buf, size);
+		break;
+	case SZ_LZMA2_MT:
+		r = sz_lzma2_mt_read(s, buf, size);
+		break;
+	case SZ_BCJ:
+		r = sz_bcj_read(s, buf, size);
+		break;
+	case SZ_BCJ2:
+		r = sz_bcj2_read(s, buf, size);
+		break;
+	default:
+		r = -1;
+		break;
+	}
+	if (r > 0)
+		s->left -= r;
+	return r;
+}
+
+static void sz_free_stream(sz_stream_t *s)
+{
+	unsigned i;
+
+	if (s == NULL)
+		return;
+	switch (s->type) {
+	case SZ_LZMA:
+	case SZ_LZMA2:
+		if (s->u.lzma != NULL)
+			xz_dec_lzma2_end(s->u.lzma);
+		break;
+	case SZ_LZMA2_MT:
+		/* The jobs in the ring are all ours */
+		sz_mt_drain(s->ctx->mt);
+		free(s->u.mt.seg);
+		break;
+	case SZ_BCJ:
+		xz_dec_bcj_end(s->u.bcj.dec);
+		break;
+	}
+	for (i = 0; i < s->num_in; i++) {
+		sz_free_stream(s->in[i].src);
+		free(s->in[i].buf);
+	}
+	free(s);
+}
+
+/* Build the nodes that decode the output of a coder. The packed streams are read
+   from 'pack' if it isn't NULL, or from the archive otherwise. */
+static sz_stream_t *sz_build(sz_ctx_t *ctx, const sz_folder_t *f, unsigned index, uint8_t **pack, bool allow_mt)
+{
+	const sz_coder_t *c = &f->coder[index];
+	sz_stream_t *s = xzalloc(sizeof(sz_stream_t)), *src;
+	unsigned i, j;
+
+	if (s == NULL)
+		goto oom;
+	s->ctx = ctx;
+	s->left = c->unpack_size;
+	switch (c->method) {
+	case SZ_METHOD_COPY:
+		s->type = SZ_COPY;
+		break;
+	case SZ_METHOD_LZMA:
+		s->type = SZ_LZMA;
+		if (c->props_size != 5)
+			goto corrupted;
+		break;
+	case SZ_METHOD_LZMA2:
+		s->type = SZ_LZMA2;
+		if (c->props_size != 1)
+			goto corrupted;
+		break;
+	case SZ_METHOD_BCJ:
+		s->type = SZ_BCJ;
+		/* Only the default start offset is supported */
+		if (c->props_size != 0 && (c->props_size != 4 || get_le32(c->props) != 0))
+			goto unsupported;
+		break;
+	case SZ_METHOD_BCJ2:
+		s->type = SZ_BCJ2;
+		break;
+	case SZ_METHOD_AES:
+		bb_error_msg("encrypted archives are not supported");
+		goto err;
+	default:
+		goto unsupported;
+	}
+	if (c->num_in != ((s->type == SZ_BCJ2) ? 4 : 1))
+		goto corrupted;
+
+	for (i = 0; i < c->num_in; i++) {
+		for (j = 0; j < f->num_bonds && f->bond[j].in != c->in_base + i; j++);
+		if (j < f->num_bonds) {
+			src = sz_build(ctx, f, f->bond[j].out, pack, allow_mt);
+		} else {
+			for (j = 0; j < f->num_pack && f->pack_in[j] != c->in_base + i; j++);
+			if (j == f->num_pack)
+				goto corrupted;
+			src = xzalloc(sizeof(sz_stream_t));
+			if (src == NULL)
+				goto oom;
+			src->type = (pack != NULL) ? SZ_PACK_MEM : SZ_PACK_FILE;
+			src->ctx = ctx;
+			src->left = f->pack_size[j];
+			src->u.pack.offset = f->pack_pos[j];
+			src->u.pack.mem = (pack != NULL) ? pack[j] : NULL;
+		}
+		if (src == NULL)
+			goto err;
+		s->in[i].src = src;
+		s->num_in++;
+		if (s->type != SZ_COPY) {
+			s->in[i].buf = malloc(BB_BUFSIZE);
+			if (s->in[i].buf == NULL)
+				goto oom;
+			s->in[i].size = BB_BUFSIZE;
+		}
+	}
+
+	/* Large LZMA2 streams, that are read from the archive, are split among the workers */
+	if (s->type == SZ_LZMA2 && allow_mt && ctx != NULL && ctx->mt != NULL &&
+		s->in[0].src->type == SZ_PACK_FILE && s->left >= 2 * SZ_MT_MIN_SEGMENT) {
+		s->type = SZ_LZMA2_MT;
+		s->u.mt.props = c->props[0];
+		return s;
+	}
+	switch (s->type) {
+	case SZ_LZMA:
+	case SZ_LZMA2:
+		if (sz_lzma_init(s, c->props) < 0)
+			goto err;
+		break;
+	case SZ_BCJ:
+		s->u.bcj.dec = xz_dec_bcj_create(false);
+		if (s->u.bcj.dec == NULL)
+			goto oom;
+		xz_dec_bcj_reset(s->u.bcj.dec, BCJ_X86);
+		break;
+	}
+	return s;
+
+corrupted:
+	bb_error_msg("corrupted archive");
+	goto err;
+unsupported:
+	bb_error_msg("unsupported compression method 0x%llx", (unsigned long long)c->method);
+	goto err;
+oom:
+	bb_error_msg("memory allocation error");
+err:
+	sz_free_stream(s);
+	return NULL;
+}
+
+/* A folder with a single LZMA or LZMA2 coder can be decoded in one call,
+   with the output buffer as the dictionary */
+static int sz_decode_single(const sz_folder_t *f, uint8_t **pack, uint8_t *out)
+{
+	const sz_coder_t *c = &f->coder[0];
+	struct xz_dec_lzma2 *s;
+	struct xz_buf b;
+	enum xz_ret ret;
+
+	s = xz_dec_lzma2_create(XZ_SINGLE, 0);
+	if (s == NULL)
+		return -1;
+	if (c->method == SZ_METHOD_LZMA)
+		ret = xz_dec_lzma1_reset(s, c->props[0], get_le32(&c->props[1]), f->pack_size[0], f->unpack_size);
+	else
+		ret = xz_dec_lzma2_reset(s, c->props[0]);
+	b.in = pack[0];
+	b.in_pos = 0;
+	b.in_size = (size_t)f->pack_size[0];
+	b.out = out;
+	b.out_pos = 0;
+	b.out_size = (size_t)f->unpack_size;
+	if (ret == XZ_OK) {
+		if (c->method == SZ_METHOD_LZMA)
+			ret = xz_dec_lzma1_run(s, &b);
+		else
+			ret = xz_dec_lzma2_run(s, &b);
+	}
+	xz_dec_lzma2_end(s);
+	return ((ret == XZ_OK || ret == XZ_STREAM_END) && b.out_pos == b.out_size) ? 0 : -1;
+}
+
+/* Decode a folder, whose packed streams are in memory, to memory */
+static int sz_decode_folder(const sz_folder_t *f, uint8_t **pack, uint8_t *out)
+{
+	const sz_coder_t *c = &f->coder[0];
+	sz_stream_t *s;
+	uint64_t n;
+	int r = 0;
+
+	if (f->num_coders == 1 && ((c->method == SZ_METHOD_LZMA && c->props_size == 5) ||
+		(c->method == SZ_METHOD_LZMA2 && c->props_size == 1)))
+		return sz_decode_single(f, pack, out);
+
+	s = sz_build(NULL, f, f->main, pack, false);
+	if (s == NULL)
+		return -1;
+	for (n = 0; n < f->unpack_size; n += r) {
+		r = sz_read(s, out + n, (size_t)MIN(f->unpack_size - n, SZ_WRITE_SIZE));
+		if (r <= 0) {
+			r = -1;
+			break;
+		}
+	}
+	sz_free_stream(s);
+	return (r < 0) ? -1 : 0;
+}
+
+/*
+ * Archive
+ */
+
+/* Read the main header, and decode it first if it is compressed */
+static int sz_open(sz_ctx_t *ctx)
+{
+	uint8_t hdr[SZ_START_HEADER_SIZE], *buf = NULL, *out, *pack[SZ_MAX_PACK] = { 0 };
+	uint64_t offset, size, id;
+	sz_archive_t ar = { 0 };
+	sz_reader_t r = { 0 };
+	sz_folder_t *f;
+	unsigned i, depth;
+	int ret = -1;
+
+	if (global_crc32_table == NULL)
+		global_crc32_table = crc32_filltable(NULL, 0);
+
+	if (read_at(ctx->fd, 0, hdr, sizeof(hdr)) != sizeof(hdr) ||
+		memcmp(hdr, SZ_SIGNATURE, SZ_SIGNATURE_SIZE) != 0) {
+		bb_error_msg("not a 7z archive");
+		return -1;
+	}
+	if (hdr[6] != 0) {
+		bb_error_msg("unsupported 7z version %d.%d", hdr[6], hdr[7]);
+		return -1;
+	}
+	if (sz_crc32(&hdr[12], 20, 0) != get_le32(&hdr[8]))
+		goto corrupted;
+	offset = get_le64(&hdr[12]) + SZ_START_HEADER_SIZE;
+	size = get_le64(&hdr[20]);
+	/* An empty archive has no header */
+	if (size == 0)
+		return 0;
+	if (size > SZ_MAX_HEADER_SIZE || offset < SZ_START_HEADER_SIZE)
+		goto corrupted;
+	buf = malloc((size_t)size);
+	if (buf == NULL || read_at(ctx->fd, offset, buf, (unsigned)size) != (int)size ||
+		sz_crc32(buf, (size_t)size, 0) != get_le32(&hdr[28]))
+		goto corrupted;
+
+	for (depth = 0; depth < 4; depth++) {
+		r.buf = buf;
+		r.pos = 0;
+		r.size = (size_t)size;
+		r.err = false;
+		id = sz_number(&r);
+		if (id == SZ_ID_HEADER) {
+			sz_read_header(&r, &ctx->ar);
+			if (!r.err)
+				ret = 0;
+			break;
+		}
+		if (id != SZ_ID_ENCODED_HEADER)
+			break;
+
+		/* The header is the output of the first folder of these streams */
+		sz_read_streams_info(&r, &ar);
+		if (r.err || ar.num_folders == 0)
+			break;
+		f = &ar.folders[0];
+		if (f->unpack_size > SZ_MAX_HEADER_SIZE)
+			break;
+		for (i = 0; i < f->num_pack; i++) {
+			if (f->pack_size[i] > SZ_MAX_HEADER_SIZE)
+				break;
+			pack[i] = malloc((size_t)f->pack_size[i] + 1);
+			if (pack[i] == NULL || read_at(ctx->fd, f->pack_pos[i], pack[i],
+				(unsigned)f->pack_size[i]) != (int)f->pack_size[i])
+				break;
+		}
+		if (i < f->num_pack)
+			break;
+		out = malloc((size_t)f->unpack_size + 1);
+		if (out == NULL || sz_decode_folder(f, pack, out) < 0 ||
+			(f->has_crc && sz_crc32(out, (size_t)f->unpack_size, 0) != f->crc)) {
+			free(out);
+			break;
+		}
+		free(buf);
+		buf = out;
+		size = f->unpack_size;
+		for (i = 0; i < SZ_MAX_PACK; i++) {
+			free(pack[i]);
+			pack[i] = NULL;
+		}
+		sz_free_archive(&ar);
+	}
+
+corrupted:
+	if (ret < 0)
+		bb_error_msg("corrupted archive");
+	for (i = 0; i < SZ_MAX_PACK; i++)
+		free(pack[i]);
+	sz_free_archive(&ar);
+	free(buf);
+	return ret;
+}
+
+/* Write the next 'size' bytes of the output of a folder to the current file, and check
+   their CRC, or skip them if 'file' is NULL. Returns the number of bytes written. */
+static IF_DESKTOP(long long) int sz_extract(sz_ctx_t *ctx, sz_stream_t *s, uint64_t size, const sz_file_t *file)
+{
+	IF_DESKTOP(long long) int n = 0;
+	uint32_t crc = 0;
+	ssize_t nwrote;
+	size_t len, i;
+	int r;
+
+	while (size > 0) {
+		len = (size_t)MIN(size, SZ_WRITE_SIZE);
+		for (i = 0; i < len; i += r) {
+			r = sz_read(s, ctx->buf + i, len - i);
+			if (r < 0)
+				return -1;
+			if (r == 0) {
+				bb_error_msg("truncated archive");
+				return -1;
+			}
+		}
+		size -= len;
+		if (file == NULL)
+			continue;
+		if (file->has_crc)
+			crc = sz_crc32(ctx->buf, len, crc);
+		nwrote = transformer_write(ctx->xstate, ctx->buf, len);
+		if (nwrote == -ENOSPC)
+			return -ENOSPC;
+		if (nwrote < 0) {
+			bb_error_msg("write error (errno: %d)", errno);
+			return -1;
+		}
+		n += nwrote;
+	}
+	if (file != NULL && file->has_crc && crc != file->crc) {
+		bb_error_msg("CRC error");
+		return -1;
+	}
+	return n;
+}
+
+/* Extract the first file that has data, which is what the archive of an image holds */
+static IF_DESKTOP(long long) int sz_unpack_first(sz_ctx_t *ctx)
+{
+	IF_DESKTOP(long long) int n;
+	sz_archive_t *ar = &ctx->ar;
+	sz_folder_t *f;
+	sz_stream_t *s;
+	uint32_t i;
+
+	for (i = 0; i < ar->num_files && !ar->files[i].has_stream; i++);
+	if (i == ar->num_files)
+		return 0;
+	f = &ar->folders[ar->files[i].folder];
+	s = sz_build(ctx, f, f->main, NULL, true);
+	if (s == NULL)
+		return -1;
+	n = sz_extract(ctx, s, ar->files[i].offset, NULL);
+	if (n >= 0)
+		n = sz_extract(ctx, s, ar->files[i].size, &ar->files[i]);
+	sz_free_stream(s);
+	return n;
+}
+
+/* Don't let a name escape the destination directory */
+static bool sz_is_safe_name(const char *name)
+{
+	const char *p;
+
+	if (name == NULL || name[0] == 0 || name[0] == '/' || name[0] == '\\' || strchr(name, ':') != NULL)
+		return false;
+	for (p = name; *p != 0; ) {
+		if (p[0] == '.' && p[1] == '.' && (p[2] == 0 || p[2] == '/' || p[2] == '\\'))
+			return false;
+		p += strcspn(p, "/\\");
+		if (*p != 0)
+			p++;
+	}
+	return true;
+}
+
+/* Packed and unpacked size of a folder, when decoded in memory */
+static uint64_t sz_folder_mem(const sz_folder_t *f)
+{
+	uint64_t size = f->unpack_size;
+	unsigned i;
+
+	for (i = 0; i < f->num_pack; i++)
+		size += f->pack_size[i];
+	return size;
+}
+
+/* Read the packed streams of a folder to memory, and queue its decoding */
+static int sz_queue_folder(sz_ctx_t *ctx, const sz_folder_t *f)
+{
+	uint8_t *pack[SZ_MAX_PACK] = { 0 };
+	unsigned i;
+
+	for (i = 0; i < f->num_pack; i++) {
+		pack[i] = malloc((size_t)f->pack_size[i] + 1);
+		if (pack[i] == NULL) {
+			bb_error_msg("memory allocation error");
+			goto err;
+		}
+		if (sz_read_file(ctx, f->pack_pos[i], pack[i], (size_t)f->pack_size[i]) < 0)
+			goto err;
+	}
+	return sz_mt_queue(ctx->mt, f, pack);
+
+err:
+	for (i = 0; i < SZ_MAX_PACK; i++)
+		free(pack[i]);
+	return -1;
+}
+
+/* Start decoding a folder. The folders that fit in memory are read ahead, up to the next
+   large one, and decoded by the workers. The large ones are decoded as we go. */
+static sz_stream_t *sz_open_folder(sz_ctx_t *ctx, uint32_t index, bool *from_job)
+{
+	sz_archive_t *ar = &ctx->ar;
+	sz_folder_t *f = &ar->folders[index];
+	sz_mt_t *mt = ctx->mt;
+	sz_stream_t *s;
+	sz_job_t *job;
+
+	*from_job = false;
+	if (mt == NULL || sz_folder_mem(f) > SZ_MT_MAX_SEGMENT)
+		return sz_build(ctx, f, f->main, NULL, true);
+
+	if (ctx->next_folder < index)
+		ctx->next_folder = index;
+	for (; ctx->next_folder < ar->num_folders; ctx->next_folder++) {
+		f = &ar->folders[ctx->next_folder];
+		if (f->num_streams == 0)
+			continue;
+		if (sz_folder_mem(f) > SZ_MT_MAX_SEGMENT || !sz_mt_room(mt, (size_t)sz_folder_mem(f)))
+			break;
+		if (sz_queue_folder(ctx, f) < 0)
+			return NULL;
+	}
+	job = sz_mt_wait(mt);
+	if (job == NULL)
+		return NULL;
+	*from_job = true;
+	s = xzalloc(sizeof(sz_stream_t));
+	if (s == NULL) {
+		bb_error_msg("memory allocation error");
+		return NULL;
+	}
+	s->type = SZ_PACK_MEM;
+	s->left = job->folder.unpack_size;
+	s->u.pack.mem = job->out;
+	return s;
+}
+
+static void sz_close_folder(sz_ctx_t *ctx, sz_stream_t *s, bool from_job)
+{
+	sz_free_stream(s);
+	if (from_job)
+		sz_mt_retire(ctx->mt);
+}
+
+/* Extract every file to the destination directory */
+static IF_DESKTOP(long long) int sz_unpack_all(sz_ctx_t *ctx)
+{
+	IF_DESKTOP(long long) int n = 0, r = 0;
+	transformer_state_t *xstate = ctx->xstate;
+	sz_archive_t *ar = &ctx->ar;
+	sz_stream_t *s = NULL;
+	sz_file_t *file;
+	uint32_t i, folder = UINT32_MAX;
+	uint64_t pos = 0;
+	bool from_job = false;
+
+	for (i = 0; i < ar->num_files; i++) {
+		file = &ar->files[i];
+		/* Directories get created along with the files they hold */
+		if (file->is_dir)
+			continue;
+		if (!sz_is_safe_name(file->name)) {
+			bb_error_msg("invalid file name '%s'", (file->name != NULL) ? file->name : "");
+			r = -1;
+			break;
+		}
+		xstate->dst_name = strdup(file->name);
+		if (xstate->dst_name == NULL) {
+			bb_error_msg("memory allocation error");
+			r = -1;
+			break;
+		}
+		xstate->dst_size = file->size;
+		r = transformer_switch_file(xstate);
+		if (r < 0)
+			break;
+		if (!file->has_stream)
+			continue;
+		if (file->folder != folder) {
+			sz_close_folder(ctx, s, from_job);
+			folder = file->folder;
+			pos = 0;
+			s = sz_open_folder(ctx, folder, &from_job);
+			if (s == NULL) {
+				r = -1;
+				break;
+			}
+		}
+		r = sz_extract(ctx, s, file->offset - pos, NULL);
+		if (r >= 0)
+			r = sz_extract(ctx, s, file->size, file);
+		if (r < 0)
+			break;
+		pos = file->offset + file->size;
+		n += r;
+	}
+	sz_close_folder(ctx, s, from_job);
+	return (r < 0) ? r : n;
+}
+
+IF_DESKTOP(long long) int FAST_FUNC unpack_7z_stream(transformer_state_t *xstate)
+{
+	IF_DESKTOP(long long) int n = -1;
+	sz_ctx_t ctx = { 0 };
+
+	ctx.xstate = xstate;
+	ctx.fd = xstate->src_fd;
+	ctx.fd_pos = UINT64_MAX;
+	if (sz_open(&ctx) < 0)
+		goto out;
+	ctx.buf = malloc(SZ_WRITE_SIZE);
+	if (ctx.buf == NULL) {
+		bb_error_msg("memory allocation error");
+		goto out;
+	}
+	ctx.mt = sz_mt_init(xstate);
+	n = (xstate->dst_dir == NULL) ? sz_unpack_first(&ctx) : sz_unpack_all(&ctx);
+	if (n == -ENOSPC)
+		n = xstate->mem_output_size_max;
+
+out:
+	sz_mt_free(ctx.mt);
+	sz_free_archive(&ctx.ar);
+	free(ctx.buf);
+	return n;
+}
+
+/* The size of the first file that has data, which is the one we extract to a single file */
+int FAST_FUNC get_7z_size(int fd, uint64_t file_size, uint64_t *size)
+{
+	sz_ctx_t ctx = { 0 };
+	uint32_t i;
+	int r = SIZE_UNKNOWN;
+
+	ctx.fd = fd;
+	if (sz_open(&ctx) == 0) {
+		for (i = 0; i < ctx.ar.num_files && !ctx.ar.files[i].has_stream; i++);
+		if (i < ctx.ar.num_files) {
+			*size = ctx.ar.files[i].size;
+			r = SIZE_EXACT;
+		}
+	}
+	sz_free_archive(&ctx.ar);
+	return r;
+}
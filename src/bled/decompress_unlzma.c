@@ -262,6 +262,10 @@ unpack_lzma_stream(transformer_state_t *xstate)
 
 	if (header.dict_size == 0)
 		header.dict_size++;
+	/* When decoding to a buffer, matches can't reach further back than the buffer size.
+	 * Use one more byte, so that the first dictionary flush is the one that fills it. */
+	if (xstate->mem_output_size_max != 0 && header.dict_size > xstate->mem_output_size_max)
+		header.dict_size = (uint32_t)xstate->mem_output_size_max + 1;
 
 	buffer_size = (uint32_t)MIN(header.dst_size, header.dict_size);
 	buffer = xmalloc(buffer_size);
@@ -532,3 +536,17 @@ unpack_lzma_stream(transformer_state_t *xstate)
 		return total_written;
 	}
 }
+
+int FAST_FUNC get_lzma_size(int fd, uint64_t file_size, uint64_t *size)
+{
+	lzma_header_t header;
+
+	if (read_at(fd, 0, &header, sizeof(header)) != sizeof(header) || header.pos >= (9 * 5 * 5))
+		return SIZE_UNKNOWN;
+	/* 2^64-1 means that the size isn't known, and that the stream has an end marker */
+	header.dst_size = SWAP_LE64(header.dst_size);
+	if (header.dst_size == UINT64_MAX)
+		return SIZE_UNKNOWN;
+	*size = header.dst_size;
+	return SIZE_EXACT;
+}
@@ -0,0 +1,482 @@
+/*
+ * WIM chunk decompression (XPRESS Huffman and LZX)
+ *
+ * Copyright © 2026 agent <agent@local>
+ *
+ * Based on the [MS-XCA] and [MS-PATCH] specifications, as well as on the
+ * WIM specific variations of these formats documented by wimlib.
+ *
+ * Licensed under GPLv2 or later, see file LICENSE in this source tree.
+ */
+
+#include "libbb.h"
+#include "bb_archive.h"
+
+/*
+ * As opposed to the other decompressors, these operate on a single WIM chunk,
+ * from a memory buffer to a memory buffer, and don't use any global state, so
+ * that the chunks of a WIM resource can be decompressed in parallel.
+ */
+
+#define HUFF_TABLE_BITS			10
+#define HUFF_MAX_LEN			16
+#define HUFF_MAX_SYMBOLS		656		// LZX main code for a 2 MB window
+
+#define XPRESS_NUM_SYMBOLS		512
+#define XPRESS_MIN_MATCH_LEN	3
+#define XPRESS_MAX_CHUNK_SIZE	65536
+
+#define LZX_BLOCKTYPE_VERBATIM	1
+#define LZX_BLOCKTYPE_ALIGNED	2
+#define LZX_BLOCKTYPE_UNCOMPRESSED	3
+#define LZX_DEFAULT_BLOCK_SIZE	32768
+#define LZX_MIN_WINDOW_ORDER	15
+#define LZX_MAX_WINDOW_ORDER	21
+#define LZX_NUM_CHARS			256
+#define LZX_NUM_LEN_HEADERS		8
+#define LZX_NUM_LEN_SYMS		249
+#define LZX_NUM_PRECODE_SYMS	20
+#define LZX_NUM_ALIGNED_SYMS	8
+#define LZX_MIN_MATCH_LEN		2
+#define LZX_MAX_OFFSET_SLOTS	50
+#define LZX_OFFSET_ADJUSTMENT	2
+#define LZX_WIM_E8_FILESIZE		12000000
+
+typedef struct {
+	uint16_t table[1 << HUFF_TABLE_BITS];	// (symbol << 5) | length, or 0 for longer codes
+	uint16_t count[HUFF_MAX_LEN + 1];
+	uint16_t symbol[HUFF_MAX_SYMBOLS];
+} huff_t;
+
+typedef struct {
+	const uint8_t* next;
+	const uint8_t* end;
+	uint32_t bitbuf;
+	uint32_t bitsleft;
+	uint32_t overrun;
+} bitstream_t;
+
+typedef struct {
+	uint8_t main_lens[HUFF_MAX_SYMBOLS];
+	uint8_t len_lens[LZX_NUM_LEN_SYMS];
+	uint8_t aligned_lens[LZX_NUM_ALIGNED_SYMS];
+	huff_t main;
+	huff_t len;
+	huff_t aligned;
+	huff_t pre;
+} lzx_state_t;
+
+static const uint8_t lzx_extra_bits[LZX_MAX_OFFSET_SLOTS] = {
+	0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6, 7, 7, 8, 8, 9, 9, 10, 10, 11, 11,
+	12, 12, 13, 13, 14, 14, 15, 15, 16, 16, 17, 17, 17, 17, 17, 17, 17, 17, 17, 17,
+	17, 17, 17, 17
+};
+
+static const uint32_t lzx_offset_base[LZX_MAX_OFFSET_SLOTS] = {
+	0, 1, 2, 3, 4, 6, 8, 12, 16, 24, 32, 48, 64, 96, 128, 192, 256, 384, 512, 768,
+	1024, 1536, 2048, 3072, 4096, 6144, 8192, 12288, 16384, 24576, 32768, 49152,
+	65536, 98304, 131072, 196608, 262144, 393216, 524288, 655360, 786432, 917504,
+	1048576, 1179648, 1310720, 1441792, 1572864, 1703936, 1835008, 1966080
+};
+
+/*
+ * Build a canonical Huffman decoding table from a set of code lengths.
+ * Codes that are longer than HUFF_TABLE_BITS are resolved by huff_decode()
+ * from the sorted symbol list. Incomplete codes are accepted, in which case
+ * decoding one of the unassigned codewords fails.
+ */
+static int huff_build(huff_t* h, const uint8_t* lens, int num_syms)
+{
+	uint16_t offs[HUFF_MAX_LEN + 1];
+	int i, j, n, len, left, code;
+
+	memset(h->count, 0, sizeof(h->count));
+	for (i = 0; i < num_syms; i++) {
+		if (lens[i] > HUFF_MAX_LEN)
+			return -1;
+		h->count[lens[i]]++;
+	}
+	h->count[0] = 0;
+
+	/* Reject over-subscribed codes */
+	left = 1;
+	for (len = 1; len <= HUFF_MAX_LEN; len++) {
+		left <<= 1;
+		left -= h->count[len];
+		if (left < 0)
+			return -1;
+	}
+
+	offs[1] = 0;
+	for (len = 1; len < HUFF_MAX_LEN; len++)
+		offs[len + 1] = offs[len] + h->count[len];
+	for (i = 0; i < num_syms; i++) {
+		if (lens[i] != 0)
+			h->symbol[offs[lens[i]]++] = (uint16_t)i;
+	}
+
+	memset(h->table, 0, sizeof(h->table));
+	for (code = 0, n = 0, len = 1; len <= HUFF_TABLE_BITS; len++, code <<= 1) {
+		for (i = 0; i < h->count[len]; i++, n++, code++) {
+			for (j = 0; j < (1 << (HUFF_TABLE_BITS - len)); j++)
+				h->table[(code << (HUFF_TABLE_BITS - len)) + j] = (uint16_t)((h->symbol[n] << 5) | len);
+		}
+	}
+	return 0;
+}
+
+/*
+ * Decode a Huffman symbol from the 16 (or more) bits that sit at the top of
+ * 'bits', and return it along with its length in 'len'. -1 on invalid code.
+ */
+static inline int huff_decode_bits(const huff_t* h, uint32_t bits, int* len)
+{
+	int code, first, index, count;
+	uint16_t entry = h->table[bits >> (32 - HUFF_TABLE_BITS)];
+
+	if (entry != 0) {
+		*len = entry & 0x1f;
+		return entry >> 5;
+	}
+	code = first = index = 0;
+	for (*len = 1; *len <= HUFF_MAX_LEN; (*len)++) {
+		code |= (bits >> (32 - *len)) & 1;
+		count = h->count[*len];
+		if (code - count < first)
+			return h->symbol[index + (code - first)];
+		index += count;
+		first += count;
+		first <<= 1;
+		code <<= 1;
+	}
+	return -1;
+}
+
+/*
+ * LZX bitstream: 16-bit little endian words, read MSB first. Words are only
+ * fetched when needed, which is what the alignment of uncompressed blocks is
+ * based on. Reading past the end of the input returns zeroes.
+ */
+static inline void bs_ensure(bitstream_t* bs, uint32_t n)
+{
+	while (bs->bitsleft < n) {
+		if (bs->end - bs->next >= 2) {
+			bs->bitbuf |= (uint32_t)(bs->next[0] | (bs->next[1] << 8)) << (16 - bs->bitsleft);
+			bs->next += 2;
+		} else {
+			bs->overrun++;
+		}
+		bs->bitsleft += 16;
+	}
+}
+
+/* Read up to 17 bits */
+static inline uint32_t bs_read(bitstream_t* bs, uint32_t n)
+{
+	uint32_t r;
+
+	if (n == 0)
+		return 0;
+	bs_ensure(bs, n);
+	r = bs->bitbuf >> (32 - n);
+	bs->bitbuf <<= n;
+	bs->bitsleft -= n;
+	return r;
+}
+
+static inline int bs_decode(bitstream_t* bs, const huff_t* h)
+{
+	int sym, len;
+
+	bs_ensure(bs, HUFF_MAX_LEN);
+	sym = huff_decode_bits(h, bs->bitbuf, &len);
+	if (sym >= 0) {
+		bs->bitbuf <<= len;
+		bs->bitsleft -= len;
+	}
+	return sym;
+}
+
+IF_DESKTOP(long long) int FAST_FUNC unpack_xpress_chunk(const uint8_t* src, size_t src_len, uint8_t* dst, size_t dst_len)
+{
+	uint8_t lens[XPRESS_NUM_SYMBOLS];
+	huff_t* h = NULL;
+	const uint8_t *in, *in_end = src + src_len;
+	uint8_t *out = dst, *out_end = dst + dst_len;
+	uint32_t next_bits, length, offset, log2_offset;
+	int32_t extra_bits;
+	int i, sym, len;
+
+	if ((dst_len > XPRESS_MAX_CHUNK_SIZE) || (src_len < XPRESS_NUM_SYMBOLS / 2 + 4))
+		return -1;
+	for (i = 0; i < XPRESS_NUM_SYMBOLS / 2; i++) {
+		lens[2 * i] = src[i] & 0x0f;
+		lens[2 * i + 1] = src[i] >> 4;
+	}
+	h = malloc(sizeof(huff_t));
+	if (h == NULL || huff_build(h, lens, XPRESS_NUM_SYMBOLS) < 0)
+		goto err;
+
+/* Per [MS-XCA], bits are consumed from a 32-bit window that gets refilled once fewer than 16 bits remain */
+#define XPRESS_READ16(p) (((p) + 1 < in_end) ? (uint32_t)((p)[0] | ((p)[1] << 8)) : 0)
+#define XPRESS_CONSUME(n) do {                                         \
+	next_bits <<= (n);                                                 \
+	extra_bits -= (n);                                                 \
+	if (extra_bits < 0) {                                              \
+		next_bits |= XPRESS_READ16(in) << (-extra_bits);               \
+		extra_bits += 16;                                              \
+		in += 2;                                                       \
+	} } while (0)
+
+	in = &src[XPRESS_NUM_SYMBOLS / 2];
+	next_bits = (XPRESS_READ16(in) << 16) | XPRESS_READ16(in + 2);
+	in += 4;
+	extra_bits = 16;
+
+	while (out < out_end) {
+		sym = huff_decode_bits(h, next_bits, &len);
+		if (sym < 0)
+			goto err;
+		XPRESS_CONSUME(len);
+		if (sym < 256) {
+			*out++ = (uint8_t)sym;
+			continue;
+		}
+		sym -= 256;
+		length = sym & 0x0f;
+		log2_offset = sym >> 4;
+		if (length == 0x0f) {
+			if (in >= in_end)
+				goto err;
+			length = *in++;
+			if (length == 0xff) {
+				if (in + 1 >= in_end)
+					goto err;
+				length = in[0] | (in[1] << 8);
+				in += 2;
+				if (length < 0x0f)
+					goto err;
+				length -= 0x0f;
+			}
+			length += 0x0f;
+		}
+		length += XPRESS_MIN_MATCH_LEN;
+		offset = (log2_offset == 0) ? 0 : next_bits >> (32 - log2_offset);
+		offset += 1 << log2_offset;
+		XPRESS_CONSUME(log2_offset);
+		if ((offset > (uint32_t)(out - dst)) || (length > (uint32_t)(out_end - out)))
+			goto err;
+		for (; length > 0; length--, out++)
+			*out = out[-(int32_t)offset];
+	}
+#undef XPRESS_CONSUME
+#undef XPRESS_READ16
+
+	free(h);
+	return (long long)dst_len;
+
+err:
+	free(h);
+	return -1;
+}
+
+/* Read a set of LZX code lengths, which are delta encoded against the previous ones through a pretree */
+static int lzx_read_lens(bitstream_t* bs, huff_t* pre, uint8_t* lens, int num_lens)
+{
+	uint8_t pre_lens[LZX_NUM_PRECODE_SYMS];
+	int i, sym, run;
+	uint8_t len;
+
+	for (i = 0; i < LZX_NUM_PRECODE_SYMS; i++)
+		pre_lens[i] = (uint8_t)bs_read(bs, 4);
+	if (huff_build(pre, pre_lens, LZX_NUM_PRECODE_SYMS) < 0)
+		return -1;
+
+	for (i = 0; i < num_lens; ) {
+		sym = bs_decode(bs, pre);
+		if (sym < 0)
+			return -1;
+		if (sym < 17) {
+			lens[i] = (uint8_t)((lens[i] + 17 - sym) % 17);
+			i++;
+			continue;
+		}
+		if (sym == 17) {
+			run = 4 + bs_read(bs, 4);
+			len = 0;
+		} else if (sym == 18) {
+			run = 20 + bs_read(bs, 5);
+			len = 0;
+		} else {
+			run = 4 + bs_read(bs, 1);
+			sym = bs_decode(bs, pre);
+			if (sym < 0 || sym > 17)
+				return -1;
+			len = (uint8_t)((lens[i] + 17 - sym) % 17);
+		}
+		/* Runs that overflow the table are harmless and just get truncated */
+		for (; (run > 0) && (i < num_lens); run--)
+			lens[i++] = len;
+	}
+	return 0;
+}
+
+/* Undo the x86 CALL (0xE8) target translation that is always applied to WIM LZX chunks */
+static void lzx_undo_e8_translation(uint8_t* data, size_t size)
+{
+	uint8_t *p = data, *tail;
+	int32_t abs_offset, rel_offset, pos;
+
+	if (size <= 10)
+		return;
+	for (tail = &data[size - 10]; p < tail; p++) {
+		if (*p != 0xe8)
+			continue;
+		pos = (int32_t)(p - data);
+		abs_offset = (int32_t)(p[1] | (p[2] << 8) | (p[3] << 16) | ((uint32_t)p[4] << 24));
+		if (abs_offset >= 0) {
+			if (abs_offset >= LZX_WIM_E8_FILESIZE) {
+				p += 4;
+				continue;
+			}
+			rel_offset = abs_offset - pos;
+		} else {
+			if (abs_offset < -pos) {
+				p += 4;
+				continue;
+			}
+			rel_offset = abs_offset + LZX_WIM_E8_FILESIZE;
+		}
+		p[1] = (uint8_t)rel_offset;
+		p[2] = (uint8_t)(rel_offset >> 8);
+		p[3] = (uint8_t)(rel_offset >> 16);
+		p[4] = (uint8_t)(rel_offset >> 24);
+		p += 4;
+	}
+}
+
+IF_DESKTOP(long long) int FAST_FUNC unpack_lzx_chunk(const uint8_t* src, size_t src_len, uint8_t* dst, size_t dst_len)
+{
+	lzx_state_t* s = NULL;
+	bitstream_t bs = { src, src + src_len, 0, 0, 0 };
+	uint8_t *out = dst, *out_end = dst + dst_len, *block_end;
+	uint32_t r[3] = { 1, 1, 1 };
+	uint32_t block_type, block_size, length, offset, slot, extra;
+	int i, window_order, num_main_syms, sym;
+
+	if (dst_len == 0)
+		return 0;
+	for (window_order = LZX_MIN_WINDOW_ORDER; ((size_t)1 << window_order) < dst_len; window_order++);
+	if (window_order > LZX_MAX_WINDOW_ORDER)
+		return -1;
+	/* The last offset slot is the one that can reach back to the start of the window */
+	for (slot = 30; (slot < LZX_MAX_OFFSET_SLOTS) &&
+		(((1U << window_order) - LZX_MIN_MATCH_LEN - 1) >= lzx_offset_base[slot]); slot++);
+	num_main_syms = LZX_NUM_CHARS + slot * LZX_NUM_LEN_HEADERS;
+
+	/* Code lengths are delta encoded, and start from all zeroes for each WIM chunk */
+	s = calloc(1, sizeof(lzx_state_t));
+	if (s == NULL)
+		return -1;
+
+	while (out < out_end) {
+		block_type = bs_read(&bs, 3);
+		if (bs_read(&bs, 1)) {
+			block_size = LZX_DEFAULT_BLOCK_SIZE;
+		} else {
+			block_size = bs_read(&bs, 16);
+			if (window_order >= 16)
+				block_size = (block_size << 8) | bs_read(&bs, 8);
+		}
+		if ((block_size == 0) || (block_size > (uint32_t)(out_end - out)))
+			goto err;
+		block_end = out + block_size;
+
+		switch (block_type) {
+		case LZX_BLOCKTYPE_ALIGNED:
+			for (i = 0; i < LZX_NUM_ALIGNED_SYMS; i++)
+				s->aligned_lens[i] = (uint8_t)bs_read(&bs, 3);
+			if (huff_build(&s->aligned, s->aligned_lens, LZX_NUM_ALIGNED_SYMS) < 0)
+				goto err;
+			/* Fall through */
+		case LZX_BLOCKTYPE_VERBATIM:
+			if ((lzx_read_lens(&bs, &s->pre, s->main_lens, LZX_NUM_CHARS) < 0) ||
+				(lzx_read_lens(&bs, &s->pre, &s->main_lens[LZX_NUM_CHARS], num_main_syms - LZX_NUM_CHARS) < 0) ||
+				(huff_build(&s->main, s->main_lens, num_main_syms) < 0) ||
+				(lzx_read_lens(&bs, &s->pre, s->len_lens, LZX_NUM_LEN_SYMS) < 0) ||
+				(huff_build(&s->len, s->len_lens, LZX_NUM_LEN_SYMS) < 0))
+				goto err;
+			while (out < block_end) {
+				sym = bs_decode(&bs, &s->main);
+				if (sym < 0)
+					goto err;
+				if (sym < LZX_NUM_CHARS) {
+					*out++ = (uint8_t)sym;
+					continue;
+				}
+				sym -= LZX_NUM_CHARS;
+				length = sym % LZX_NUM_LEN_HEADERS;
+				slot = sym / LZX_NUM_LEN_HEADERS;
+				if (length == LZX_NUM_LEN_HEADERS - 1) {
+					sym = bs_decode(&bs, &s->len);
+					if (sym < 0)
+						goto err;
+					length += sym;
+				}
+				length += LZX_MIN_MATCH_LEN;
+				if (slot < 3) {
+					/* Repeat offset: swap with R0 */
+					offset = r[slot];
+					r[slot] = r[0];
+					r[0] = offset;
+				} else {
+					extra = lzx_extra_bits[slot];
+					offset = lzx_offset_base[slot] - LZX_OFFSET_ADJUSTMENT;
+					if ((block_type == LZX_BLOCKTYPE_ALIGNED) && (extra >= 3)) {
+						offset += bs_read(&bs, extra - 3) << 3;
+						sym = bs_decode(&bs, &s->aligned);
+						if (sym < 0)
+							goto err;
+						offset += sym;
+					} else {
+						offset += bs_read(&bs, extra);
+					}
+					r[2] = r[1];
+					r[1] = r[0];
+					r[0] = offset;
+				}
+				if ((offset == 0) || (offset > (uint32_t)(out - dst)) || (length > (uint32_t)(block_end - out)))
+					goto err;
+				for (; length > 0; length--, out++)
+					*out = out[-(int32_t)offset];
+			}
+			break;
+		case LZX_BLOCKTYPE_UNCOMPRESSED:
+			/* Align to the next 16-bit word, which always skips at least one bit */
+			bs_ensure(&bs, 1);
+			bs.bitbuf = 0;
+			bs.bitsleft = 0;
+			if ((bs.overrun != 0) || (bs.end - bs.next < 12 + (ptrdiff_t)block_size))
+				goto err;
+			for (i = 0; i < 3; i++, bs.next += 4)
+				r[i] = bs.next[0] | (bs.next[1] << 8) | (bs.next[2] << 16) | ((uint32_t)bs.next[3] << 24);
+			memcpy(out, bs.next, block_size);
+			bs.next += block_size;
+			out += block_size;
+			/* Uncompressed blocks are padded to an even size */
+			if ((block_size & 1) && (bs.next < bs.end))
+				bs.next++;
+			break;
+		default:
+			goto err;
+		}
+	}
+
+	free(s);
+	lzx_undo_e8_translation(dst, dst_len);
+	return (long long)dst_len;
+
+err:
+	free(s);
+	return -1;
+}
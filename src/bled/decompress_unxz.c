@@ -50,6 +50,13 @@ IF_DESKTOP(long long) int FAST_FUNC unpack_xz_stream(transformer_state_t *xstate
 	s = xz_dec_init(XZ_DYNALLOC, 1 << 26);
 	if (!s)
 		bb_error_msg_and_err("memory allocation error");
+	/*
+	 * When decoding to a buffer, we never need more history than the
+	 * buffer can hold. Use one more byte, so that the decoder doesn't
+	 * wrap the dictionary before the buffer is full.
+	 */
+	if (xstate->mem_output_size_max != 0 && xstate->mem_output_size_max < (1 << 26))
+		xz_dec_cap_dict(s, (uint32_t)xstate->mem_output_size_max + 1);
 
 	in = xmalloc(XZ_BUFSIZE);
 	out = xmalloc(XZ_BUFSIZE);
@@ -140,3 +147,166 @@ err:
 	else
 		return -ret;
 }
+
+/* Decode a variable-length integer from the index. Returns the number of bytes used, or 0 on error. */
+static size_t xz_get_vli(const uint8_t *buf, size_t size, uint64_t *vli)
+{
+	size_t i;
+
+	*vli = 0;
+	for (i = 0; i < size && i < VLI_BYTES_MAX; i++) {
+		*vli |= (uint64_t)(buf[i] & 0x7F) << (7 * i);
+		if ((buf[i] & 0x80) == 0)
+			return (i == 0 || buf[i] != 0) ? i + 1 : 0;
+	}
+	return 0;
+}
+
+/*
+ * Walk the index of every stream, backwards from the end of the file, as xz does
+ * for --list, to add up the uncompressed sizes. If 'blocks' is not NULL, also list
+ * the location of every block, so that each one of them can be decoded on its own.
+ */
+static int xz_parse_index(int fd, uint64_t file_size, uint64_t *size, seek_block_t **blocks, uint32_t *nb_blocks)
+{
+	uint8_t buf[STREAM_HEADER_SIZE], *idx = NULL;
+	uint64_t pos = file_size, total = 0, blocks_size, records, unpadded, uncompressed, idx_size;
+	seek_block_t *list = NULL, *block;
+	uint32_t first, nb = 0;
+	size_t i, n;
+	int r = SIZE_UNKNOWN;
+
+	xz_crc32_init();
+	while (pos > 0) {
+		if (pos % 4 != 0 || pos < 2 * STREAM_HEADER_SIZE || read_at(fd, pos - 4, buf, 4) != 4)
+			goto out;
+		/* Skip stream padding */
+		if (get_le32(buf) == 0) {
+			pos -= 4;
+			continue;
+		}
+
+		/* Stream footer: CRC32, backward size, stream flags and magic */
+		if (read_at(fd, pos - STREAM_HEADER_SIZE, buf, STREAM_HEADER_SIZE) != STREAM_HEADER_SIZE ||
+			memcmp(&buf[10], FOOTER_MAGIC, FOOTER_MAGIC_SIZE) != 0 ||
+			xz_crc32(&buf[4], 6, 0) != get_le32(buf))
+			goto out;
+		idx_size = ((uint64_t)get_le32(&buf[4]) + 1) * 4;
+		if (idx_size < 8 || idx_size > pos - 2 * STREAM_HEADER_SIZE || idx_size > 64 * 1024 * 1024)
+			goto out;
+		free(idx);
+		idx = malloc((size_t)idx_size);
+		if (idx == NULL || read_at(fd, pos - STREAM_HEADER_SIZE - idx_size, idx, (unsigned)idx_size) != (int)idx_size ||
+			idx[0] != 0x00 || xz_crc32(idx, (size_t)idx_size - 4, 0) != get_le32(&idx[idx_size - 4]))
+			goto out;
+
+		/* Index: indicator, number of records, then unpadded and uncompressed size of each block */
+		i = 1;
+		n = xz_get_vli(&idx[i], (size_t)idx_size - 4 - i, &records);
+		if (n == 0)
+			goto out;
+		first = nb;
+		for (i += n, blocks_size = 0; records > 0; records--) {
+			n = xz_get_vli(&idx[i], (size_t)idx_size - 4 - i, &unpadded);
+			if (n == 0)
+				goto out;
+			i += n;
+			n = xz_get_vli(&idx[i], (size_t)idx_size - 4 - i, &uncompressed);
+			if (n == 0)
+				goto out;
+			i += n;
+			if (blocks != NULL) {
+				block = add_seek_block(&list, &nb);
+				if (block == NULL)
+					goto out;
+				/* Relative to the first block of the stream, until we know where it starts */
+				block->src_offset = blocks_size;
+				block->src_size = (unpadded + 3) & ~3ULL;
+				block->dst_size = uncompressed;
+			}
+			blocks_size += (unpadded + 3) & ~3ULL;
+			total += uncompressed;
+		}
+		if (((i + 3) & ~3) != idx_size - 4)
+			goto out;
+
+		/* Move to the stream header, and check its magic */
+		if (blocks_size > pos - 2 * STREAM_HEADER_SIZE - idx_size)
+			goto out;
+		pos -= 2 * STREAM_HEADER_SIZE + idx_size + blocks_size;
+		if (read_at(fd, pos, buf, HEADER_MAGIC_SIZE) != HEADER_MAGIC_SIZE ||
+			memcmp(buf, HEADER_MAGIC, HEADER_MAGIC_SIZE) != 0)
+			goto out;
+		for (; first < nb; first++) {
+			list[first].src_offset += pos + STREAM_HEADER_SIZE;
+			list[first].stream_offset = pos;
+		}
+	}
+	*size = total;
+	if (blocks != NULL) {
+		*blocks = list;
+		*nb_blocks = nb;
+		list = NULL;
+	}
+	r = SIZE_EXACT;
+
+out:
+	free(list);
+	free(idx);
+	return r;
+}
+
+int FAST_FUNC get_xz_size(int fd, uint64_t file_size, uint64_t *size)
+{
+	return xz_parse_index(fd, file_size, size, NULL, NULL);
+}
+
+int FAST_FUNC get_xz_blocks(int fd, uint64_t file_size, seek_block_t **blocks, uint32_t *nb_blocks)
+{
+	uint64_t size;
+
+	return (xz_parse_index(fd, file_size, &size, blocks, nb_blocks) == SIZE_EXACT) ? 0 : -1;
+}
+
+/*
+ * Decode a single block, by feeding the decoder with the header of the stream
+ * it belongs to, followed by the block itself. Since every block starts with a
+ * dictionary reset, the dictionary never needs to be larger than the block.
+ */
+int FAST_FUNC unpack_xz_block(int fd, const seek_block_t *block, uint8_t *dst)
+{
+	struct xz_buf b;
+	struct xz_dec *s;
+	enum xz_ret ret;
+	uint8_t *in;
+	int r = -1;
+
+	in = malloc(STREAM_HEADER_SIZE + (size_t)block->src_size);
+	s = xz_dec_init(XZ_DYNALLOC, 1 << 26);
+	if (in == NULL || s == NULL)
+		goto out;
+	if (read_at(fd, block->stream_offset, in, STREAM_HEADER_SIZE) != STREAM_HEADER_SIZE ||
+		read_at(fd, block->src_offset, &in[STREAM_HEADER_SIZE], (unsigned)block->src_size) != (int)block->src_size)
+		goto out;
+	if (block->dst_size < (1 << 26))
+		xz_dec_cap_dict(s, (uint32_t)block->dst_size + 1);
+
+	xz_crc32_init();
+	b.in = in;
+	b.in_pos = 0;
+	b.in_size = STREAM_HEADER_SIZE + (size_t)block->src_size;
+	b.out = dst;
+	b.out_pos = 0;
+	b.out_size = (size_t)block->dst_size;
+	do {
+		ret = xz_dec_run(s, &b);
+	} while ((ret == XZ_OK || ret == XZ_UNSUPPORTED_CHECK) && b.in_pos < b.in_size);
+	/* The decoder then waits for the next block, or the index */
+	if ((ret == XZ_OK || ret == XZ_UNSUPPORTED_CHECK) && b.in_pos == b.in_size && b.out_pos == b.out_size)
+		r = 0;
+
+out:
+	xz_dec_end(s);
+	free(in);
+	return r;
+}
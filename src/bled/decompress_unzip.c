@@ -659,3 +659,44 @@ err:
 	else
 		return n;
 }
+
+/* Only the first file gets extracted when not extracting to a dir */
+int FAST_FUNC get_zip_size(int fd, uint64_t file_size, uint64_t *size)
+{
+	cdf_header_t cdf;
+	uint64_t cdf_offset, next;
+	uint8_t *buf = NULL;
+	extra_header_t *extra;
+	unsigned i;
+	int r = SIZE_UNKNOWN;
+
+	cdf_offset = find_cdf_offset(fd);
+	if (cdf_offset == BAD_CDF_OFFSET || cdf_offset >= file_size)
+		return SIZE_UNKNOWN;
+	next = read_next_cdf(fd, cdf_offset, &cdf);
+	if (next == 0 || next > file_size)
+		return SIZE_UNKNOWN;
+	*size = cdf.fmt.ucmpsize;
+	if (cdf.fmt.ucmpsize != 0xffffffffL)
+		return SIZE_EXACT;
+
+	/* The actual size is the first field of the ZIP64 extra record */
+	buf = malloc(cdf.fmt.extra_len);
+	if (buf == NULL || read_at(fd, cdf_offset + 4 + CDF_HEADER_LEN + cdf.fmt.filename_len,
+		buf, cdf.fmt.extra_len) != cdf.fmt.extra_len)
+		goto out;
+	for (i = 0; i + EXTRA_HEADER_LEN <= cdf.fmt.extra_len; ) {
+		extra = (extra_header_t*)&buf[i];
+		FIX_ENDIANNESS_EXTRA(*extra);
+		if (extra->fmt.tag == SWAP_LE16(0x0001) && extra->fmt.length >= 8 &&
+			i + EXTRA_HEADER_LEN + 8 <= cdf.fmt.extra_len) {
+			*size = SWAP_LE64(get_le64(&buf[i + EXTRA_HEADER_LEN]));
+			r = SIZE_EXACT;
+			break;
+		}
+		i += EXTRA_HEADER_LEN + extra->fmt.length;
+	}
+out:
+	free(buf);
+	return r;
+}
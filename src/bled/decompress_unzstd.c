@@ -22,108 +22,313 @@ ALWAYS_INLINE static size_t roundupsize(size_t size, size_t align)
 	return (size + align - 1U) & ~(align - 1);
 }
 
-ALWAYS_INLINE static IF_DESKTOP(long long) int
-unpack_zstd_stream_inner(transformer_state_t *xstate,
-	ZSTD_DStream *dctx, void *out_buff)
+/* Make sure that at least 'size' bytes of input are available from 'in' */
+static bool zstd_fill(transformer_state_t *xstate, uint8_t *in, size_t in_allocsize,
+	size_t *in_pos, size_t *in_len, size_t size)
 {
-	const U32 zstd_magic = ZSTD_MAGIC;
-	const size_t in_allocsize = roundupsize(ZSTD_DStreamInSize(), 1024),
-		out_allocsize = roundupsize(ZSTD_DStreamOutSize(), 1024);
+	ssize_t red;
 
-	IF_DESKTOP(long long int total = 0;)
-	size_t last_result = ZSTD_error_maxCode + 1;
-	ssize_t nwrote = 0;
-	unsigned input_fixup;
-	void *in_buff = (char *)out_buff + out_allocsize;
-
-	memcpy(in_buff, &zstd_magic, 4);
-	input_fixup = xstate->signature_skipped ? 4 : 0;
-
-	/* This loop assumes that the input file is one or more concatenated
-	 * zstd streams. This example won't work if there is trailing non-zstd
-	 * data at the end, but streaming decompression in general handles this
-	 * case. ZSTD_decompressStream() returns 0 exactly when the frame is
-	 * completed, and doesn't consume input after the frame.
-	 */
-	for (;;) {
-		bool has_error = false;
-		ZSTD_inBuffer input;
-		ssize_t red;
+	if (*in_len - *in_pos >= size)
+		return true;
+	memmove(in, in + *in_pos, *in_len - *in_pos);
+	*in_len -= *in_pos;
+	*in_pos = 0;
+	while (*in_len < size) {
+		red = safe_read(xstate->src_fd, in + *in_len, (unsigned int)(in_allocsize - *in_len));
+		if (red <= 0)
+			return false;
+		*in_len += red;
+	}
+	return true;
+}
 
-		red = safe_read(xstate->src_fd, (char *)in_buff + input_fixup, (unsigned int)(in_allocsize - input_fixup));
-		if (red < 0) {
-			bb_perror_msg(bb_msg_read_error);
+/*
+ * Skip the skippable frames, since the decoder needs them whole, until the next frame.
+ * Returns 1 if there is one, 0 at the end of the stream or -1 if the input is truncated.
+ */
+static int zstd_next_frame(transformer_state_t *xstate, uint8_t *in, size_t in_allocsize,
+	size_t *in_pos, size_t *in_len)
+{
+	uint64_t skip;
+	size_t size;
+
+	for (;;) {
+		if (!zstd_fill(xstate, in, in_allocsize, in_pos, in_len, 1))
+			return 0;
+		if (!zstd_fill(xstate, in, in_allocsize, in_pos, in_len, ZSTD_SKIPPABLEHEADERSIZE))
 			return -1;
+		if ((MEM_readLE32(in + *in_pos) & ZSTD_MAGIC_SKIPPABLE_MASK) != ZSTD_MAGIC_SKIPPABLE_START)
+			return 1;
+		skip = ZSTD_SKIPPABLEHEADERSIZE + (uint64_t)MEM_readLE32(in + *in_pos + 4);
+		while (skip > 0) {
+			if (!zstd_fill(xstate, in, in_allocsize, in_pos, in_len, 1))
+				return -1;
+			size = (size_t)MIN(skip, *in_len - *in_pos);
+			*in_pos += size;
+			skip -= size;
 		}
-		if (red == 0) {
-			break;
-		}
+	}
+}
 
-		input.src = in_buff;
-		input.size = (size_t)red + input_fixup;
-		input.pos = 0;
-		input_fixup = 0;
-
-		/* Given a valid frame, zstd won't consume the last byte of the
-		 * frame until it has flushed all of the decompressed data of
-		 * the frame. So input.pos < input.size means frame is not done
-		 * or there is still output available.
-		 */
-		while (input.pos < input.size) {
-			ZSTD_outBuffer output = { out_buff, out_allocsize, 0 };
-			/* The return code is zero if the frame is complete, but
-			 * there may be multiple frames concatenated together.
-			 * Zstd will automatically reset the context when a
-			 * frame is complete. Still, calling ZSTD_DCtx_reset()
-			 * can be useful to reset the context to a clean state,
-			 * for instance if the last decompression call returned
-			 * an error.
-			 */
-			last_result = ZSTD_decompressStream(dctx, &output, &input);
-			if (ZSTD_isError(last_result)) {
-				has_error = true;
-				break;
-			}
+/*
+ * Decode the start of the stream into the output buffer, using the buffer-less API,
+ * so that the decoder reads its history from the output rather than from a window
+ * buffer, that must be as large as the stream requires (up to 2 GB with --long).
+ * Blocks are always decoded in full, so the tail of the output goes through a small
+ * scratch buffer, that the decoder sees as following the data already decoded.
+ */
+static IF_DESKTOP(long long) int
+unpack_zstd_to_buffer(transformer_state_t *xstate, ZSTD_DCtx *dctx, uint8_t *in, size_t in_allocsize)
+{
+	const U32 zstd_magic = ZSTD_MAGIC;
+	uint8_t *dst = (uint8_t *)xstate->mem_output_buf, *tail = NULL;
+	size_t dst_max = xstate->mem_output_size_max, dst_pos = 0;
+	size_t tail_size = 0, tail_pos = 0, in_pos = 0, in_len = 0, need, r = 0;
+	bool in_frame = false;
+	int next;
 
-			nwrote = transformer_write(xstate, output.dst, output.pos);
-			if (nwrote < 0 && nwrote != -ENOSPC) {
-				has_error = true;
+	if (xstate->signature_skipped) {
+		memcpy(in, &zstd_magic, 4);
+		in_len = 4;
+	}
+
+	while (dst_pos < dst_max) {
+		if (!in_frame) {
+			next = zstd_next_frame(xstate, in, in_allocsize, &in_pos, &in_len);
+			if (next == 0)
 				break;
-			}
-			IF_DESKTOP(total = (nwrote == -ENOSPC) ? xstate->mem_output_size_max : total + output.pos);
+			if (next < 0)
+				goto truncated;
+			r = ZSTD_decompressBegin(dctx);
+			if (ZSTD_isError(r))
+				goto error;
+			in_frame = true;
+		}
+		need = ZSTD_nextSrcSizeToDecompress(dctx);
+		if (need == 0) {
+			in_frame = false;
+			continue;
+		}
+		if (need > in_allocsize || !zstd_fill(xstate, in, in_allocsize, &in_pos, &in_len, need))
+			goto truncated;
+		if (tail == NULL && dst_max - dst_pos < ZSTD_BLOCKSIZE_MAX) {
+			tail_size = dst_max - dst_pos + ZSTD_BLOCKSIZE_MAX;
+			tail = xmalloc(tail_size);
+		}
+		if (tail == NULL) {
+			r = ZSTD_decompressContinue(dctx, dst + dst_pos, dst_max - dst_pos, in + in_pos, need);
+			if (ZSTD_isError(r))
+				goto error;
+			dst_pos += r;
+		} else {
+			r = ZSTD_decompressContinue(dctx, tail + tail_pos, tail_size - tail_pos, in + in_pos, need);
+			if (ZSTD_isError(r))
+				goto error;
+			memcpy(dst + dst_pos, tail + tail_pos, MIN(r, dst_max - dst_pos));
+			dst_pos += MIN(r, dst_max - dst_pos);
+			tail_pos += r;
 		}
-		if (has_error)
-			break;
+		in_pos += need;
 	}
 
-	if (last_result != 0) {
-		/* The last return value from ZSTD_decompressStream did not end
-		 * on a frame, but we reached the end of the file! We assume
-		 * this is an error, and the input was truncated.
-		 */
-		if (last_result == ZSTD_error_maxCode + 1) {
-			bb_simple_error_msg("could not read zstd data");
-		} else {
+	free(tail);
+	xstate->mem_output_size = dst_pos;
+	return IF_DESKTOP(dst_pos) + 0;
+
+truncated:
+	bb_simple_error_msg("could not read zstd data");
+	free(tail);
+	return -1;
+
+error:
 #if defined(ZSTD_STRIP_ERROR_STRINGS) && ZSTD_STRIP_ERROR_STRINGS == 1
-			bb_error_msg("zstd decoder error: %u", (unsigned)last_result);
+	bb_error_msg("zstd decoder error: %u", (unsigned)r);
 #else
-			bb_error_msg("zstd decoder error: %s", ZSTD_getErrorName(last_result));
+	bb_error_msg("zstd decoder error: %s", ZSTD_getErrorName(r));
 #endif
+	free(tail);
+	return -1;
+}
+
+/* Size of the writes we issue when decoding to a file, and alignment of their start */
+#define ZSTD_WRITE_SIZE		(4 * 1024 * 1024)
+#define ZSTD_WRITE_ALIGN	4096
+
+typedef struct {
+	uint8_t *mem;		/* allocated memory */
+	uint8_t *buf;		/* start of the ring, aligned to ZSTD_WRITE_ALIGN */
+	size_t size;
+	size_t pos;			/* where the next block gets decoded */
+	size_t flushed;		/* end of the data that was written */
+} zstd_ring_t;
+
+/* Write out the decoded data, in ZSTD_WRITE_ALIGN multiples, unless 'all' is set */
+static ssize_t zstd_ring_flush(transformer_state_t *xstate, zstd_ring_t *ring, bool all)
+{
+	size_t size = ring->pos - ring->flushed;
+	ssize_t nwrote;
+
+	if (!all)
+		size &= ~((size_t)ZSTD_WRITE_ALIGN - 1);
+	if (size == 0)
+		return 0;
+	nwrote = transformer_write(xstate, ring->buf + ring->flushed, size);
+	if (nwrote < 0)
+		return nwrote;
+	ring->flushed += size;
+	return (ssize_t)size;
+}
+
+/*
+ * Go back to the start of the ring, moving to a larger one if 'size' is set. The
+ * data that doesn't fill a ZSTD_WRITE_ALIGN block is moved too, so that it goes
+ * out with the next write. This can only overwrite history that is older than the
+ * window, which the ring is always larger than by more than ZSTD_WRITE_SIZE.
+ */
+static bool zstd_ring_rewind(zstd_ring_t *ring, size_t size)
+{
+	size_t left = ring->pos - ring->flushed;
+	uint8_t *mem = ring->mem, *buf = ring->buf;
+
+	if (size != 0) {
+		mem = malloc(size + ZSTD_WRITE_ALIGN);
+		if (mem == NULL)
+			return false;
+		buf = (uint8_t *)(((uintptr_t)mem + ZSTD_WRITE_ALIGN - 1) & ~((uintptr_t)ZSTD_WRITE_ALIGN - 1));
+		ring->size = size;
+	}
+	if (left != 0)
+		memmove(buf, ring->buf + ring->flushed, left);
+	if (mem != ring->mem)
+		free(ring->mem);
+	ring->mem = mem;
+	ring->buf = buf;
+	ring->pos = left;
+	ring->flushed = 0;
+	return true;
+}
+
+/*
+ * Decode to a file, using the buffer-less API, into a ring that holds the window of
+ * the frame, so that the decoder reads its history from the data it just decoded.
+ * Unlike with the streaming API, there is no copy from the window to an output buffer,
+ * and we can write the data out in large aligned chunks.
+ */
+static IF_DESKTOP(long long) int
+unpack_zstd_to_file(transformer_state_t *xstate, ZSTD_DCtx *dctx, uint8_t *in, size_t in_allocsize)
+{
+	const U32 zstd_magic = ZSTD_MAGIC;
+	zstd_ring_t ring = { 0 };
+	ZSTD_frameHeader zfh;
+	IF_DESKTOP(long long int total = 0;)
+	size_t in_pos = 0, in_len = 0, need, r = 0;
+	uint64_t history;
+	ssize_t nwrote;
+	bool in_frame = false;
+	int next;
+
+	if (xstate->signature_skipped) {
+		memcpy(in, &zstd_magic, 4);
+		in_len = 4;
+	}
+
+	for (;;) {
+		if (!in_frame) {
+			next = zstd_next_frame(xstate, in, in_allocsize, &in_pos, &in_len);
+			if (next == 0)
+				break;
+			if (next < 0)
+				goto truncated;
+			r = ZSTD_getFrameHeader(&zfh, in + in_pos, in_len - in_pos);
+			if (!ZSTD_isError(r) && r != 0) {
+				if (!zstd_fill(xstate, in, in_allocsize, &in_pos, &in_len, r))
+					goto truncated;
+				r = ZSTD_getFrameHeader(&zfh, in + in_pos, in_len - in_pos);
+			}
+			if (ZSTD_isError(r))
+				goto error;
+			/* A frame never refers to data further back than its window or its start */
+			history = MIN(zfh.windowSize, zfh.frameContentSize);
+			if (history > ((uint64_t)1 << ZSTD_WINDOWLOG_LIMIT_DEFAULT)) {
+				bb_simple_error_msg("zstd frame requires too much memory");
+				goto out;
+			}
+			need = (size_t)history + ZSTD_WRITE_SIZE + ZSTD_BLOCKSIZE_MAX + ZSTD_WRITE_ALIGN;
+			if (need > ring.size) {
+				nwrote = zstd_ring_flush(xstate, &ring, false);
+				if (nwrote < 0)
+					goto write_error;
+				IF_DESKTOP(total += nwrote;)
+				if (!zstd_ring_rewind(&ring, need)) {
+					bb_simple_error_msg("memory exhausted");
+					goto out;
+				}
+			}
+			r = ZSTD_decompressBegin(dctx);
+			if (ZSTD_isError(r))
+				goto error;
+			in_frame = true;
+		}
+		need = ZSTD_nextSrcSizeToDecompress(dctx);
+		if (need == 0) {
+			in_frame = false;
+			continue;
+		}
+		if (need > in_allocsize || !zstd_fill(xstate, in, in_allocsize, &in_pos, &in_len, need))
+			goto truncated;
+		if (ring.size - ring.pos < ZSTD_BLOCKSIZE_MAX) {
+			nwrote = zstd_ring_flush(xstate, &ring, false);
+			if (nwrote < 0)
+				goto write_error;
+			IF_DESKTOP(total += nwrote;)
+			zstd_ring_rewind(&ring, 0);
+		}
+		r = ZSTD_decompressContinue(dctx, ring.buf + ring.pos, ring.size - ring.pos, in + in_pos, need);
+		if (ZSTD_isError(r))
+			goto error;
+		ring.pos += r;
+		in_pos += need;
+		if (ring.pos - ring.flushed >= ZSTD_WRITE_SIZE) {
+			nwrote = zstd_ring_flush(xstate, &ring, false);
+			if (nwrote < 0)
+				goto write_error;
+			IF_DESKTOP(total += nwrote;)
 		}
-		return -1;
 	}
 
+	nwrote = zstd_ring_flush(xstate, &ring, true);
+	if (nwrote < 0)
+		goto write_error;
+	IF_DESKTOP(total += nwrote;)
+	free(ring.mem);
 	return IF_DESKTOP(total) + 0;
+
+truncated:
+	bb_simple_error_msg("could not read zstd data");
+	goto out;
+
+write_error:
+	bb_error_msg("write error (errno: %d)", errno);
+	goto out;
+
+error:
+#if defined(ZSTD_STRIP_ERROR_STRINGS) && ZSTD_STRIP_ERROR_STRINGS == 1
+	bb_error_msg("zstd decoder error: %u", (unsigned)r);
+#else
+	bb_error_msg("zstd decoder error: %s", ZSTD_getErrorName(r));
+#endif
+out:
+	free(ring.mem);
+	return -1;
 }
 
 IF_DESKTOP(long long) int FAST_FUNC
 unpack_zstd_stream(transformer_state_t *xstate)
 {
-	const size_t in_allocsize = roundupsize(ZSTD_DStreamInSize(), 1024),
-		   out_allocsize = roundupsize(ZSTD_DStreamOutSize(), 1024);
+	const size_t in_allocsize = roundupsize(ZSTD_DStreamInSize(), 1024);
 
 	IF_DESKTOP(long long) int result;
-	void *out_buff;
+	void *in_buff;
 	ZSTD_DStream *dctx;
 
 	dctx = ZSTD_createDStream();
@@ -132,10 +337,162 @@ unpack_zstd_stream(transformer_state_t *xstate)
 		bb_error_msg_and_die("memory exhausted");
 	}
 
-	out_buff = xmalloc(in_allocsize + out_allocsize);
-
-	result = unpack_zstd_stream_inner(xstate, dctx, out_buff);
-	free(out_buff);
+	in_buff = xmalloc(in_allocsize);
+	if (xstate->mem_output_size_max != 0)
+		result = unpack_zstd_to_buffer(xstate, dctx, in_buff, in_allocsize);
+	else
+		result = unpack_zstd_to_file(xstate, dctx, in_buff, in_allocsize);
+	free(in_buff);
 	ZSTD_freeDStream(dctx);
 	return result;
 }
+
+#define ZSTD_SEEKABLE_MAGIC		0x8F92EAB1
+#define ZSTD_SEEKTABLE_FOOTER_SIZE	9
+#define ZSTD_SEEKTABLE_MAX_SIZE		(64 * 1024 * 1024)
+#define ZSTD_MAX_BLOCK_WALK		(1024 * 1024)
+
+/*
+ * Add up the content sizes of all the frames, from the seek table when the file
+ * uses the seekable format, or by walking the frame and block headers. If 'blocks'
+ * is not NULL, also list the location of every frame, so that each one of them can
+ * be decoded on its own.
+ */
+static int zstd_parse_index(int fd, uint64_t file_size, uint64_t *size, seek_block_t **blocks, uint32_t *nb_blocks)
+{
+	uint8_t buf[ZSTD_FRAMEHEADERSIZE_MAX], *table = NULL;
+	ZSTD_frameHeader zfh;
+	seek_block_t *list = NULL, *block;
+	uint64_t pos, start, total = 0, csize = 0, table_size;
+	uint32_t i, num_frames, entry_size, bh, nb = 0;
+	unsigned walked = 0;
+	int n, r = SIZE_UNKNOWN;
+
+	/* Seekable format: the seek table sits in a skippable frame at the end of the file */
+	if (file_size >= ZSTD_SKIPPABLEHEADERSIZE + ZSTD_SEEKTABLE_FOOTER_SIZE &&
+		read_at(fd, file_size - ZSTD_SEEKTABLE_FOOTER_SIZE, buf, ZSTD_SEEKTABLE_FOOTER_SIZE) == ZSTD_SEEKTABLE_FOOTER_SIZE &&
+		MEM_readLE32(&buf[5]) == ZSTD_SEEKABLE_MAGIC) {
+		num_frames = MEM_readLE32(buf);
+		entry_size = (buf[4] & 0x80) ? 12 : 8;
+		table_size = (uint64_t)num_frames * entry_size + ZSTD_SEEKTABLE_FOOTER_SIZE;
+		if (table_size + ZSTD_SKIPPABLEHEADERSIZE <= file_size && table_size <= ZSTD_SEEKTABLE_MAX_SIZE) {
+			table = malloc((size_t)table_size + ZSTD_SKIPPABLEHEADERSIZE);
+			if (table != NULL &&
+				read_at(fd, file_size - table_size - ZSTD_SKIPPABLEHEADERSIZE, table,
+					(unsigned)table_size + ZSTD_SKIPPABLEHEADERSIZE) == (int)table_size + ZSTD_SKIPPABLEHEADERSIZE &&
+				MEM_readLE32(table) == (ZSTD_MAGIC_SKIPPABLE_START | 0xE) &&
+				MEM_readLE32(&table[4]) == table_size) {
+				for (i = 0; i < num_frames; i++) {
+					if (blocks != NULL) {
+						block = add_seek_block(&list, &nb);
+						if (block == NULL)
+							goto out;
+						block->src_offset = csize;
+						block->src_size = MEM_readLE32(&table[ZSTD_SKIPPABLEHEADERSIZE + i * entry_size]);
+						block->dst_size = MEM_readLE32(&table[ZSTD_SKIPPABLEHEADERSIZE + i * entry_size + 4]);
+					}
+					csize += MEM_readLE32(&table[ZSTD_SKIPPABLEHEADERSIZE + i * entry_size]);
+					total += MEM_readLE32(&table[ZSTD_SKIPPABLEHEADERSIZE + i * entry_size + 4]);
+				}
+				if (csize + table_size + ZSTD_SKIPPABLEHEADERSIZE == file_size) {
+					r = SIZE_EXACT;
+					goto out;
+				}
+			}
+			total = 0;
+			nb = 0;
+		}
+	}
+
+	/* Regular format: frames must declare their content size, and blocks are skipped over */
+	for (pos = 0; pos < file_size; ) {
+		n = read_at(fd, pos, buf, (unsigned)MIN(sizeof(buf), file_size - pos));
+		if (n < ZSTD_SKIPPABLEHEADERSIZE)
+			goto out;
+		if ((MEM_readLE32(buf) & ZSTD_MAGIC_SKIPPABLE_MASK) == ZSTD_MAGIC_SKIPPABLE_START) {
+			pos += ZSTD_SKIPPABLEHEADERSIZE + (uint64_t)MEM_readLE32(&buf[4]);
+			continue;
+		}
+		if (ZSTD_getFrameHeader(&zfh, buf, n) != 0 || zfh.frameType != ZSTD_frame ||
+			zfh.frameContentSize == ZSTD_CONTENTSIZE_UNKNOWN)
+			goto out;
+		total += zfh.frameContentSize;
+		start = pos;
+		pos += zfh.headerSize;
+		do {
+			if (++walked > ZSTD_MAX_BLOCK_WALK ||
+				read_at(fd, pos, buf, ZSTD_blockHeaderSize) != ZSTD_blockHeaderSize)
+				goto out;
+			bh = MEM_readLE24(buf);
+			switch ((bh >> 1) & 3) {
+			case bt_rle:
+				pos += 1;
+				break;
+			case bt_reserved:
+				goto out;
+			default:
+				pos += bh >> 3;
+				break;
+			}
+			pos += ZSTD_blockHeaderSize;
+		} while (!(bh & 1));
+		if (zfh.checksumFlag)
+			pos += 4;
+		if (blocks != NULL) {
+			block = add_seek_block(&list, &nb);
+			if (block == NULL)
+				goto out;
+			block->src_offset = start;
+			block->src_size = pos - start;
+			block->dst_size = zfh.frameContentSize;
+		}
+	}
+	if (pos == file_size)
+		r = SIZE_EXACT;
+
+out:
+	if (r == SIZE_EXACT) {
+		*size = total;
+		if (blocks != NULL) {
+			*blocks = list;
+			*nb_blocks = nb;
+			list = NULL;
+		}
+	}
+	free(list);
+	free(table);
+	return r;
+}
+
+int FAST_FUNC get_zstd_size(int fd, uint64_t file_size, uint64_t *size)
+{
+	return zstd_parse_index(fd, file_size, size, NULL, NULL);
+}
+
+int FAST_FUNC get_zstd_blocks(int fd, uint64_t file_size, seek_block_t **blocks, uint32_t *nb_blocks)
+{
+	uint64_t size;
+
+	return (zstd_parse_index(fd, file_size, &size, blocks, nb_blocks) == SIZE_EXACT) ? 0 : -1;
+}
+
+/* Decode a single frame. A one-shot decode writes straight to 'dst', so no window is allocated. */
+int FAST_FUNC unpack_zstd_block(int fd, const seek_block_t *block, uint8_t *dst)
+{
+	ZSTD_DCtx *dctx;
+	uint8_t *src;
+	size_t r;
+	int ret = -1;
+
+	src = malloc((size_t)block->src_size);
+	dctx = ZSTD_createDCtx();
+	if (src != NULL && dctx != NULL &&
+		read_at(fd, block->src_offset, src, (unsigned)block->src_size) == (int)block->src_size) {
+		r = ZSTD_decompressDCtx(dctx, dst, (size_t)block->dst_size, src, (size_t)block->src_size);
+		if (!ZSTD_isError(r) && r == block->dst_size)
+			ret = 0;
+	}
+	ZSTD_freeDCtx(dctx);
+	free(src);
+	return ret;
+}
@@ -187,3 +187,15 @@ err:
 
 	return n;
 }
+
+int FAST_FUNC get_vtsi_size(int fd, uint64_t file_size, uint64_t *size)
+{
+	VTSI_FOOTER footer;
+
+	if (file_size < sizeof(footer) ||
+		read_at(fd, file_size - sizeof(footer), &footer, sizeof(footer)) != sizeof(footer) ||
+		footer.magic != VTSI_MAGIC || !check_vtsi_footer(&footer))
+		return SIZE_UNKNOWN;
+	*size = footer.disk_size;
+	return SIZE_EXACT;
+}
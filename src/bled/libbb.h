@@ -40,6 +40,8 @@
 #include <io.h>
 
 #define ONE_TB                          1099511627776ULL
+/* Decoders that keep their output in a large buffer may write it out in chunks of up to this size */
+#define BB_MAX_WRITE_SIZE               (16 * 1024 * 1024)
 
 #define ENABLE_DESKTOP                  1
 #if ENABLE_DESKTOP
@@ -124,6 +126,7 @@ extern jmp_buf bb_error_jmp;
 extern char* bb_virtual_buf;
 extern size_t bb_virtual_len, bb_virtual_pos;
 extern int bb_virtual_fd;
+extern int bb_prefetch_fd;
 
 uint32_t* crc32_filltable(uint32_t *crc_table, int endian);
 uint32_t crc32_le(uint32_t crc, unsigned char const *p, size_t len, uint32_t *crc32table_le);
@@ -193,6 +196,7 @@ static inline pid_t wait(int* status) { *status = 4; return -1; }
 
 /* This enables the display of a progress based on the number of bytes read */
 extern uint64_t bb_total_rb;
+int prefetch_read(void *buf, unsigned int count);
 static inline int full_read(int fd, void *buf, unsigned int count) {
 	int rb;
 
@@ -220,6 +224,8 @@ static inline int full_read(int fd, void *buf, unsigned int count) {
 		memcpy(buf, &bb_virtual_buf[bb_virtual_pos], count);
 		bb_virtual_pos += count;
 		rb = (int)count;
+	} else if (fd == bb_prefetch_fd) {
+		rb = prefetch_read(buf, count);
 	} else {
 		rb = (bled_read != NULL) ? bled_read(fd, buf, count) : _read(fd, buf, count);
 	}
@@ -233,8 +239,7 @@ static inline int full_read(int fd, void *buf, unsigned int count) {
 
 static inline int full_write(int fd, const void* buffer, unsigned int count)
 {
-	/* None of our r/w buffers should be larger than BB_BUFSIZE */
-	if (count > BB_BUFSIZE) {
+	if (count > MAX(BB_BUFSIZE, BB_MAX_WRITE_SIZE)) {
 		errno = E2BIG;
 		return -1;
 	}
@@ -242,6 +247,14 @@ static inline int full_write(int fd, const void* buffer, unsigned int count)
 	return (bled_write != NULL) ? bled_write(fd, buffer, count) : _write(fd, buffer, count);
 }
 
+/* Read at a specific offset, without going through bled_read or reporting progress */
+static inline int read_at(int fd, uint64_t offset, void* buf, unsigned int count)
+{
+	if (_lseeki64(fd, (int64_t)offset, SEEK_SET) != (int64_t)offset)
+		return -1;
+	return _read(fd, buf, count);
+}
+
 static inline void bb_copyfd_exact_size(int fd1, int fd2, off_t size)
 {
 	off_t rb = 0;
@@ -0,0 +1,198 @@
+/*
+ * Source read-ahead for Bled
+ *
+ * Copyright © 2026 agent <agent@local>
+ *
+ * Licensed under GPLv2 or later, see file LICENSE in this source tree.
+ */
+
+#include "libbb.h"
+#include "bb_archive.h"
+
+/*
+ * The unpackers that only ever read their source forward can get it from a ring
+ * of large blocks, that a separate thread fills ahead of the decompressor. This
+ * way, source I/O and decompression overlap, rather than having the decompressor
+ * stall on every refill, which is especially costly for images that sit on a
+ * network share or on a slow drive.
+ * The unpackers don't need to know about it, since full_read() serves the reads
+ * on the source descriptor from the ring, for as long as it is open.
+ */
+
+#define PREFETCH_BLOCK_SIZE	(4 * 1024 * 1024)
+#define PREFETCH_MAX_DEPTH	16
+
+typedef struct prefetch_block_t {
+	uint8_t *data;
+	unsigned len;
+	int last;           /* set on the block that holds the end of the source */
+	int err;            /* errno of the read that ended the source, if it failed */
+} prefetch_block_t;
+
+typedef struct prefetch_t {
+	int fd;
+	unsigned depth;
+	unsigned block_size;
+	volatile LONG quit;
+	HANDLE thread;
+	HANDLE empty;       /* counts the blocks the reader can fill */
+	HANDLE full;        /* counts the blocks the decompressor can consume */
+	unsigned head;      /* next block to be filled, only used by the reader */
+	unsigned tail;      /* block being consumed */
+	unsigned pos;       /* position in the block being consumed */
+	int busy;           /* whether the tail block has been handed over by the reader */
+	int last;
+	int err;
+	int64_t start;      /* source offset that reading started from */
+	uint64_t consumed;
+	prefetch_block_t blocks[PREFETCH_MAX_DEPTH];
+} prefetch_t;
+
+static prefetch_t *bb_prefetch;
+
+static DWORD WINAPI prefetch_reader(LPVOID param)
+{
+	prefetch_t *p = (prefetch_t*)param;
+	prefetch_block_t *block;
+	int r, last;
+
+	do {
+		WaitForSingleObject(p->empty, INFINITE);
+		if (p->quit)
+			break;
+		block = &p->blocks[p->head++ % p->depth];
+		block->len = 0;
+		block->err = 0;
+		block->last = 0;
+		/* A short read only happens at the end of a regular file, but pipes and sockets may return less */
+		do {
+			if (p->quit || ((bled_cancel_request != NULL) && (*bled_cancel_request != 0))) {
+				r = -1;
+				errno = EINTR;
+			} else {
+				r = _read(p->fd, &block->data[block->len], p->block_size - block->len);
+			}
+			if (r > 0)
+				block->len += r;
+		} while (r > 0 && block->len < p->block_size);
+		last = (r <= 0);
+		if (last) {
+			block->last = 1;
+			/* errno is per thread, so it must be handed over to the decompressor */
+			block->err = (r < 0) ? errno : 0;
+		}
+		/* The block belongs to the decompressor from here on */
+		ReleaseSemaphore(p->full, 1, NULL);
+	} while (!last);
+	return 0;
+}
+
+/* Called by full_read() for the source descriptor. Only returns less than 'count' at the end of the source. */
+int prefetch_read(void *buf, unsigned int count)
+{
+	prefetch_t *p = bb_prefetch;
+	prefetch_block_t *block;
+	unsigned n, rb = 0;
+
+	while (rb < count) {
+		if (!p->busy) {
+			if (p->last)
+				break;
+			WaitForSingleObject(p->full, INFINITE);
+			p->busy = 1;
+			p->pos = 0;
+		}
+		block = &p->blocks[p->tail % p->depth];
+		n = MIN(count - rb, block->len - p->pos);
+		memcpy((uint8_t*)buf + rb, &block->data[p->pos], n);
+		p->pos += n;
+		rb += n;
+		if (p->pos == block->len) {
+			p->last = block->last;
+			p->err = block->err;
+			p->busy = 0;
+			p->tail++;
+			ReleaseSemaphore(p->empty, 1, NULL);
+		}
+	}
+	p->consumed += rb;
+	if (rb == 0 && p->err != 0) {
+		errno = p->err;
+		return -1;
+	}
+	return (int)rb;
+}
+
+void FAST_FUNC prefetch_close(transformer_state_t *xstate)
+{
+	prefetch_t *p = xstate->src_prefetch;
+	unsigned i;
+
+	if (p == NULL)
+		return;
+	if (p->thread != NULL) {
+		p->quit = 1;
+		ReleaseSemaphore(p->empty, 1, NULL);
+		WaitForSingleObject(p->thread, INFINITE);
+		CloseHandle(p->thread);
+		/* Leave the source where the decompressor stopped, as if it had read it directly */
+		if (p->start >= 0)
+			_lseeki64(p->fd, p->start + p->consumed, SEEK_SET);
+	}
+	if (p->empty != NULL)
+		CloseHandle(p->empty);
+	if (p->full != NULL)
+		CloseHandle(p->full);
+	for (i = 0; i < p->depth; i++)
+		free(p->blocks[i].data);
+	free(p);
+	bb_prefetch = NULL;
+	bb_prefetch_fd = -1;
+	xstate->src_prefetch = NULL;
+}
+
+/*
+ * Start reading the source of 'xstate' ahead, into a ring of 'depth' blocks. This must
+ * only be used with the unpackers that never seek on the source. Returns 0 on success,
+ * or -1 if the source is to be read directly, as when a custom read function was set.
+ */
+int FAST_FUNC prefetch_open(transformer_state_t *xstate, unsigned depth)
+{
+	prefetch_t *p;
+	unsigned i;
+
+	if (depth == 0 || bled_read != NULL || bb_prefetch != NULL ||
+		xstate->src_fd < 0 || xstate->src_fd == bb_virtual_fd)
+		return -1;
+	/* Double buffering is the least that lets the reader work while a block is being consumed */
+	depth = MIN(MAX(depth, 2), PREFETCH_MAX_DEPTH);
+
+	p = xzalloc(sizeof(prefetch_t));
+	if (p == NULL)
+		return -1;
+	xstate->src_prefetch = p;
+	p->fd = xstate->src_fd;
+	p->depth = depth;
+	p->block_size = MAX(BB_BUFSIZE, PREFETCH_BLOCK_SIZE);
+	p->start = _telli64(p->fd);
+	for (i = 0; i < depth; i++) {
+		p->blocks[i].data = malloc(p->block_size);
+		if (p->blocks[i].data == NULL)
+			goto error;
+	}
+	/* One more than the depth, so that prefetch_close() can always wake the reader */
+	p->empty = CreateSemaphore(NULL, depth, depth + 1, NULL);
+	p->full = CreateSemaphore(NULL, 0, depth, NULL);
+	if (p->empty == NULL || p->full == NULL)
+		goto error;
+	p->thread = CreateThread(NULL, 0, prefetch_reader, p, 0, NULL);
+	if (p->thread == NULL)
+		goto error;
+	bb_prefetch = p;
+	bb_prefetch_fd = p->fd;
+	return 0;
+
+ error:
+	prefetch_close(xstate);
+	return -1;
+}
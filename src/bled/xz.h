@@ -239,6 +239,19 @@ XZ_EXTERN enum xz_ret XZ_FUNC xz_dec_run(struct xz_dec *s, struct xz_buf *b);
  */
 XZ_EXTERN void XZ_FUNC xz_dec_reset(struct xz_dec *s);
 
+/**
+ * xz_dec_cap_dict() - Limit the dictionary of a multi-call decoder
+ * @s:          Decoder state allocated using xz_dec_init()
+ * @size:       Amount of uncompressed data the caller will read, or zero
+ *              for no limit
+ *
+ * Streams that use a larger dictionary than @size get a dictionary of
+ * @size bytes instead, which is enough as long as decoding is stopped
+ * once @size bytes of output have been produced. This must be called
+ * before the first call to xz_dec_run().
+ */
+XZ_EXTERN void XZ_FUNC xz_dec_cap_dict(struct xz_dec *s, uint32_t size);
+
 /**
  * xz_dec_end() - Free the memory allocated for the decoder state
  * @s:          Decoder state allocated using xz_dec_init(). If s is NULL,
@@ -80,6 +80,12 @@ struct dictionary {
 	 */
 	uint32_t size_max;
 
+	/*
+	 * Amount of output the caller reads, or zero if unlimited. When set,
+	 * the multi-call dictionary buffer is never made larger than this.
+	 */
+	uint32_t cap;
+
 	/*
 	 * Amount of memory currently allocated for the dictionary.
 	 * This is used only with XZ_DYNALLOC. (With XZ_PREALLOC,
@@ -248,6 +254,16 @@ struct lzma2_dec {
 	 * before the first LZMA chunk.
 	 */
 	bool need_props;
+
+#ifdef XZ_DEC_LZMA1
+	/*
+	 * Raw LZMA streams can be larger than 4 GiB, so the part of
+	 * their sizes that doesn't fit in uncompressed and compressed
+	 * is kept here.
+	 */
+	uint64_t uncompressed_left;
+	uint64_t compressed_left;
+#endif
 };
 
 struct xz_dec_lzma2 {
@@ -347,7 +363,7 @@ static inline void XZ_FUNC dict_put(struct dictionary *dict, uint8_t byte)
 static bool XZ_FUNC dict_repeat(
 		struct dictionary *dict, uint32_t *len, uint32_t dist)
 {
-	size_t back;
+	size_t back, copy_size;
 	uint32_t left;
 
 	if (dist >= dict->full || dist >= dict->size)
@@ -356,15 +372,33 @@ static bool XZ_FUNC dict_repeat(
 	left = (uint32_t)min_t(size_t, dict->limit - dict->pos, *len);
 	*len -= left;
 
-	back = dict->pos - dist - 1;
-	if (dist >= dict->pos)
-		back += dict->end;
+	/*
+	 * If the match starts before the wrap point of the dictionary, copy
+	 * the part up to the end of the buffer first. It lies ahead of the
+	 * data we write, so a forward copy gives the same result as the
+	 * byte by byte one.
+	 */
+	if (dist >= dict->pos) {
+		back = dict->pos - dist - 1 + dict->end;
+		copy_size = min_t(size_t, dict->end - back, left);
+		memmove(dict->buf + dict->pos, dict->buf + back, copy_size);
+		dict->pos += copy_size;
+		left -= (uint32_t)copy_size;
+	}
 
-	do {
-		dict->buf[dict->pos++] = dict->buf[back++];
-		if (back == dict->end)
-			back = 0;
-	} while (--left > 0);
+	/*
+	 * The rest of the match is behind the data we write, and repeats
+	 * with a period of dist + 1 when it overlaps it. Copying the bytes
+	 * that are already in place, which doubles the size of each copy,
+	 * keeps the source and destination of every memcpy() apart.
+	 */
+	back = dict->pos - dist - 1;
+	while (left > 0) {
+		copy_size = min_t(size_t, dict->pos - back, left);
+		memcpy(dict->buf + dict->pos, dict->buf + back, copy_size);
+		dict->pos += copy_size;
+		left -= (uint32_t)copy_size;
+	}
 
 	if (dict->full < dict->pos)
 		dict->full = dict->pos;
@@ -486,35 +520,32 @@ static __always_inline void XZ_FUNC rc_normalize(struct rc_dec *rc)
 }
 
 /*
- * Decode one bit. In some versions, this function has been split in three
- * functions so that the compiler is supposed to be able to more easily avoid
- * an extra branch. In this particular version of the LZMA decoder, this
- * doesn't seem to be a good idea (tested with GCC 3.3.6, 3.4.6, and 4.3.3
- * on x86). Using a non-split version results in nicer looking code too.
+ * Decode one bit. The probability is known to be poor at predicting most
+ * of the bits that are worth decoding (that's why they weren't compressed
+ * away), so the CPU mispredicts a branch on the decoded value about half
+ * of the time. Instead, turn the value into a mask and use it to select
+ * the new range, code and probability without branching.
+ *
+ * For the probability, bit 0 moves it towards RC_BIT_MODEL_TOTAL and bit 1
+ * towards 0, and with an arithmetic shift, both updates become
+ * prob -= (prob - target) >> RC_MOVE_BITS with a rounding adjusted target.
  *
  * NOTE: This must return an int. Do not make it return a bool or the speed
- * of the code generated by GCC 3.x decreases 10-15 %. (GCC 4.3 doesn't care,
- * and it generates 10-20 % faster code than GCC 3.x from this file anyway.)
+ * of the code generated by GCC 3.x decreases 10-15 %.
  */
 static __always_inline int XZ_FUNC rc_bit(struct rc_dec *rc, uint16_t *prob)
 {
-	uint32_t bound;
-	int bit;
+	uint32_t bound, mask;
 
 	rc_normalize(rc);
 	bound = (rc->range >> RC_BIT_MODEL_TOTAL_BITS) * *prob;
-	if (rc->code < bound) {
-		rc->range = bound;
-		*prob += (RC_BIT_MODEL_TOTAL - *prob) >> RC_MOVE_BITS;
-		bit = 0;
-	} else {
-		rc->range -= bound;
-		rc->code -= bound;
-		*prob -= *prob >> RC_MOVE_BITS;
-		bit = 1;
-	}
+	mask = (uint32_t)0 - (uint32_t)(rc->code >= bound);
+	rc->range = (bound & ~mask) | ((rc->range - bound) & mask);
+	rc->code -= bound & mask;
+	*prob -= (uint16_t)(((int32_t)*prob - (int32_t)((RC_BIT_MODEL_TOTAL
+			- (1 << RC_MOVE_BITS) + 1) & ~mask)) >> RC_MOVE_BITS);
 
-	return bit;
+	return (int)(mask & 1);
 }
 
 /* Decode a bittree starting from the most significant bit. */
@@ -1113,6 +1144,7 @@ XZ_EXTERN struct xz_dec_lzma2 * XZ_FUNC xz_dec_lzma2_create(
 
 	s->dict.mode = mode;
 	s->dict.size_max = dict_max;
+	s->dict.cap = 0;
 
 	if (DEC_IS_PREALLOC(mode)) {
 		s->dict.buf = vmalloc(dict_max);
@@ -1128,34 +1160,52 @@ XZ_EXTERN struct xz_dec_lzma2 * XZ_FUNC xz_dec_lzma2_create(
 	return s;
 }
 
-XZ_EXTERN enum xz_ret XZ_FUNC xz_dec_lzma2_reset(
-		struct xz_dec_lzma2 *s, uint8_t props)
+/*
+ * Allocate the dictionary buffer for s->dict.size, limited to s->dict.cap
+ * when the caller knows that the output is smaller than the dictionary.
+ */
+static enum xz_ret XZ_FUNC dict_alloc(struct xz_dec_lzma2 *s)
 {
-	/* This limits dictionary size to 3 GiB to keep parsing simpler. */
-	if (props > 39)
-		return XZ_OPTIONS_ERROR;
-
-	s->dict.size = 2 + (props & 1);
-	s->dict.size <<= (props >> 1) + 11;
-
 	if (DEC_IS_MULTI(s->dict.mode)) {
-		if (s->dict.size > s->dict.size_max)
-			return XZ_MEMLIMIT_ERROR;
-
 		s->dict.end = s->dict.size;
+		if (s->dict.cap != 0 && s->dict.end > s->dict.cap)
+			s->dict.end = s->dict.cap;
+
+		if (s->dict.end > s->dict.size_max)
+			return XZ_MEMLIMIT_ERROR;
 
 		if (DEC_IS_DYNALLOC(s->dict.mode)) {
-			if (s->dict.allocated < s->dict.size) {
+			if (s->dict.allocated < s->dict.end) {
 				vfree(s->dict.buf);
-				s->dict.buf = vmalloc(s->dict.size);
+				s->dict.buf = vmalloc(s->dict.end);
 				if (s->dict.buf == NULL) {
 					s->dict.allocated = 0;
 					return XZ_MEM_ERROR;
 				}
+				s->dict.allocated = s->dict.end;
 			}
 		}
 	}
 
+	return XZ_OK;
+}
+
+XZ_EXTERN enum xz_ret XZ_FUNC xz_dec_lzma2_reset(
+		struct xz_dec_lzma2 *s, uint8_t props)
+{
+	enum xz_ret ret;
+
+	/* This limits dictionary size to 3 GiB to keep parsing simpler. */
+	if (props > 39)
+		return XZ_OPTIONS_ERROR;
+
+	s->dict.size = 2 + (props & 1);
+	s->dict.size <<= (props >> 1) + 11;
+
+	ret = dict_alloc(s);
+	if (ret != XZ_OK)
+		return ret;
+
 	s->lzma.len = 0;
 
 	s->lzma2.sequence = SEQ_CONTROL;
@@ -1166,6 +1216,113 @@ XZ_EXTERN enum xz_ret XZ_FUNC xz_dec_lzma2_reset(
 	return XZ_OK;
 }
 
+#ifdef XZ_DEC_LZMA1
+/*
+ * Raw LZMA, as found in 7z archives, is a single LZMA chunk without the
+ * LZMA2 framing. Its properties are the lc/lp/pb byte and the dictionary
+ * size, and the caller provides the compressed and uncompressed sizes, so
+ * that the stream doesn't need an end of payload marker.
+ */
+XZ_EXTERN enum xz_ret XZ_FUNC xz_dec_lzma1_reset(struct xz_dec_lzma2 *s,
+		uint8_t props, uint32_t dict_size,
+		uint64_t compressed, uint64_t uncompressed)
+{
+	enum xz_ret ret;
+
+	if (!lzma_props(s, props))
+		return XZ_OPTIONS_ERROR;
+
+	/* Same minimum as the LZMA SDK */
+	s->dict.size = dict_size < 4096 ? 4096 : dict_size;
+
+	ret = dict_alloc(s);
+	if (ret != XZ_OK)
+		return ret;
+
+	s->lzma.len = 0;
+	s->temp.size = 0;
+
+	s->lzma2.compressed = 0;
+	s->lzma2.uncompressed = 0;
+	s->lzma2.compressed_left = compressed;
+	s->lzma2.uncompressed_left = uncompressed;
+
+	/*
+	 * The dictionary is reset on the first call, since it needs the
+	 * output buffer in single-call mode.
+	 */
+	s->lzma2.need_dict_reset = true;
+	s->lzma2.sequence = SEQ_LZMA_PREPARE;
+
+	return XZ_OK;
+}
+
+/* Move as much of a 64-bit size as possible to its 32-bit counter */
+static void XZ_FUNC lzma1_refill(uint32_t *counter, uint64_t *left)
+{
+	uint32_t size = (uint32_t)min_t(uint64_t, *left, UINT32_MAX - *counter);
+
+	*counter += size;
+	*left -= size;
+}
+
+/*
+ * Decode raw LZMA, using the same code as the LZMA chunks of LZMA2. Returns
+ * XZ_STREAM_END once the uncompressed size has been reached.
+ */
+XZ_EXTERN enum xz_ret XZ_FUNC xz_dec_lzma1_run(
+		struct xz_dec_lzma2 *s, struct xz_buf *b)
+{
+	if (s->lzma2.need_dict_reset) {
+		dict_reset(&s->dict, b);
+		s->lzma2.need_dict_reset = false;
+	}
+
+	if (s->lzma2.sequence == SEQ_LZMA_PREPARE) {
+		lzma1_refill(&s->lzma2.compressed, &s->lzma2.compressed_left);
+		if (s->lzma2.compressed < RC_INIT_BYTES)
+			return XZ_DATA_ERROR;
+
+		if (!rc_read_init(&s->rc, b))
+			return XZ_OK;
+
+		s->lzma2.compressed -= RC_INIT_BYTES;
+		s->lzma2.sequence = SEQ_LZMA_RUN;
+	}
+
+	while (true) {
+		lzma1_refill(&s->lzma2.compressed, &s->lzma2.compressed_left);
+		lzma1_refill(&s->lzma2.uncompressed,
+				&s->lzma2.uncompressed_left);
+		if (s->lzma2.uncompressed == 0)
+			return XZ_STREAM_END;
+
+		dict_limit(&s->dict, min_t(size_t,
+				b->out_size - b->out_pos,
+				s->lzma2.uncompressed));
+		if (!lzma2_lzma(s, b))
+			return XZ_DATA_ERROR;
+
+		s->lzma2.uncompressed -= dict_flush(&s->dict, b);
+
+		if (s->lzma2.uncompressed == 0
+				&& s->lzma2.uncompressed_left == 0)
+			return XZ_STREAM_END;
+
+		if (b->out_pos == b->out_size
+				|| (b->in_pos == b->in_size
+					&& s->temp.size
+					< s->lzma2.compressed))
+			return XZ_OK;
+	}
+}
+#endif
+
+XZ_EXTERN void XZ_FUNC xz_dec_lzma2_cap(struct xz_dec_lzma2 *s, uint32_t size)
+{
+	s->dict.cap = size;
+}
+
 XZ_EXTERN void XZ_FUNC xz_dec_lzma2_end(struct xz_dec_lzma2 *s)
 {
 	if (DEC_IS_MULTI(s->dict.mode))
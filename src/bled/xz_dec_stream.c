@@ -808,6 +808,11 @@ XZ_EXTERN void XZ_FUNC xz_dec_reset(struct xz_dec *s)
 	s->temp.size = STREAM_HEADER_SIZE;
 }
 
+XZ_EXTERN void XZ_FUNC xz_dec_cap_dict(struct xz_dec *s, uint32_t size)
+{
+	xz_dec_lzma2_cap(s->lzma2, size);
+}
+
 XZ_EXTERN void XZ_FUNC xz_dec_end(struct xz_dec *s)
 {
 	if (s != NULL) {
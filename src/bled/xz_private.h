@@ -121,6 +121,9 @@ XZ_EXTERN struct xz_dec_lzma2 * XZ_FUNC xz_dec_lzma2_create(
 XZ_EXTERN enum xz_ret XZ_FUNC xz_dec_lzma2_reset(
 		struct xz_dec_lzma2 *s, uint8_t props);
 
+/* Limit the size of the dictionary, for callers that stop after 'size' bytes of output. */
+XZ_EXTERN void XZ_FUNC xz_dec_lzma2_cap(struct xz_dec_lzma2 *s, uint32_t size);
+
 /* Decode raw LZMA2 stream from b->in to b->out. */
 XZ_EXTERN enum xz_ret XZ_FUNC xz_dec_lzma2_run(
 		struct xz_dec_lzma2 *s, struct xz_buf *b);
@@ -128,6 +131,24 @@ XZ_EXTERN enum xz_ret XZ_FUNC xz_dec_lzma2_run(
 /* Free the memory allocated for the LZMA2 decoder. */
 XZ_EXTERN void XZ_FUNC xz_dec_lzma2_end(struct xz_dec_lzma2 *s);
 
+#ifdef XZ_DEC_LZMA1
+/*
+ * Reset the decoder for a raw LZMA stream with the given lc/lp/pb properties
+ * byte, dictionary size and compressed and uncompressed sizes. The return
+ * values are the same as for xz_dec_lzma2_reset().
+ */
+XZ_EXTERN enum xz_ret XZ_FUNC xz_dec_lzma1_reset(struct xz_dec_lzma2 *s,
+		uint8_t props, uint32_t dict_size,
+		uint64_t compressed, uint64_t uncompressed);
+
+/*
+ * Decode raw LZMA stream from b->in to b->out. Returns XZ_STREAM_END once
+ * all of the uncompressed data has been produced.
+ */
+XZ_EXTERN enum xz_ret XZ_FUNC xz_dec_lzma1_run(
+		struct xz_dec_lzma2 *s, struct xz_buf *b);
+#endif
+
 #ifdef XZ_DEC_BCJ
 /*
  * Allocate memory for BCJ decoders. xz_dec_bcj_reset() must be used before
@@ -0,0 +1,469 @@
+/*
+ * Rufus: The Reliable USB Formatting Utility
+ * Block device abstraction
+ * Copyright © 2026 agent <agent@local>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <windows.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <io.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+
+#include "rufus.h"
+#include "drive.h"
+#include "winio.h"
+#include "missing.h"
+#include "blockdev.h"
+#include "msapi_utf8.h"
+
+/*
+ * Backends that can't do asynchronous I/O perform the request on Submit()
+ * and hand the result over on Complete(), as if it had been queued.
+ */
+typedef struct {
+	BOOL bStatus;
+	DWORD dwSize;
+	DWORD dwError;
+} SYNC_REQUEST;
+
+static BOOL SyncSubmit(BLOCK_DEVICE* dev, SYNC_REQUEST* req, BOOL write, void* buf, uint64_t offset, DWORD size)
+{
+	req->dwSize = 0;
+	req->bStatus = write ? dev->Ops->Write(dev, buf, offset, size, &req->dwSize) :
+		dev->Ops->Read(dev, buf, offset, size, &req->dwSize);
+	req->dwError = req->bStatus ? ERROR_SUCCESS : GetLastError();
+	return TRUE;
+}
+
+static BOOL SyncComplete(SYNC_REQUEST* req, DWORD* size)
+{
+	*size = req->dwSize;
+	if (!req->bStatus)
+		SetLastError(req->dwError);
+	return req->bStatus;
+}
+
+/*
+ * Win32 backend, for physical drives and volumes
+ */
+typedef struct {
+	BLOCK_DEVICE Dev;
+	HANDLE hDevice;		// Synchronous handle
+	HANDLE hAsync;		// Overlapped handle from CreateFileAsync(), if any
+	BOOL bAsyncWrite;	// Whether hAsync was opened for writing
+	BOOL bOwned;
+	BOOL bSyncReq;		// Whether the current request was performed on Submit()
+	SYNC_REQUEST Req;
+} WIN32_BLOCK_DEVICE;
+
+static BOOL Win32Read(BLOCK_DEVICE* dev, void* buf, uint64_t offset, DWORD size, DWORD* read_size)
+{
+	WIN32_BLOCK_DEVICE* wdev = (WIN32_BLOCK_DEVICE*)dev;
+	OVERLAPPED ov = { 0 };
+
+	ov.Offset = (DWORD)offset;
+	ov.OffsetHigh = (DWORD)(offset >> 32);
+	return ReadFile(wdev->hDevice, buf, size, read_size, &ov);
+}
+
+static BOOL Win32Write(BLOCK_DEVICE* dev, const void* buf, uint64_t offset, DWORD size, DWORD* write_size)
+{
+	WIN32_BLOCK_DEVICE* wdev = (WIN32_BLOCK_DEVICE*)dev;
+	OVERLAPPED ov = { 0 };
+
+	ov.Offset = (DWORD)offset;
+	ov.OffsetHigh = (DWORD)(offset >> 32);
+	return WriteFile(wdev->hDevice, buf, size, write_size, &ov);
+}
+
+static BOOL Win32Submit(BLOCK_DEVICE* dev, BOOL write, void* buf, uint64_t offset, DWORD size)
+{
+	WIN32_BLOCK_DEVICE* wdev = (WIN32_BLOCK_DEVICE*)dev;
+
+	if ((wdev->hAsync == NULL) || (write && !wdev->bAsyncWrite)) {
+		wdev->bSyncReq = TRUE;
+		return SyncSubmit(dev, &wdev->Req, write, buf, offset, size);
+	}
+	wdev->bSyncReq = FALSE;
+	SetFileOffsetAsync(wdev->hAsync, offset);
+	return write ? WriteFileAsync(wdev->hAsync, buf, size) : ReadFileAsync(wdev->hAsync, buf, size);
+}
+
+static BOOL Win32Complete(BLOCK_DEVICE* dev, DWORD timeout, DWORD* size)
+{
+	WIN32_BLOCK_DEVICE* wdev = (WIN32_BLOCK_DEVICE*)dev;
+
+	if (wdev->bSyncReq)
+		return SyncComplete(&wdev->Req, size);
+	*size = 0;
+	if (!WaitFileAsync(wdev->hAsync, timeout)) {
+		SetLastError(ERROR_TIMEOUT);
+		return FALSE;
+	}
+	return GetSizeAsync(wdev->hAsync, size);
+}
+
+static BOOL Win32Discard(BLOCK_DEVICE* dev, uint64_t offset, uint64_t size)
+{
+	return DiscardVolumeRange(((WIN32_BLOCK_DEVICE*)dev)->hDevice, offset, size);
+}
+
+static BOOL Win32Flush(BLOCK_DEVICE* dev)
+{
+	return FlushFileBuffers(((WIN32_BLOCK_DEVICE*)dev)->hDevice);
+}
+
+static void Win32Close(BLOCK_DEVICE* dev)
+{
+	WIN32_BLOCK_DEVICE* wdev = (WIN32_BLOCK_DEVICE*)dev;
+
+	CloseFileAsync(wdev->hAsync);
+	if (wdev->bOwned)
+		safe_closehandle(wdev->hDevice);
+	free(wdev);
+}
+
+static const BLOCK_DEVICE_OPS win32_ops = {
+	Win32Read, Win32Write, Win32Submit, Win32Complete, Win32Discard, Win32Flush, Win32Close
+};
+
+/*
+ * Wrap an existing synchronous handle, such as the one from GetPhysicalHandle().
+ * The handle is not closed by BdClose(). If ReadAheadPath is provided, it is opened
+ * for asynchronous reads, so that the next block can be read while the current one
+ * is written. Otherwise, as well as for writes, asynchronous requests are emulated.
+ */
+BLOCK_DEVICE* BdOpenHandle(HANDLE hDevice, const char* ReadAheadPath, uint32_t SectorSize, uint64_t Size)
+{
+	WIN32_BLOCK_DEVICE* wdev;
+
+	if ((hDevice == NULL) || (hDevice == INVALID_HANDLE_VALUE) || !IS_POWER_OF_2(SectorSize)) {
+		SetLastError(ERROR_INVALID_PARAMETER);
+		return NULL;
+	}
+	wdev = calloc(1, sizeof(WIN32_BLOCK_DEVICE));
+	if (wdev == NULL) {
+		SetLastError(ERROR_NOT_ENOUGH_MEMORY);
+		return NULL;
+	}
+	wdev->Dev.Ops = &win32_ops;
+	wdev->Dev.Name = "win32";
+	wdev->Dev.SectorSize = SectorSize;
+	wdev->Dev.Size = Size;
+	wdev->hDevice = hDevice;
+	if (ReadAheadPath != NULL) {
+		wdev->hAsync = CreateFileAsync(ReadAheadPath, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE,
+			OPEN_EXISTING, FILE_FLAG_NO_BUFFERING);
+		if (wdev->hAsync == NULL)
+			uprintf("Could not open '%s' for read-ahead: %s", ReadAheadPath, WindowsErrorString());
+	}
+	return &wdev->Dev;
+}
+
+/*
+ * Open a drive or volume by path, with unbuffered access. Asynchronous requests go
+ * through a separate overlapped handle, which means that buffers must be aligned to
+ * the sector size.
+ */
+BLOCK_DEVICE* BdOpenDevice(const char* path, BOOL bWrite, uint32_t SectorSize, uint64_t Size)
+{
+	DWORD access = GENERIC_READ | (bWrite ? GENERIC_WRITE : 0);
+	HANDLE hDevice;
+	BLOCK_DEVICE* dev;
+
+	hDevice = CreateFileU(path, access, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL,
+		OPEN_EXISTING, FILE_FLAG_NO_BUFFERING, NULL);
+	if (hDevice == INVALID_HANDLE_VALUE) {
+		uprintf("Could not open block device '%s': %s", path, WindowsErrorString());
+		return NULL;
+	}
+	dev = BdOpenHandle(hDevice, NULL, SectorSize, Size);
+	if (dev == NULL) {
+		CloseHandle(hDevice);
+		return NULL;
+	}
+	((WIN32_BLOCK_DEVICE*)dev)->bOwned = TRUE;
+	((WIN32_BLOCK_DEVICE*)dev)->bAsyncWrite = bWrite;
+	((WIN32_BLOCK_DEVICE*)dev)->hAsync = CreateFileAsync(path, access, FILE_SHARE_READ | FILE_SHARE_WRITE,
+		OPEN_EXISTING, FILE_FLAG_NO_BUFFERING);
+	if (((WIN32_BLOCK_DEVICE*)dev)->hAsync == NULL)
+		uprintf("Could not open '%s' for asynchronous access: %s", path, WindowsErrorString());
+	return dev;
+}
+
+/*
+ * Image file backend, using the POSIX I/O calls from the CRT
+ */
+typedef struct {
+	BLOCK_DEVICE Dev;
+	int fd;
+	SYNC_REQUEST Req;
+} IMAGE_BLOCK_DEVICE;
+
+static BOOL ImageRead(BLOCK_DEVICE* dev, void* buf, uint64_t offset, DWORD size, DWORD* read_size)
+{
+	IMAGE_BLOCK_DEVICE* idev = (IMAGE_BLOCK_DEVICE*)dev;
+	int r;
+
+	*read_size = 0;
+	if ((_lseeki64(idev->fd, (int64_t)offset, SEEK_SET) != (int64_t)offset) ||
+		((r = _read(idev->fd, buf, (unsigned int)size)) < 0)) {
+		SetLastError(ERROR_READ_FAULT);
+		return FALSE;
+	}
+	*read_size = (DWORD)r;
+	return TRUE;
+}
+
+static BOOL ImageWrite(BLOCK_DEVICE* dev, const void* buf, uint64_t offset, DWORD size, DWORD* write_size)
+{
+	IMAGE_BLOCK_DEVICE* idev = (IMAGE_BLOCK_DEVICE*)dev;
+	int r;
+
+	*write_size = 0;
+	if ((_lseeki64(idev->fd, (int64_t)offset, SEEK_SET) != (int64_t)offset) ||
+		((r = _write(idev->fd, buf, (unsigned int)size)) < 0)) {
+		SetLastError(ERROR_WRITE_FAULT);
+		return FALSE;
+	}
+	*write_size = (DWORD)r;
+	return TRUE;
+}
+
+static BOOL ImageSubmit(BLOCK_DEVICE* dev, BOOL write, void* buf, uint64_t offset, DWORD size)
+{
+	return SyncSubmit(dev, &((IMAGE_BLOCK_DEVICE*)dev)->Req, write, buf, offset, size);
+}
+
+static BOOL ImageComplete(BLOCK_DEVICE* dev, DWORD timeout, DWORD* size)
+{
+	return SyncComplete(&((IMAGE_BLOCK_DEVICE*)dev)->Req, size);
+}
+
+// Same as TRIM, the content of a discarded range is undefined, so there's nothing to do
+static BOOL ImageDiscard(BLOCK_DEVICE* dev, uint64_t offset, uint64_t size)
+{
+	return TRUE;
+}
+
+static BOOL ImageFlush(BLOCK_DEVICE* dev)
+{
+	return (_commit(((IMAGE_BLOCK_DEVICE*)dev)->fd) == 0);
+}
+
+static void ImageClose(BLOCK_DEVICE* dev)
+{
+	_close(((IMAGE_BLOCK_DEVICE*)dev)->fd);
+	free(dev);
+}
+
+static const BLOCK_DEVICE_OPS image_ops = {
+	ImageRead, ImageWrite, ImageSubmit, ImageComplete, ImageDiscard, ImageFlush, ImageClose
+};
+
+/*
+ * Open an image file as a block device. If Size is 0, the size of the existing file is used.
+ */
+BLOCK_DEVICE* BdOpenImage(const char* path, BOOL bCreate, uint32_t SectorSize, uint64_t Size)
+{
+	IMAGE_BLOCK_DEVICE* idev;
+	int fd;
+
+	if ((path == NULL) || !IS_POWER_OF_2(SectorSize) || (bCreate && (Size == 0))) {
+		SetLastError(ERROR_INVALID_PARAMETER);
+		return NULL;
+	}
+	fd = _openU(path, _O_RDWR | _O_BINARY | (bCreate ? _O_CREAT | _O_TRUNC : 0), _S_IREAD | _S_IWRITE);
+	if (fd < 0) {
+		uprintf("Could not open image '%s': %s", path, strerror(errno));
+		return NULL;
+	}
+	if (bCreate && (_chsize_s(fd, (int64_t)Size) != 0)) {
+		uprintf("Could not set the size of image '%s': %s", path, strerror(errno));
+		_close(fd);
+		return NULL;
+	}
+	if (Size == 0)
+		Size = LO_ALIGN_X_TO_Y((uint64_t)_filelengthi64(fd), SectorSize);
+	idev = calloc(1, sizeof(IMAGE_BLOCK_DEVICE));
+	if (idev == NULL) {
+		SetLastError(ERROR_NOT_ENOUGH_MEMORY);
+		_close(fd);
+		return NULL;
+	}
+	idev->Dev.Ops = &image_ops;
+	idev->Dev.Name = "image";
+	idev->Dev.SectorSize = SectorSize;
+	idev->Dev.Size = Size;
+	idev->fd = fd;
+	return &idev->Dev;
+}
+
+/*
+ * Throttled backend, that simulates the latency and throughput of a slow device
+ * (such as a flash drive) on top of another block device. Requests are serviced
+ * one at a time, so an asynchronous request keeps the device busy until it has
+ * completed, but lets the caller do something else in the meantime.
+ */
+typedef struct {
+	BLOCK_DEVICE Dev;
+	BLOCK_DEVICE* Lower;
+	BLOCK_DEVICE_PROFILE Profile;
+	uint64_t BusyUntil;		// in µs
+	uint64_t CompletesAt;		// in µs
+	SYNC_REQUEST Req;
+} THROTTLED_BLOCK_DEVICE;
+
+static uint64_t GetTimeUs(void)
+{
+	static LARGE_INTEGER freq = { { 0, 0 } };
+	LARGE_INTEGER li;
+
+	if (freq.QuadPart == 0)
+		QueryPerformanceFrequency(&freq);
+	QueryPerformanceCounter(&li);
+	return (uint64_t)((li.QuadPart / freq.QuadPart) * 1000000ULL +
+		((li.QuadPart % freq.QuadPart) * 1000000ULL) / freq.QuadPart);
+}
+
+static void WaitUntilUs(uint64_t t)
+{
+	uint64_t now;
+
+	// Sleep() only has millisecond granularity, so just yield for the remainder
+	while ((now = GetTimeUs()) < t) {
+		if (t - now >= 1000)
+			Sleep((DWORD)((t - now) / 1000));
+		else
+			SwitchToThread();
+	}
+}
+
+// Book the device for a request, and return the time at which it will complete
+static uint64_t ThrottledSchedule(THROTTLED_BLOCK_DEVICE* tdev, BOOL write, uint64_t offset, uint64_t size)
+{
+	BLOCK_DEVICE_PROFILE* p = &tdev->Profile;
+	uint64_t bandwidth = write ? p->WriteBandwidth : p->ReadBandwidth, start, cost;
+
+	// Flash media must rewrite whole erase blocks, whatever the size of the write
+	if (write && (p->EraseBlockSize != 0) && (size != 0)) {
+		size = HI_ALIGN_X_TO_Y(offset + size, p->EraseBlockSize) - LO_ALIGN_X_TO_Y(offset, p->EraseBlockSize);
+	}
+	cost = write ? p->WriteLatency : p->ReadLatency;
+	if (bandwidth != 0)
+		cost += size * 1000000ULL / bandwidth;
+	start = MAX(GetTimeUs(), tdev->BusyUntil);
+	tdev->BusyUntil = start + cost;
+	return tdev->BusyUntil;
+}
+
+static BOOL ThrottledRead(BLOCK_DEVICE* dev, void* buf, uint64_t offset, DWORD size, DWORD* read_size)
+{
+	THROTTLED_BLOCK_DEVICE* tdev = (THROTTLED_BLOCK_DEVICE*)dev;
+	BOOL r = tdev->Lower->Ops->Read(tdev->Lower, buf, offset, size, read_size);
+
+	WaitUntilUs(ThrottledSchedule(tdev, FALSE, offset, size));
+	return r;
+}
+
+static BOOL ThrottledWrite(BLOCK_DEVICE* dev, const void* buf, uint64_t offset, DWORD size, DWORD* write_size)
+{
+	THROTTLED_BLOCK_DEVICE* tdev = (THROTTLED_BLOCK_DEVICE*)dev;
+	BOOL r = tdev->Lower->Ops->Write(tdev->Lower, buf, offset, size, write_size);
+
+	WaitUntilUs(ThrottledSchedule(tdev, TRUE, offset, size));
+	return r;
+}
+
+static BOOL ThrottledSubmit(BLOCK_DEVICE* dev, BOOL write, void* buf, uint64_t offset, DWORD size)
+{
+	THROTTLED_BLOCK_DEVICE* tdev = (THROTTLED_BLOCK_DEVICE*)dev;
+
+	SyncSubmit(tdev->Lower, &tdev->Req, write, buf, offset, size);
+	tdev->CompletesAt = ThrottledSchedule(tdev, write, offset, size);
+	return TRUE;
+}
+
+static BOOL ThrottledComplete(BLOCK_DEVICE* dev, DWORD timeout, DWORD* size)
+{
+	THROTTLED_BLOCK_DEVICE* tdev = (THROTTLED_BLOCK_DEVICE*)dev;
+	uint64_t now = GetTimeUs();
+
+	if ((timeout != INFINITE) && (tdev->CompletesAt > now + timeout * 1000ULL)) {
+		WaitUntilUs(now + timeout * 1000ULL);
+		SetLastError(ERROR_TIMEOUT);
+		return FALSE;
+	}
+	WaitUntilUs(tdev->CompletesAt);
+	return SyncComplete(&tdev->Req, size);
+}
+
+static BOOL ThrottledDiscard(BLOCK_DEVICE* dev, uint64_t offset, uint64_t size)
+{
+	THROTTLED_BLOCK_DEVICE* tdev = (THROTTLED_BLOCK_DEVICE*)dev;
+	BOOL r = tdev->Lower->Ops->Discard(tdev->Lower, offset, size);
+
+	// A discard only costs a command round trip
+	WaitUntilUs(ThrottledSchedule(tdev, TRUE, offset, 0));
+	return r;
+}
+
+static BOOL ThrottledFlush(BLOCK_DEVICE* dev)
+{
+	THROTTLED_BLOCK_DEVICE* tdev = (THROTTLED_BLOCK_DEVICE*)dev;
+
+	WaitUntilUs(tdev->BusyUntil);
+	return tdev->Lower->Ops->Flush(tdev->Lower);
+}
+
+static void ThrottledClose(BLOCK_DEVICE* dev)
+{
+	BdClose(((THROTTLED_BLOCK_DEVICE*)dev)->Lower);
+	free(dev);
+}
+
+static const BLOCK_DEVICE_OPS throttled_ops = {
+	ThrottledRead, ThrottledWrite, ThrottledSubmit, ThrottledComplete, ThrottledDiscard, ThrottledFlush, ThrottledClose
+};
+
+/*
+ * Simulate a slow device on top of 'lower', which is then owned by the new device.
+ */
+BLOCK_DEVICE* BdOpenThrottled(BLOCK_DEVICE* lower, const BLOCK_DEVICE_PROFILE* profile)
+{
+	THROTTLED_BLOCK_DEVICE* tdev;
+
+	if ((lower == NULL) || (profile == NULL)) {
+		SetLastError(ERROR_INVALID_PARAMETER);
+		return NULL;
+	}
+	tdev = calloc(1, sizeof(THROTTLED_BLOCK_DEVICE));
+	if (tdev == NULL) {
+		SetLastError(ERROR_NOT_ENOUGH_MEMORY);
+		return NULL;
+	}
+	tdev->Dev.Ops = &throttled_ops;
+	tdev->Dev.Name = "throttled";
+	tdev->Dev.SectorSize = lower->SectorSize;
+	tdev->Dev.Size = lower->Size;
+	tdev->Lower = lower;
+	tdev->Profile = *profile;
+	return &tdev->Dev;
+}
@@ -0,0 +1,108 @@
+/*
+ * Rufus: The Reliable USB Formatting Utility
+ * Block device abstraction
+ * Copyright © 2026 agent <agent@local>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <windows.h>
+#include <stdint.h>
+
+#pragma once
+
+/*
+ * A block device is accessed through a set of backend operations, so that the
+ * I/O engines can run against a real drive, an image file or a simulated device.
+ * All offsets and sizes must be multiples of the device's sector size, and at most
+ * one asynchronous request (Submit() followed by Complete()) can be in flight,
+ * though synchronous requests can be issued while it is.
+ */
+typedef struct BLOCK_DEVICE BLOCK_DEVICE;
+
+typedef struct {
+	BOOL (*Read)(BLOCK_DEVICE* dev, void* buf, uint64_t offset, DWORD size, DWORD* read_size);
+	BOOL (*Write)(BLOCK_DEVICE* dev, const void* buf, uint64_t offset, DWORD size, DWORD* write_size);
+	BOOL (*Submit)(BLOCK_DEVICE* dev, BOOL write, void* buf, uint64_t offset, DWORD size);
+	BOOL (*Complete)(BLOCK_DEVICE* dev, DWORD timeout, DWORD* size);
+	BOOL (*Discard)(BLOCK_DEVICE* dev, uint64_t offset, uint64_t size);
+	BOOL (*Flush)(BLOCK_DEVICE* dev);
+	void (*Close)(BLOCK_DEVICE* dev);
+} BLOCK_DEVICE_OPS;
+
+struct BLOCK_DEVICE {
+	const BLOCK_DEVICE_OPS* Ops;
+	const char* Name;
+	uint32_t SectorSize;
+	uint64_t Size;
+};
+
+/* Latency and throughput of a simulated device (0 means unlimited) */
+typedef struct {
+	uint32_t ReadLatency;		// in µs
+	uint32_t WriteLatency;		// in µs
+	uint64_t ReadBandwidth;		// in bytes/s
+	uint64_t WriteBandwidth;	// in bytes/s
+	uint32_t EraseBlockSize;	// partial writes cost a full erase block
+} BLOCK_DEVICE_PROFILE;
+
+extern BLOCK_DEVICE* BdOpenHandle(HANDLE hDevice, const char* ReadAheadPath, uint32_t SectorSize, uint64_t Size);
+extern BLOCK_DEVICE* BdOpenDevice(const char* path, BOOL bWrite, uint32_t SectorSize, uint64_t Size);
+extern BLOCK_DEVICE* BdOpenImage(const char* path, BOOL bCreate, uint32_t SectorSize, uint64_t Size);
+extern BLOCK_DEVICE* BdOpenThrottled(BLOCK_DEVICE* lower, const BLOCK_DEVICE_PROFILE* profile);
+
+static __inline BOOL BdIsAligned(BLOCK_DEVICE* dev, uint64_t offset, uint64_t size)
+{
+	if ((offset % dev->SectorSize != 0) || (size % dev->SectorSize != 0) || (offset + size > dev->Size)) {
+		SetLastError(ERROR_INVALID_PARAMETER);
+		return FALSE;
+	}
+	return TRUE;
+}
+
+static __inline BOOL BdRead(BLOCK_DEVICE* dev, void* buf, uint64_t offset, DWORD size, DWORD* read_size)
+{
+	return BdIsAligned(dev, offset, size) && dev->Ops->Read(dev, buf, offset, size, read_size);
+}
+
+static __inline BOOL BdWrite(BLOCK_DEVICE* dev, const void* buf, uint64_t offset, DWORD size, DWORD* write_size)
+{
+	return BdIsAligned(dev, offset, size) && dev->Ops->Write(dev, buf, offset, size, write_size);
+}
+
+static __inline BOOL BdSubmit(BLOCK_DEVICE* dev, BOOL write, void* buf, uint64_t offset, DWORD size)
+{
+	return BdIsAligned(dev, offset, size) && dev->Ops->Submit(dev, write, buf, offset, size);
+}
+
+static __inline BOOL BdComplete(BLOCK_DEVICE* dev, DWORD timeout, DWORD* size)
+{
+	return dev->Ops->Complete(dev, timeout, size);
+}
+
+static __inline BOOL BdDiscard(BLOCK_DEVICE* dev, uint64_t offset, uint64_t size)
+{
+	return BdIsAligned(dev, offset, size) && dev->Ops->Discard(dev, offset, size);
+}
+
+static __inline BOOL BdFlush(BLOCK_DEVICE* dev)
+{
+	return dev->Ops->Flush(dev);
+}
+
+static __inline void BdClose(BLOCK_DEVICE* dev)
+{
+	if (dev != NULL)
+		dev->Ops->Close(dev);
+}
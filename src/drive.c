@@ -2077,6 +2077,55 @@ BOOL UnmountVolume(HANDLE hDrive)
 	return TRUE;
 }
 
+/*
+ * Discard (TRIM) a range of a volume, if the underlying device supports it.
+ * Note that a successful discard does not mean that the range reads back as zeroes.
+ */
+BOOL DiscardVolumeRange(HANDLE hDrive, uint64_t Offset, uint64_t Size)
+{
+	DWORD size;
+	STORAGE_PROPERTY_QUERY query = { StorageDeviceTrimProperty, PropertyStandardQuery, { 0 } };
+	DEVICE_TRIM_DESCRIPTOR trim = { 0 };
+	struct {
+		DEVICE_MANAGE_DATA_SET_ATTRIBUTES attr;
+		DEVICE_DATA_SET_RANGE range;
+	} dsm = { 0 };
+
+	if (!DeviceIoControl(hDrive, IOCTL_STORAGE_QUERY_PROPERTY, &query, sizeof(query),
+		&trim, sizeof(trim), &size, NULL) || (size < sizeof(trim)) || !trim.TrimEnabled)
+		return FALSE;
+
+	dsm.attr.Size = sizeof(dsm.attr);
+	dsm.attr.Action = DeviceDsmAction_Trim;
+	dsm.attr.DataSetRangesOffset = (DWORD)((BYTE*)&dsm.range - (BYTE*)&dsm);
+	dsm.attr.DataSetRangesLength = sizeof(dsm.range);
+	dsm.range.StartingOffset = (LONGLONG)Offset;
+	dsm.range.LengthInBytes = Size;
+	if (!DeviceIoControl(hDrive, IOCTL_STORAGE_MANAGE_DATA_SET_ATTRIBUTES, &dsm, sizeof(dsm),
+		NULL, 0, &size, NULL)) {
+		uprintf("Could not discard volume range: %s", WindowsErrorString());
+		return FALSE;
+	}
+	return TRUE;
+}
+
+/*
+ * Whether discarded ranges of the device are guaranteed to read back as zeroes, as
+ * reported through the logical block provisioning VPD (LBPRZ for SCSI and UAS, which
+ * the SCSI/ATA translation layer sets from the DRAT/RZAT capabilities of ATA devices).
+ */
+BOOL DiscardReadsZeroes(HANDLE hDrive)
+{
+	DWORD size;
+	STORAGE_PROPERTY_QUERY query = { StorageDeviceLBProvisioningProperty, PropertyStandardQuery, { 0 } };
+	DEVICE_LB_PROVISIONING_DESCRIPTOR lbp = { 0 };
+
+	if (!DeviceIoControl(hDrive, IOCTL_STORAGE_QUERY_PROPERTY, &query, sizeof(query),
+		&lbp, sizeof(lbp), &size, NULL) || (size < offsetof(DEVICE_LB_PROVISIONING_DESCRIPTOR, OptimalUnmapGranularity)))
+		return FALSE;
+	return lbp.ThinProvisioningEnabled && lbp.ThinProvisioningReadZeros;
+}
+
 /*
  * Mount the volume identified by drive_guid to mountpoint drive_name.
  * If volume_name is already mounted, but with a different letter than the
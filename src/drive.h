@@ -407,6 +407,8 @@ BOOL AnalyzeMBR(HANDLE hPhysicalDrive, const char* TargetName, BOOL bSilent);
 BOOL AnalyzePBR(HANDLE hLogicalVolume);
 BOOL GetDrivePartitionData(DWORD DriveIndex, char* FileSystemName, DWORD FileSystemNameSize, BOOL bSilent);
 BOOL UnmountVolume(HANDLE hDrive);
+BOOL DiscardVolumeRange(HANDLE hDrive, uint64_t Offset, uint64_t Size);
+BOOL DiscardReadsZeroes(HANDLE hDrive);
 BOOL MountVolume(char* drive_name, char *drive_guid);
 BOOL AltUnmountVolume(const char* drive_name, BOOL bSilent);
 char* AltMountVolume(DWORD DriveIndex, uint64_t PartitionOffset, BOOL bSilent);
@@ -28,10 +28,13 @@
 #include "config.h"
 #include "ext2fs.h"
 #include "rufus.h"
+#include "blockdev.h"
 #include "msapi_utf8.h"
 
 extern char* NtStatusError(NTSTATUS Status);
 static DWORD LastWinError = 0;
+// Set by the benchmarks, to simulate a slow device underneath the ext engine
+const BLOCK_DEVICE_PROFILE* nt_io_throttle = NULL;
 
 PF_TYPE_DECL(NTAPI, ULONG, RtlNtStatusToDosError, (NTSTATUS));
 PF_TYPE_DECL(NTAPI, NTSTATUS, NtClose, (HANDLE));
@@ -57,6 +60,7 @@ PF_TYPE_DECL(NTAPI, NTSTATUS, NtDelayExecution, (BOOLEAN, PLARGE_INTEGER));
 typedef struct _NT_PRIVATE_DATA {
     int     magic;
     HANDLE  handle;
+    BLOCK_DEVICE* dev;
     int     flags;
     char*   buffer;
     __u32   buffer_block_number;
@@ -244,14 +248,6 @@ static NTSTATUS _OpenDriveLetter(IN CHAR Letter, IN BOOLEAN ReadOnly, OUT PHANDL
 	return _OpenNtName(Buffer, ReadOnly, Handle, OpenedReadonly);
 }
 
-static __inline NTSTATUS _FlushDrive(IN HANDLE Handle)
-{
-	IO_STATUS_BLOCK IoStatusBlock;
-	PF_INIT(NtFlushBuffersFile, NtDll);
-	return (pfNtFlushBuffersFile == NULL) ? STATUS_DLL_NOT_FOUND : pfNtFlushBuffersFile(Handle, &IoStatusBlock);
-}
-
-
 static __inline NTSTATUS _LockDrive(IN HANDLE Handle)
 {
 	IO_STATUS_BLOCK IoStatusBlock;
@@ -385,31 +381,28 @@ static BOOLEAN _Ext2OpenDevice(IN PCSTR Name, IN BOOLEAN ReadOnly, OUT PHANDLE H
 	return TRUE;
 }
 
-static BOOLEAN _BlockIo(IN HANDLE Handle, IN LARGE_INTEGER Offset, IN ULONG Bytes, IN OUT PCHAR Buffer, IN BOOLEAN Read, OUT errcode_t *Errno OPTIONAL)
+static BOOLEAN _BlockIo(IN BLOCK_DEVICE* Dev, IN LARGE_INTEGER Offset, IN ULONG Bytes, IN OUT PCHAR Buffer, IN BOOLEAN Read, OUT errcode_t *Errno OPTIONAL)
 {
-	IO_STATUS_BLOCK IoStatusBlock;
-	NTSTATUS Status = STATUS_DLL_NOT_FOUND;
-	PF_INIT_OR_OUT(NtReadFile, NtDll);
-	PF_INIT_OR_OUT(NtWriteFile, NtDll);
+	BOOL r;
+	DWORD Size;
+	uint64_t start;
 
 	// Should be aligned
 	assert((Bytes % 512) == 0);
 	assert((Offset.LowPart % 512) == 0);
 
 	LastWinError = 0;
+	start = IoStatsNow();
 	// Perform io
-	if(Read) {
-		Status = pfNtReadFile(Handle, NULL, NULL, NULL,
-			&IoStatusBlock, Buffer, Bytes, &Offset, NULL);
-	} else	{
-		Status = pfNtWriteFile(Handle, NULL, NULL, NULL,
-			&IoStatusBlock, Buffer, Bytes, &Offset, NULL);
-	}
+	if (Read)
+		r = BdRead(Dev, Buffer, Offset.QuadPart, Bytes, &Size);
+	else
+		r = BdWrite(Dev, Buffer, Offset.QuadPart, Bytes, &Size);
+	IoStatsAdd(Read ? IOSTAT_READ : IOSTAT_WRITE, r ? Bytes : 0, start);
 
-out:
-	if (!NT_SUCCESS(Status)) {
+	if (!r) {
 		if (ARGUMENT_PRESENT(Errno))
-			*Errno = _MapNtStatus(Status);
+			*Errno = _MapDosError(GetLastError());
 		return FALSE;
 	}
 
@@ -418,14 +411,14 @@ out:
 	return TRUE;
 }
 
-static BOOLEAN _RawWrite(IN HANDLE Handle, IN LARGE_INTEGER Offset, IN ULONG Bytes, OUT const CHAR* Buffer, OUT errcode_t* Errno)
+static BOOLEAN _RawWrite(IN BLOCK_DEVICE* Dev, IN LARGE_INTEGER Offset, IN ULONG Bytes, OUT const CHAR* Buffer, OUT errcode_t* Errno)
 {
-	return _BlockIo(Handle, Offset, Bytes, (PCHAR)Buffer, FALSE, Errno);
+	return _BlockIo(Dev, Offset, Bytes, (PCHAR)Buffer, FALSE, Errno);
 }
 
-static BOOLEAN _RawRead(IN HANDLE Handle, IN LARGE_INTEGER Offset, IN ULONG Bytes, IN PCHAR Buffer, OUT errcode_t* Errno)
+static BOOLEAN _RawRead(IN BLOCK_DEVICE* Dev, IN LARGE_INTEGER Offset, IN ULONG Bytes, IN PCHAR Buffer, OUT errcode_t* Errno)
 {
-	return _BlockIo(Handle, Offset, Bytes, Buffer, TRUE, Errno);
+	return _BlockIo(Dev, Offset, Bytes, Buffer, TRUE, Errno);
 }
 
 static BOOLEAN _SetPartType(IN HANDLE Handle, IN UCHAR Type)
@@ -495,6 +488,8 @@ static errcode_t nt_open(const char *name, int flags, io_channel *channel)
 {
 	io_channel io = NULL;
 	PNT_PRIVATE_DATA nt_data = NULL;
+	BLOCK_DEVICE* dev;
+	__u64 size;
 	errcode_t errcode = 0;
 
 	if (name == NULL)
@@ -545,6 +540,18 @@ static errcode_t nt_open(const char *name, int flags, io_channel *channel)
 		goto out;
 	}
 
+	// The data is accessed through a block device, that doesn't let us go past the partition
+	size = nt_data->size;
+	if (size == 0)
+		_GetDeviceSize(nt_data->handle, &size);
+	nt_data->dev = BdOpenHandle(nt_data->handle, NULL, 512, (size == 0) ? UINT64_MAX : nt_data->offset + size);
+	if (nt_data->dev == NULL) {
+		errcode = ENOMEM;
+		goto out;
+	}
+	if ((nt_io_throttle != NULL) && ((dev = BdOpenThrottled(nt_data->dev, nt_io_throttle)) != NULL))
+		nt_data->dev = dev;
+
 	// Done
 	*channel = io;
 
@@ -556,6 +563,7 @@ out:
 		}
 
 		if (nt_data != NULL) {
+			BdClose(nt_data->dev);
 			if (nt_data->handle != NULL) {
 				_UnlockDrive(nt_data->handle);
 				_CloseDisk(nt_data->handle);
@@ -586,6 +594,7 @@ static errcode_t nt_close(io_channel channel)
 	free(channel);
 
 	if (nt_data != NULL) {
+		BdClose(nt_data->dev);
 		if (nt_data->handle != NULL)
 			CloseHandle(nt_data->handle);
 		free(nt_data->buffer);
@@ -655,7 +664,7 @@ static errcode_t nt_read_blk64(io_channel channel, unsigned long long block, int
 		assert((read_size % channel->block_size) == 0);
 	}
 
-	if (!_RawRead(nt_data->handle, offset, read_size, read_buffer, &errcode)) {
+	if (!_RawRead(nt_data->dev, offset, read_size, read_buffer, &errcode)) {
 		if (channel->read_error)
 			return (channel->read_error)(channel, block, count, buf, size, 0, errcode);
 		else
@@ -703,7 +712,7 @@ static errcode_t nt_write_blk64(io_channel channel, unsigned long long block, in
 	assert((write_size % 512) == 0);
 	offset.QuadPart = block * channel->block_size + nt_data->offset;
 
-	if (!_RawWrite(nt_data->handle, offset, write_size, buf, &errcode)) {
+	if (!_RawWrite(nt_data->dev, offset, write_size, buf, &errcode)) {
 		if (channel->write_error)
 			return (channel->write_error)(channel, block, count, buf, write_size, 0, errcode);
 		else
@@ -730,6 +739,7 @@ static errcode_t nt_write_blk(io_channel channel, unsigned long block, int count
 static errcode_t nt_flush(io_channel channel)
 {
 	PNT_PRIVATE_DATA nt_data = NULL;
+	uint64_t start;
 
 	EXT2_CHECK_MAGIC(channel, EXT2_ET_MAGIC_IO_CHANNEL);
 	nt_data = (PNT_PRIVATE_DATA) channel->private_data;
@@ -739,8 +749,10 @@ static errcode_t nt_flush(io_channel channel)
 		return 0;
 
 
-	// Flush file buffers.
-	_FlushDrive(nt_data->handle);
+	// Flush file buffers. This is waiting on the pending writes, so account for it as a write.
+	start = IoStatsNow();
+	BdFlush(nt_data->dev);
+	IoStatsAdd(IOSTAT_WRITE, 0, start);
 
 
 	// Test and correct partition type.
@@ -55,11 +55,38 @@
 #include "drive.h"
 #include "format.h"
 #include "badblocks.h"
+#include "blockdev.h"
 #include "bled/bled.h"
 #include "../res/grub/grub_version.h"
 
 /* Numbers of buffer used for asynchronous DD reads */
 #define NUM_BUFFERS 2
+/* Number of device reads kept in flight when verifying a write */
+#define VERIFY_QUEUE_DEPTH 4
+/* Maximum number of blocks we write without checking them, when fast-zeroing */
+#define FAST_ZEROING_MAX_BACKOFF 16
+/* Amount of image data written between two checkpoints, that allow an interrupted write to resume */
+#define CHECKPOINT_INTERVAL (256 * MB)
+/* Data at the start of the drive that must be rewritten on resume, since repartitioning alters it */
+#define CHECKPOINT_HEAD_SIZE (1 * MB)
+#define CHECKPOINT_EXT ".resume"
+#define CHECKPOINT_MAGIC "RUFUSCKP"
+#define CHECKPOINT_VERSION 1
+
+/* Write checkpoint, that we save next to the image */
+typedef struct {
+	char magic[8];
+	uint32_t version;
+	uint32_t sector_size;
+	uint64_t image_size;
+	int64_t image_time;
+	uint64_t disk_size;
+	char drive_id[256];
+	// Everything above identifies the image and the target, and must match for a resume
+	uint64_t offset;			// all the data before this offset is on the target
+	uint64_t digest_start;		// start of the data written since the previous checkpoint, or the end of the head
+	uint8_t digest[SHA256_HASHSIZE];	// SHA-256 of the data in [digest_start, offset[
+} WRITE_CHECKPOINT;
 
 /*
  * Globals
@@ -70,13 +97,19 @@ badblocks_report report = { 0 };
 static float format_percent = 0.0f;
 static int task_number = 0, actual_fs_type;
 static unsigned int sec_buf_pos = 0;
+static uint64_t sector_write_time = 0;
+static int vfy_fd = -1;
+static uint32_t vfy_buf_size = 0;
+static uint8_t* vfy_buf = NULL;
 extern const int nb_steps[FS_MAX];
 extern const char* md5sum_name[2];
 extern uint32_t dur_mins, dur_secs;
 extern uint32_t wim_nb_files, wim_proc_files, wim_extra_files;
 extern BOOL force_large_fat32, enable_ntfs_compression, lock_drive, zero_drive, fast_zeroing, enable_file_indexing;
 extern BOOL write_as_image, use_vds, write_as_esp, is_vds_available, has_ffu_support, use_rufus_mbr;
+extern BOOL verify_write;
 extern char* archive_path;
+extern RUFUS_DRIVE rufus_drive[MAX_DRIVES];
 uint8_t *grub2_buf = NULL, *sec_buf = NULL;
 long grub2_len;
 
@@ -1097,6 +1130,167 @@ static void update_progress(const uint64_t processed_bytes)
 	}
 }
 
+/*
+ * Write checkpoints: After every CHECKPOINT_INTERVAL bytes of image data, we flush the target
+ * and save the offset we reached, along with the digest of the data written since the previous
+ * checkpoint. If the write then fails (e.g. because the USB hub was reset), writing the same image
+ * to the same drive again reads that data back and, if it still matches, resumes from there.
+ */
+static struct {
+	BOOL enabled;
+	HANDLE hDrive;
+	char path[MAX_PATH];
+	HASH_CONTEXT hash_ctx;
+	WRITE_CHECKPOINT data;
+} ckp;
+
+static void InitCheckpoints(HANDLE hPhysicalDrive)
+{
+	struct __stat64 st;
+	int index;
+
+	memset(&ckp, 0, sizeof(ckp));
+	// We run in the format thread, so look the drive up from its number rather than from the UI
+	for (index = 0; (index < MAX_DRIVES) && (rufus_drive[index].size != 0); index++) {
+		if (rufus_drive[index].index == SelectedDrive.DeviceNumber)
+			break;
+	}
+	if ((index >= MAX_DRIVES) || (rufus_drive[index].size == 0) || (rufus_drive[index].id == NULL) ||
+		(_stat64U(image_path, &st) != 0) ||
+		(strlen(image_path) + sizeof(CHECKPOINT_EXT) + 1 >= sizeof(ckp.path)))
+		return;
+	static_sprintf(ckp.path, "%s%s", image_path, CHECKPOINT_EXT);
+	memcpy(ckp.data.magic, CHECKPOINT_MAGIC, sizeof(ckp.data.magic));
+	ckp.data.version = CHECKPOINT_VERSION;
+	ckp.data.sector_size = SelectedDrive.SectorSize;
+	ckp.data.image_size = st.st_size;
+	ckp.data.image_time = st.st_mtime;
+	ckp.data.disk_size = SelectedDrive.DiskSize;
+	static_strcpy(ckp.data.drive_id, rufus_drive[index].id);
+	// The head is rewritten on resume, and repartitioning the drive alters it, so leave it out of the digest
+	ckp.data.digest_start = CHECKPOINT_HEAD_SIZE;
+	hash_init[HASH_SHA256](&ckp.hash_ctx);
+	ckp.hDrive = hPhysicalDrive;
+	ckp.enabled = TRUE;
+}
+
+static BOOL SaveCheckpoint(void)
+{
+	char tmp_path[MAX_PATH + 1];
+	FILE* fd;
+	BOOL r;
+
+	static_sprintf(tmp_path, "%s~", ckp.path);
+	fd = fopenU(tmp_path, "wb");
+	if (fd == NULL)
+		return FALSE;
+	r = (fwrite(&ckp.data, sizeof(ckp.data), 1, fd) == 1);
+	r = (fclose(fd) == 0) && r;
+	r = r && MoveFileExU(tmp_path, ckp.path, MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH);
+	if (!r)
+		DeleteFileU(tmp_path);
+	return r;
+}
+
+// Must be called, in sequence, with the data of every successful write
+static void UpdateCheckpoint(const uint8_t* buf, uint64_t offset, uint32_t size)
+{
+	uint32_t skip;
+
+	// Rewriting data that a checkpoint already covers doesn't change it
+	if (!ckp.enabled || (offset + size <= ckp.data.offset))
+		return;
+	if (offset != ckp.data.offset) {
+		uprintf("\r\nNon sequential write at offset 0x%llx - Write checkpoints are disabled", offset);
+		ckp.enabled = FALSE;
+		return;
+	}
+	if (offset + size > ckp.data.digest_start) {
+		skip = (uint32_t)(MAX(offset, ckp.data.digest_start) - offset);
+		hash_write[HASH_SHA256](&ckp.hash_ctx, &buf[skip], size - skip);
+	}
+	ckp.data.offset += size;
+	if (ckp.data.offset < ckp.data.digest_start + CHECKPOINT_INTERVAL)
+		return;
+
+	hash_final[HASH_SHA256](&ckp.hash_ctx);
+	memcpy(ckp.data.digest, ckp.hash_ctx.buf, SHA256_HASHSIZE);
+	if (!FlushFileBuffers(ckp.hDrive) || !SaveCheckpoint()) {
+		uprintf("\r\nCould not save write checkpoint: %s - Write checkpoints are disabled", WindowsErrorString());
+		ckp.enabled = FALSE;
+		return;
+	}
+	ckp.data.digest_start = ckp.data.offset;
+	hash_init[HASH_SHA256](&ckp.hash_ctx);
+}
+
+/*
+ * Look for a checkpoint from a previous write of the same image to the same drive, and read the
+ * data from the last checkpoint interval back, to make sure that it is still there. 'buffer' must
+ * be aligned to the sector size. Returns the offset from which the write can resume, or 0.
+ */
+static uint64_t GetResumeOffset(BLOCK_DEVICE* dev, uint8_t* buffer, DWORD buf_size, uint64_t target_size)
+{
+	WRITE_CHECKPOINT saved;
+	HASH_CONTEXT hash_ctx;
+	DWORD size, read_size;
+	uint64_t pos;
+	FILE* fd;
+
+	if (!ckp.enabled)
+		return 0;
+	fd = fopenU(ckp.path, "rb");
+	if (fd == NULL)
+		return 0;
+	size = (DWORD)fread(&saved, 1, sizeof(saved), fd);
+	fclose(fd);
+	if ((size != sizeof(saved)) || (memcmp(&saved, &ckp.data, offsetof(WRITE_CHECKPOINT, offset)) != 0)) {
+		uprintf("Ignoring write checkpoint '%s', as it is for a different image or drive", ckp.path);
+		return 0;
+	}
+	if ((saved.offset > target_size) || (saved.digest_start < CHECKPOINT_HEAD_SIZE) || (saved.digest_start >= saved.offset) ||
+		(saved.offset % SelectedDrive.SectorSize != 0) || (saved.digest_start % SelectedDrive.SectorSize != 0) ||
+		(saved.offset - saved.digest_start > CHECKPOINT_INTERVAL + DD_BUFFER_SIZE)) {
+		uprintf("Ignoring invalid write checkpoint '%s'", ckp.path);
+		return 0;
+	}
+
+	uprintf("Found a checkpoint at offset 0x%llx from a previous write - Checking data...", saved.offset);
+	hash_init[HASH_SHA256](&hash_ctx);
+	for (pos = saved.digest_start; pos < saved.offset; pos += size) {
+		size = (DWORD)MIN(buf_size, saved.offset - pos);
+		if (!BdRead(dev, buffer, pos, size, &read_size) || (read_size != size)) {
+			uprintf("Could not read data at offset 0x%llx: %s", pos, WindowsErrorString());
+			return 0;
+		}
+		hash_write[HASH_SHA256](&hash_ctx, buffer, size);
+	}
+	hash_final[HASH_SHA256](&hash_ctx);
+	if (memcmp(hash_ctx.buf, saved.digest, SHA256_HASHSIZE) != 0) {
+		uprintf("The data on the drive does not match the checkpoint - Restarting from the beginning");
+		return 0;
+	}
+	ckp.data.offset = saved.offset;
+	ckp.data.digest_start = saved.offset;
+	uprintf("Resuming write from %s", SizeToHumanReadable(saved.offset, FALSE, FALSE));
+	return saved.offset;
+}
+
+// _write() that also records the request in the I/O statistics
+static int _write_with_stats(int fd, const void* buf, unsigned int count)
+{
+	uint64_t start = IoStatsNow();
+	int64_t offset = ckp.enabled ? _lseeki64(fd, 0, SEEK_CUR) : 0;
+	int written = _write(fd, buf, count);
+
+	if (written > 0)
+		UpdateCheckpoint(buf, offset, written);
+	IoStatsAdd(IOSTAT_WRITE, (written > 0) ? written : 0, start);
+	if (start != 0)
+		sector_write_time += IoStatsNow() - start;
+	return written;
+}
+
 // Some compressed images use streams that aren't multiple of the sector
 // size and cause write failures => Use a write override that alleviates
 // the problem. See GitHub issue #1422 for details.
@@ -1116,7 +1310,7 @@ static int sector_write(int fd, const void* _buf, unsigned int count)
 	// If we are on a sector boundary and count is multiple of the
 	// sector size, just issue a regular write
 	if ((sec_buf_pos == 0) && (count % sec_size == 0))
-		return _write(fd, buf, count);
+		return _write_with_stats(fd, buf, count);
 
 	// If we have an existing partial sector, fill and write it
 	if (sec_buf_pos > 0) {
@@ -1129,14 +1323,14 @@ static int sector_write(int fd, const void* _buf, unsigned int count)
 		if (sec_buf_pos < sec_size)
 			return (int)count;
 		sec_buf_pos = 0;
-		written = _write(fd, sec_buf, sec_size);
+		written = _write_with_stats(fd, sec_buf, sec_size);
 		if (written != sec_size)
 			return written;
 	}
 
 	// Now write as many full sectors as we can
 	uint32_t sec_num = (count - fill_size) / sec_size;
-	written = _write(fd, &buf[fill_size], sec_num * sec_size);
+	written = _write_with_stats(fd, &buf[fill_size], sec_num * sec_size);
 	if (written < 0)
 		return written;
 	if (written != sec_num * sec_size) {
@@ -1158,139 +1352,597 @@ static int sector_write(int fd, const void* _buf, unsigned int count)
 	return (int)count;
 }
 
-/* Write an image file or zero a drive */
-static BOOL WriteDrive(HANDLE hPhysicalDrive, BOOL bZeroDrive)
+static void verify_progress(const uint64_t processed_bytes)
 {
-	BOOL s, ret = FALSE;
-	LARGE_INTEGER li;
-	HANDLE hSourceImage = INVALID_HANDLE_VALUE;
-	DWORD i, read_size[NUM_BUFFERS] = { 0 }, write_size, comp_size, buf_size;
-	uint64_t wb, target_size = bZeroDrive ? SelectedDrive.DiskSize : MIN((uint64_t)SelectedDrive.DiskSize, img_report.image_size);
-	uint64_t cur_value, last_value = 0;
-	int64_t bled_ret;
-	uint8_t* buffer = NULL;
-	uint32_t zero_data, *cmp_buffer = NULL;
-	char* vhd_path = NULL;
-	int throttle_fast_zeroing = 0, read_bufnum = 0, proc_bufnum = 1;
+	static uint64_t last_value = UINT64_MAX;
+	uint64_t cur_value;
 
-	if (SelectedDrive.SectorSize < 512) {
-		uprintf("Unexpected sector size (%d) - Aborting", SelectedDrive.SectorSize);
+	UpdateProgressWithInfo(OP_FORMAT, MSG_353, processed_bytes, img_report.image_size);
+	cur_value = (processed_bytes * min(80, img_report.image_size)) / img_report.image_size;
+	if (cur_value != last_value) {
+		last_value = cur_value;
+		uprintfs("+");
+	}
+}
+
+// Read 'size' bytes from the current position of the target and compare them
+// against 'buf'. 'size' must be a multiple of the sector size, but only the
+// first 'cmp_size' bytes are checked (for the trailing partial sector).
+static BOOL verify_sectors(int fd, const uint8_t* buf, uint32_t size, uint32_t cmp_size)
+{
+	int64_t offset = _lseeki64(fd, 0, SEEK_CUR);
+	size_t pos;
+
+	if (vfy_buf_size < size) {
+		safe_mm_free(vfy_buf);
+		vfy_buf_size = 0;
+		vfy_buf = (uint8_t*)_mm_malloc(size, SelectedDrive.SectorSize);
+		if (vfy_buf == NULL) {
+			ErrorStatus = RUFUS_ERROR(ERROR_NOT_ENOUGH_MEMORY);
+			uprintf("\r\nCould not allocate verification buffer");
+			return FALSE;
+		}
+		vfy_buf_size = size;
+	}
+	if ((offset < 0) || (_read(fd, vfy_buf, size) != (int)size)) {
+		uprintf("\r\nRead error: Could not read data for verification at offset 0x%llx", offset);
+		ErrorStatus = RUFUS_ERROR(ERROR_READ_FAULT);
+		return FALSE;
+	}
+	pos = mismatch_offset(buf, vfy_buf, cmp_size);
+	if (pos < cmp_size) {
+		uprintf("\r\nVerification error: Data mismatch at LBA %lld (offset 0x%llx)",
+			(offset + pos) / SelectedDrive.SectorSize, offset + pos);
+		ErrorStatus = RUFUS_ERROR(ERROR_WRITE_FAULT);
 		return FALSE;
 	}
+	return TRUE;
+}
+
+// Counterpart of sector_write() that compares the decompressed data against
+// what was written on the target rather than write it. Since we use the target's
+// file position, this also works for sparse images that seek around.
+static int sector_verify(int fd, const void* _buf, unsigned int count)
+{
+	const uint8_t* buf = (const uint8_t*)_buf;
+	unsigned int sec_size = (unsigned int)SelectedDrive.SectorSize;
+	unsigned int fill_size = 0, sec_num;
+
+	if (sec_size == 0)
+		sec_size = 512;
+	if_not_assert(sec_size <= 64 * KB)
+		return -1;
+	if_not_assert(count <= 1 * GB)
+		return -1;
+	vfy_fd = fd;
+
+	// Complete any partial sector left over from the previous call
+	if (sec_buf_pos > 0) {
+		if_not_assert(sec_size >= sec_buf_pos)
+			return -1;
+		fill_size = min(sec_size - sec_buf_pos, count);
+		memcpy(&sec_buf[sec_buf_pos], buf, fill_size);
+		sec_buf_pos += fill_size;
+		if (sec_buf_pos < sec_size)
+			return (int)count;
+		sec_buf_pos = 0;
+		if (!verify_sectors(fd, sec_buf, sec_size, sec_size))
+			return -1;
+	}
+
+	sec_num = (count - fill_size) / sec_size;
+	if ((sec_num != 0) && !verify_sectors(fd, &buf[fill_size], sec_num * sec_size, sec_num * sec_size))
+		return -1;
+
+	sec_buf_pos = count - fill_size - sec_num * sec_size;
+	if (sec_buf_pos != 0)
+		memcpy(sec_buf, &buf[fill_size + sec_num * sec_size], sec_buf_pos);
+	return (int)count;
+}
+
+/*
+ * Queue a device read for verification, on one of the asynchronous handles if we have them.
+ * Without these, the read is performed synchronously, when the slot is waited on.
+ */
+static BOOL SubmitVerifyRead(HANDLE hAsync, uint8_t* buf, uint64_t offset, DWORD size)
+{
+	if (hAsync == NULL)
+		return TRUE;
+	SetFileOffsetAsync(hAsync, offset);
+	return ReadFileAsync(hAsync, buf, size);
+}
+
+/* Read back the image we just wrote and compare it with the source */
+static BOOL VerifyDrive(HANDLE hPhysicalDrive, const char* path, uint64_t target_size)
+{
+	BOOL s, ret = FALSE, pending[VERIFY_QUEUE_DEPTH] = { 0 };
+	LARGE_INTEGER li;
+	HANDLE hSourceImage = INVALID_HANDLE_VALUE, hDevice[VERIFY_QUEUE_DEPTH] = { 0 };
+	DWORD read_size = 0, cmp_size = 0, buf_size, slot_size, slot_pos = 0, n, req_size[VERIFY_QUEUE_DEPTH] = { 0 };
+	uint64_t wb, cur_value, last_value = 0, io_start, dev_offset = 0;
+	int64_t bled_ret;
+	size_t pos, mpos;
+	char* physical_name = NULL;
+	uint8_t *buffer = NULL, *src, *dev_buf;
+	int i, slot = 0, read_bufnum = 0, proc_bufnum;
+	BOOL is_compressed = (img_report.compression_type != BLED_COMPRESSION_NONE &&
+		img_report.compression_type < BLED_COMPRESSION_MAX);
 
-	// We poked the MBR and other stuff, so we need to rewind
 	li.QuadPart = 0;
-	if (!SetFilePointerEx(hPhysicalDrive, li, NULL, FILE_BEGIN))
-		uprintf("Warning: Unable to rewind image position - wrong data might be copied!");
+	if (!SetFilePointerEx(hPhysicalDrive, li, NULL, FILE_BEGIN)) {
+		uprintf("Could not rewind device for verification: %s", WindowsErrorString());
+		return FALSE;
+	}
 	UpdateProgressWithInfoInit(NULL, FALSE);
+	uprintf("Verifying image:");
 
-	if (bZeroDrive) {
-		uprintf(fast_zeroing ? "Fast-zeroing drive:" : "Zeroing drive:");
-		// Our buffer size must be a multiple of the sector size and *ALIGNED* to the sector size
-		buf_size = ((DD_BUFFER_SIZE + SelectedDrive.SectorSize - 1) / SelectedDrive.SectorSize) * SelectedDrive.SectorSize;
-		buffer = (uint8_t*)_mm_malloc(buf_size, SelectedDrive.SectorSize);
-		if (buffer == NULL) {
+	if (is_compressed) {
+		// Have bled decode the source again, with a write function that compares instead of writing
+		hSourceImage = CreateFileU(path, GENERIC_READ, FILE_SHARE_READ, NULL,
+			OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+		if (hSourceImage == INVALID_HANDLE_VALUE) {
+			uprintf("Could not open image '%s': %s", path, WindowsErrorString());
+			ErrorStatus = RUFUS_ERROR(ERROR_OPEN_FAILED);
+			goto out;
+		}
+		sec_buf = (uint8_t*)_mm_malloc(SelectedDrive.SectorSize, SelectedDrive.SectorSize);
+		if (sec_buf == NULL) {
 			ErrorStatus = RUFUS_ERROR(ERROR_NOT_ENOUGH_MEMORY);
-			uprintf("Could not allocate disk zeroing buffer");
+			uprintf("Could not allocate verification buffer");
+			goto out;
+		}
+		sec_buf_pos = 0;
+		vfy_fd = -1;
+		bled_init(256 * KB, uprintf, NULL, sector_verify, verify_progress, NULL, &ErrorStatus);
+		bled_ret = bled_uncompress_with_handles(hSourceImage, hPhysicalDrive, img_report.compression_type);
+		bled_exit();
+		uprintfs("\r\n");
+		if (bled_ret < 0) {
+			if (!IS_ERROR(ErrorStatus))
+				ErrorStatus = RUFUS_ERROR(ERROR_READ_FAULT);
 			goto out;
 		}
-		if_not_assert((uintptr_t)buffer % SelectedDrive.SectorSize == 0)
+		// Same as WriteDrive(), the last partial sector was written as a full one
+		if ((sec_buf_pos != 0) && !verify_sectors(vfy_fd, sec_buf, SelectedDrive.SectorSize, sec_buf_pos))
 			goto out;
+		ret = TRUE;
+		goto out;
+	}
 
-		// Clear buffer
-		memset(buffer, fast_zeroing ? 0xff : 0x00, buf_size);
+	hSourceImage = CreateFileAsync(path, GENERIC_READ, FILE_SHARE_READ, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN);
+	if (hSourceImage == NULL) {
+		uprintf("Could not open image '%s': %s", path, WindowsErrorString());
+		ErrorStatus = RUFUS_ERROR(ERROR_OPEN_FAILED);
+		goto out;
+	}
 
-		if (fast_zeroing) {
-			cmp_buffer = (uint32_t*)_mm_malloc(buf_size, SelectedDrive.SectorSize);
-			if (cmp_buffer == NULL) {
-				ErrorStatus = RUFUS_ERROR(ERROR_NOT_ENOUGH_MEMORY);
-				uprintf("Could not allocate disk comparison buffer");
-				goto out;
+	// We use NUM_BUFFERS buffers for the asynchronous source reads, plus one that is split into
+	// VERIFY_QUEUE_DEPTH slots for the device, so that several device reads can be in flight.
+	buf_size = ((DD_BUFFER_SIZE + SelectedDrive.SectorSize - 1) / SelectedDrive.SectorSize) * SelectedDrive.SectorSize;
+	slot_size = (DWORD)HI_ALIGN_X_TO_Y(buf_size / VERIFY_QUEUE_DEPTH, SelectedDrive.SectorSize);
+	buffer = (uint8_t*)_mm_malloc(buf_size * NUM_BUFFERS + slot_size * VERIFY_QUEUE_DEPTH, SelectedDrive.SectorSize);
+	if (buffer == NULL) {
+		ErrorStatus = RUFUS_ERROR(ERROR_NOT_ENOUGH_MEMORY);
+		uprintf("Could not allocate verification buffer");
+		goto out;
+	}
+	dev_buf = &buffer[NUM_BUFFERS * buf_size];
+
+	// Each asynchronous handle can only have one request in flight, so we need one per slot.
+	// If we can't get them, we fall back to reading the device synchronously.
+	physical_name = GetPhysicalName(SelectedDrive.DeviceNumber);
+	for (i = 0; (physical_name != NULL) && (i < VERIFY_QUEUE_DEPTH); i++) {
+		hDevice[i] = CreateFileAsync(physical_name, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE,
+			OPEN_EXISTING, FILE_FLAG_NO_BUFFERING);
+		if (hDevice[i] == NULL) {
+			uprintf("Could not open '%s' for asynchronous verification: %s", physical_name, WindowsErrorString());
+			for (i = 0; i < VERIFY_QUEUE_DEPTH; i++) {
+				CloseFileAsync(hDevice[i]);
+				hDevice[i] = NULL;
 			}
-			if_not_assert((uintptr_t)cmp_buffer % SelectedDrive.SectorSize == 0)
-				goto out;
+			break;
 		}
+	}
+	safe_free(physical_name);
 
-		read_size[0] = buf_size;
-		for (wb = 0, write_size = 0; wb < target_size; wb += write_size) {
-			UpdateProgressWithInfo(OP_FORMAT, fast_zeroing ? MSG_306 : MSG_286, wb, target_size);
-			cur_value = (wb * 80) / target_size;
-			for (; cur_value > last_value && last_value < 80; last_value++)
-				uprintfs("+");
-			// Don't overflow our projected size (mostly for VHDs)
-			if (wb + read_size[0] > target_size)
-				read_size[0] = (DWORD)(target_size - wb);
-
-			// WriteFile fails unless the size is a multiple of sector size
-			if (read_size[0] % SelectedDrive.SectorSize != 0)
-				read_size[0] = ((read_size[0] + SelectedDrive.SectorSize - 1) / SelectedDrive.SectorSize) * SelectedDrive.SectorSize;
-
-			// Fast-zeroing: Depending on your hardware, reading from flash may be much faster than writing, so
-			// we might speed things up by skipping empty blocks, or skipping the write if the data is the same.
-			// Notes: A block is declared empty when all bits are either 0 (zeros) or 1 (flash block erased).
-			// Also, a back-off strategy is used to limit reading.
-			if (throttle_fast_zeroing) {
-				throttle_fast_zeroing--;
-			} else if (fast_zeroing) {
-				CHECK_FOR_USER_CANCEL;
+	// Queue the first device reads
+	for (i = 0; (i < VERIFY_QUEUE_DEPTH) && (dev_offset < target_size); i++, dev_offset += slot_size) {
+		req_size[i] = (DWORD)MIN(slot_size, HI_ALIGN_X_TO_Y(target_size - dev_offset, SelectedDrive.SectorSize));
+		pending[i] = SubmitVerifyRead(hDevice[i], &dev_buf[i * slot_size], dev_offset, req_size[i]);
+		if (!pending[i]) {
+			uprintf("Read error: Could not read data for verification at sector %lld - %s",
+				dev_offset / SelectedDrive.SectorSize, WindowsErrorString());
+			ErrorStatus = RUFUS_ERROR(ERROR_READ_FAULT);
+			goto out;
+		}
+	}
 
-				// Read block and compare against the block that needs to be written
-				s = ReadFile(hPhysicalDrive, cmp_buffer, read_size[0], &comp_size, NULL);
-				if ((!s) || (comp_size != read_size[0])) {
-					uprintf("\r\nRead error: Could not read data for fast zeroing comparison - %s", WindowsErrorString());
-					goto out;
-				}
+	// Read the source ahead, while we read and compare the data from the device
+	ReadFileAsync(hSourceImage, &buffer[read_bufnum * buf_size], (DWORD)MIN(buf_size, target_size));
+	for (wb = 0; wb < target_size; wb += read_size) {
+		UpdateProgressWithInfo(OP_FORMAT, MSG_353, wb, target_size);
+		cur_value = (wb * 80) / target_size;
+		for ( ; cur_value > last_value && last_value < 80; last_value++)
+			uprintfs("+");
 
-				// Check for an empty block by comparing with the first element
-				zero_data = cmp_buffer[0];
-				// Check all bits are the same
-				if ((zero_data == 0) || (zero_data == 0xffffffff)) {
-					// Compare the rest of the block against the first element
-					for (i = 1; (i < read_size[0] / sizeof(uint32_t)) && (cmp_buffer[i] == zero_data); i++);
-					if (i >= read_size[0] / sizeof(uint32_t)) {
-						// Block is empty, skip write
-						write_size = read_size[0];
-						continue;
-					}
-				}
+		io_start = IoStatsNow();
+		if ((!WaitFileAsync(hSourceImage, DRIVE_ACCESS_TIMEOUT)) ||
+			(!GetSizeAsync(hSourceImage, &read_size))) {
+			uprintf("\r\nRead error: %s", WindowsErrorString());
+			ErrorStatus = RUFUS_ERROR(ERROR_READ_FAULT);
+			goto out;
+		}
+		IoStatsAdd(IOSTAT_READ, read_size, io_start);
+		if (read_size == 0)
+			break;
+		proc_bufnum = read_bufnum;
+		read_bufnum = (read_bufnum + 1) % NUM_BUFFERS;
+		if (wb + read_size < target_size)
+			ReadFileAsync(hSourceImage, &buffer[read_bufnum * buf_size], (DWORD)MIN(buf_size, target_size - (wb + read_size)));
 
-				// Move the file pointer position back for writing
-				li.QuadPart = wb;
-				if (!SetFilePointerEx(hPhysicalDrive, li, NULL, FILE_BEGIN)) {
-					uprintf("\r\nError: Could not reset position - %s", WindowsErrorString());
+		CHECK_FOR_USER_CANCEL;
+		// The device reads don't have to line up with the source ones, so compare slot by slot
+		src = &buffer[proc_bufnum * buf_size];
+		for (pos = 0; pos < read_size; pos += n) {
+			if (slot_pos == 0) {
+				io_start = IoStatsNow();
+				if (hDevice[slot] == NULL)
+					s = ReadFile(hPhysicalDrive, &dev_buf[slot * slot_size], req_size[slot], &cmp_size, NULL);
+				else
+					s = WaitFileAsync(hDevice[slot], DRIVE_ACCESS_TIMEOUT) && GetSizeAsync(hDevice[slot], &cmp_size);
+				pending[slot] = FALSE;
+				IoStatsAdd(IOSTAT_READ, s ? cmp_size : 0, io_start);
+				if ((!s) || (cmp_size != req_size[slot])) {
+					uprintf("\r\nRead error: Could not read data for verification at sector %lld - %s",
+						(wb + pos) / SelectedDrive.SectorSize, WindowsErrorString());
+					ErrorStatus = RUFUS_ERROR(ERROR_READ_FAULT);
 					goto out;
 				}
-				// Throttle read operations
-				throttle_fast_zeroing = 15;
 			}
+			// Only compare the actual image data, since the padding of the last sector is undefined
+			n = (DWORD)MIN(read_size - pos, req_size[slot] - slot_pos);
+			mpos = mismatch_offset(&src[pos], &dev_buf[slot * slot_size + slot_pos], n);
+			if (mpos < n) {
+				uprintf("\r\nVerification error: Data mismatch at LBA %lld (offset 0x%llx)",
+					(wb + pos + mpos) / SelectedDrive.SectorSize, wb + pos + mpos);
+				ErrorStatus = RUFUS_ERROR(ERROR_WRITE_FAULT);
+				goto out;
+			}
+			slot_pos += n;
+			if (slot_pos < req_size[slot])
+				continue;
+			// This slot has been compared, so reuse it for the next device read
+			slot_pos = 0;
+			if (dev_offset < target_size) {
+				req_size[slot] = (DWORD)MIN(slot_size, HI_ALIGN_X_TO_Y(target_size - dev_offset, SelectedDrive.SectorSize));
+				pending[slot] = SubmitVerifyRead(hDevice[slot], &dev_buf[slot * slot_size], dev_offset, req_size[slot]);
+				if (!pending[slot]) {
+					uprintf("\r\nRead error: Could not read data for verification at sector %lld - %s",
+						dev_offset / SelectedDrive.SectorSize, WindowsErrorString());
+					ErrorStatus = RUFUS_ERROR(ERROR_READ_FAULT);
+					goto out;
+				}
+				dev_offset += slot_size;
+			}
+			slot = (slot + 1) % VERIFY_QUEUE_DEPTH;
+		}
+	}
+	uprintfs("\r\n");
+	ret = TRUE;
 
-			for (i = 1; i <= WRITE_RETRIES; i++) {
-				CHECK_FOR_USER_CANCEL;
-				s = WriteFile(hPhysicalDrive, buffer, read_size[0], &write_size, NULL);
-				if ((s) && (write_size == read_size[0]))
-					break;
-				if (s)
-					uprintf("\r\nWrite error: Wrote %d bytes, expected %d bytes", write_size, read_size[0]);
-				else
-					uprintf("\r\nWrite error at sector %lld: %s", wb / SelectedDrive.SectorSize, WindowsErrorString());
-				if (i < WRITE_RETRIES) {
-					li.QuadPart = wb;
-					uprintf("Retrying in %d seconds...", WRITE_TIMEOUT / 1000);
-					Sleep(WRITE_TIMEOUT);
-					if (!SetFilePointerEx(hPhysicalDrive, li, NULL, FILE_BEGIN)) {
-						uprintf("Write error: Could not reset position - %s", WindowsErrorString());
-						goto out;
-					}
-				} else {
-					ErrorStatus = RUFUS_ERROR(ERROR_WRITE_FAULT);
+out:
+	if (is_compressed) {
+		safe_closehandle(hSourceImage);
+	} else if ((hSourceImage != NULL) && (hSourceImage != INVALID_HANDLE_VALUE)) {
+		// Don't release the buffers while a read-ahead may still be in progress
+		WaitFileAsync(hSourceImage, DRIVE_ACCESS_TIMEOUT);
+		CloseFileAsync(hSourceImage);
+	}
+	for (i = 0; i < VERIFY_QUEUE_DEPTH; i++) {
+		if (pending[i] && (hDevice[i] != NULL))
+			WaitFileAsync(hDevice[i], DRIVE_ACCESS_TIMEOUT);
+		CloseFileAsync(hDevice[i]);
+	}
+	safe_mm_free(sec_buf);
+	safe_mm_free(vfy_buf);
+	vfy_buf_size = 0;
+	safe_mm_free(buffer);
+	if (ret)
+		uprintf("Verification completed successfully");
+	else if (SCODE_CODE(ErrorStatus) != ERROR_CANCELLED)
+		uprintf("Verification failed!");
+	return ret;
+}
+
+// Write a block to the target, retrying on failure
+static BOOL WriteBlock(BLOCK_DEVICE* dev, const uint8_t* buf, uint64_t offset, DWORD size)
+{
+	BOOL s;
+	DWORD i, write_size;
+	uint64_t io_start;
+
+	for (i = 1; i <= WRITE_RETRIES; i++) {
+		if (IS_ERROR(ErrorStatus) && (SCODE_CODE(ErrorStatus) == ERROR_CANCELLED))
+			return FALSE;
+		if (i > 1)
+			IoStatsRetry();
+		io_start = IoStatsNow();
+		s = BdWrite(dev, buf, offset, size, &write_size);
+		IoStatsAdd(IOSTAT_WRITE, s ? write_size : 0, io_start);
+		if ((s) && (write_size == size))
+			return TRUE;
+		if (s)
+			uprintf("\r\nWrite error: Wrote %d bytes, expected %d bytes", write_size, size);
+		else
+			uprintf("\r\nWrite error at sector %lld: %s", offset / dev->SectorSize, WindowsErrorString());
+		if (i < WRITE_RETRIES) {
+			uprintf("Retrying in %d seconds...", WRITE_TIMEOUT / 1000);
+			Sleep(WRITE_TIMEOUT);
+		}
+		Sleep(200);
+	}
+	ErrorStatus = RUFUS_ERROR(ERROR_WRITE_FAULT);
+	return FALSE;
+}
+
+// Write the [start, end[ range of the data from a compressed image that we can seek into
+static BOOL WriteSeekable(BLOCK_DEVICE* dev, bled_seekable_t* seekable, uint8_t* buffer, DWORD buf_size,
+	uint64_t start, uint64_t end)
+{
+	DWORD size;
+	int64_t read_size;
+	uint64_t wb;
+
+	for (wb = start; wb < end; wb += size) {
+		update_progress(wb);
+		if (IS_ERROR(ErrorStatus))
+			return FALSE;
+		read_size = bled_pread(seekable, wb, buffer, (size_t)MIN(buf_size, end - wb));
+		if (read_size <= 0) {
+			uprintf("\r\nCould not decompress image data at offset 0x%llx", wb);
+			if (!IS_ERROR(ErrorStatus))
+				ErrorStatus = RUFUS_ERROR(ERROR_READ_FAULT);
+			return FALSE;
+		}
+		// Writes fail unless the size is a multiple of sector size
+		size = (DWORD)HI_ALIGN_X_TO_Y(read_size, dev->SectorSize);
+		memset(&buffer[read_size], 0, size - (DWORD)read_size);
+		if (!WriteBlock(dev, buffer, wb, size))
+			return FALSE;
+		UpdateCheckpoint(buffer, wb, size);
+	}
+	return TRUE;
+}
+
+/* Zero the first target_size bytes of a device, or only the blocks that aren't blank when fast-zeroing */
+static BOOL ZeroBlockDevice(BLOCK_DEVICE* dev, BOOL bFast, uint64_t target_size)
+{
+	BOOL s, probe, blank, read_ahead, pending = FALSE, ret = FALSE;
+	DWORD size, comp_size, buf_size;
+	uint64_t wb, cur_value, last_value = 0;
+	uint64_t read_time = 0, write_time = 0, io_start;
+	uint8_t *buffer = NULL, *cmp_buffer = NULL;
+	int blind_blocks = 0, backoff = 1, max_backoff;
+
+	uprintf(bFast ? "Fast-zeroing drive:" : "Zeroing drive:");
+	// Our buffer size must be a multiple of the sector size and *ALIGNED* to the sector size
+	buf_size = ((DD_BUFFER_SIZE + dev->SectorSize - 1) / dev->SectorSize) * dev->SectorSize;
+	buffer = (uint8_t*)_mm_malloc(buf_size, dev->SectorSize);
+	if (buffer == NULL) {
+		ErrorStatus = RUFUS_ERROR(ERROR_NOT_ENOUGH_MEMORY);
+		uprintf("Could not allocate disk zeroing buffer");
+		goto out;
+	}
+	if_not_assert((uintptr_t)buffer % dev->SectorSize == 0)
+		goto out;
+
+	// Clear buffer
+	memset(buffer, bFast ? 0xff : 0x00, buf_size);
+
+	if (bFast) {
+		cmp_buffer = (uint8_t*)_mm_malloc(buf_size, dev->SectorSize);
+		if (cmp_buffer == NULL) {
+			ErrorStatus = RUFUS_ERROR(ERROR_NOT_ENOUGH_MEMORY);
+			uprintf("Could not allocate disk comparison buffer");
+			goto out;
+		}
+		if_not_assert((uintptr_t)cmp_buffer % dev->SectorSize == 0)
+			goto out;
+	}
+
+	// Fast-zeroing: Depending on your hardware, reading from flash may be much faster than writing, so
+	// we might speed things up by skipping empty blocks, or skipping the write if the data is the same.
+	// Notes: A block is declared empty when all bits are either 0 (zeros) or 1 (flash block erased).
+	// Also, once we find a block that isn't empty, we write the next ones without checking them, for
+	// a number of blocks that doubles on each consecutive non empty block we find, up to a maximum
+	// that depends on how long we wait for reads, relative to how long writes take.
+	// The next block we want to check is submitted as an asynchronous read, so that it can be read
+	// while the current one is being written, and we fall back to synchronous reads if that fails.
+	probe = bFast;
+	read_ahead = bFast;
+	if (probe)
+		pending = BdSubmit(dev, FALSE, cmp_buffer, 0, (DWORD)HI_ALIGN_X_TO_Y(MIN(buf_size, target_size), dev->SectorSize));
+	for (wb = 0, size = 0; wb < target_size; wb += size) {
+		UpdateProgressWithInfo(OP_FORMAT, bFast ? MSG_306 : MSG_286, wb, target_size);
+		cur_value = (wb * 80) / target_size;
+		for (; cur_value > last_value && last_value < 80; last_value++)
+			uprintfs("+");
+		// Don't overflow our projected size (mostly for VHDs), and make sure that the
+		// size is a multiple of the sector size, as writes fail otherwise
+		size = (DWORD)HI_ALIGN_X_TO_Y(MIN(buf_size, target_size - wb), dev->SectorSize);
+		CHECK_FOR_USER_CANCEL;
+
+		blank = FALSE;
+		if (probe) {
+			// Read block and compare against the block that needs to be written
+			io_start = IoStatsNow();
+			s = FALSE;
+			if (pending) {
+				s = BdComplete(dev, DRIVE_ACCESS_TIMEOUT, &comp_size);
+				if (!s && (GetLastError() == ERROR_TIMEOUT)) {
+					uprintf("\r\nRead error: Timeout while reading data for fast zeroing comparison");
 					goto out;
 				}
-				Sleep(200);
+				pending = FALSE;
+				if (!s || (comp_size != size)) {
+					uprintf("\r\nCould not use read-ahead for fast zeroing: %s", WindowsErrorString());
+					read_ahead = FALSE;
+					s = FALSE;
+				}
 			}
-			if (i > WRITE_RETRIES)
+			if (!s)
+				s = BdRead(dev, cmp_buffer, wb, size, &comp_size);
+			if ((!s) || (comp_size != size)) {
+				uprintf("\r\nRead error: Could not read data for fast zeroing comparison - %s", WindowsErrorString());
 				goto out;
+			}
+			IoStatsAdd(IOSTAT_READ, comp_size, io_start);
+			// Keep the averages in microseconds, as reads and writes often complete in less than 1 ms
+			read_time = (3 * read_time + (IoStatsNow() - io_start)) / 4;
+			blank = is_blank_buffer(cmp_buffer, size);
+			if (blank) {
+				// Block is empty, skip write
+				backoff = 1;
+			} else {
+				blind_blocks = backoff;
+				max_backoff = (int)(1 + (FAST_ZEROING_MAX_BACKOFF - 1) * read_time / MAX(read_time + write_time, 1));
+				backoff = MIN(2 * backoff, max_backoff);
+			}
+		} else if (blind_blocks > 0) {
+			blind_blocks--;
 		}
-		uprintfs("\r\n");
+
+		// Start reading the next block we want to check, while we write this one
+		probe = bFast && (blind_blocks == 0);
+		if (probe && read_ahead && (wb + size < target_size))
+			pending = BdSubmit(dev, FALSE, cmp_buffer, wb + size,
+				(DWORD)HI_ALIGN_X_TO_Y(MIN(buf_size, target_size - wb - size), dev->SectorSize));
+		if (blank)
+			continue;
+
+		io_start = IoStatsNow();
+		if (!WriteBlock(dev, buffer, wb, size))
+			goto out;
+		write_time = (3 * write_time + (IoStatsNow() - io_start)) / 4;
+	}
+	uprintfs("\r\n");
+	ret = TRUE;
+
+out:
+	// Don't release the comparison buffer while a read-ahead may still be in progress
+	if (pending)
+		BdComplete(dev, DRIVE_ACCESS_TIMEOUT, &comp_size);
+	safe_mm_free(buffer);
+	safe_mm_free(cmp_buffer);
+	return ret;
+}
+
+/* Write the [start, target_size[ range of an uncompressed image, reading the next buffer while we write the current one */
+static BOOL WriteImageData(BLOCK_DEVICE* dev, HANDLE hSourceImage, uint8_t* buffer, DWORD buf_size,
+	uint64_t start, uint64_t target_size)
+{
+	DWORD read_size[NUM_BUFFERS] = { 0 };
+	uint64_t wb, cur_value, last_value = 0, io_start;
+	int read_bufnum = 0, proc_bufnum = 1;
+
+	SetFileOffsetAsync(hSourceImage, start);
+
+	// Start the initial read
+	ReadFileAsync(hSourceImage, &buffer[read_bufnum * buf_size], (DWORD)MIN(buf_size, target_size - start));
+
+	read_size[proc_bufnum] = 1;	// To avoid early loop exit
+	for (wb = start; read_size[proc_bufnum] != 0; wb += read_size[proc_bufnum]) {
+		// 0. Update the progress
+		UpdateProgressWithInfo(OP_FORMAT, MSG_261, wb, target_size);
+		cur_value = (wb * 80) / target_size;
+		for ( ; cur_value > last_value && last_value < 80; last_value++)
+			uprintfs("+");
+
+		if (wb >= target_size)
+			break;
+
+		// 1. Wait for the current read operation to complete (and update the read size)
+		io_start = IoStatsNow();
+		if ((!WaitFileAsync(hSourceImage, DRIVE_ACCESS_TIMEOUT)) ||
+			(!GetSizeAsync(hSourceImage, &read_size[read_bufnum]))) {
+			uprintf("\r\nRead error: %s", WindowsErrorString());
+			ErrorStatus = RUFUS_ERROR(ERROR_READ_FAULT);
+			return FALSE;
+		}
+		IoStatsAdd(IOSTAT_READ, read_size[read_bufnum], io_start);
+
+		// 2. Writes fail unless the size is a multiple of sector size
+		if (read_size[read_bufnum] % dev->SectorSize != 0) {
+			if_not_assert(HI_ALIGN_X_TO_Y(read_size[read_bufnum], dev->SectorSize) <= buf_size)
+				return FALSE;
+			read_size[read_bufnum] = HI_ALIGN_X_TO_Y(read_size[read_bufnum], dev->SectorSize);
+		}
+
+		// 3. Switch to the next reading buffer
+		proc_bufnum = read_bufnum;
+		read_bufnum = (read_bufnum + 1) % NUM_BUFFERS;
+
+		// 3. Launch the next asynchronous read operation
+		// It is VERY IMPORTANT here that we don't attempt to read past the source
+		// or target sizes, as mounted VHDs will SCREW YOU if you attempt to do so
+		// and will even start returning ERRONEOUS DATA for sectors before the end
+		// of the disk... So we make sure to adjust the size not to ever overflow.
+		// Also we need to make sure we add read_size[proc_bufnum] to wb since we
+		// have already read the data and are about to write it.
+		ReadFileAsync(hSourceImage, &buffer[read_bufnum * buf_size], (DWORD)MIN(buf_size, target_size - (wb + read_size[proc_bufnum])));
+
+		// 4. Synchronously write the current data buffer
+		if (!WriteBlock(dev, &buffer[proc_bufnum * buf_size], wb, read_size[proc_bufnum]))
+			return FALSE;
+		UpdateCheckpoint(&buffer[proc_bufnum * buf_size], wb, read_size[proc_bufnum]);
+	}
+	uprintfs("\r\n");
+	return TRUE;
+}
+
+/* Write an image file or zero a drive */
+static BOOL WriteDrive(HANDLE hPhysicalDrive, BOOL bZeroDrive)
+{
+	BOOL ret = FALSE;
+	LARGE_INTEGER li;
+	HANDLE hSourceImage = INVALID_HANDLE_VALUE;
+	DWORD read_size, write_size, buf_size;
+	uint64_t target_size = bZeroDrive ? SelectedDrive.DiskSize : MIN((uint64_t)SelectedDrive.DiskSize, img_report.image_size);
+	uint64_t resume_offset = 0, io_start;
+	int64_t bled_ret;
+	bled_seekable_t* seekable = NULL;
+	uint8_t *buffer = NULL;
+	char *vhd_path = NULL, *physical_name = NULL;
+	BLOCK_DEVICE* dev = NULL;
+
+	if (SelectedDrive.SectorSize < 512) {
+		uprintf("Unexpected sector size (%d) - Aborting", SelectedDrive.SectorSize);
+		return FALSE;
+	}
+
+	memset(&ckp, 0, sizeof(ckp));
+
+	// When fast-zeroing, use a separate handle for the comparison reads, so that the next block we want
+	// to check can be read while the current one is being written.
+	if (bZeroDrive && fast_zeroing)
+		physical_name = GetPhysicalName(SelectedDrive.DeviceNumber);
+	dev = BdOpenHandle(hPhysicalDrive, physical_name, SelectedDrive.SectorSize, SelectedDrive.DiskSize);
+	safe_free(physical_name);
+	if (dev == NULL) {
+		uprintf("Could not access drive: %s", WindowsErrorString());
+		ErrorStatus = RUFUS_ERROR(ERROR_OPEN_FAILED);
+		return FALSE;
+	}
+
+	// We poked the MBR and other stuff, so we need to rewind
+	li.QuadPart = 0;
+	if (!SetFilePointerEx(hPhysicalDrive, li, NULL, FILE_BEGIN))
+		uprintf("Warning: Unable to rewind image position - wrong data might be copied!");
+	UpdateProgressWithInfoInit(NULL, FALSE);
+
+	if (bZeroDrive) {
+		if (!ZeroBlockDevice(dev, fast_zeroing, target_size))
+			goto out;
 	} else if (img_report.compression_type != BLED_COMPRESSION_NONE && img_report.compression_type < BLED_COMPRESSION_MAX) {
 		uprintf("Writing compressed image:");
 		hSourceImage = CreateFileU(image_path, GENERIC_READ, FILE_SHARE_READ, NULL,
@@ -1309,9 +1961,38 @@ static BOOL WriteDrive(HANDLE hPhysicalDrive, BOOL bZeroDrive)
 		if_not_assert((uintptr_t)sec_buf% SelectedDrive.SectorSize == 0)
 			goto out;
 		sec_buf_pos = 0;
+		sector_write_time = 0;
+		io_start = IoStatsNow();
 		bled_init(256 * KB, uprintf, NULL, sector_write, update_progress, NULL, &ErrorStatus);
-		bled_ret = bled_uncompress_with_handles(hSourceImage, hPhysicalDrive, img_report.compression_type);
+		// Only images that we can decompress from any offset can resume an interrupted write
+		if (img_report.compression_type == BLED_COMPRESSION_XZ || img_report.compression_type == BLED_COMPRESSION_ZSTD)
+			seekable = bled_open_seekable(image_path, img_report.compression_type);
+		if (seekable != NULL) {
+			target_size = MIN(target_size, bled_seekable_size(seekable));
+			buf_size = ((DD_BUFFER_SIZE + SelectedDrive.SectorSize - 1) / SelectedDrive.SectorSize) * SelectedDrive.SectorSize;
+			buffer = (uint8_t*)_mm_malloc(buf_size, SelectedDrive.SectorSize);
+			if (buffer != NULL) {
+				InitCheckpoints(hPhysicalDrive);
+				resume_offset = GetResumeOffset(dev, buffer, buf_size, target_size);
+			}
+		}
+		if (resume_offset != 0) {
+			// Partitioning the drive altered its first sectors, so we need to write them again
+			bled_ret = (WriteSeekable(dev, seekable, buffer, buf_size, 0, MIN(CHECKPOINT_HEAD_SIZE, resume_offset)) &&
+				WriteSeekable(dev, seekable, buffer, buf_size, resume_offset, target_size)) ? target_size : -1;
+		} else {
+			safe_mm_free(buffer);
+			li.QuadPart = 0;
+			if (SetFilePointerEx(hPhysicalDrive, li, NULL, FILE_BEGIN))
+				bled_ret = bled_uncompress_with_handles(hSourceImage, hPhysicalDrive, img_report.compression_type);
+			else
+				bled_ret = -1;
+		}
+		bled_close_seekable(seekable);
 		bled_exit();
+		// Whatever wasn't spent writing went into reading and decompressing the source
+		if ((io_start != 0) && (resume_offset == 0))
+			IoStatsAdd(IOSTAT_CPU, (bled_ret > 0) ? bled_ret : 0, io_start + sector_write_time);
 		uprintfs("\r\n");
 		if ((bled_ret >= 0) && (sec_buf_pos != 0)) {
 			// A disk image that doesn't end up on disk boundary should be a rare
@@ -1359,92 +2040,153 @@ static BOOL WriteDrive(HANDLE hPhysicalDrive, BOOL bZeroDrive)
 		if_not_assert((uintptr_t)buffer% SelectedDrive.SectorSize == 0)
 			goto out;
 
-		// Start the initial read
-		ReadFileAsync(hSourceImage, &buffer[read_bufnum * buf_size], (DWORD)MIN(buf_size, target_size));
-
-		read_size[proc_bufnum] = 1;	// To avoid early loop exit
-		for (wb = 0; read_size[proc_bufnum] != 0; wb += read_size[proc_bufnum]) {
-			// 0. Update the progress
-			UpdateProgressWithInfo(OP_FORMAT, MSG_261, wb, target_size);
-			cur_value = (wb * 80) / target_size;
-			for ( ; cur_value > last_value && last_value < 80; last_value++)
-				uprintfs("+");
-
-			if (wb >= target_size)
-				break;
-
-			// 1. Wait for the current read operation to complete (and update the read size)
-			if ((!WaitFileAsync(hSourceImage, DRIVE_ACCESS_TIMEOUT)) ||
-				(!GetSizeAsync(hSourceImage, &read_size[read_bufnum]))) {
-				uprintf("\r\nRead error: %s", WindowsErrorString());
+		InitCheckpoints(hPhysicalDrive);
+		resume_offset = GetResumeOffset(dev, buffer, buf_size, target_size);
+		if (resume_offset != 0) {
+			// Partitioning the drive altered its first sectors, so we need to write them again
+			read_size = (DWORD)MIN(CHECKPOINT_HEAD_SIZE, resume_offset);
+			SetFileOffsetAsync(hSourceImage, 0);
+			if (!ReadFileAsync(hSourceImage, buffer, read_size) || !WaitFileAsync(hSourceImage, DRIVE_ACCESS_TIMEOUT) ||
+				!GetSizeAsync(hSourceImage, &write_size) || (write_size != read_size)) {
+				uprintf("Read error: %s", WindowsErrorString());
 				ErrorStatus = RUFUS_ERROR(ERROR_READ_FAULT);
 				goto out;
 			}
-
-
-			// 2. WriteFile fails unless the size is a multiple of sector size
-			if (read_size[read_bufnum] % SelectedDrive.SectorSize != 0) {
-				if_not_assert(HI_ALIGN_X_TO_Y(read_size[read_bufnum], SelectedDrive.SectorSize) <= buf_size)
-					goto out;
-				read_size[read_bufnum] = HI_ALIGN_X_TO_Y(read_size[read_bufnum], SelectedDrive.SectorSize);
-			}
-
-			// 3. Switch to the next reading buffer
-			proc_bufnum = read_bufnum;
-			read_bufnum = (read_bufnum + 1) % NUM_BUFFERS;
-
-			// 3. Launch the next asynchronous read operation
-			// It is VERY IMPORTANT here that we don't attempt to read past the source
-			// or target sizes, as mounted VHDs will SCREW YOU if you attempt to do so
-			// and will even start returning ERRONEOUS DATA for sectors before the end
-			// of the disk... So we make sure to adjust the size not to ever overflow.
-			// Also we need to make sure we add read_size[proc_bufnum] to wb since we
-			// have already read the data and are about to write it.
-			ReadFileAsync(hSourceImage, &buffer[read_bufnum * buf_size], (DWORD)MIN(buf_size, target_size - (wb + read_size[proc_bufnum])));
-
-			// 4. Synchronously write the current data buffer
-			for (i = 1; i <= WRITE_RETRIES; i++) {
-				CHECK_FOR_USER_CANCEL;
-				s = WriteFile(hPhysicalDrive, &buffer[proc_bufnum * buf_size], read_size[proc_bufnum], &write_size, NULL);
-				if ((s) && (write_size == read_size[proc_bufnum]))
-					break;
-				if (s)
-					uprintf("\r\nWrite error: Wrote %d bytes, expected %d bytes", write_size, read_size[proc_bufnum]);
-				else
-					uprintf("\r\nWrite error at sector %lld: %s", wb / SelectedDrive.SectorSize, WindowsErrorString());
-				if (i < WRITE_RETRIES) {
-					li.QuadPart = wb;
-					uprintf("Retrying in %d seconds...", WRITE_TIMEOUT / 1000);
-					Sleep(WRITE_TIMEOUT);
-					if (!SetFilePointerEx(hPhysicalDrive, li, NULL, FILE_BEGIN)) {
-						uprintf("Write error: Could not reset position - %s", WindowsErrorString());
-						goto out;
-					}
-				} else {
-					ErrorStatus = RUFUS_ERROR(ERROR_WRITE_FAULT);
-					goto out;
-				}
-				Sleep(200);
-			}
-			if (i > WRITE_RETRIES)
+			if (!WriteBlock(dev, buffer, 0, read_size))
 				goto out;
 		}
-		uprintfs("\r\n");
+		if (!WriteImageData(dev, hSourceImage, buffer, buf_size, resume_offset, target_size))
+			goto out;
 	}
+	// The write completed, so we no longer need to be able to resume it
+	ckp.enabled = FALSE;
+	if ((ckp.path[0] != 0) && !IS_ERROR(ErrorStatus))
+		DeleteFileU(ckp.path);
+	if (!bZeroDrive && verify_write && !VerifyDrive(hPhysicalDrive, (vhd_path != NULL) ? vhd_path : image_path, target_size))
+		goto out;
 	RefreshDriveLayout(hPhysicalDrive);
 	ret = TRUE;
 out:
+	ckp.enabled = FALSE;
 	if (img_report.compression_type != BLED_COMPRESSION_NONE && img_report.compression_type < BLED_COMPRESSION_MAX)
 		safe_closehandle(hSourceImage);
 	else
 		CloseFileAsync(hSourceImage);
 	if (vhd_path != NULL)
 		VhdUnmountImage();
+	BdClose(dev);
 	safe_mm_free(buffer);
-	safe_mm_free(cmp_buffer);
 	return ret;
 }
 
+#if defined(_DEBUG) || defined(TEST) || defined(ALPHA)
+#define BENCH_DEVICE_SIZE   (64 * MB)
+#define BENCH_BLOCK_SIZE    (1 * MB)
+extern const BLOCK_DEVICE_PROFILE* nt_io_throttle;
+
+/* Create an image, with every other block left blank, for the image write benchmark */
+static BOOL CreateBenchmarkImage(const char* path, uint8_t* buf)
+{
+	BLOCK_DEVICE* dev = BdOpenImage(path, TRUE, 512, BENCH_DEVICE_SIZE);
+	uint64_t offset;
+	DWORD size;
+	BOOL r = (dev != NULL);
+
+	for (offset = 0; r && (offset < BENCH_DEVICE_SIZE); offset += BENCH_BLOCK_SIZE) {
+		memset(buf, ((offset / BENCH_BLOCK_SIZE) % 2) ? 0x00 : 0x5a, BENCH_BLOCK_SIZE);
+		r = BdWrite(dev, buf, offset, BENCH_BLOCK_SIZE, &size) && (size == BENCH_BLOCK_SIZE);
+	}
+	BdClose(dev);
+	return r;
+}
+
+/* Run the image writing, zeroing and ext formatting engines against an image file and simulated flash drives */
+int BenchmarkBlockDevices(void)
+{
+	const struct {
+		const char* name;
+		BLOCK_DEVICE_PROFILE profile;
+	} device[] = {
+		{ "image file", { 0, 0, 0, 0, 0 } },
+		{ "USB 2.0 flash", { 1000, 2000, 30 * MB, 10 * MB, 4 * MB } },
+		{ "USB 3.0 flash", { 200, 500, 200 * MB, 60 * MB, 4 * MB } },
+	};
+	const char* engine[] = { "image write", "fast zeroing", "zeroing", "ext3 format" };
+	char src_path[MAX_PATH] = "", path[MAX_PATH] = "", nt_path[MAX_PATH + 4];
+	uint8_t* buf = NULL;
+	uint64_t start;
+	HANDLE hSourceImage;
+	BLOCK_DEVICE* dev;
+	BOOL r;
+	int i, j, errors = 0;
+
+	if ((GetTempFileNameU(temp_dir, APPLICATION_NAME, 0, src_path) == 0) ||
+		(GetTempFileNameU(temp_dir, APPLICATION_NAME, 0, path) == 0))
+		goto out;
+	static_sprintf(nt_path, "\\??\\%s", path);
+	buf = _mm_malloc(NUM_BUFFERS * BENCH_BLOCK_SIZE, 4 * KB);
+	if ((buf == NULL) || !CreateBenchmarkImage(src_path, buf)) {
+		errors++;
+		goto out;
+	}
+
+	for (i = 0; i < ARRAYSIZE(device); i++) {
+		for (j = 0; j < ARRAYSIZE(engine); j++) {
+			// nt_io can't open a path with spaces, since it uses them to separate the offset and size
+			if ((j == 3) && (strchr(path, ' ') != NULL))
+				continue;
+			ErrorStatus = 0;
+			dev = BdOpenImage(path, (j == 0), 512, BENCH_DEVICE_SIZE);
+			if ((dev != NULL) && (i != 0))
+				dev = BdOpenThrottled(dev, &device[i].profile);
+			if (dev == NULL) {
+				errors++;
+				continue;
+			}
+			start = GetTickCount64();
+			switch (j) {
+			case 0:
+				hSourceImage = CreateFileAsync(src_path, GENERIC_READ, FILE_SHARE_READ, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN);
+				r = (hSourceImage != NULL) && WriteImageData(dev, hSourceImage, buf, BENCH_BLOCK_SIZE, 0, dev->Size);
+				CloseFileAsync(hSourceImage);
+				break;
+			case 1:
+			case 2:
+				r = ZeroBlockDevice(dev, (j == 1), dev->Size);
+				break;
+			default:
+				// libext2fs opens the volume by name, so leave the image to it
+				BdClose(dev);
+				dev = NULL;
+				nt_io_throttle = (i != 0) ? &device[i].profile : NULL;
+				r = FormatExtVolume(nt_path, 0, FileSystemLabel[FS_EXT3], "bench", FP_QUICK);
+				nt_io_throttle = NULL;
+				break;
+			}
+			r = r && ((dev == NULL) || BdFlush(dev));
+			BdClose(dev);
+			if (!r) {
+				uprintf("%s on %s: FAILED (%s)", engine[j], device[i].name, WindowsErrorString());
+				errors++;
+				continue;
+			}
+			start = MAX(GetTickCount64() - start, 1);
+			uprintf("%s on %s: %lld ms (%.1f MB/s)", engine[j], device[i].name, start,
+				(double)BENCH_DEVICE_SIZE * 1000.0 / (double)start / (double)MB);
+		}
+	}
+
+out:
+	ErrorStatus = 0;
+	safe_mm_free(buf);
+	if (src_path[0] != 0)
+		DeleteFileU(src_path);
+	if (path[0] != 0)
+		DeleteFileU(path);
+	return errors;
+}
+#endif
+
 /*
  * Standalone thread for the formatting operation
  * According to https://learn.microsoft.com/windows/win32/api/winioctl/ni-winioctl-fsctl_dismount_volume
@@ -1516,6 +2258,7 @@ DWORD WINAPI FormatThread(void* param)
 	// Fixed drives + ext2/ext3 don't play nice and require the same handling as ESPs
 	write_as_ext = IS_EXT(fs_type) && (GetDriveTypeFromIndex(DriveIndex) == DRIVE_FIXED);
 
+	IoStatsStart("format");
 	PrintInfoDebug(0, MSG_225);
 	hPhysicalDrive = GetPhysicalHandle(DriveIndex, actual_lock_drive, FALSE, !actual_lock_drive);
 	if (hPhysicalDrive == INVALID_HANDLE_VALUE) {
@@ -1909,7 +2652,9 @@ DWORD WINAPI FormatThread(void* param)
 	// We issue a complete remount of the filesystem on account of:
 	// - Ensuring the file explorer properly detects that the volume was updated
 	// - Ensuring that an NTFS system will be reparsed so that it becomes bootable
-	if (!RemountVolume(drive_name, FALSE))
+	// An ext partition on a fixed drive is only mounted through AltMountVolume(), and
+	// has nothing mounted on the drive letter, so there is nothing to remount there.
+	if (!write_as_ext && !RemountVolume(drive_name, FALSE))
 		goto out;
 	CHECK_FOR_USER_CANCEL;
 
@@ -1946,6 +2691,8 @@ DWORD WINAPI FormatThread(void* param)
 			} else {
 				if_not_assert(!img_report.is_windows_img)
 					goto out;
+				// For ext, ExtractISO() populates the partition directly, through the physical drive,
+				// so drive_name is only used as the root of the extracted paths.
 				if (!ExtractISO(image_path, drive_name, FALSE)) {
 					if (!IS_ERROR(ErrorStatus))
 						ErrorStatus = RUFUS_ERROR(APPERR(ERROR_ISO_EXTRACT));
@@ -1992,12 +2739,14 @@ DWORD WINAPI FormatThread(void* param)
 
 		UpdateProgress(OP_FINALIZE, -1.0f);
 		PrintInfoDebug(0, MSG_233);
-		if ((boot_type == BT_IMAGE) && (image_path != NULL) && (img_report.is_iso) && (!windows_to_go))
+		// md5sum.txt can't be updated on ext, since there is no file system driver to go through
+		if ((boot_type == BT_IMAGE) && (image_path != NULL) && (img_report.is_iso) && (!windows_to_go) && !IS_EXT(fs_type))
 			UpdateMD5Sum(drive_name, md5sum_name[img_report.has_md5sum ? img_report.has_md5sum - 1 : 0]);
 		if (IsChecked(IDC_EXTENDED_LABEL))
 			SetAutorun(drive_name);
 		// Issue another complete remount before we exit, to ensure we're clean
-		RemountVolume(drive_name, TRUE);
+		if (!write_as_ext)
+			RemountVolume(drive_name, TRUE);
 		// NTFS fixup (WinPE/AIK images don't seem to boot without an extra checkdisk)
 		if ((boot_type == BT_IMAGE) && (img_report.is_iso) && (fs_type == FS_NTFS)) {
 			// Try to ensure that all messages from Checkdisk will be in English
@@ -2027,6 +2776,7 @@ out:
 	safe_free(buffer);
 	safe_unlockclose(hLogicalVolume);
 	safe_unlockclose(hPhysicalDrive);	// This can take a while
+	IoStatsReport();
 	if ((boot_type == BT_IMAGE) && write_as_image) {
 		PrintInfo(0, MSG_320, lmprintf(MSG_307));
 		Sleep(200);
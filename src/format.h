@@ -115,8 +115,52 @@ typedef BOOLEAN (WINAPI* EnableVolumeCompression_t)(
 #define IMG_COMPRESSION_VHD     (BLED_COMPRESSION_MAX + 1)
 #define IMG_COMPRESSION_VHDX    (BLED_COMPRESSION_MAX + 2)
 
+/* Offline FAT32 population (see format_fat32.c) */
+typedef BOOL (*fat32_layout_read_t)(void* ctx, uint64_t src, uint64_t offset, uint8_t* buf, DWORD size);
+
+typedef struct {
+	char* name;                 // UTF-8 long name
+	uint8_t* data;              // in-memory content, used instead of the read callback if not NULL
+	uint64_t src;               // opaque source reference, for the read callback
+	uint32_t size;
+	uint32_t parent;
+	uint32_t first_child;       // directories only (0 = none, as the root can't be a child)
+	uint32_t last_child;
+	uint32_t next_sibling;
+	uint32_t nb_dirents;        // directories only
+	uint32_t cluster;
+	uint16_t date, time;
+	uint8_t nb_lfn;
+	uint8_t nt_flags;
+	uint8_t short_name[11];
+	BOOLEAN is_dir;
+} FAT32_LAYOUT_ENTRY;
+
+typedef struct {
+	FAT32_LAYOUT_ENTRY* entry;  // entry[0] is the root directory
+	uint32_t* hash_table;
+	uint32_t nb_entries;
+	uint32_t max_entries;
+	uint32_t hash_size;
+	fat32_layout_read_t read;
+	void* read_ctx;
+} FAT32_LAYOUT;
+
+/* Direct ext2/ext3 population (see format_ext.c) */
+typedef BOOL (*extfs_read_t)(void* ctx, uint64_t src, uint64_t offset, uint8_t* buf, DWORD size);
+typedef struct extfs_populate EXTFS_POPULATE;
+
 BOOL WritePBR(HANDLE hLogicalDrive);
 BOOL FormatLargeFAT32(DWORD DriveIndex, uint64_t PartitionOffset, DWORD ClusterSize, LPCSTR FSName, LPCSTR Label, DWORD Flags);
+FAT32_LAYOUT* CreateFAT32Layout(fat32_layout_read_t read, void* read_ctx);
+BOOL AddFAT32LayoutEntry(FAT32_LAYOUT* layout, const char* path, BOOL is_dir, uint64_t size, uint64_t src, uint8_t* data, const FILETIME* ft);
+BOOL WriteFAT32Layout(FAT32_LAYOUT* layout, DWORD DriveIndex, uint64_t PartitionOffset);
+void FreeFAT32Layout(FAT32_LAYOUT* layout);
 BOOL FormatExtFs(DWORD DriveIndex, uint64_t PartitionOffset, DWORD BlockSize, LPCSTR FSName, LPCSTR Label, DWORD Flags);
+BOOL FormatExtVolume(const char* volume_name, DWORD BlockSize, LPCSTR FSName, LPCSTR Label, DWORD Flags);
+EXTFS_POPULATE* OpenExtFsPopulate(DWORD DriveIndex, uint64_t PartitionOffset, extfs_read_t read, void* read_ctx, uint64_t total_size);
+BOOL AddExtFsEntry(EXTFS_POPULATE* p, const char* path, BOOL is_dir, const char* symlink, uint32_t mode,
+	uint32_t uid, uint32_t gid, uint64_t size, uint64_t src, const uint8_t* data, int64_t mtime);
+BOOL CloseExtFsPopulate(EXTFS_POPULATE* p);
 BOOL FormatPartition(DWORD DriveIndex, uint64_t PartitionOffset, DWORD UnitAllocationSize, USHORT FSType, LPCSTR Label, DWORD Flags);
 DWORD WINAPI FormatThread(void* param);
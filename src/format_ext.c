@@ -227,29 +227,12 @@ const char* GetExtFsLabel(DWORD DriveIndex, uint64_t PartitionOffset)
 
 BOOL FormatExtFs(DWORD DriveIndex, uint64_t PartitionOffset, DWORD BlockSize, LPCSTR FSName, LPCSTR Label, DWORD Flags)
 {
-	// Mostly taken from mke2fs.conf
-	const float reserve_ratio = 0.05f;
-	const ext2fs_default_t ext2fs_default[5] = {
-		{ 3 * MB, 1024, 128, 3},	// "floppy"
-		{ 512 * MB, 1024, 128, 2},	// "small"
-		{ 4 * GB, 4096, 256, 2},	// "default"
-		{ 16 * GB, 4096, 256, 3},	// "big"
-		{ 1024 * TB, 4096, 256, 4}	// "huge"
-	};
-
-	BOOL ret = FALSE;
+	BOOL ret;
 	char* volume_name = NULL;
-	int i, count;
-	struct ext2_super_block features = { 0 };
-	io_manager manager = nt_io_manager;
-	blk_t journal_size;
-	blk64_t size = 0, cur;
-	ext2_filsys ext2fs = NULL;
-	errcode_t r;
-	uint8_t* buf = NULL;
 
 #if defined(RUFUS_TEST)
 	// Create a disk image file to test
+	int i;
 	uint8_t zb[1024];
 	HANDLE h;
 	DWORD dwSize;
@@ -272,12 +255,44 @@ BOOL FormatExtFs(DWORD DriveIndex, uint64_t PartitionOffset, DWORD BlockSize, LP
 #else
 	volume_name = GetExtPartitionName(DriveIndex, PartitionOffset);
 #endif
-	if ((volume_name == NULL) | (strlen(FSName) != 4) || (strncmp(FSName, "ext", 3) != 0)) {
+	if (volume_name == NULL) {
 		ErrorStatus = RUFUS_ERROR(ERROR_INVALID_PARAMETER);
-		goto out;
+		return FALSE;
 	}
 	if (strchr(volume_name, ' ') != NULL)
 		uprintf("Notice: Using physical device to access partition data");
+	ret = FormatExtVolume(volume_name, BlockSize, FSName, Label, Flags);
+	free(volume_name);
+	return ret;
+}
+
+// Create an ext2/ext3 file system on the volume that libext2fs knows as 'volume_name'
+BOOL FormatExtVolume(const char* volume_name, DWORD BlockSize, LPCSTR FSName, LPCSTR Label, DWORD Flags)
+{
+	// Mostly taken from mke2fs.conf
+	const float reserve_ratio = 0.05f;
+	const ext2fs_default_t ext2fs_default[5] = {
+		{ 3 * MB, 1024, 128, 3},	// "floppy"
+		{ 512 * MB, 1024, 128, 2},	// "small"
+		{ 4 * GB, 4096, 256, 2},	// "default"
+		{ 16 * GB, 4096, 256, 3},	// "big"
+		{ 1024 * TB, 4096, 256, 4}	// "huge"
+	};
+
+	BOOL ret = FALSE;
+	int i, count;
+	struct ext2_super_block features = { 0 };
+	io_manager manager = nt_io_manager;
+	blk_t journal_size;
+	blk64_t size = 0, cur;
+	ext2_filsys ext2fs = NULL;
+	errcode_t r;
+	uint8_t* buf = NULL;
+
+	if ((strlen(FSName) != 4) || (strncmp(FSName, "ext", 3) != 0)) {
+		ErrorStatus = RUFUS_ERROR(ERROR_INVALID_PARAMETER);
+		goto out;
+	}
 
 	if ((strcmp(FSName, FileSystemLabel[FS_EXT2]) != 0) && (strcmp(FSName, FileSystemLabel[FS_EXT3]) != 0)) {
 		if (strcmp(FSName, FileSystemLabel[FS_EXT4]) == 0)
@@ -464,8 +479,8 @@ BOOL FormatExtFs(DWORD DriveIndex, uint64_t PartitionOffset, DWORD BlockSize, LP
 		time_t ctime = time(NULL);
 		struct ext2_inode inode = { 0 };
 		// Don't care about the Y2K38 problem of ext2/ext3 for a 'persistence.conf' timestamp
-		if (ctime > UINT32_MAX)
-			ctime = UINT32_MAX;
+		if (ctime > INT32_MAX)
+			ctime = INT32_MAX;
 		inode.i_mode = 0100644;
 		inode.i_links_count = 1;
 		// coverity[store_truncates_time_t]
@@ -503,8 +518,655 @@ BOOL FormatExtFs(DWORD DriveIndex, uint64_t PartitionOffset, DWORD BlockSize, LP
 	ret = TRUE;
 
 out:
-	free(volume_name);
 	ext2fs_free(ext2fs);
 	free(buf);
 	return ret;
 }
+
+/*
+ * Direct ext2/ext3 population
+ *
+ * Windows has no ext driver, so rather than going through file APIs, we create the
+ * inodes ourselves and copy the data of each file straight into blocks that have been
+ * preallocated as contiguously as the volume allows, with each indirect block placed
+ * right ahead of the data it maps, as the kernel does. Directories and symlinks are
+ * created through libext2fs, but the inodes of regular files are kept in memory and
+ * written to the inode tables in batches, whereas the bitmaps and group descriptors
+ * only get written on close.
+ */
+#define EXTFS_POPULATE_BUFFER_SIZE  (4 * MB)
+#define EXTFS_MAX_PENDING_INODES    4096
+#define EXTFS_PATH_MAP_SIZE         4099
+
+typedef struct {
+	blk64_t blk;
+	blk64_t len;
+} EXTFS_RUN;
+
+typedef struct {
+	ext2_ino_t ino;
+	struct ext2_inode_large inode;
+} EXTFS_PENDING_INODE;
+
+typedef struct {
+	ext2_ino_t ino;
+	uint16_t mode;
+	char path[1];
+} EXTFS_PATH_ENTRY;
+
+typedef struct {
+	struct ext2_inode* inode;
+	uint32_t* ptr;              // content of the indirect blocks
+	blk64_t* blk;               // location of the indirect blocks
+	blk64_t* index;             // allocation order of the indirect blocks
+	uint32_t addr_per_block;
+	uint32_t next, ind, dind, tind;
+	uint32_t run;               // allocation cursor
+	blk64_t pos, k;
+} EXTFS_BLOCK_MAP;
+
+struct extfs_populate {
+	ext2_filsys fs;
+	struct ext2fs_hashmap* path_map;
+	extfs_read_t read;
+	void* read_ctx;
+	uint8_t* buf;
+	EXTFS_RUN* run;
+	uint32_t nb_runs;
+	uint32_t max_runs;
+	EXTFS_PENDING_INODE* pending;
+	uint32_t nb_pending;
+	blk64_t goal;
+	uint64_t written;
+	uint64_t total;
+};
+
+static uint32_t GetExtFsTime(int64_t t)
+{
+	if (t <= 0)
+		t = (int64_t)time(NULL);
+	// ext2 and ext3 timestamps are signed 32-bit and can't go past 2038
+	return (t > INT32_MAX) ? INT32_MAX : (uint32_t)t;
+}
+
+static void SetExtFsInodeAttributes(struct ext2_inode* inode, uint16_t type, uint32_t mode,
+	uint32_t uid, uint32_t gid, int64_t mtime)
+{
+	inode->i_mode = type | (mode & 07777);
+	inode->i_uid = (uint16_t)uid;
+	ext2fs_set_i_uid_high(*inode, (uint16_t)(uid >> 16));
+	inode->i_gid = (uint16_t)gid;
+	ext2fs_set_i_gid_high(*inode, (uint16_t)(gid >> 16));
+	inode->i_atime = inode->i_ctime = inode->i_mtime = GetExtFsTime(mtime);
+}
+
+static EXTFS_PATH_ENTRY* LookupExtFsPath(EXTFS_POPULATE* p, const char* path, size_t len)
+{
+	return (EXTFS_PATH_ENTRY*)ext2fs_hashmap_lookup(p->path_map, path, len);
+}
+
+static void AddExtFsPath(EXTFS_POPULATE* p, const char* path, size_t len, ext2_ino_t ino, uint16_t mode)
+{
+	EXTFS_PATH_ENTRY* entry = malloc(sizeof(EXTFS_PATH_ENTRY) + len);
+
+	// Not being able to add a path only means that we'll have to use namei() for it
+	if (entry == NULL)
+		return;
+	entry->ino = ino;
+	entry->mode = mode;
+	memcpy(entry->path, path, len);
+	entry->path[len] = 0;
+	ext2fs_hashmap_add(p->path_map, entry, entry->path, len);
+	if (LookupExtFsPath(p, path, len) != entry)
+		free(entry);
+}
+
+static EXTFS_PENDING_INODE* GetExtFsPendingInode(EXTFS_POPULATE* p, ext2_ino_t ino)
+{
+	uint32_t i;
+
+	for (i = p->nb_pending; i > 0; i--) {
+		if (p->pending[i - 1].ino == ino)
+			return &p->pending[i - 1];
+	}
+	return NULL;
+}
+
+static int ComparePendingInodes(const void* a, const void* b)
+{
+	ext2_ino_t ino_a = ((const EXTFS_PENDING_INODE*)a)->ino, ino_b = ((const EXTFS_PENDING_INODE*)b)->ino;
+
+	return (ino_a < ino_b) ? -1 : ((ino_a > ino_b) ? 1 : 0);
+}
+
+// Write all the pending inodes, by patching each run of inode table blocks in one go
+static errcode_t FlushExtFsInodes(EXTFS_POPULATE* p)
+{
+	ext2_filsys fs = p->fs;
+	errcode_t r = 0;
+	uint32_t i, j, isize = EXT2_INODE_SIZE(fs->super), ipg = fs->super->s_inodes_per_group;
+	uint32_t ipb = fs->blocksize / isize, max_blocks = EXTFS_POPULATE_BUFFER_SIZE / fs->blocksize;
+	uint32_t len = MIN(isize, (uint32_t)sizeof(struct ext2_inode_large));
+	blk64_t first, last, blk;
+	dgrp_t group;
+	uint8_t* dst;
+
+	qsort(p->pending, p->nb_pending, sizeof(EXTFS_PENDING_INODE), ComparePendingInodes);
+	for (i = 0; i < p->nb_pending; i = j) {
+		group = (p->pending[i].ino - 1) / ipg;
+		first = ext2fs_inode_table_loc(fs, group) + ((p->pending[i].ino - 1) % ipg) / ipb;
+		last = first;
+		for (j = i + 1; j < p->nb_pending; j++) {
+			if ((p->pending[j].ino - 1) / ipg != group)
+				break;
+			blk = ext2fs_inode_table_loc(fs, group) + ((p->pending[j].ino - 1) % ipg) / ipb;
+			if (blk - first >= max_blocks)
+				break;
+			last = blk;
+		}
+		// The tables may also hold inodes that libext2fs wrote, so read them first
+		r = io_channel_read_blk64(fs->io, first, (int)(last - first + 1), p->buf);
+		if (r != 0)
+			break;
+		for (; i < j; i++) {
+			dst = &p->buf[(uint64_t)((p->pending[i].ino - 1) % ipg) * isize -
+				(first - ext2fs_inode_table_loc(fs, group)) * fs->blocksize];
+			memset(dst, 0, isize);
+			memcpy(dst, &p->pending[i].inode, len);
+			ext2fs_inode_csum_set(fs, p->pending[i].ino, (struct ext2_inode_large*)dst);
+		}
+		r = io_channel_write_blk64(fs->io, first, (int)(last - first + 1), p->buf);
+		if (r != 0)
+			break;
+	}
+	p->nb_pending = 0;
+	return r;
+}
+
+// Number of indirect blocks needed to map nb_blocks data blocks
+static blk64_t GetExtFsMetaBlocks(blk64_t nb_blocks, blk64_t a)
+{
+	blk64_t n = nb_blocks, m = 0;
+
+	if (n <= EXT2_NDIR_BLOCKS)
+		return 0;
+	n -= EXT2_NDIR_BLOCKS;
+	m++;
+	if (n <= a)
+		return m;
+	n -= a;
+	m += 1 + (MIN(n, a * a) + a - 1) / a;
+	if (n <= a * a)
+		return m;
+	n -= a * a;
+	m += 1 + ((n + a - 1) / a + a - 1) / a + (n + a - 1) / a;
+	return m;
+}
+
+// Reserve count blocks, in as few runs as possible, following the previous allocation
+static errcode_t AllocExtFsRuns(EXTFS_POPULATE* p, blk64_t count)
+{
+	errcode_t r;
+	blk64_t blk, len;
+	EXTFS_RUN* new_run;
+
+	p->nb_runs = 0;
+	while (count > 0) {
+		r = ext2fs_new_range(p->fs, 0, p->goal, count, NULL, &blk, &len);
+		if (r != 0)
+			goto out;
+		if (p->nb_runs >= p->max_runs) {
+			new_run = realloc(p->run, (p->max_runs + 64) * sizeof(EXTFS_RUN));
+			if (new_run == NULL) {
+				r = EXT2_ET_NO_MEMORY;
+				goto out;
+			}
+			p->run = new_run;
+			p->max_runs += 64;
+		}
+		ext2fs_block_alloc_stats_range(p->fs, blk, (blk_t)len, +1);
+		p->run[p->nb_runs].blk = blk;
+		p->run[p->nb_runs++].len = len;
+		p->goal = blk + len;
+		count -= len;
+	}
+	return 0;
+
+out:
+	for (; p->nb_runs > 0; p->nb_runs--)
+		ext2fs_block_alloc_stats_range(p->fs, p->run[p->nb_runs - 1].blk, (blk_t)p->run[p->nb_runs - 1].len, -1);
+	return r;
+}
+
+static blk64_t GetNextRunBlock(EXTFS_POPULATE* p, EXTFS_BLOCK_MAP* map)
+{
+	blk64_t blk = p->run[map->run].blk + map->pos;
+
+	if (++map->pos >= p->run[map->run].len) {
+		map->run++;
+		map->pos = 0;
+	}
+	map->k++;
+	return blk;
+}
+
+static uint32_t NewExtFsMetaBlock(EXTFS_POPULATE* p, EXTFS_BLOCK_MAP* map)
+{
+	uint32_t m = map->next++;
+
+	map->index[m] = map->k;
+	map->blk[m] = GetNextRunBlock(p, map);
+	return m;
+}
+
+// Map the next logical block, with the indirect blocks allocated right ahead of the data they point to
+static void MapExtFsBlock(EXTFS_POPULATE* p, EXTFS_BLOCK_MAP* map, blk64_t lblk)
+{
+	const blk64_t a = map->addr_per_block;
+
+	if (lblk < EXT2_NDIR_BLOCKS) {
+		map->inode->i_block[lblk] = (uint32_t)GetNextRunBlock(p, map);
+		return;
+	}
+	lblk -= EXT2_NDIR_BLOCKS;
+	if (lblk < a) {
+		if (lblk == 0) {
+			map->ind = NewExtFsMetaBlock(p, map);
+			map->inode->i_block[EXT2_IND_BLOCK] = (uint32_t)map->blk[map->ind];
+		}
+	} else if ((lblk -= a) < a * a) {
+		if (lblk == 0) {
+			map->dind = NewExtFsMetaBlock(p, map);
+			map->inode->i_block[EXT2_DIND_BLOCK] = (uint32_t)map->blk[map->dind];
+		}
+		if (lblk % a == 0) {
+			map->ind = NewExtFsMetaBlock(p, map);
+			map->ptr[map->dind * a + lblk / a] = ext2fs_cpu_to_le32((uint32_t)map->blk[map->ind]);
+		}
+	} else {
+		lblk -= a * a;
+		if (lblk == 0) {
+			map->tind = NewExtFsMetaBlock(p, map);
+			map->inode->i_block[EXT2_TIND_BLOCK] = (uint32_t)map->blk[map->tind];
+		}
+		if (lblk % (a * a) == 0) {
+			map->dind = NewExtFsMetaBlock(p, map);
+			map->ptr[map->tind * a + lblk / (a * a)] = ext2fs_cpu_to_le32((uint32_t)map->blk[map->dind]);
+		}
+		if (lblk % a == 0) {
+			map->ind = NewExtFsMetaBlock(p, map);
+			map->ptr[map->dind * a + (lblk / a) % a] = ext2fs_cpu_to_le32((uint32_t)map->blk[map->ind]);
+		}
+	}
+	map->ptr[map->ind * a + lblk % a] = ext2fs_cpu_to_le32((uint32_t)GetNextRunBlock(p, map));
+}
+
+// Allocate, map and write the data of a regular file
+static errcode_t WriteExtFsFile(EXTFS_POPULATE* p, struct ext2_inode* inode, uint64_t size, uint64_t src, const uint8_t* data)
+{
+	ext2_filsys fs = p->fs;
+	errcode_t r;
+	EXTFS_BLOCK_MAP map = { 0 };
+	const uint32_t bs = fs->blocksize;
+	const blk64_t a = bs / sizeof(uint32_t);
+	blk64_t i, j, n, k, blk, lblk, nb_data, nb_meta;
+	uint32_t m, len;
+
+	r = ext2fs_inode_size_set(fs, inode, size);
+	if (r != 0)
+		return r;
+	nb_data = (size + bs - 1) / bs;
+	if (nb_data == 0)
+		return 0;
+	if (nb_data > EXT2_NDIR_BLOCKS + a + a * a + a * a * a)
+		return EXT2_ET_FILE_TOO_BIG;
+	nb_meta = GetExtFsMetaBlocks(nb_data, a);
+	r = AllocExtFsRuns(p, nb_data + nb_meta);
+	if (r != 0)
+		return r;
+
+	map.inode = inode;
+	map.addr_per_block = (uint32_t)a;
+	if (nb_meta != 0) {
+		map.ptr = calloc((size_t)nb_meta, bs);
+		map.blk = malloc((size_t)nb_meta * sizeof(blk64_t));
+		map.index = malloc((size_t)nb_meta * sizeof(blk64_t));
+		if ((map.ptr == NULL) || (map.blk == NULL) || (map.index == NULL)) {
+			r = EXT2_ET_NO_MEMORY;
+			goto out;
+		}
+	}
+	for (lblk = 0; lblk < nb_data; lblk++)
+		MapExtFsBlock(p, &map, lblk);
+
+	// Now stream the whole allocation, indirect blocks included, as large runs of blocks
+	for (k = 0, lblk = 0, m = 0, map.run = 0, map.pos = 0; k < nb_data + nb_meta; k += n) {
+		blk = p->run[map.run].blk + map.pos;
+		n = MIN(p->run[map.run].len - map.pos, nb_data + nb_meta - k);
+		n = MIN(n, EXTFS_POPULATE_BUFFER_SIZE / bs);
+		for (i = 0; i < n; i += j) {
+			if ((m < nb_meta) && (map.index[m] == k + i)) {
+				memcpy(&p->buf[i * bs], &map.ptr[m++ * a], bs);
+				j = 1;
+				continue;
+			}
+			// Data blocks, up to the next indirect block
+			j = n - i;
+			if ((m < nb_meta) && (map.index[m] < k + n))
+				j = map.index[m] - (k + i);
+			len = (uint32_t)MIN(j * bs, size - lblk * bs);
+			if (data != NULL) {
+				memcpy(&p->buf[i * bs], &data[lblk * bs], len);
+			} else if (!p->read(p->read_ctx, src, lblk * bs, &p->buf[i * bs], len)) {
+				r = EXT2_ET_SHORT_READ;
+				goto out;
+			}
+			memset(&p->buf[i * bs + len], 0, (size_t)(j * bs - len));
+			lblk += j;
+			p->written += len;
+		}
+		r = io_channel_write_blk64(fs->io, blk, (int)n, p->buf);
+		if (r != 0)
+			goto out;
+		map.pos += n;
+		if (map.pos >= p->run[map.run].len) {
+			map.run++;
+			map.pos = 0;
+		}
+		UpdateProgressWithInfo(OP_FILE_COPY, MSG_231, p->written, p->total);
+		if (IS_ERROR(ErrorStatus)) {
+			r = EXT2_ET_CANCEL_REQUESTED;
+			goto out;
+		}
+	}
+	r = ext2fs_iblk_set(fs, inode, nb_data + nb_meta);
+
+out:
+	if (r != 0) {
+		for (; p->nb_runs > 0; p->nb_runs--)
+			ext2fs_block_alloc_stats_range(fs, p->run[p->nb_runs - 1].blk, (blk_t)p->run[p->nb_runs - 1].len, -1);
+	}
+	free(map.ptr);
+	free(map.blk);
+	free(map.index);
+	return r;
+}
+
+EXTFS_POPULATE* OpenExtFsPopulate(DWORD DriveIndex, uint64_t PartitionOffset, extfs_read_t read, void* read_ctx, uint64_t total_size)
+{
+	errcode_t r;
+	char* volume_name;
+	EXTFS_POPULATE* p = calloc(1, sizeof(EXTFS_POPULATE));
+
+	if (p == NULL)
+		return NULL;
+#if defined(RUFUS_TEST)
+	volume_name = strdup(TEST_IMG_PATH);
+#else
+	volume_name = GetExtPartitionName(DriveIndex, PartitionOffset);
+#endif
+	if (volume_name == NULL) {
+		ErrorStatus = RUFUS_ERROR(ERROR_INVALID_PARAMETER);
+		goto out;
+	}
+	r = ext2fs_open(volume_name, EXT2_FLAG_RW | EXT2_FLAG_64BITS | EXT2_FLAG_SKIP_MMP, 0, 0, nt_io_manager, &p->fs);
+	free(volume_name);
+	if (r != 0) {
+		p->fs = NULL;
+		SET_EXT2_FORMAT_ERROR(ERROR_OPEN_FAILED);
+		uprintf("Could not open ext volume: %s", error_message(r));
+		goto out;
+	}
+	// Block maps can only address 32-bit block numbers
+	if (ext2fs_blocks_count(p->fs->super) > UINT32_MAX) {
+		ErrorStatus = RUFUS_ERROR(ERROR_INVALID_VOLUME_SIZE);
+		uprintf("Volume is too large to be populated");
+		goto out;
+	}
+	r = ext2fs_read_bitmaps(p->fs);
+	if (r != 0) {
+		SET_EXT2_FORMAT_ERROR(ERROR_READ_FAULT);
+		uprintf("Could not read ext bitmaps: %s", error_message(r));
+		goto out;
+	}
+	p->path_map = ext2fs_hashmap_create(ext2fs_djb2_hash, free, EXTFS_PATH_MAP_SIZE);
+	p->buf = malloc(EXTFS_POPULATE_BUFFER_SIZE);
+	p->pending = malloc(EXTFS_MAX_PENDING_INODES * sizeof(EXTFS_PENDING_INODE));
+	if ((p->path_map == NULL) || (p->buf == NULL) || (p->pending == NULL)) {
+		ErrorStatus = RUFUS_ERROR(ERROR_NOT_ENOUGH_MEMORY);
+		goto out;
+	}
+	p->read = read;
+	p->read_ctx = read_ctx;
+	p->total = total_size;
+	return p;
+
+out:
+	if (p->fs != NULL)
+		ext2fs_close_free(&p->fs);
+	if (p->path_map != NULL)
+		ext2fs_hashmap_free(p->path_map);
+	free(p->buf);
+	free(p->pending);
+	free(p);
+	return NULL;
+}
+
+// Get the inode of a directory, creating it (and its parents) if needed
+static ext2_ino_t GetExtFsDir(EXTFS_POPULATE* p, char* path, size_t len)
+{
+	char c;
+	ext2_ino_t ino = 0;
+	EXTFS_PATH_ENTRY* entry;
+	struct ext2_inode inode;
+
+	if (len == 0)
+		return EXT2_ROOT_INO;
+	entry = LookupExtFsPath(p, path, len);
+	if (entry != NULL)
+		return LINUX_S_ISDIR(entry->mode) ? entry->ino : 0;
+	c = path[len];
+	path[len] = 0;
+	if (ext2fs_namei(p->fs, EXT2_ROOT_INO, EXT2_ROOT_INO, path, &ino) == 0) {
+		if ((ext2fs_read_inode(p->fs, ino, &inode) != 0) || !LINUX_S_ISDIR(inode.i_mode))
+			ino = 0;
+		else
+			AddExtFsPath(p, path, len, ino, LINUX_S_IFDIR);
+	} else if (AddExtFsEntry(p, path, TRUE, NULL, 0755, 0, 0, 0, 0, NULL, 0)) {
+		entry = LookupExtFsPath(p, path, len);
+		if (entry != NULL)
+			ino = entry->ino;
+		else if (ext2fs_namei(p->fs, EXT2_ROOT_INO, EXT2_ROOT_INO, path, &ino) != 0)
+			ino = 0;
+	}
+	path[len] = c;
+	return ino;
+}
+
+BOOL AddExtFsEntry(EXTFS_POPULATE* p, const char* path, BOOL is_dir, const char* symlink, uint32_t mode,
+	uint32_t uid, uint32_t gid, uint64_t size, uint64_t src, const uint8_t* data, int64_t mtime)
+{
+	BOOL ret = FALSE;
+	errcode_t r = 0;
+	char *fullpath = NULL, *name, *sep;
+	size_t i, len;
+	ext2_ino_t parent, ino = 0;
+	uint16_t type = is_dir ? LINUX_S_IFDIR : ((symlink != NULL) ? LINUX_S_IFLNK : LINUX_S_IFREG);
+	struct ext2_inode inode;
+	EXTFS_PATH_ENTRY* entry;
+	EXTFS_PENDING_INODE* pending = NULL;
+
+	if ((p == NULL) || (path == NULL))
+		return FALSE;
+
+	// Normalize the path, so that it can be used as a key
+	while ((*path == '/') || (*path == '\\'))
+		path++;
+	fullpath = strdup(path);
+	if (fullpath == NULL)
+		goto out;
+	for (i = 0; fullpath[i] != 0; i++) {
+		if (fullpath[i] == '\\')
+			fullpath[i] = '/';
+	}
+	while ((i > 0) && (fullpath[i - 1] == '/'))
+		fullpath[--i] = 0;
+	len = i;
+	if (len == 0) {
+		ret = is_dir;
+		goto out;
+	}
+	sep = strrchr(fullpath, '/');
+	name = (sep == NULL) ? fullpath : &sep[1];
+	parent = GetExtFsDir(p, fullpath, (sep == NULL) ? 0 : (size_t)(sep - fullpath));
+	if (parent == 0) {
+		uprintf("Could not get parent directory of '%s'", fullpath);
+		goto out;
+	}
+	if ((type == LINUX_S_IFREG) && (p->nb_pending >= EXTFS_MAX_PENDING_INODES)) {
+		r = FlushExtFsInodes(p);
+		if (r != 0)
+			goto out;
+	}
+
+	entry = LookupExtFsPath(p, fullpath, len);
+	if (entry != NULL) {
+		if (is_dir && LINUX_S_ISDIR(entry->mode)) {
+			ret = TRUE;
+			goto out;
+		}
+		if ((type != LINUX_S_IFREG) || !LINUX_S_ISREG(entry->mode)) {
+			uprintf("Could not replace '%s': Type mismatch", fullpath);
+			goto out;
+		}
+		// Replace the content of an existing file
+		ino = entry->ino;
+		pending = GetExtFsPendingInode(p, ino);
+		if (pending == NULL) {
+			r = ext2fs_read_inode(p->fs, ino, &inode);
+			if (r != 0)
+				goto out;
+		} else {
+			memcpy(&inode, &pending->inode, sizeof(inode));
+		}
+		r = ext2fs_punch(p->fs, ino, &inode, NULL, 0, ~0ULL);
+		if (r != 0)
+			goto out;
+	} else if (is_dir) {
+		r = ext2fs_new_inode(p->fs, parent, LINUX_S_IFDIR | 0755, 0, &ino);
+		if (r == 0)
+			r = ext2fs_mkdir(p->fs, parent, ino, name);
+		if (r == EXT2_ET_DIR_NO_SPACE) {
+			r = ext2fs_expand_dir(p->fs, parent);
+			if (r == 0)
+				r = ext2fs_mkdir(p->fs, parent, ino, name);
+		}
+		// Existing directories, such as 'lost+found', are fine
+		if (r == EXT2_ET_DIR_EXISTS)
+			r = ext2fs_lookup(p->fs, parent, name, (int)strlen(name), NULL, &ino);
+		if (r == 0)
+			r = ext2fs_read_inode(p->fs, ino, &inode);
+		if (r != 0)
+			goto out;
+	} else if (symlink != NULL) {
+		r = ext2fs_new_inode(p->fs, parent, LINUX_S_IFLNK | 0777, 0, &ino);
+		if (r == 0)
+			r = ext2fs_symlink(p->fs, parent, ino, name, symlink);
+		if (r == EXT2_ET_DIR_NO_SPACE) {
+			r = ext2fs_expand_dir(p->fs, parent);
+			if (r == 0)
+				r = ext2fs_symlink(p->fs, parent, ino, name, symlink);
+		}
+		if (r == 0)
+			r = ext2fs_read_inode(p->fs, ino, &inode);
+		if (r != 0)
+			goto out;
+	} else {
+		r = ext2fs_new_inode(p->fs, parent, LINUX_S_IFREG | 0644, 0, &ino);
+		if (r != 0)
+			goto out;
+		ext2fs_inode_alloc_stats2(p->fs, ino, +1, 0);
+		r = ext2fs_link(p->fs, parent, name, ino, EXT2_FT_REG_FILE);
+		if (r == EXT2_ET_DIR_NO_SPACE) {
+			r = ext2fs_expand_dir(p->fs, parent);
+			if (r == 0)
+				r = ext2fs_link(p->fs, parent, name, ino, EXT2_FT_REG_FILE);
+		}
+		if (r != 0) {
+			ext2fs_inode_alloc_stats2(p->fs, ino, -1, 0);
+			goto out;
+		}
+		memset(&inode, 0, sizeof(inode));
+		inode.i_links_count = 1;
+	}
+
+	SetExtFsInodeAttributes(&inode, type, mode, uid, gid, mtime);
+	if (type != LINUX_S_IFREG) {
+		r = ext2fs_write_inode(p->fs, ino, &inode);
+		if (r != 0)
+			goto out;
+	} else {
+		r = WriteExtFsFile(p, &inode, size, src, data);
+		if ((r != 0) && (entry == NULL)) {
+			// Don't leave a dangling directory entry behind
+			ext2fs_unlink(p->fs, parent, name, ino, 0);
+			ext2fs_inode_alloc_stats2(p->fs, ino, -1, 0);
+			goto out;
+		}
+		if (r != 0) {
+			// Leave the file we were replacing empty
+			memset(inode.i_block, 0, sizeof(inode.i_block));
+			inode.i_size = inode.i_size_high = 0;
+			ext2fs_iblk_set(p->fs, &inode, 0);
+		}
+		if (pending == NULL) {
+			pending = &p->pending[p->nb_pending++];
+			memset(pending, 0, sizeof(EXTFS_PENDING_INODE));
+			pending->ino = ino;
+			if (EXT2_INODE_SIZE(p->fs->super) > EXT2_GOOD_OLD_INODE_SIZE) {
+				pending->inode.i_extra_isize = sizeof(struct ext2_inode_large) - EXT2_GOOD_OLD_INODE_SIZE;
+				pending->inode.i_crtime = inode.i_ctime;
+			}
+		}
+		memcpy(&pending->inode, &inode, sizeof(inode));
+		if (r != 0)
+			goto out;
+	}
+	if (entry == NULL)
+		AddExtFsPath(p, fullpath, len, ino, type);
+	ret = TRUE;
+
+out:
+	if (r != 0) {
+		SET_EXT2_FORMAT_ERROR((r == EXT2_ET_BLOCK_ALLOC_FAIL) ? ERROR_DISK_FULL : ERROR_WRITE_FAULT);
+		uprintf("Could not create '%s': %s", fullpath, error_message(r));
+	}
+	free(fullpath);
+	return ret;
+}
+
+BOOL CloseExtFsPopulate(EXTFS_POPULATE* p)
+{
+	errcode_t r;
+
+	if (p == NULL)
+		return FALSE;
+	r = FlushExtFsInodes(p);
+	if (r != 0) {
+		SET_EXT2_FORMAT_ERROR(ERROR_WRITE_FAULT);
+		uprintf("Could not write ext inode tables: %s", error_message(r));
+		ext2fs_free(p->fs);
+	} else {
+		r = ext2fs_close_free(&p->fs);
+		if (r != 0) {
+			SET_EXT2_FORMAT_ERROR(ERROR_WRITE_FAULT);
+			uprintf("Could not close ext volume: %s", error_message(r));
+		}
+	}
+	ext2fs_hashmap_free(p->path_map);
+	free(p->run);
+	free(p->pending);
+	free(p->buf);
+	free(p);
+	return (r == 0);
+}
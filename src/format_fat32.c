@@ -33,6 +33,7 @@
 #include "file.h"
 #include "drive.h"
 #include "format.h"
+#include "libfat.h"
 #include "missing.h"
 #include "resource.h"
 #include "msapi_utf8.h"
@@ -86,8 +87,46 @@ typedef struct {
 	BYTE sReserved2[12];    // zeros
 	DWORD dTrailSig;        // 0xAA550000
 } FAT_FSINFO;
+
+typedef struct {
+	BYTE sName[11];
+	BYTE bAttr;
+	BYTE bNTRes;
+	BYTE bCrtTimeTenth;
+	WORD wCrtTime;
+	WORD wCrtDate;
+	WORD wLstAccDate;
+	WORD wFstClusHI;
+	WORD wWrtTime;
+	WORD wWrtDate;
+	WORD wFstClusLO;
+	DWORD dFileSize;
+} FAT_DIRENT;
 #pragma pack(pop)
 
+/* Offline FAT32 population */
+#define FAT32_LAYOUT_BUFFER_SIZE    (4 * MB)
+#define FAT32_MAX_DIRENTS           65536
+#define FAT32_MAX_LFN_SIZE          255
+#define FAT32_CLUSTER_MASK          0x0fffffff
+#define FAT32_EOC                   0x0fffffff
+#define FAT_DIRENT_SIZE             32
+#define FAT_ATTR_VOLUME_ID          0x08
+#define FAT_ATTR_DIRECTORY          0x10
+#define FAT_ATTR_ARCHIVE            0x20
+#define FAT_ATTR_LFN                0x0f
+#define FAT_NTRES_LOWER_BASE        0x08
+#define FAT_NTRES_LOWER_EXT         0x10
+#define FAT_LFN_CHARS               13
+
+typedef struct {
+	HANDLE hDrive;
+	uint8_t* buf;
+	DWORD pos;
+	uint64_t written;
+	uint64_t total;
+} FAT32_STREAM;
+
 /*
  * 28.2  CALCULATING THE VOLUME SERIAL NUMBER
  *
@@ -145,6 +184,79 @@ static DWORD GetFATSizeSectors(DWORD DskSize, DWORD ReservedSecCnt, DWORD SecPer
 	return (DWORD)FatSz;
 }
 
+/*
+ * Clear the system area (reserved sectors, FATs and root cluster) of a FAT32 volume, using
+ * large writes from a single zeroed buffer. The sectors from Sector[] (boot sectors, FSInfo,
+ * first FAT sectors) are copied into the buffer on the fly, so that they are written as part
+ * of the same requests. If the device supports TRIM and guarantees that trimmed sectors read
+ * back as zeroes, we discard the area first, and only rewrite the bursts that do not read back
+ * as zeroes, which saves most of the writes on SSDs. Without that guarantee, trimmed sectors
+ * may return anything, so we always write the zeroes.
+ */
+#define FAT32_CLEAR_BURST_SIZE      (4 * MB)
+typedef struct {
+	DWORD Sector;
+	const void* Data;
+} FAT32_SYSTEM_SECTOR;
+
+static BOOL ClearFAT32SystemArea(HANDLE hLogicalVolume, DWORD BytesPerSect, DWORD SystemAreaSize,
+	const FAT32_SYSTEM_SECTOR* Sector, DWORD NumSectors)
+{
+	BOOL r = FALSE, discarded, has_data;
+	DWORD i, j, k, Burst, BurstSize = FAT32_CLEAR_BURST_SIZE / BytesPerSect;
+	uint64_t* pReadBack = NULL;
+	BYTE* pZero = NULL;
+
+	BurstSize = MIN(BurstSize, SystemAreaSize);
+	pZero = (BYTE*)calloc(BurstSize, BytesPerSect);
+	if (pZero == NULL)
+		goto out;
+	discarded = DiscardReadsZeroes(hLogicalVolume) &&
+		DiscardVolumeRange(hLogicalVolume, 0, (uint64_t)SystemAreaSize * BytesPerSect);
+	if (discarded) {
+		uprintf("Discarded system area - only rewriting the parts that don't read back as zeroes");
+		pReadBack = (uint64_t*)malloc((size_t)BurstSize * BytesPerSect);
+		if (pReadBack == NULL)
+			discarded = FALSE;
+	}
+
+	for (i = 0; i < SystemAreaSize; i += Burst) {
+		Burst = MIN(BurstSize, SystemAreaSize - i);
+		UpdateProgressWithInfo(OP_FORMAT, MSG_217, (uint64_t)i, (uint64_t)SystemAreaSize);
+		CHECK_FOR_USER_CANCEL;
+		has_data = FALSE;
+		for (j = 0; j < NumSectors; j++) {
+			if ((Sector[j].Sector >= i) && (Sector[j].Sector < i + Burst)) {
+				memcpy(&pZero[(Sector[j].Sector - i) * BytesPerSect], Sector[j].Data, BytesPerSect);
+				has_data = TRUE;
+			}
+		}
+		if (discarded && !has_data) {
+			if (read_sectors(hLogicalVolume, BytesPerSect, i, Burst, pReadBack) == (int64_t)Burst * BytesPerSect) {
+				for (k = 0; (k < Burst * BytesPerSect / sizeof(uint64_t)) && (pReadBack[k] == 0); k++);
+				if (k >= Burst * BytesPerSect / sizeof(uint64_t))
+					continue;
+			}
+		}
+		if (write_sectors(hLogicalVolume, BytesPerSect, i, Burst, pZero) != (int64_t)Burst * BytesPerSect) {
+			uprintf("Error clearing reserved sectors: %s", WindowsErrorString());
+			goto out;
+		}
+		if (has_data) {
+			for (j = 0; j < NumSectors; j++) {
+				if ((Sector[j].Sector >= i) && (Sector[j].Sector < i + Burst))
+					memset(&pZero[(Sector[j].Sector - i) * BytesPerSect], 0, BytesPerSect);
+			}
+		}
+	}
+	r = TRUE;
+
+out:
+	free(pZero);
+	free(pReadBack);
+	return r;
+}
+
 /*
  * Large FAT32 volume formatting from fat32format by Tom Thornhill
  * http://www.ridgecrop.demon.co.uk/index.htm?fat32format.htm
@@ -166,7 +278,6 @@ BOOL FormatLargeFAT32(DWORD DriveIndex, uint64_t PartitionOffset, DWORD ClusterS
 	DWORD BackupBootSect = 6;
 	DWORD VolumeId = 0; // calculated before format
 	char* VolumeName = NULL;
-	DWORD BurstSize = 128; // Zero in blocks of 64K typically
 
 	// Calculated later
 	DWORD FatSize = 0;
@@ -182,7 +293,8 @@ BOOL FormatLargeFAT32(DWORD DriveIndex, uint64_t PartitionOffset, DWORD ClusterS
 	FAT_BOOTSECTOR32* pFAT32BootSect = NULL;
 	FAT_FSINFO* pFAT32FsInfo = NULL;
 	DWORD* pFirstSectOfFat = NULL;
-	BYTE* pZeroSect = NULL;
+	FAT32_SYSTEM_SECTOR SystemSector[4 + 2];
+	DWORD nSystemSectors = 0;
 	char VolId[12] = "NO NAME    ";
 
 	// Debug temp vars
@@ -412,37 +524,27 @@ BOOL FormatLargeFAT32(DWORD DriveIndex, uint64_t PartitionOffset, DWORD ClusterS
 	uprintf("%lu Free clusters", pFAT32FsInfo->dFree_Count);
 	// Work out the Cluster count
 
-	// First zero out ReservedSect + FatSize * NumFats + SectorsPerCluster
+	// Zero out ReservedSect + FatSize * NumFats + SectorsPerCluster, and write the boot sector
+	// and fsinfo twice (once at 0 and once at the backup boot sect position) as well as the first
+	// sector of each FAT, as part of the same pass.
 	SystemAreaSize = ReservedSectCount + (NumFATs * FatSize) + SectorsPerCluster;
 	uprintf("Clearing out %d sectors for reserved sectors, FATs and root cluster...", SystemAreaSize);
-
-	// Not the most effective, but easy on RAM
-	pZeroSect = (BYTE*)calloc(BytesPerSect, BurstSize);
-	if (!pZeroSect) {
-		die("Failed to allocate memory", ERROR_NOT_ENOUGH_MEMORY);
+	SystemSector[nSystemSectors].Sector = 0;
+	SystemSector[nSystemSectors++].Data = pFAT32BootSect;
+	SystemSector[nSystemSectors].Sector = 1;
+	SystemSector[nSystemSectors++].Data = pFAT32FsInfo;
+	SystemSector[nSystemSectors].Sector = BackupBootSect;
+	SystemSector[nSystemSectors++].Data = pFAT32BootSect;
+	SystemSector[nSystemSectors].Sector = BackupBootSect + 1;
+	SystemSector[nSystemSectors++].Data = pFAT32FsInfo;
+	for (i = 0; i < NumFATs; i++) {
+		SystemSector[nSystemSectors].Sector = ReservedSectCount + (i * FatSize);
+		SystemSector[nSystemSectors++].Data = pFirstSectOfFat;
+		uprintf("FAT #%d sector at address: %d", i, ReservedSectCount + (i * FatSize));
 	}
-
-	for (i = 0; i < (SystemAreaSize + BurstSize - 1); i += BurstSize) {
-		UpdateProgressWithInfo(OP_FORMAT, MSG_217, (uint64_t)i, (uint64_t)SystemAreaSize + BurstSize);
+	if (!ClearFAT32SystemArea(hLogicalVolume, BytesPerSect, SystemAreaSize, SystemSector, nSystemSectors)) {
 		CHECK_FOR_USER_CANCEL;
-		if (write_sectors(hLogicalVolume, BytesPerSect, i, BurstSize, pZeroSect) != (BytesPerSect * BurstSize)) {
-			die("Error clearing reserved sectors", ERROR_WRITE_FAULT);
-		}
-	}
-
-	uprintf ("Initializing reserved sectors and FATs...");
-	// Now we should write the boot sector and fsinfo twice, once at 0 and once at the backup boot sect position
-	for (i = 0; i < 2; i++) {
-		int SectorStart = (i == 0) ? 0 : BackupBootSect;
-		write_sectors(hLogicalVolume, BytesPerSect, SectorStart, 1, pFAT32BootSect);
-		write_sectors(hLogicalVolume, BytesPerSect, SectorStart + 1, 1, pFAT32FsInfo);
-	}
-
-	// Write the first fat sector in the right places
-	for (i = 0; i < NumFATs; i++) {
-		int SectorStart = ReservedSectCount + (i * FatSize);
-		uprintf("FAT #%d sector at address: %d", i, SectorStart);
-		write_sectors(hLogicalVolume, BytesPerSect, SectorStart, 1, pFirstSectOfFat);
+		die("Error clearing reserved sectors", ERROR_WRITE_FAULT);
 	}
 
 	if (!(Flags & FP_NO_BOOT)) {
@@ -476,6 +578,1090 @@ out:
 	safe_free(pFAT32BootSect);
 	safe_free(pFAT32FsInfo);
 	safe_free(pFirstSectOfFat);
-	safe_free(pZeroSect);
 	return r;
 }
+
+/*
+ * Offline FAT32 population
+ *
+ * Creating every file of an ISO through the Windows FAT driver results in lots of small,
+ * scattered writes for directory entries, FAT and FSInfo updates, which flash media does
+ * not handle well. Instead, we collect the layout of the content in memory, and then, on
+ * the freshly formatted volume, allocate all the directories and files as contiguous runs
+ * of clusters that we write as a single sequential stream, followed by the FAT sectors.
+ */
+static const char* sfn_special_chars = "$%'-_@~`!(){}^#&";
+
+static __inline uint32_t LayoutHash(uint32_t parent, const char* name)
+{
+	uint32_t i, h = 2166136261U;
+	char c;
+
+	for (i = 0; i < sizeof(parent); i++) {
+		h ^= (parent >> (8 * i)) & 0xff;
+		h *= 16777619U;
+	}
+	for (; *name != 0; name++) {
+		c = ((*name >= 'a') && (*name <= 'z')) ? *name - 0x20 : *name;
+		h ^= (uint8_t)c;
+		h *= 16777619U;
+	}
+	return h;
+}
+
+static uint32_t LookupLayoutEntry(FAT32_LAYOUT* layout, uint32_t parent, const char* name)
+{
+	uint32_t i, mask = layout->hash_size - 1;
+	FAT32_LAYOUT_ENTRY* e;
+
+	for (i = LayoutHash(parent, name) & mask; layout->hash_table[i] != 0; i = (i + 1) & mask) {
+		e = &layout->entry[layout->hash_table[i]];
+		if ((e->parent == parent) && (_stricmp(e->name, name) == 0))
+			return layout->hash_table[i];
+	}
+	return 0;
+}
+
+static void SetLayoutTimestamp(FAT32_LAYOUT_ENTRY* e, const FILETIME* ft)
+{
+	FILETIME now, local;
+
+	if (ft == NULL) {
+		GetSystemTimeAsFileTime(&now);
+		ft = &now;
+	}
+	if (!FileTimeToLocalFileTime(ft, &local) || !FileTimeToDosDateTime(&local, &e->date, &e->time)) {
+		e->date = (1 << 5) | 1;	// 1980.01.01
+		e->time = 0;
+	}
+}
+
+// Returns the index of the new entry, or 0 on error
+static uint32_t NewLayoutEntry(FAT32_LAYOUT* layout, uint32_t parent, const char* name, BOOL is_dir, const FILETIME* ft)
+{
+	uint32_t i, j, mask, index, *new_table;
+	FAT32_LAYOUT_ENTRY *e, *new_entry;
+
+	if (layout->nb_entries >= layout->max_entries) {
+		new_entry = realloc(layout->entry, 2 * (size_t)layout->max_entries * sizeof(FAT32_LAYOUT_ENTRY));
+		if (new_entry == NULL)
+			return 0;
+		layout->entry = new_entry;
+		layout->max_entries *= 2;
+	}
+	if (2 * (layout->nb_entries + 1) > layout->hash_size) {
+		new_table = calloc(2 * (size_t)layout->hash_size, sizeof(uint32_t));
+		if (new_table == NULL)
+			return 0;
+		mask = 2 * layout->hash_size - 1;
+		for (i = 0; i < layout->hash_size; i++) {
+			if (layout->hash_table[i] == 0)
+				continue;
+			e = &layout->entry[layout->hash_table[i]];
+			for (j = LayoutHash(e->parent, e->name) & mask; new_table[j] != 0; j = (j + 1) & mask);
+			new_table[j] = layout->hash_table[i];
+		}
+		free(layout->hash_table);
+		layout->hash_table = new_table;
+		layout->hash_size *= 2;
+	}
+
+	index = layout->nb_entries;
+	e = &layout->entry[index];
+	memset(e, 0, sizeof(FAT32_LAYOUT_ENTRY));
+	e->name = safe_strdup(name);
+	if (e->name == NULL)
+		return 0;
+	e->parent = parent;
+	e->is_dir = (BOOLEAN)is_dir;
+	SetLayoutTimestamp(e, ft);
+	if (layout->entry[parent].first_child == 0)
+		layout->entry[parent].first_child = index;
+	else
+		layout->entry[layout->entry[parent].last_child].next_sibling = index;
+	layout->entry[parent].last_child = index;
+	mask = layout->hash_size - 1;
+	for (i = LayoutHash(parent, name) & mask; layout->hash_table[i] != 0; i = (i + 1) & mask);
+	layout->hash_table[i] = index;
+	layout->nb_entries++;
+	return index;
+}
+
+FAT32_LAYOUT* CreateFAT32Layout(fat32_layout_read_t read, void* read_ctx)
+{
+	FAT32_LAYOUT* layout = calloc(1, sizeof(FAT32_LAYOUT));
+
+	if (layout == NULL)
+		return NULL;
+	layout->max_entries = 1024;
+	layout->hash_size = 2048;
+	layout->entry = calloc(layout->max_entries, sizeof(FAT32_LAYOUT_ENTRY));
+	layout->hash_table = calloc(layout->hash_size, sizeof(uint32_t));
+	if ((layout->entry == NULL) || (layout->hash_table == NULL)) {
+		FreeFAT32Layout(layout);
+		return NULL;
+	}
+	layout->entry[0].is_dir = TRUE;
+	SetLayoutTimestamp(&layout->entry[0], NULL);
+	layout->nb_entries = 1;
+	layout->read = read;
+	layout->read_ctx = read_ctx;
+	return layout;
+}
+
+void FreeFAT32Layout(FAT32_LAYOUT* layout)
+{
+	uint32_t i;
+
+	if (layout == NULL)
+		return;
+	if (layout->entry != NULL) {
+		for (i = 0; i < layout->nb_entries; i++) {
+			safe_free(layout->entry[i].name);
+			safe_free(layout->entry[i].data);
+		}
+	}
+	safe_free(layout->entry);
+	safe_free(layout->hash_table);
+	free(layout);
+}
+
+/*
+ * Add a file or directory to the layout. 'path' is relative to the root of the volume, and
+ * missing parent directories are created. Adding a file that already exists replaces it.
+ * If 'data' is not NULL, it must have been allocated with malloc() and is then owned by the
+ * layout (including on error), else the file content is obtained from the read callback.
+ */
+BOOL AddFAT32LayoutEntry(FAT32_LAYOUT* layout, const char* path, BOOL is_dir, uint64_t size, uint64_t src, uint8_t* data, const FILETIME* ft)
+{
+	BOOL r = FALSE;
+	char *p, *name, *next, *tmp = NULL;
+	uint32_t index = 0, parent = 0;
+	FAT32_LAYOUT_ENTRY* e;
+
+	if ((layout == NULL) || (path == NULL))
+		goto out;
+	if (!is_dir && (size > 0xffffffffULL)) {
+		uprintf("Can't add '%s' to FAT32 layout: File is too large", path);
+		goto out;
+	}
+	tmp = safe_strdup(path);
+	if (tmp == NULL)
+		goto out;
+	for (p = tmp; *p != 0; p++) {
+		if (*p == '\\')
+			*p = '/';
+	}
+	for (name = tmp; ; name = next) {
+		while (*name == '/')
+			name++;
+		if (*name == 0)
+			goto out;
+		next = strchr(name, '/');
+		if (next != NULL) {
+			*next++ = 0;
+			while (*next == '/')
+				next++;
+			if (*next == 0)
+				next = NULL;
+		}
+		index = LookupLayoutEntry(layout, parent, name);
+		if (next == NULL)
+			break;
+		// Intermediate directory
+		if (index == 0)
+			index = NewLayoutEntry(layout, parent, name, TRUE, NULL);
+		if ((index == 0) || (!layout->entry[index].is_dir))
+			goto out;
+		parent = index;
+	}
+	if (index == 0)
+		index = NewLayoutEntry(layout, parent, name, is_dir, ft);
+	if (index == 0)
+		goto out;
+	e = &layout->entry[index];
+	if (e->is_dir != is_dir) {
+		uprintf("Can't add '%s' to FAT32 layout: Conflicting %s exists", path, e->is_dir ? "directory" : "file");
+		goto out;
+	}
+	if (!is_dir) {
+		safe_free(e->data);
+		e->data = data;
+		data = NULL;
+		e->size = (uint32_t)size;
+		e->src = src;
+		SetLayoutTimestamp(e, ft);
+	}
+	r = TRUE;
+
+out:
+	safe_free(data);
+	safe_free(tmp);
+	return r;
+}
+
+static __inline BOOL IsShortNameChar(char c)
+{
+	return ((c >= 'A') && (c <= 'Z')) || ((c >= '0') && (c <= '9')) ||
+		((c != 0) && (strchr(sfn_special_chars, c) != NULL));
+}
+
+// Returns TRUE if the name can be stored as a short name only, which is then set along with the case flags
+static BOOL GetDirectShortName(const char* name, uint8_t* short_name, uint8_t* nt_flags)
+{
+	const char* dot = strchr(name, '.');
+	size_t i, base_len = (dot == NULL) ? strlen(name) : (size_t)(dot - name);
+	size_t ext_len = (dot == NULL) ? 0 : strlen(&dot[1]);
+	BOOL lower[2] = { FALSE, FALSE }, upper[2] = { FALSE, FALSE };
+	int k;
+	char c;
+
+	if ((base_len == 0) || (base_len > 8) || (ext_len > 3) || ((dot != NULL) && (ext_len == 0)) ||
+		((dot != NULL) && (strchr(&dot[1], '.') != NULL)))
+		return FALSE;
+	memset(short_name, ' ', 11);
+	for (i = 0; name[i] != 0; i++) {
+		if (&name[i] == dot)
+			continue;
+		k = (i > base_len) ? 1 : 0;
+		c = name[i];
+		if ((c >= 'a') && (c <= 'z')) {
+			lower[k] = TRUE;
+			c -= 0x20;
+		} else if ((c >= 'A') && (c <= 'Z')) {
+			upper[k] = TRUE;
+		}
+		if (!IsShortNameChar(c))
+			return FALSE;
+		short_name[k ? (8 + i - base_len - 1) : i] = (uint8_t)c;
+	}
+	if ((lower[0] && upper[0]) || (lower[1] && upper[1]))
+		return FALSE;
+	*nt_flags = (lower[0] ? FAT_NTRES_LOWER_BASE : 0) | (lower[1] ? FAT_NTRES_LOWER_EXT : 0);
+	return TRUE;
+}
+
+// Fill the 'basis' short name from a long name, and return the number of base characters
+static size_t GetShortNameBasis(const char* name, uint8_t* basis)
+{
+	const char *p, *dot = strrchr(name, '.');
+	size_t i = 0, j = 0;
+	char c;
+
+	// Leading periods are ignored, so they can't introduce an extension
+	for (p = name; *p == '.'; p++);
+	if (dot < p)
+		dot = NULL;
+	memset(basis, ' ', 11);
+	for (; (*p != 0) && (p != dot); p++) {
+		c = *p;
+		if ((c == '.') || (c == ' ') || ((c & 0xc0) == 0x80))
+			continue;
+		if ((c >= 'a') && (c <= 'z'))
+			c -= 0x20;
+		if (i < 8)
+			basis[i++] = IsShortNameChar(c) ? c : '_';
+	}
+	for (p = (dot == NULL) ? "" : &dot[1]; (*p != 0) && (j < 3); p++) {
+		c = *p;
+		if ((c == ' ') || ((c & 0xc0) == 0x80))
+			continue;
+		if ((c >= 'a') && (c <= 'z'))
+			c -= 0x20;
+		basis[8 + j++] = IsShortNameChar(c) ? c : '_';
+	}
+	if (i == 0)
+		basis[i++] = '_';
+	return i;
+}
+
+// Returns FALSE if the short name is already present in the table, else inserts it
+static BOOL InsertShortName(const uint8_t** table, uint32_t size, const uint8_t* name)
+{
+	uint32_t i, h = 2166136261U, mask = size - 1;
+
+	for (i = 0; i < 11; i++) {
+		h ^= name[i];
+		h *= 16777619U;
+	}
+	for (i = h & mask; table[i] != NULL; i = (i + 1) & mask) {
+		if (memcmp(table[i], name, 11) == 0)
+			return FALSE;
+	}
+	table[i] = name;
+	return TRUE;
+}
+
+static uint8_t ShortNameChecksum(const uint8_t* name)
+{
+	uint8_t i, sum = 0;
+
+	for (i = 0; i < 11; i++)
+		sum = ((sum & 1) << 7) + (sum >> 1) + name[i];
+	return sum;
+}
+
+/*
+ * Set the short names and the number of LFN entries for all the children of a directory,
+ * and return the number of directory entries it requires (or 0 on error). 'existing' and
+ * 'nb_existing' are the directory entries that are already present on disk (root only).
+ */
+static uint32_t SetFAT32ShortNames(FAT32_LAYOUT* layout, uint32_t dir, const uint8_t* existing, uint32_t nb_existing)
+{
+	const uint8_t** table = NULL;
+	uint32_t i, n, table_size, nb_dirents = (dir == 0) ? nb_existing : 2;
+	WCHAR wname[FAT32_MAX_LFN_SIZE + 1];
+	FAT32_LAYOUT_ENTRY* e;
+	char tail[8];
+	size_t base_len, len, tail_len;
+	int wlen;
+
+	for (n = nb_existing, i = layout->entry[dir].first_child; i != 0; i = layout->entry[i].next_sibling)
+		n++;
+	for (table_size = 64; table_size < 2 * n; table_size <<= 1);
+	table = (const uint8_t**)calloc(table_size, sizeof(uint8_t*));
+	if (table == NULL)
+		return 0;
+	for (i = 0; i < nb_existing; i++) {
+		// Skip deleted entries, as well as volume label and LFN entries
+		if ((existing[i * FAT_DIRENT_SIZE] != 0xe5) && !(existing[i * FAT_DIRENT_SIZE + 11] & FAT_ATTR_VOLUME_ID))
+			InsertShortName(table, table_size, &existing[i * FAT_DIRENT_SIZE]);
+	}
+
+	// Names that are valid short names are used as is and take precedence
+	for (i = layout->entry[dir].first_child; i != 0; i = layout->entry[i].next_sibling) {
+		e = &layout->entry[i];
+		wlen = utf8_to_wchar_no_alloc(e->name, wname, ARRAYSIZE(wname));
+		if (wlen <= 1) {
+			uprintf("Can't use '%s' as a FAT32 file name", e->name);
+			nb_dirents = 0;
+			goto out;
+		}
+		e->nb_lfn = (uint8_t)((wlen - 1 + FAT_LFN_CHARS - 1) / FAT_LFN_CHARS);
+		if (GetDirectShortName(e->name, e->short_name, &e->nt_flags)) {
+			if (!InsertShortName(table, table_size, e->short_name)) {
+				uprintf("Can't use '%s' as a FAT32 file name: Name is already in use", e->name);
+				nb_dirents = 0;
+				goto out;
+			}
+			e->nb_lfn = 0;
+		}
+	}
+
+	// Other names get a "basis~n" short name along with LFN entries
+	for (i = layout->entry[dir].first_child; i != 0; i = layout->entry[i].next_sibling) {
+		e = &layout->entry[i];
+		nb_dirents += 1 + e->nb_lfn;
+		if (e->nb_lfn == 0)
+			continue;
+		e->nt_flags = 0;
+		base_len = GetShortNameBasis(e->name, e->short_name);
+		for (n = 1; n < 1000000; n++) {
+			tail_len = (size_t)sprintf(tail, "~%u", n);
+			len = MIN(base_len, 8 - tail_len);
+			memcpy(&e->short_name[len], tail, tail_len);
+			memset(&e->short_name[len + tail_len], ' ', 8 - len - tail_len);
+			if (InsertShortName(table, table_size, e->short_name))
+				break;
+		}
+		if (n >= 1000000) {
+			nb_dirents = 0;
+			goto out;
+		}
+	}
+	if (nb_dirents > FAT32_MAX_DIRENTS) {
+		uprintf("Can't create FAT32 directory '%s': Too many entries", (dir == 0) ? "\\" : layout->entry[dir].name);
+		nb_dirents = 0;
+	}
+
+out:
+	free((void*)table);
+	return nb_dirents;
+}
+
+static void SetFAT32Dirent(FAT_DIRENT* d, const uint8_t* name, BYTE attr, BYTE nt_flags,
+	uint32_t cluster, uint32_t size, WORD date, WORD time)
+{
+	memcpy(d->sName, name, 11);
+	d->bAttr = attr;
+	d->bNTRes = nt_flags;
+	d->bCrtTimeTenth = 0;
+	d->wCrtTime = time;
+	d->wCrtDate = date;
+	d->wLstAccDate = date;
+	d->wFstClusHI = (WORD)(cluster >> 16);
+	d->wWrtTime = time;
+	d->wWrtDate = date;
+	d->wFstClusLO = (WORD)cluster;
+	d->dFileSize = size;
+}
+
+// Populate the directory entries of a layout directory, and return the number of bytes used
+static size_t BuildFAT32Directory(FAT32_LAYOUT* layout, uint32_t dir, uint8_t* buf)
+{
+	static const uint8_t lfn_offset[FAT_LFN_CHARS] = { 1, 3, 5, 7, 9, 14, 16, 18, 20, 22, 24, 28, 30 };
+	FAT32_LAYOUT_ENTRY *d = &layout->entry[dir], *e;
+	WCHAR wname[FAT32_MAX_LFN_SIZE + 1], wc;
+	uint8_t *p = buf, checksum, short_name[11];
+	uint32_t i, j, k, c;
+	int wlen;
+
+	if (dir != 0) {
+		memset(short_name, ' ', sizeof(short_name));
+		short_name[0] = '.';
+		SetFAT32Dirent((FAT_DIRENT*)p, short_name, FAT_ATTR_DIRECTORY, 0, d->cluster, 0, d->date, d->time);
+		p += FAT_DIRENT_SIZE;
+		short_name[1] = '.';
+		SetFAT32Dirent((FAT_DIRENT*)p, short_name, FAT_ATTR_DIRECTORY, 0,
+			(d->parent == 0) ? 0 : layout->entry[d->parent].cluster, 0, d->date, d->time);
+		p += FAT_DIRENT_SIZE;
+	}
+	for (i = d->first_child; i != 0; i = e->next_sibling) {
+		e = &layout->entry[i];
+		if (e->nb_lfn != 0) {
+			wlen = utf8_to_wchar_no_alloc(e->name, wname, ARRAYSIZE(wname)) - 1;
+			checksum = ShortNameChecksum(e->short_name);
+			for (j = e->nb_lfn; j > 0; j--) {
+				memset(p, 0, FAT_DIRENT_SIZE);
+				p[0] = (uint8_t)(j | ((j == e->nb_lfn) ? 0x40 : 0));
+				p[11] = FAT_ATTR_LFN;
+				p[13] = checksum;
+				for (k = 0; k < FAT_LFN_CHARS; k++) {
+					c = (j - 1) * FAT_LFN_CHARS + k;
+					wc = (c < (uint32_t)wlen) ? wname[c] : ((c == (uint32_t)wlen) ? 0x0000 : 0xffff);
+					p[lfn_offset[k]] = (uint8_t)wc;
+					p[lfn_offset[k] + 1] = (uint8_t)(wc >> 8);
+				}
+				p += FAT_DIRENT_SIZE;
+			}
+		}
+		SetFAT32Dirent((FAT_DIRENT*)p, e->short_name, e->is_dir ? FAT_ATTR_DIRECTORY : FAT_ATTR_ARCHIVE,
+			e->nt_flags, e->cluster, e->is_dir ? 0 : e->size, e->date, e->time);
+		p += FAT_DIRENT_SIZE;
+	}
+	return p - buf;
+}
+
+static BOOL FlushFAT32Stream(FAT32_STREAM* s)
+{
+	DWORD wr_size;
+
+	if (s->pos == 0)
+		return TRUE;
+	if (!WriteFileWithRetry(s->hDrive, s->buf, s->pos, &wr_size, WRITE_RETRIES) || (wr_size != s->pos)) {
+		uprintf("Could not write FAT32 data: %s", WindowsErrorString());
+		return FALSE;
+	}
+	s->written += s->pos;
+	s->pos = 0;
+	UpdateProgressWithInfo(OP_FILE_COPY, MSG_231, s->written, s->total);
+	return TRUE;
+}
+
+// Append data (or zeroes if buf is NULL) to the stream
+static BOOL WriteFAT32Stream(FAT32_STREAM* s, const uint8_t* buf, size_t size)
+{
+	size_t n;
+
+	while (size > 0) {
+		n = MIN(size, FAT32_LAYOUT_BUFFER_SIZE - s->pos);
+		if (buf == NULL) {
+			memset(&s->buf[s->pos], 0, n);
+		} else {
+			memcpy(&s->buf[s->pos], buf, n);
+			buf += n;
+		}
+		s->pos += (DWORD)n;
+		size -= n;
+		if ((s->pos == FAT32_LAYOUT_BUFFER_SIZE) && !FlushFAT32Stream(s))
+			return FALSE;
+	}
+	return TRUE;
+}
+
+static BOOL WriteFAT32StreamFile(FAT32_STREAM* s, FAT32_LAYOUT* layout, FAT32_LAYOUT_ENTRY* e)
+{
+	uint64_t offset;
+	DWORD n;
+
+	if (e->data != NULL)
+		return WriteFAT32Stream(s, e->data, e->size);
+	for (offset = 0; offset < e->size; offset += n) {
+		if (IS_ERROR(ErrorStatus))
+			return FALSE;
+		n = (DWORD)MIN(e->size - offset, FAT32_LAYOUT_BUFFER_SIZE - s->pos);
+		if ((layout->read == NULL) || !layout->read(layout->read_ctx, e->src, offset, &s->buf[s->pos], n)) {
+			uprintf("Could not read data for '%s'", e->name);
+			return FALSE;
+		}
+		s->pos += n;
+		if ((s->pos == FAT32_LAYOUT_BUFFER_SIZE) && !FlushFAT32Stream(s))
+			return FALSE;
+	}
+	return TRUE;
+}
+
+static __inline uint32_t GetNbClusters(FAT32_LAYOUT_ENTRY* e, uint32_t ClusterSize)
+{
+	uint64_t size = e->is_dir ? (uint64_t)e->nb_dirents * FAT_DIRENT_SIZE : e->size;
+
+	return (uint32_t)(HI_ALIGN_X_TO_Y(size, ClusterSize) / ClusterSize);
+}
+
+static __inline void SetFAT32Chain(DWORD* fat, uint32_t base, uint32_t cluster, uint32_t nb_clusters)
+{
+	uint32_t i;
+
+	for (i = 0; i < nb_clusters; i++)
+		fat[cluster + i - base] = (i == nb_clusters - 1) ? FAT32_EOC : cluster + i + 1;
+}
+
+/*
+ * Write the content of a layout onto the freshly formatted FAT32 volume opened as
+ * hLogicalVolume. Existing root directory entries (e.g. the volume label) are preserved,
+ * and the new content is allocated above the last used cluster. Returns FALSE with
+ * ErrorStatus unset if the volume was left untouched.
+ */
+static BOOL WriteFAT32LayoutToVolume(FAT32_LAYOUT* layout, HANDLE hLogicalVolume, DWORD BytesPerSect)
+{
+	BOOL r = FALSE, written = FALSE;
+	FAT_BOOTSECTOR32* pFAT32BootSect = NULL;
+	FAT_FSINFO* pFAT32FsInfo = NULL;
+	FAT32_STREAM stream = { 0 };
+	DWORD *fat = NULL, *sector = NULL;
+	uint8_t *root_buf = NULL, *dir_buf = NULL;
+	uint32_t i, j, n, ClusterSize, FatStart, FatSize, DataStart, NumFATs;
+	uint32_t MaxCluster, LastUsed = 0, FreeCount = 0, NxtCluster, StartCluster, RootExt, MaxDirSize = 0;
+	uint32_t *root_chain = NULL, root_len = 0, nb_existing, root_size, fat_sector = (uint32_t)-1;
+	uint64_t s, s0, s1;
+	LARGE_INTEGER li;
+
+	pFAT32BootSect = (FAT_BOOTSECTOR32*)_mm_malloc(BytesPerSect, BytesPerSect);
+	pFAT32FsInfo = (FAT_FSINFO*)_mm_malloc(BytesPerSect, BytesPerSect);
+	sector = (DWORD*)_mm_malloc(BytesPerSect, BytesPerSect);
+	stream.buf = (uint8_t*)_mm_malloc(FAT32_LAYOUT_BUFFER_SIZE, BytesPerSect);
+	if ((pFAT32BootSect == NULL) || (pFAT32FsInfo == NULL) || (sector == NULL) || (stream.buf == NULL))
+		goto out;
+
+	if (read_sectors(hLogicalVolume, BytesPerSect, 0, 1, pFAT32BootSect) != BytesPerSect) {
+		uprintf("Could not read FAT32 boot sector: %s", WindowsErrorString());
+		goto out;
+	}
+	if ((pFAT32BootSect->wBytsPerSec != BytesPerSect) || !IS_POWER_OF_2(pFAT32BootSect->bSecPerClus) ||
+		(pFAT32BootSect->wRootEntCnt != 0) || (pFAT32BootSect->wFATSz16 != 0) || (pFAT32BootSect->dFATSz32 == 0) ||
+		(pFAT32BootSect->bNumFATs == 0) || (pFAT32BootSect->wExtFlags & 0x80) ||
+		(memcmp(pFAT32BootSect->sBS_FilSysType, "FAT32   ", 8) != 0)) {
+		uprintf("Unexpected FAT32 boot sector parameters");
+		goto out;
+	}
+	ClusterSize = pFAT32BootSect->bSecPerClus * BytesPerSect;
+	FatStart = pFAT32BootSect->wRsvdSecCnt;
+	FatSize = pFAT32BootSect->dFATSz32;
+	NumFATs = pFAT32BootSect->bNumFATs;
+	DataStart = FatStart + NumFATs * FatSize;
+	if ((DataStart >= pFAT32BootSect->dTotSec32) || (FAT32_LAYOUT_BUFFER_SIZE % ClusterSize != 0)) {
+		uprintf("Unexpected FAT32 boot sector parameters");
+		goto out;
+	}
+	MaxCluster = (pFAT32BootSect->dTotSec32 - DataStart) / pFAT32BootSect->bSecPerClus + 1;
+	MaxCluster = MIN(MaxCluster, (FatSize * (BytesPerSect / 4)) - 1);
+
+	// Find the last used cluster and the number of free clusters
+	n = FAT32_LAYOUT_BUFFER_SIZE / BytesPerSect;
+	for (s = 0; s * (BytesPerSect / 4) <= MaxCluster; s += n) {
+		n = (uint32_t)MIN(n, FatSize - s);
+		if (read_sectors(hLogicalVolume, BytesPerSect, FatStart + s, n, stream.buf) != (int64_t)n * BytesPerSect) {
+			uprintf("Could not read FAT: %s", WindowsErrorString());
+			goto out;
+		}
+		for (i = 0; i < n * (BytesPerSect / 4); i++) {
+			j = (uint32_t)(s * (BytesPerSect / 4)) + i;
+			if (j > MaxCluster)
+				break;
+			if (j < 2)
+				continue;
+			if ((((DWORD*)stream.buf)[i] & FAT32_CLUSTER_MASK) != 0)
+				LastUsed = j;
+			else
+				FreeCount++;
+		}
+	}
+
+	// Read the existing root directory
+	root_chain = (uint32_t*)calloc(FAT32_MAX_DIRENTS * FAT_DIRENT_SIZE / ClusterSize + 1, sizeof(uint32_t));
+	if (root_chain == NULL)
+		goto out;
+	for (i = pFAT32BootSect->dRootClus; (i >= 2) && (i <= MaxCluster); i = sector[i % (BytesPerSect / 4)] & FAT32_CLUSTER_MASK) {
+		if (root_len > FAT32_MAX_DIRENTS * FAT_DIRENT_SIZE / ClusterSize) {
+			uprintf("Unexpected root directory size");
+			goto out;
+		}
+		root_chain[root_len++] = i;
+		if (fat_sector != i / (BytesPerSect / 4)) {
+			fat_sector = i / (BytesPerSect / 4);
+			if (read_sectors(hLogicalVolume, BytesPerSect, FatStart + fat_sector, 1, sector) != BytesPerSect)
+				goto out;
+		}
+	}
+	if (root_len == 0) {
+		uprintf("Could not locate FAT32 root directory");
+		goto out;
+	}
+
+	// Set the short names and compute the directory sizes. The root directory buffer must be
+	// large enough for the existing clusters as well as for a maximum size directory.
+	root_buf = (uint8_t*)_mm_malloc((size_t)root_len * ClusterSize + FAT32_MAX_DIRENTS * FAT_DIRENT_SIZE, BytesPerSect);
+	if (root_buf == NULL)
+		goto out;
+	for (i = 0; i < root_len; i++) {
+		if (read_sectors(hLogicalVolume, BytesPerSect, DataStart + (uint64_t)(root_chain[i] - 2) * pFAT32BootSect->bSecPerClus,
+			pFAT32BootSect->bSecPerClus, &root_buf[i * ClusterSize]) != ClusterSize) {
+			uprintf("Could not read FAT32 root directory: %s", WindowsErrorString());
+			goto out;
+		}
+	}
+	for (nb_existing = 0; (nb_existing < root_len * ClusterSize / FAT_DIRENT_SIZE) &&
+		(root_buf[nb_existing * FAT_DIRENT_SIZE] != 0); nb_existing++);
+	for (i = 0; i < layout->nb_entries; i++) {
+		if (!layout->entry[i].is_dir)
+			continue;
+		layout->entry[i].nb_dirents = SetFAT32ShortNames(layout, i, root_buf, (i == 0) ? nb_existing : 0);
+		if (layout->entry[i].nb_dirents == 0)
+			goto out;
+		MaxDirSize = MAX(MaxDirSize, layout->entry[i].nb_dirents * FAT_DIRENT_SIZE);
+	}
+
+	dir_buf = (uint8_t*)malloc(MaxDirSize);
+	if (dir_buf == NULL)
+		goto out;
+
+	// Allocate contiguous clusters: root directory extension, directories and then files
+	root_size = MAX(HI_ALIGN_X_TO_Y(layout->entry[0].nb_dirents * FAT_DIRENT_SIZE, ClusterSize), root_len * ClusterSize);
+	RootExt = (root_size / ClusterSize > root_len) ? root_size / ClusterSize - root_len : 0;
+	StartCluster = LastUsed + 1;
+	NxtCluster = StartCluster + RootExt;
+	stream.total = (uint64_t)RootExt * ClusterSize;
+	for (j = 0; j < 2; j++) {
+		for (i = 1; i < layout->nb_entries; i++) {
+			FAT32_LAYOUT_ENTRY* e = &layout->entry[i];
+			if (e->is_dir != (j == 0))
+				continue;
+			n = GetNbClusters(e, ClusterSize);
+			e->cluster = (n == 0) ? 0 : NxtCluster;
+			if (NxtCluster + (uint64_t)n > (uint64_t)MaxCluster + 1) {
+				uprintf("Not enough contiguous space on FAT32 volume");
+				goto out;
+			}
+			NxtCluster += n;
+			stream.total += (uint64_t)n * ClusterSize;
+		}
+	}
+	if (NxtCluster - StartCluster > FreeCount) {
+		uprintf("Not enough space on FAT32 volume");
+		goto out;
+	}
+	uprintf("Writing %s as %lu contiguous clusters, starting at cluster %lu...",
+		SizeToHumanReadable(stream.total, FALSE, FALSE), NxtCluster - StartCluster, StartCluster);
+
+	// Now we're committed: Write the data area as one sequential stream
+	written = TRUE;
+	stream.hDrive = hLogicalVolume;
+	UpdateProgressWithInfoInit(NULL, TRUE);
+	BuildFAT32Directory(layout, 0, &root_buf[nb_existing * FAT_DIRENT_SIZE]);
+	memset(&root_buf[layout->entry[0].nb_dirents * FAT_DIRENT_SIZE], 0, root_size - layout->entry[0].nb_dirents * FAT_DIRENT_SIZE);
+	if (NxtCluster > StartCluster) {
+		li.QuadPart = (DataStart + (uint64_t)(StartCluster - 2) * pFAT32BootSect->bSecPerClus) * BytesPerSect;
+		if (!SetFilePointerEx(hLogicalVolume, li, NULL, FILE_BEGIN)) {
+			uprintf("Could not seek FAT32 volume: %s", WindowsErrorString());
+			goto out;
+		}
+	}
+	if ((RootExt != 0) && !WriteFAT32Stream(&stream, &root_buf[root_len * ClusterSize], (size_t)RootExt * ClusterSize))
+		goto out;
+	for (j = 0; j < 2; j++) {
+		for (i = 1; i < layout->nb_entries; i++) {
+			FAT32_LAYOUT_ENTRY* e = &layout->entry[i];
+			if ((e->is_dir != (j == 0)) || (e->cluster == 0))
+				continue;
+			CHECK_FOR_USER_CANCEL;
+			if (e->is_dir) {
+				s = BuildFAT32Directory(layout, i, dir_buf);
+				if (!WriteFAT32Stream(&stream, dir_buf, (size_t)s))
+					goto out;
+			} else {
+				s = e->size;
+				if (!WriteFAT32StreamFile(&stream, layout, e))
+					goto out;
+			}
+			if (!WriteFAT32Stream(&stream, NULL, (size_t)((uint64_t)GetNbClusters(e, ClusterSize) * ClusterSize - s)))
+				goto out;
+		}
+	}
+	if (!FlushFAT32Stream(&stream))
+		goto out;
+	for (i = 0; i < root_len; i++) {
+		if (write_sectors(hLogicalVolume, BytesPerSect, DataStart + (uint64_t)(root_chain[i] - 2) * pFAT32BootSect->bSecPerClus,
+			pFAT32BootSect->bSecPerClus, &root_buf[i * ClusterSize]) != ClusterSize) {
+			uprintf("Could not write FAT32 root directory: %s", WindowsErrorString());
+			goto out;
+		}
+	}
+
+	// Update the FATs
+	uprintf("Updating FATs...");
+	if (NxtCluster > StartCluster) {
+		s0 = StartCluster / (BytesPerSect / 4);
+		s1 = (NxtCluster - 1) / (BytesPerSect / 4);
+		n = (uint32_t)(s1 - s0 + 1);
+		fat = (DWORD*)_mm_malloc((size_t)n * BytesPerSect, BytesPerSect);
+		if (fat == NULL)
+			goto out;
+		memset(fat, 0, (size_t)n * BytesPerSect);
+		// Preserve the entries that precede our first cluster
+		if (read_sectors(hLogicalVolume, BytesPerSect, FatStart + s0, 1, fat) != BytesPerSect)
+			goto out;
+		j = (uint32_t)(s0 * (BytesPerSect / 4));
+		if (RootExt != 0)
+			SetFAT32Chain(fat, j, StartCluster, RootExt);
+		for (i = 1; i < layout->nb_entries; i++) {
+			FAT32_LAYOUT_ENTRY* e = &layout->entry[i];
+			if (e->cluster != 0)
+				SetFAT32Chain(fat, j, e->cluster, GetNbClusters(e, ClusterSize));
+		}
+		for (i = 0; i < NumFATs; i++) {
+			if (write_sectors(hLogicalVolume, BytesPerSect, FatStart + (uint64_t)i * FatSize + s0, n, fat) != (int64_t)n * BytesPerSect) {
+				uprintf("Could not write FAT: %s", WindowsErrorString());
+				goto out;
+			}
+		}
+		// Link the existing root directory clusters to the extension
+		if (RootExt != 0) {
+			fat_sector = root_chain[root_len - 1] / (BytesPerSect / 4);
+			for (i = 0; i < NumFATs; i++) {
+				if (read_sectors(hLogicalVolume, BytesPerSect, FatStart + i * FatSize + fat_sector, 1, sector) != BytesPerSect)
+					goto out;
+				sector[root_chain[root_len - 1] % (BytesPerSect / 4)] = StartCluster;
+				if (write_sectors(hLogicalVolume, BytesPerSect, FatStart + i * FatSize + fat_sector, 1, sector) != BytesPerSect)
+					goto out;
+			}
+		}
+	}
+
+	// Update the FSInfo sector and its backup
+	if ((pFAT32BootSect->wFSInfo != 0) && (pFAT32BootSect->wFSInfo < FatStart)) {
+		for (i = 0; i < 2; i++) {
+			s = pFAT32BootSect->wFSInfo + ((i == 0) ? 0 : pFAT32BootSect->wBkBootSec);
+			if ((i != 0) && ((pFAT32BootSect->wBkBootSec == 0) || (s >= FatStart)))
+				break;
+			if ((read_sectors(hLogicalVolume, BytesPerSect, s, 1, pFAT32FsInfo) != BytesPerSect) ||
+				(pFAT32FsInfo->dLeadSig != 0x41615252) || (pFAT32FsInfo->dStrucSig != 0x61417272))
+				continue;
+			pFAT32FsInfo->dFree_Count = FreeCount - (NxtCluster - StartCluster);
+			pFAT32FsInfo->dNxt_Free = NxtCluster;
+			if (write_sectors(hLogicalVolume, BytesPerSect, s, 1, pFAT32FsInfo) != BytesPerSect)
+				uprintf("Could not update FSInfo sector: %s", WindowsErrorString());
+		}
+	}
+	uprintf("FAT32 population completed.");
+	r = TRUE;
+
+out:
+	if (!r && written && !IS_ERROR(ErrorStatus))
+		ErrorStatus = RUFUS_ERROR(ERROR_WRITE_FAULT);
+	safe_free(root_chain);
+	safe_mm_free(pFAT32BootSect);
+	safe_mm_free(pFAT32FsInfo);
+	safe_mm_free(sector);
+	safe_mm_free(stream.buf);
+	safe_mm_free(root_buf);
+	safe_free(dir_buf);
+	safe_mm_free(fat);
+	return r;
+}
+
+/*
+ * Write the content of a layout onto a freshly formatted FAT32 volume. Returns FALSE with
+ * ErrorStatus unset if the volume was left untouched, in which case the caller may fall
+ * back to regular copy.
+ */
+BOOL WriteFAT32Layout(FAT32_LAYOUT* layout, DWORD DriveIndex, uint64_t PartitionOffset)
+{
+	BOOL r;
+	HANDLE hLogicalVolume;
+
+	if ((layout == NULL) || (layout->nb_entries <= 1))
+		return FALSE;
+
+	hLogicalVolume = GetLogicalHandle(DriveIndex, PartitionOffset, TRUE, TRUE, FALSE);
+	if ((hLogicalVolume == INVALID_HANDLE_VALUE) || (hLogicalVolume == NULL)) {
+		uprintf("Could not open volume for FAT32 population");
+		return FALSE;
+	}
+	// Make sure the file system driver drops its cached view of the volume
+	UnmountVolume(hLogicalVolume);
+	r = WriteFAT32LayoutToVolume(layout, hLogicalVolume, MAX(SelectedDrive.SectorSize, 512));
+	safe_unlockclose(hLogicalVolume);
+	return r;
+}
+
+#if defined(_DEBUG) || defined(TEST) || defined(ALPHA)
+extern const char test_msg[];
+extern int libfat_readfile(intptr_t pp, void* buf, size_t size, libfat_sector_t sector);
+
+// Enough clusters for libfat to see the test image as FAT32 rather than FAT16
+#define FAT32_TEST_CLUSTERS         66000
+#define FAT32_TEST_RSVD_SECTORS     32
+#define FAT32_TEST_FAT_SIZE         ((FAT32_TEST_CLUSTERS + 2) * 4 / 512 + 1)
+#define FAT32_TEST_DATA_START       (FAT32_TEST_RSVD_SECTORS + 2 * FAT32_TEST_FAT_SIZE)
+#define FAT32_TEST_MAX_FILE_SIZE    (6 * MB)
+
+/* Content of the test layout files that are not in memory */
+static BOOL TestFAT32LayoutRead(void* ctx, uint64_t src, uint64_t offset, uint8_t* buf, DWORD size)
+{
+	DWORD i;
+
+	for (i = 0; i < size; i++)
+		buf[i] = (uint8_t)(src * 131 + (offset + i) * 7 + ((offset + i) >> 9));
+	return TRUE;
+}
+
+/* Create a freshly formatted FAT32 image, with 512 bytes sectors and clusters and a volume label */
+static HANDLE CreateFAT32TestImage(const char* path)
+{
+	uint8_t sector[512] = { 0 };
+	FAT_BOOTSECTOR32* bs = (FAT_BOOTSECTOR32*)sector;
+	FAT_FSINFO* fsi = (FAT_FSINFO*)sector;
+	FAT_DIRENT* label = (FAT_DIRENT*)sector;
+	DWORD fat[3] = { 0x0ffffff8, FAT32_EOC, FAT32_EOC };
+	LARGE_INTEGER li;
+	HANDLE h;
+	int i;
+
+	h = CreateFileU(path, GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (h == INVALID_HANDLE_VALUE)
+		return h;
+	li.QuadPart = (FAT32_TEST_DATA_START + FAT32_TEST_CLUSTERS) * 512LL;
+	if (!SetFilePointerEx(h, li, NULL, FILE_BEGIN) || !SetEndOfFile(h))
+		goto err;
+	memcpy(bs->sJmpBoot, "\xeb\x58\x90", 3);
+	memcpy(bs->sOEMName, "MSWIN4.1", 8);
+	bs->wBytsPerSec = 512;
+	bs->bSecPerClus = 1;
+	bs->wRsvdSecCnt = FAT32_TEST_RSVD_SECTORS;
+	bs->bNumFATs = 2;
+	bs->bMedia = 0xf8;
+	bs->dTotSec32 = FAT32_TEST_DATA_START + FAT32_TEST_CLUSTERS;
+	bs->dFATSz32 = FAT32_TEST_FAT_SIZE;
+	bs->dRootClus = 2;
+	bs->wFSInfo = 1;
+	bs->wBkBootSec = 6;
+	bs->bBootSig = 0x29;
+	memcpy(bs->sVolLab, "FAT32 TEST ", 11);
+	memcpy(bs->sBS_FilSysType, "FAT32   ", 8);
+	sector[510] = 0x55;
+	sector[511] = 0xaa;
+	if ((write_sectors(h, 512, 0, 1, sector) != 512) || (write_sectors(h, 512, 6, 1, sector) != 512))
+		goto err;
+	memset(sector, 0, sizeof(sector));
+	fsi->dLeadSig = 0x41615252;
+	fsi->dStrucSig = 0x61417272;
+	fsi->dFree_Count = FAT32_TEST_CLUSTERS - 1;
+	fsi->dNxt_Free = 3;
+	fsi->dTrailSig = 0xaa550000;
+	if ((write_sectors(h, 512, 1, 1, sector) != 512) || (write_sectors(h, 512, 7, 1, sector) != 512))
+		goto err;
+	memset(sector, 0, sizeof(sector));
+	memcpy(sector, fat, sizeof(fat));
+	for (i = 0; i < 2; i++) {
+		if (write_sectors(h, 512, FAT32_TEST_RSVD_SECTORS + i * FAT32_TEST_FAT_SIZE, 1, sector) != 512)
+			goto err;
+	}
+	memset(sector, 0, sizeof(sector));
+	memcpy(label->sName, "FAT32 TEST ", 11);
+	label->bAttr = FAT_ATTR_VOLUME_ID;
+	if (write_sectors(h, 512, FAT32_TEST_DATA_START, 1, sector) != 512)
+		goto err;
+	return h;
+
+err:
+	CloseHandle(h);
+	return INVALID_HANDLE_VALUE;
+}
+
+/* Check a directory, as read back through libfat, against the layout. Returns the number of errors. */
+static int CheckFAT32LayoutDir(struct libfat_filesystem* lf_fs, FAT32_LAYOUT* layout, uint32_t dir, int32_t cluster,
+	uint8_t* buf, uint8_t* expected)
+{
+	libfat_diritem_t diritem = { 0 };
+	libfat_dirpos_t dirpos = { cluster, -1, 0 };
+	libfat_sector_t s, next;
+	FAT32_LAYOUT_ENTRY* e;
+	uint32_t i, nsec, size, nb_children = 0, nb_found = 0;
+	char* name;
+	int errors = 0;
+
+	for (i = layout->entry[dir].first_child; i != 0; i = layout->entry[i].next_sibling)
+		nb_children++;
+	while ((dirpos.cluster = libfat_dumpdir(lf_fs, &dirpos, &diritem)) >= 0) {
+		name = wchar_to_utf8(diritem.name);
+		i = (name == NULL) ? 0 : LookupLayoutEntry(layout, dir, name);
+		if ((i == 0) || (strcmp(layout->entry[i].name, name) != 0)) {
+			uprintf("FAT32 layout: FAIL (unexpected entry '%s')", name);
+			errors++;
+			free(name);
+			continue;
+		}
+		free(name);
+		e = &layout->entry[i];
+		nb_found++;
+		if (e->is_dir != ((diritem.attributes & FAT_ATTR_DIRECTORY) != 0)) {
+			uprintf("FAT32 layout: FAIL ('%s' has the wrong type)", e->name);
+			errors++;
+		} else if (e->is_dir) {
+			errors += CheckFAT32LayoutDir(lf_fs, layout, i, dirpos.cluster, buf, expected);
+		} else if ((diritem.size != e->size) || ((e->size == 0) != (dirpos.cluster == 0))) {
+			uprintf("FAT32 layout: FAIL ('%s' has the wrong size)", e->name);
+			errors++;
+		} else if (e->size != 0) {
+			memset(buf, 0xaa, e->size);
+			s = libfat_clustertosector(lf_fs, dirpos.cluster);
+			for (size = 0; (size < e->size) && (s != 0) && (s < 0xFFFFFFFFULL); s = next) {
+				next = libfat_nextrun(lf_fs, s, (uint32_t)HI_ALIGN_X_TO_Y(e->size - size, 512) / 512, &nsec);
+				if (libfat_readrun(lf_fs, &buf[size], s, nsec) < 0)
+					break;
+				size += nsec * 512;
+			}
+			if (e->data != NULL)
+				memcpy(expected, e->data, e->size);
+			else
+				TestFAT32LayoutRead(NULL, e->src, 0, expected, e->size);
+			if ((size < e->size) || (memcmp(buf, expected, e->size) != 0)) {
+				uprintf("FAT32 layout: FAIL ('%s' has the wrong content)", e->name);
+				errors++;
+			}
+		}
+	}
+	// -2 is the end of the directory, anything else a read error
+	if ((dirpos.cluster != -2) || (nb_found != nb_children)) {
+		uprintf("FAT32 layout: FAIL (found %d of the %d entries of '%s')", nb_found, nb_children,
+			(dir == 0) ? "\\" : layout->entry[dir].name);
+		errors++;
+	}
+	return errors;
+}
+
+int TestFAT32Layout(void)
+{
+	char path[MAX_PATH] = "", name[256];
+	HANDLE h = INVALID_HANDLE_VALUE;
+	FAT32_LAYOUT* layout = NULL;
+	struct libfat_filesystem* lf_fs = NULL;
+	uint8_t *buf = NULL, *expected = NULL, *data;
+	uint32_t sector_shift = LIBFAT_SECTOR_SHIFT, sector_size = LIBFAT_SECTOR_SIZE, sector_mask = LIBFAT_SECTOR_MASK;
+	DWORD error_status = ErrorStatus;
+	int i, errors = 0;
+	// The files to add, in order. Directories are created as needed, and a file that is
+	// added again, regardless of case, is replaced.
+	static const struct {
+		const char* path;
+		uint32_t size;
+	} fat32_test_file[] = {
+		{ "/EFI/boot/bootx64.efi", 200000 },
+		{ "/EFI/BOOT/grubx64.efi", 512 },
+		{ "/README.TXT", 100 },
+		{ "/readme.md", 0 },
+		{ "/isolinux/isolinux.cfg", 513 },
+		{ "/MiXeD", 3 },
+		{ "/lower", 1 },
+		{ "/a b c.txt", 10 },
+		{ "/many.dots.in.name.tar.gz", 30 },
+		{ "/.disk/info", 20 },
+		{ "/\xc3\x9cn\xc3\xaf""c\xc3\xb6""d\xc3\xa9 \xe6\x96\x87\xe4\xbb\xb6.txt", 77 },
+		{ "/deep/a/b/c/d/e/file.bin", 65536 },
+		{ "/readme.txt", 200 },
+		// Crosses the end of the first FAT32_LAYOUT_BUFFER_SIZE stream buffer
+		{ "/sources/install.wim", 5 * MB + 123 },
+	};
+
+	LIBFAT_SECTOR_SHIFT = 9;
+	LIBFAT_SECTOR_SIZE = 512;
+	LIBFAT_SECTOR_MASK = 511;
+	buf = malloc(FAT32_TEST_MAX_FILE_SIZE);
+	expected = malloc(FAT32_TEST_MAX_FILE_SIZE);
+	layout = CreateFAT32Layout(TestFAT32LayoutRead, NULL);
+	if ((buf == NULL) || (expected == NULL) || (layout == NULL) ||
+		(GetTempFileNameU(temp_dir, APPLICATION_NAME, 0, path) == 0) ||
+		((h = CreateFAT32TestImage(path)) == INVALID_HANDLE_VALUE)) {
+		uprintf("FAT32 layout: Could not set up the test");
+		errors++;
+		goto out;
+	}
+
+	for (i = 0; i < ARRAYSIZE(fat32_test_file); i++) {
+		if (!AddFAT32LayoutEntry(layout, fat32_test_file[i].path, FALSE, fat32_test_file[i].size, i + 1, NULL, NULL))
+			goto add_error;
+	}
+	// A directory that spans multiple clusters, and enough root entries to extend the root
+	for (i = 0; i < 300; i++) {
+		static_sprintf(name, "/pool/main/package_number_%04d.deb", i);
+		if (!AddFAT32LayoutEntry(layout, name, FALSE, (i * 37) % 3000, 100 + i, NULL, NULL))
+			goto add_error;
+	}
+	for (i = 0; i < 40; i++) {
+		static_sprintf(name, "/f%02d", i);
+		if (!AddFAT32LayoutEntry(layout, name, FALSE, i % 3, 1000 + i, NULL, NULL))
+			goto add_error;
+	}
+	// A name that requires the maximum number of LFN entries
+	memset(name, 'x', 250);
+	strcpy(&name[250], ".txt");
+	name[0] = '/';
+	if (!AddFAT32LayoutEntry(layout, name, FALSE, 9, 2000, NULL, NULL) ||
+		!AddFAT32LayoutEntry(layout, "/empty", TRUE, 0, 0, NULL, NULL))
+		goto add_error;
+	data = (uint8_t*)safe_strdup(test_msg);
+	if ((data == NULL) || !AddFAT32LayoutEntry(layout, "/isolinux/link.txt", FALSE, strlen(test_msg), 0, data, NULL))
+		goto add_error;
+
+	if (!WriteFAT32LayoutToVolume(layout, h, 512)) {
+		uprintf("FAT32 layout: FAIL (could not write layout)");
+		errors++;
+		goto out;
+	}
+	lf_fs = libfat_open(libfat_readfile, (intptr_t)h);
+	if (lf_fs == NULL) {
+		uprintf("FAT32 layout: FAIL (libfat could not open the volume)");
+		errors++;
+		goto out;
+	}
+	errors += CheckFAT32LayoutDir(lf_fs, layout, 0, 0, buf, expected);
+	// libfat skips volume labels, so check the first root directory entry directly
+	data = libfat_get_sector(lf_fs, libfat_clustertosector(lf_fs, 0));
+	if ((data == NULL) || (memcmp(data, "FAT32 TEST ", 11) != 0) || (data[11] != FAT_ATTR_VOLUME_ID)) {
+		uprintf("FAT32 layout: FAIL (volume label was not preserved)");
+		errors++;
+	}
+	if (errors == 0)
+		uprintf("FAT32 layout: PASS (%d entries)", layout->nb_entries - 1);
+	goto out;
+
+add_error:
+	uprintf("FAT32 layout: Could not add entries to the layout");
+	errors++;
+
+out:
+	if (lf_fs != NULL)
+		libfat_close(lf_fs);
+	safe_closehandle(h);
+	if (path[0] != 0)
+		DeleteFileU(path);
+	FreeFAT32Layout(layout);
+	free(buf);
+	free(expected);
+	LIBFAT_SECTOR_SHIFT = sector_shift;
+	LIBFAT_SECTOR_SIZE = sector_size;
+	LIBFAT_SECTOR_MASK = sector_mask;
+	ErrorStatus = error_status;
+	return errors;
+}
+#endif
@@ -92,6 +92,7 @@
 #undef BIG_ENDIAN_HOST
 
 #define BUFFER_SIZE         (64*KB)
+#define HASH_FILE_BUFFER_SIZE (1*MB)
 #define WAIT_TIME           5000
 
 /* Number of buffers we work with */
@@ -1523,37 +1524,50 @@ hash_init_t *hash_init[HASH_MAX] = { md5_init, sha1_init , sha256_init, sha512_i
 hash_write_t *hash_write[HASH_MAX] = { md5_write, sha1_write , sha256_write, sha512_write };
 hash_final_t *hash_final[HASH_MAX] = { md5_final, sha1_final , sha256_final, sha512_final };
 
-/* Compute an individual hash without threading or buffering, for a single file */
+/*
+ * Compute an individual hash for a single file. We use double buffered asynchronous I/O,
+ * so that the next chunk of the file is being read while we hash the current one.
+ */
 BOOL HashFile(const unsigned type, const char* path, uint8_t* hash)
 {
-	BOOL r = FALSE;
+	BOOL r = FALSE, pending = FALSE;
 	HASH_CONTEXT hash_ctx = { {0} };
-	HANDLE h = INVALID_HANDLE_VALUE;
+	HANDLE h = NULL;
 	DWORD rs = 0;
-	uint64_t rb;
-	uint8_t buf[4096];
+	int read_bufnum = 0;
+	uint8_t* buf = NULL;
 
 	if ((type >= HASH_MAX) || (path == NULL) || (hash == NULL))
 		goto out;
 
-	h = CreateFileU(path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
-	if (h == INVALID_HANDLE_VALUE) {
+	buf = (uint8_t*)_mm_malloc(2 * HASH_FILE_BUFFER_SIZE, 64);
+	if (buf == NULL) {
+		ErrorStatus = RUFUS_ERROR(ERROR_NOT_ENOUGH_MEMORY);
+		goto out;
+	}
+
+	h = CreateFileAsync(path, GENERIC_READ, FILE_SHARE_READ, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN);
+	if (h == NULL) {
 		uprintf("Could not open file: %s", WindowsErrorString());
 		ErrorStatus = RUFUS_ERROR(ERROR_OPEN_FAILED);
 		goto out;
 	}
 
 	hash_init[type](&hash_ctx);
-	for (rb = 0; ; rb += rs) {
+	pending = ReadFileAsync(h, buf, HASH_FILE_BUFFER_SIZE);
+	while (1) {
 		CHECK_FOR_USER_CANCEL;
-		if (!ReadFile(h, buf, sizeof(buf), &rs, NULL)) {
+		if (!pending || !WaitFileAsync(h, DRIVE_ACCESS_TIMEOUT) || !GetSizeAsync(h, &rs)) {
 			ErrorStatus = RUFUS_ERROR(ERROR_READ_FAULT);
 			uprintf("  Read error: %s", WindowsErrorString());
 			goto out;
 		}
+		pending = FALSE;
 		if (rs == 0)
 			break;
-		hash_write[type](&hash_ctx, buf, (size_t)rs);
+		read_bufnum ^= 1;
+		pending = ReadFileAsync(h, &buf[read_bufnum * HASH_FILE_BUFFER_SIZE], HASH_FILE_BUFFER_SIZE);
+		hash_write[type](&hash_ctx, &buf[(read_bufnum ^ 1) * HASH_FILE_BUFFER_SIZE], (size_t)rs);
 	}
 	hash_final[type](&hash_ctx);
 
@@ -1561,10 +1575,80 @@ BOOL HashFile(const unsigned type, const char* path, uint8_t* hash)
 	r = TRUE;
 
 out:
-	safe_closehandle(h);
+	// Don't release the buffer while a read may still be writing into it
+	if (pending)
+		WaitFileAsync(h, DRIVE_ACCESS_TIMEOUT);
+	CloseFileAsync(h);
+	_mm_free(buf);
 	return r;
 }
 
+typedef struct {
+	unsigned type;
+	const char* const* path;
+	uint8_t* hash;
+	BOOL* hashed;
+	uint32_t count;
+	volatile LONG next;
+	volatile LONG done;
+} hash_files_job;
+
+static DWORD WINAPI HashFilesThread(LPVOID param)
+{
+	hash_files_job* job = (hash_files_job*)param;
+	BOOL r;
+	LONG i;
+
+	// Files can have very different sizes, so pick them one at a time rather than by range
+	while ((i = InterlockedIncrement(&job->next) - 1) < (LONG)job->count) {
+		r = HashFile(job->type, job->path[i], &job->hash[i * hash_count[job->type]]);
+		if (job->hashed != NULL)
+			job->hashed[i] = r;
+		if (r)
+			InterlockedIncrement(&job->done);
+	}
+	return 0;
+}
+
+/*
+ * Compute the hashes of multiple files, spread over a pool of up to one thread per CPU.
+ * hash must have room for count hashes of hash_count[type] bytes, and if hashed is not
+ * NULL, hashed[i] is set to whether path[i] could be hashed.
+ * Returns the number of files that were successfully hashed.
+ * Note that IsFileInDB() is always called for a single file whose result is needed right
+ * away, and that the bootloader revocation checks work on buffers read from the image, so
+ * neither of them goes through here.
+ */
+uint32_t HashFiles(const unsigned type, const char* const* path, const uint32_t count, uint8_t* hash, BOOL* hashed)
+{
+	HANDLE thread[MAXIMUM_WAIT_OBJECTS] = { 0 };
+	SYSTEM_INFO si;
+	hash_files_job job = { 0 };
+	uint32_t i, num_threads;
+
+	if ((type >= HASH_MAX) || (path == NULL) || (hash == NULL) || (count == 0))
+		return 0;
+
+	job.type = type;
+	job.path = path;
+	job.hash = hash;
+	job.hashed = hashed;
+	job.count = count;
+	GetSystemInfo(&si);
+	num_threads = min(min(si.dwNumberOfProcessors, count), MAXIMUM_WAIT_OBJECTS);
+	// The current thread also takes part, and picks up the work of any thread we couldn't create
+	for (i = 1; i < num_threads; i++)
+		thread[i] = CreateThread(NULL, 0, HashFilesThread, &job, 0, NULL);
+	HashFilesThread(&job);
+	for (i = 1; i < num_threads; i++) {
+		if (thread[i] == NULL)
+			continue;
+		WaitForSingleObject(thread[i], INFINITE);
+		CloseHandle(thread[i]);
+	}
+	return (uint32_t)job.done;
+}
+
 /* A part of an image, used for hashing */
 struct image_region {
 	const uint8_t*      data;
@@ -1999,7 +2083,7 @@ DWORD WINAPI HashThread(void* param)
 	HANDLE hash_thread[HASH_MAX] = { NULL, NULL, NULL, NULL };
 	DWORD wr;
 	VOID* fd = NULL;
-	uint64_t processed_bytes;
+	uint64_t processed_bytes, io_start;
 	int i, read_bufnum, r = -1;
 	int num_hashes = HASH_MAX - (enable_extra_hashes ? 0 : 1);
 
@@ -2007,6 +2091,7 @@ DWORD WINAPI HashThread(void* param)
 		ExitThread(r);
 
 	uprintf("\r\nComputing hash for '%s'...", image_path);
+	IoStatsStart("hash");
 
 	if (thread_affinity[0] != 0)
 		// Use the first affinity mask, as our read thread is the least
@@ -2056,12 +2141,14 @@ DWORD WINAPI HashThread(void* param)
 		CHECK_FOR_USER_CANCEL;
 
 		// 1. Wait for the current read operation to complete (and update the read size)
+		io_start = IoStatsNow();
 		if ((!WaitFileAsync(fd, DRIVE_ACCESS_TIMEOUT)) ||
 			(!GetSizeAsync(fd, &read_size[read_bufnum]))) {
 			uprintf("Read error: %s", WindowsErrorString());
 			ErrorStatus = RUFUS_ERROR(ERROR_READ_FAULT);
 			goto out;
 		}
+		IoStatsAdd(IOSTAT_READ, read_size[read_bufnum], io_start);
 
 		// 2. Switch to the next reading buffer
 		read_bufnum = (read_bufnum + 1) % NUM_BUFFERS;
@@ -2070,6 +2157,7 @@ DWORD WINAPI HashThread(void* param)
 		ReadFileAsync(fd, buffer[read_bufnum], BUFFER_SIZE);
 
 		// 4. Wait for all the hash threads to indicate that they are ready to process data
+		io_start = IoStatsNow();
 		wr = WaitForMultipleObjects(num_hashes, thread_ready, TRUE, WAIT_TIME);
 		if (wr != WAIT_OBJECT_0) {
 			if (wr == STATUS_TIMEOUT)
@@ -2077,6 +2165,8 @@ DWORD WINAPI HashThread(void* param)
 			uprintf("Hash threads failed to signal: %s", WindowsErrorString());
 			goto out;
 		}
+		// Any time spent here is time the hash threads needed on top of the read
+		IoStatsAdd(IOSTAT_CPU, (processed_bytes == 0) ? 0 : read_size[proc_bufnum], io_start);
 
 		// 5. Set the target buffer we want to process to the buffer we just read data into
 		// Note that this variable should only be updated AFTER all the threads have signalled.
@@ -2117,6 +2207,7 @@ out:
 		safe_closehandle(thread_ready[i]);
 	}
 	CloseFileAsync(fd);
+	IoStatsReport();
 	PostMessage(hMainDialog, UM_FORMAT_COMPLETED, (WPARAM)FALSE, 0);
 	if (r == 0)
 		MyDialogBox(hMainInstance, IDD_HASH, hMainDialog, HashCallback);
@@ -2335,6 +2426,47 @@ void PrintRevokedBootloaderInfo(void)
 		uprintf("Found %d additional revoked UEFI bootloaders from this system's SKUSiPolicy.p7b", pe256ssp_size);
 }
 
+/*
+ * Index the lines of an md5sum.txt file by path (with any leading '.' removed, so that
+ * "<MD5SUM>  ./casper/vmlinuz" is indexed as "/casper/vmlinuz"). The data of each entry
+ * points to the start of the line. Room is left for extra_entries additional entries.
+ */
+static BOOL IndexMD5Sum(char* md5_data, uint32_t md5_size, uint32_t extra_entries, htab_table* index)
+{
+	uint32_t idx, nb_lines = 1;
+	char c, *s, *e, *p, *q, *end = &md5_data[md5_size];
+
+	for (p = md5_data; (p = memchr(p, '\n', end - p)) != NULL; p++)
+		nb_lines++;
+	if (!htab_create(nb_lines + extra_entries, index))
+		return FALSE;
+
+	for (s = md5_data; s < end; s = e + 1) {
+		e = memchr(s, '\n', end - s);
+		if (e == NULL)
+			e = end;
+		for (p = s; (p < s + 2 * MD5_HASHSIZE) && (p < e) && IS_HEXASCII(*p); p++);
+		if ((p != s + 2 * MD5_HASHSIZE) || (p >= e) || ((*p != ' ') && (*p != '\t')))
+			continue;
+		while ((p < e) && ((*p == ' ') || (*p == '\t') || (*p == '*')))
+			p++;
+		if ((p < e) && (*p == '.'))
+			p++;
+		for (q = e; (q > p) && (q[-1] == '\r'); q--);
+		if (q == p)
+			continue;
+		// md5_data is NUL terminated so we can always do this
+		c = *q;
+		*q = 0;
+		idx = htab_hash(p, index);
+		*q = c;
+		// Keep the first occurrence of a path, as strstr() used to
+		if ((idx != 0) && (index->table[idx].data == NULL))
+			index->table[idx].data = s;
+	}
+	return TRUE;
+}
+
 /*
  * Updates the MD5SUMS/md5sum.txt file that some distros (Ubuntu, Mint...)
  * use to validate the media. Because we may alter some of the validated files
@@ -2346,15 +2478,16 @@ void PrintRevokedBootloaderInfo(void)
  */
 void UpdateMD5Sum(const char* dest_dir, const char* md5sum_name)
 {
-	BOOL display_header = TRUE;
 	BYTE* res_data;
 	DWORD res_size;
+	BOOL* hashed = NULL;
 	HANDLE hFile;
-	intptr_t pos;
-	uint32_t i, j, size, md5_size, new_size;
-	uint8_t sum[MD5_HASHSIZE];
+	htab_table index = HTAB_EMPTY;
+	uint8_t* sum = NULL;
+	uint32_t i, j, idx, size, md5_size, new_size, count = 0;
 	char md5_path[64], path1[64], path2[64], bootloader_name[32];
-	char *md5_data = NULL, *new_data = NULL, *str_pos, *d, *s, *p;
+	char *md5_data = NULL, *new_data = NULL, *d, *s, *p, **line = NULL;
+	const char** path = NULL;
 
 	if (!img_report.has_md5sum && !validate_md5sum)
 		return;
@@ -2364,27 +2497,48 @@ void UpdateMD5Sum(const char* dest_dir, const char* md5sum_name)
 	if (md5_size == 0)
 		return;
 
-	for (i = 0; i < modified_files.Index; i++) {
-		for (j = 0; j < (uint32_t)strlen(modified_files.String[i]); j++)
-			if (modified_files.String[i][j] == '\\')
-				modified_files.String[i][j] = '/';
-		str_pos = strstr(md5_data, &modified_files.String[i][2]);
-		if (str_pos == NULL)
-			// File is not listed in md5 sums
-			continue;
-		if (display_header) {
+	if (modified_files.Index != 0) {
+		// Look up all the modified files in a single pass index of md5sum.txt, then rehash
+		// the ones that are listed in parallel
+		path = calloc(modified_files.Index, sizeof(char*));
+		sum = calloc(modified_files.Index, MD5_HASHSIZE);
+		hashed = calloc(modified_files.Index, sizeof(BOOL));
+		line = calloc(modified_files.Index, sizeof(char*));
+		if ((path == NULL) || (sum == NULL) || (hashed == NULL) || (line == NULL) ||
+			!IndexMD5Sum(md5_data, md5_size, modified_files.Index, &index)) {
+			uprintf("Could not index %s", md5_path);
+			goto out;
+		}
+		for (i = 0; i < modified_files.Index; i++) {
+			for (j = 0; j < (uint32_t)strlen(modified_files.String[i]); j++)
+				if (modified_files.String[i][j] == '\\')
+					modified_files.String[i][j] = '/';
+			idx = htab_hash(&modified_files.String[i][2], &index);
+			if ((idx == 0) || (index.table[idx].data == NULL))
+				// File is not listed in md5 sums
+				continue;
+			line[count] = (char*)index.table[idx].data;
+			path[count++] = modified_files.String[i];
+		}
+
+		if (count != 0) {
+			HashFiles(HASH_MD5, path, count, sum, hashed);
 			uprintf("Updating %s:", md5_path);
-			display_header = FALSE;
 		}
-		uprintf("● %s", &modified_files.String[i][2]);
-		pos = str_pos - md5_data;
-		HashFile(HASH_MD5, modified_files.String[i], sum);
-		while ((pos > 0) && (md5_data[pos - 1] != '\n'))
-			pos--;
-		assert(IS_HEXASCII(md5_data[pos]));
-		for (j = 0; j < 16; j++) {
-			md5_data[pos + 2 * j] = ((sum[j] >> 4) < 10) ? ('0' + (sum[j] >> 4)) : ('a' - 0xa + (sum[j] >> 4));
-			md5_data[pos + 2 * j + 1] = ((sum[j] & 15) < 10) ? ('0' + (sum[j] & 15)) : ('a' - 0xa + (sum[j] & 15));
+
+		for (i = 0; i < count; i++) {
+			uprintf("● %s", &path[i][2]);
+			if (!hashed[i]) {
+				uprintf("  Could not compute MD5 - entry left unchanged");
+				continue;
+			}
+			assert(IS_HEXASCII(line[i][0]));
+			for (j = 0; j < 16; j++) {
+				line[i][2 * j] = ((sum[i * MD5_HASHSIZE + j] >> 4) < 10) ?
+					('0' + (sum[i * MD5_HASHSIZE + j] >> 4)) : ('a' - 0xa + (sum[i * MD5_HASHSIZE + j] >> 4));
+				line[i][2 * j + 1] = ((sum[i * MD5_HASHSIZE + j] & 15) < 10) ?
+					('0' + (sum[i * MD5_HASHSIZE + j] & 15)) : ('a' - 0xa + (sum[i * MD5_HASHSIZE + j] & 15));
+			}
 		}
 	}
 
@@ -2394,7 +2548,7 @@ void UpdateMD5Sum(const char* dest_dir, const char* md5sum_name)
 		new_data = malloc(md5_size + 1024);
 		assert(new_data != NULL);
 		if (new_data == NULL)
-			return;
+			goto out;
 		// Will be nonzero if we created the file, otherwise zero
 		if (md5sum_totalbytes != 0) {
 			snprintf(new_data, md5_size + 1024, "# md5sum_totalbytes = 0x%llx\n", md5sum_totalbytes);
@@ -2464,6 +2618,13 @@ void UpdateMD5Sum(const char* dest_dir, const char* md5sum_name)
 	}
 
 	write_file(md5_path, md5_data, md5_size);
+
+out:
+	htab_destroy(&index);
+	free(path);
+	free(sum);
+	free(hashed);
+	free(line);
 	free(md5_data);
 }
 
@@ -2574,4 +2735,40 @@ int TestHashes(void)
 	free(msg);
 	return errors;
 }
+
+/* Benchmarks the lookup of modified files against a synthetic 100k entries md5sum.txt */
+int BenchmarkMD5SumIndex(void)
+{
+	const uint32_t nb_entries = 100000, nb_lookups = 1000, line_size = 2 * MD5_HASHSIZE + 31;
+	htab_table index = HTAB_EMPTY;
+	uint32_t i, idx, found = 0;
+	uint64_t start, indexed, looked_up;
+	char path[32], *md5_data = malloc((size_t)nb_entries * line_size + 1);
+
+	if (md5_data == NULL)
+		return -1;
+	for (i = 0; i < nb_entries; i++)
+		sprintf(&md5_data[i * line_size], "%08x%024x  ./pool/d%04u/file%07u.deb\n", i * 2654435761U, 0, i / 100, i);
+
+	start = GetTickCount64();
+	if (!IndexMD5Sum(md5_data, nb_entries * line_size, nb_lookups, &index)) {
+		free(md5_data);
+		return -1;
+	}
+	indexed = GetTickCount64();
+	for (i = 0; i < nb_lookups; i++) {
+		// Look up entries that are spread over the whole file, as well as entries that don't exist
+		static_sprintf(path, "/pool/d%04u/file%07u.deb", (i * 197) % 1000, (i * 197) % 1000 * 100 + (i % 2) * 100000);
+		idx = htab_hash(path, &index);
+		if ((idx != 0) && (index.table[idx].data != NULL))
+			found++;
+	}
+	looked_up = GetTickCount64();
+	uprintf("md5sum index: %d entries indexed in %lld ms, %d/%d lookups found in %lld ms",
+		nb_entries, indexed - start, found, nb_lookups, looked_up - indexed);
+
+	htab_destroy(&index);
+	free(md5_data);
+	return (found == nb_lookups / 2) ? 0 : 1;
+}
 #endif
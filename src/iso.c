@@ -45,6 +45,7 @@
 #include "rufus.h"
 #include "ui.h"
 #include "drive.h"
+#include "format.h"
 #include "libfat.h"
 #include "missing.h"
 #include "resource.h"
@@ -80,10 +81,17 @@ typedef struct {
 	BOOLEAN is_old_c32[NB_OLD_C32];
 } EXTRACT_PROPS;
 
+typedef struct {
+	char* fullpath;
+	char* path;
+	char* basename;
+	EXTRACT_PROPS props;
+} DEFERRED_CONFIG;
+
 RUFUS_IMG_REPORT img_report;
 int64_t iso_blocking_status = -1;
 extern uint64_t md5sum_totalbytes;
-extern BOOL preserve_timestamps, enable_ntfs_compression, validate_md5sum;
+extern BOOL preserve_timestamps, enable_ntfs_compression, validate_md5sum, write_as_esp;
 extern HANDLE format_thread;
 extern StrArray modified_files;
 BOOL enable_iso = TRUE, enable_joliet = TRUE, enable_rockridge = TRUE, has_ldlinux_c32;
@@ -129,6 +137,10 @@ static BOOL scan_only = FALSE;
 static FILE* fd_md5sum = NULL;
 static StrArray config_path, isolinux_path;
 static char symlinked_syslinux[MAX_PATH], *md5sum_data = NULL, *md5sum_pos = NULL;
+static FAT32_LAYOUT* fat_layout = NULL;
+static EXTFS_POPULATE* ext_populate = NULL;
+static DEFERRED_CONFIG* deferred_config = NULL;
+static uint32_t nb_deferred_config = 0;
 
 // Ensure filenames do not contain invalid FAT32 or NTFS characters
 static __inline char* sanitize_filename(char* filename, BOOL* is_identical)
@@ -366,23 +378,33 @@ static BOOL check_iso_props(const char* psz_dirname, int64_t file_length, const
 	return FALSE;
 }
 
-// Apply various workarounds to Linux config files
-static void fix_config(const char* psz_fullpath, const char* psz_path, const char* psz_basename, EXTRACT_PROPS* props)
+// Whether any of the fix_config() workarounds may modify a config file, so that
+// we don't have to read the ones that are going to be left unmodified
+static BOOL needs_config_fix(EXTRACT_PROPS* props)
 {
-	BOOL modified = FALSE, patched;
-	size_t nul_pos;
-	char *iso_label = NULL, *usb_label = NULL, *src, *dst;
+	if ((boot_type == BT_IMAGE) && HAS_PERSISTENCE(img_report) && persistence_size &&
+		((props->is_grub_cfg) || (props->is_menu_cfg) || (props->is_syslinux_cfg)))
+		return TRUE;
+	// The FreeNAS workaround always has something to look for
+	if (props->is_grub_cfg)
+		return TRUE;
+	if (!props->is_cfg && !props->is_conf)
+		return FALSE;
+	return (strcmp(img_report.label, img_report.usb_label) != 0) ||
+		(img_report.rh8_derivative && (strstr(image_path, "netinst") == NULL));
+}
 
-	src = safe_strdup(psz_fullpath);
-	if (src == NULL)
-		return;
-	nul_pos = strlen(src);
-	to_windows_path(src);
+// Apply various workarounds to the in-memory data of a Linux config file, where 'name'
+// is only used for display. Returns TRUE if the data was modified.
+static BOOL fix_config_data(cfg_file* cfg, const char* name, EXTRACT_PROPS* props)
+{
+	BOOL modified = FALSE, patched;
+	char *iso_label = NULL, *usb_label = NULL;
 
 	// Add persistence to the kernel options
 	if ((boot_type == BT_IMAGE) && HAS_PERSISTENCE(img_report) && persistence_size) {
 		if ((props->is_grub_cfg) || (props->is_menu_cfg) || (props->is_syslinux_cfg)) {
-			if (replace_in_token_data(src, props->is_grub_cfg ? "linux" : "append",
+			if (cfg_replace_in_token_data(cfg, props->is_grub_cfg ? "linux" : "append",
 				"file=/cdrom/preseed", "persistent file=/cdrom/preseed", TRUE) != NULL) {
 				// Ubuntu & derivatives are assumed to use 'file=/cdrom/preseed/...'
 				// or 'layerfs-path=minimal.standard.live.squashfs' (see below)
@@ -390,20 +412,20 @@ static void fix_config(const char* psz_fullpath, const char* psz_path, const cha
 				uprintf("  Added 'persistent' kernel option");
 				modified = TRUE;
 				// Also remove Ubuntu's "maybe-ubiquity" to avoid splash screen (GRUB only)
-				if ((props->is_grub_cfg) && replace_in_token_data(src, "linux",
+				if ((props->is_grub_cfg) && cfg_replace_in_token_data(cfg, "linux",
 					"maybe-ubiquity", "", TRUE))
 					uprintf("  Removed 'maybe-ubiquity' kernel option");
-			} else if (replace_in_token_data(src, "linux", "/casper/vmlinuz",
+			} else if (cfg_replace_in_token_data(cfg, "linux", "/casper/vmlinuz",
 				"/casper/vmlinuz persistent", TRUE) != NULL) {
 				// Ubuntu 23.04 and 24.04 use GRUB only with the above and don't use "maybe-ubiquity"
 				uprintf("  Added 'persistent' kernel option");
 				modified = TRUE;
-			} else if (replace_in_token_data(src, props->is_grub_cfg ? "linux" : "append",
+			} else if (cfg_replace_in_token_data(cfg, props->is_grub_cfg ? "linux" : "append",
 				"boot=casper", "boot=casper persistent", TRUE) != NULL) {
 				// Linux Mint uses boot=casper.
 				uprintf("  Added 'persistent' kernel option");
 				modified = TRUE;
-			} else if (replace_in_token_data(src, props->is_grub_cfg ? "linux" : "append",
+			} else if (cfg_replace_in_token_data(cfg, props->is_grub_cfg ? "linux" : "append",
 				"boot=live", "boot=live persistence", TRUE) != NULL) {
 				// Debian & derivatives are assumed to use 'boot=live' in
 				// their kernel options and use 'persistence' as keyword.
@@ -436,13 +458,13 @@ static void fix_config(const char* psz_fullpath, const char* psz_path, const cha
 		if ((iso_label != NULL) && (usb_label != NULL)) {
 			patched = FALSE;
 			for (int i = 0; i < ARRAYSIZE(cfg_token); i++) {
-				if (replace_in_token_data(src, cfg_token[i], iso_label, usb_label, TRUE) != NULL) {
+				if (cfg_replace_in_token_data(cfg, cfg_token[i], iso_label, usb_label, TRUE) != NULL) {
 					modified = TRUE;
 					patched = TRUE;
 				}
 			}
 			if (patched)
-				uprintf("  Patched %s: '%s' ➔ '%s'", src, iso_label, usb_label);
+				uprintf("  Patched %s: '%s' ➔ '%s'", name, iso_label, usb_label);
 			// Since version 8.2, and https://github.com/rhinstaller/anaconda/commit/a7661019546ec1d8b0935f9cb0f151015f2e1d95,
 			// Red Hat derivatives have changed their CD-ROM detection policy which leads to the installation source
 			// not being found. So we need to use 'inst.repo' instead of 'inst.stage2' in the kernel options.
@@ -453,29 +475,19 @@ static void fix_config(const char* psz_fullpath, const char* psz_path, const cha
 			patched = FALSE;
 			if (img_report.rh8_derivative && (strstr(image_path, "netinst") == NULL)) {
 				for (int i = 0; i < ARRAYSIZE(cfg_token); i++) {
-					if (replace_in_token_data(src, cfg_token[i], "inst.stage2", "inst.repo", TRUE) != NULL) {
+					if (cfg_replace_in_token_data(cfg, cfg_token[i], "inst.stage2", "inst.repo", TRUE) != NULL) {
 						modified = TRUE;
 						patched = TRUE;
 					}
 				}
 				if (patched)
-					uprintf("  Patched %s: '%s' ➔ '%s'", src, "inst.stage2", "inst.repo");
+					uprintf("  Patched %s: '%s' ➔ '%s'", name, "inst.stage2", "inst.repo");
 			}
 		}
 		safe_free(iso_label);
 		safe_free(usb_label);
 	}
 
-	// Fix dual BIOS + EFI support for tails and other ISOs
-	if ( (props->is_syslinux_cfg) && (safe_stricmp(psz_path, efi_dirname) == 0) &&
-		 (safe_stricmp(psz_basename, syslinux_cfg[0]) == 0) &&
-		 (!img_report.has_efi_syslinux) && (dst = safe_strdup(src)) ) {
-		dst[nul_pos-12] = 's'; dst[nul_pos-11] = 'y'; dst[nul_pos-10] = 's';
-		CopyFileA(src, dst, TRUE);
-		uprintf("Duplicated %s to %s", src, dst);
-		free(dst);
-	}
-
 	// Workaround for FreeNAS
 	if (props->is_grub_cfg) {
 		iso_label = malloc(MAX_PATH);
@@ -483,8 +495,8 @@ static void fix_config(const char* psz_fullpath, const char* psz_path, const cha
 		if ((iso_label != NULL) && (usb_label != NULL)) {
 			safe_sprintf(iso_label, MAX_PATH, "cd9660:/dev/iso9660/%s", img_report.label);
 			safe_sprintf(usb_label, MAX_PATH, "msdosfs:/dev/msdosfs/%s", img_report.usb_label);
-			if (replace_in_token_data(src, "set", iso_label, usb_label, TRUE) != NULL) {
-				uprintf("  Patched %s: '%s' ➔ '%s'", src, iso_label, usb_label);
+			if (cfg_replace_in_token_data(cfg, "set", iso_label, usb_label, TRUE) != NULL) {
+				uprintf("  Patched %s: '%s' ➔ '%s'", name, iso_label, usb_label);
 				modified = TRUE;
 			}
 		}
@@ -492,12 +504,171 @@ static void fix_config(const char* psz_fullpath, const char* psz_path, const cha
 		safe_free(usb_label);
 	}
 
+	return modified;
+}
+
+// Apply various workarounds to Linux config files
+static void fix_config(const char* psz_fullpath, const char* psz_path, const char* psz_basename, EXTRACT_PROPS* props)
+{
+	BOOL modified = FALSE;
+	size_t nul_pos;
+	char *src, *dst;
+	cfg_file* cfg = NULL;
+
+	src = safe_strdup(psz_fullpath);
+	if (src == NULL)
+		return;
+	nul_pos = strlen(src);
+	to_windows_path(src);
+	// Read the file once and apply all our modifications in memory
+	if (needs_config_fix(props))
+		cfg = cfg_open(src);
+	if (cfg != NULL) {
+		modified = fix_config_data(cfg, src, props);
+		// Write the modified file back, before we duplicate it below
+		if (!cfg_close(cfg))
+			modified = FALSE;
+	}
+
+	// Fix dual BIOS + EFI support for tails and other ISOs
+	if ( (props->is_syslinux_cfg) && (safe_stricmp(psz_path, efi_dirname) == 0) &&
+		 (safe_stricmp(psz_basename, syslinux_cfg[0]) == 0) &&
+		 (!img_report.has_efi_syslinux) && (dst = safe_strdup(src)) ) {
+		dst[nul_pos-12] = 's'; dst[nul_pos-11] = 'y'; dst[nul_pos-10] = 's';
+		CopyFileA(src, dst, TRUE);
+		uprintf("Duplicated %s to %s", src, dst);
+		free(dst);
+	}
+
 	if (modified)
 		StrArrayAdd(&modified_files, psz_fullpath, TRUE);
 
 	free(src);
 }
 
+// When populating a FAT32 layout, config files only exist on the target once the layout has been
+// written, so their fixup must be deferred until then
+static void defer_fix_config(const char* psz_fullpath, const char* psz_path, const char* psz_basename, EXTRACT_PROPS* props)
+{
+	DEFERRED_CONFIG* new_config = realloc(deferred_config, (nb_deferred_config + 1) * sizeof(DEFERRED_CONFIG));
+
+	if (new_config == NULL) {
+		uprintf("  Could not defer config file fixup");
+		return;
+	}
+	deferred_config = new_config;
+	new_config = &deferred_config[nb_deferred_config++];
+	new_config->fullpath = safe_strdup(psz_fullpath);
+	new_config->path = safe_strdup(psz_path);
+	new_config->basename = safe_strdup(psz_basename);
+	memcpy(&new_config->props, props, sizeof(EXTRACT_PROPS));
+}
+
+static void apply_deferred_configs(BOOL apply)
+{
+	uint32_t i;
+
+	for (i = 0; i < nb_deferred_config; i++) {
+		if (apply && (deferred_config[i].fullpath != NULL) && (deferred_config[i].path != NULL) &&
+			(deferred_config[i].basename != NULL))
+			fix_config(deferred_config[i].fullpath, deferred_config[i].path, deferred_config[i].basename,
+				&deferred_config[i].props);
+		safe_free(deferred_config[i].fullpath);
+		safe_free(deferred_config[i].path);
+		safe_free(deferred_config[i].basename);
+	}
+	safe_free(deferred_config);
+	nb_deferred_config = 0;
+}
+
+// Read callback for the FAT32 layout, where 'src' is the LSN of the file
+static BOOL iso_read_layout(void* ctx, uint64_t src, uint64_t offset, uint8_t* buf, DWORD size)
+{
+	iso9660_t* p_iso = (iso9660_t*)ctx;
+	uint8_t block[ISO_BLOCKSIZE];
+	lsn_t lsn = (lsn_t)(src + offset / ISO_BLOCKSIZE);
+	DWORD n, skip = (DWORD)(offset % ISO_BLOCKSIZE);
+	long nb;
+
+	while (size > 0) {
+		if ((skip != 0) || (size < ISO_BLOCKSIZE)) {
+			if (iso9660_iso_seek_read(p_iso, block, lsn, 1) != ISO_BLOCKSIZE)
+				return FALSE;
+			n = MIN(size, ISO_BLOCKSIZE - skip);
+			memcpy(buf, &block[skip], n);
+			skip = 0;
+			lsn++;
+		} else {
+			nb = (long)(size / ISO_BLOCKSIZE);
+			if (iso9660_iso_seek_read(p_iso, buf, lsn, nb) != nb * ISO_BLOCKSIZE)
+				return FALSE;
+			n = (DWORD)nb * ISO_BLOCKSIZE;
+			lsn += nb;
+		}
+		buf += n;
+		size -= n;
+	}
+	return TRUE;
+}
+
+// Add a local file to the FAT32 layout or ext file system, in lieu of CopyFile()
+static BOOL layout_copy_file(const char* src, const char* dst)
+{
+	BOOL r;
+	uint8_t* buf = NULL;
+	uint32_t size = read_file(src, &buf);
+
+	if (size == 0)
+		return FALSE;
+	if (ext_populate == NULL)
+		return AddFAT32LayoutEntry(fat_layout, &dst[strlen(psz_extract_dir)], FALSE, size, 0, buf, NULL);
+	r = AddExtFsEntry(ext_populate, &dst[strlen(psz_extract_dir)], FALSE, NULL, 0644, 0, 0, size, 0, buf, 0);
+	free(buf);
+	return r;
+}
+
+// Add an ISO9660 entry to the ext file system, along with its Rock Ridge ownership and permissions.
+// If 'data' is not NULL, it is used as the content of the file, instead of the ISO data.
+static BOOL ext_add_entry(iso9660_stat_t* p_statbuf, const char* psz_fullpath, BOOL is_dir, const char* symlink,
+	const uint8_t* data, size_t data_size)
+{
+	BOOL has_rr = (p_statbuf->rr.b3_rock == yep) && enable_rockridge;
+
+	return AddExtFsEntry(ext_populate, &psz_fullpath[strlen(psz_extract_dir)], is_dir, symlink,
+		has_rr ? p_statbuf->rr.st_mode : (is_dir ? 0755 : 0644),
+		has_rr ? p_statbuf->rr.st_uid : 0, has_rr ? p_statbuf->rr.st_gid : 0,
+		(is_dir || symlink != NULL) ? 0 : ((data != NULL) ? data_size : p_statbuf->total_size),
+		(data != NULL) ? 0 : p_statbuf->lsn, data, preserve_timestamps ? (int64_t)mktime(&p_statbuf->tm) : 0);
+}
+
+// Add an ISO9660 config file to the ext file system. Since the file is never written through
+// a file system driver, the fix_config() workarounds are applied to its data beforehand.
+#define EXT_MAX_CONFIG_SIZE     (4 * MB)
+static BOOL ext_add_config(iso9660_t* p_iso, iso9660_stat_t* p_statbuf, const char* psz_fullpath, EXTRACT_PROPS* props)
+{
+	BOOL r;
+	uint8_t *data = NULL, *fixed = NULL;
+	size_t size = (size_t)p_statbuf->total_size;
+	cfg_file* cfg = NULL;
+
+	if (needs_config_fix(props) && (size != 0)) {
+		if (size > EXT_MAX_CONFIG_SIZE)
+			uprintf("  Config file is too large to be patched");
+		else
+			data = (uint8_t*)malloc(size);
+		if ((data != NULL) && iso_read_layout(p_iso, p_statbuf->lsn, 0, data, (DWORD)size))
+			cfg = cfg_open_buffer(data, size);
+	}
+	if (cfg != NULL) {
+		fix_config_data(cfg, psz_fullpath, props);
+		size = cfg_close_buffer(cfg, &fixed);
+	}
+	r = ext_add_entry(p_statbuf, psz_fullpath, FALSE, NULL, fixed, size);
+	free(data);
+	free(fixed);
+	return r;
+}
+
 // Returns TRUE if a path appears in md5sum.txt
 static BOOL is_in_md5sum(char* path)
 {
@@ -615,6 +786,7 @@ static int udf_extract_files(udf_t *p_udf, udf_dirent_t *p_udf_dirent, const cha
 		"ISO_BUFFER_SIZE is not a multiple of UDF_BLOCKSIZE");
 	uint8_t* buf = malloc(ISO_BUFFER_SIZE);
 	int64_t read, file_length;
+	uint64_t io_start;
 
 	if ((p_udf_dirent == NULL) || (psz_path == NULL) || (buf == NULL)) {
 		safe_free(buf);
@@ -693,7 +865,9 @@ static int udf_extract_files(udf_t *p_udf, udf_dirent_t *p_udf_dirent, const cha
 					if (ErrorStatus)
 						goto out;
 					nb = (size_t)MIN(ISO_BUFFER_SIZE / UDF_BLOCKSIZE, (file_length + UDF_BLOCKSIZE - 1) / UDF_BLOCKSIZE);
+					io_start = IoStatsNow();
 					read = udf_read_block(p_udf_dirent, buf, nb);
+					IoStatsAdd(IOSTAT_READ, (read > 0) ? read : 0, io_start);
 					if (read < 0) {
 						uprintf("  Error reading UDF file %s", &psz_fullpath[strlen(psz_extract_dir)]);
 						goto out;
@@ -769,6 +943,7 @@ static int iso_extract_files(iso9660_t* p_iso, const char *psz_path)
 	size_t i, j, nb;
 	lsn_t lsn;
 	int64_t file_length;
+	uint64_t io_start;
 
 	if ((p_iso == NULL) || (psz_path == NULL) || (buf == NULL)) {
 		safe_free(buf);
@@ -831,10 +1006,19 @@ static int iso_extract_files(iso9660_t* p_iso, const char *psz_path)
 		if (p_statbuf->type == _STAT_DIR) {
 			if (!scan_only) {
 				psz_sanpath = sanitize_filename(psz_fullpath, &is_identical);
-				IGNORE_RETVAL(_mkdirU(psz_sanpath));
-				if (preserve_timestamps) {
-					LPFILETIME ft = to_filetime(mktime(&p_statbuf->tm));
-					set_directory_timestamp(psz_sanpath, ft, ft, ft);
+				if (ext_populate != NULL) {
+					if (!ext_add_entry(p_statbuf, psz_fullpath, TRUE, NULL, NULL, 0))
+						goto out;
+				} else if (fat_layout != NULL) {
+					if (!AddFAT32LayoutEntry(fat_layout, &psz_sanpath[strlen(psz_extract_dir)], TRUE, 0, 0, NULL,
+						preserve_timestamps ? to_filetime(mktime(&p_statbuf->tm)) : NULL))
+						goto out;
+				} else {
+					IGNORE_RETVAL(_mkdirU(psz_sanpath));
+					if (preserve_timestamps) {
+						LPFILETIME ft = to_filetime(mktime(&p_statbuf->tm));
+						set_directory_timestamp(psz_sanpath, ft, ft, ft);
+					}
 				}
 				safe_free(psz_sanpath);
 			}
@@ -868,7 +1052,8 @@ static int iso_extract_files(iso9660_t* p_iso, const char *psz_path)
 			for (i = 0; i < NB_OLD_C32; i++) {
 				if (props.is_old_c32[i] && use_own_c32[i]) {
 					static_sprintf(tmp, "%s/syslinux-%s/%s", FILES_DIR, embedded_sl_version_str[0], old_c32_name[i]);
-					if (CopyFileU(tmp, psz_fullpath, FALSE)) {
+					if (((fat_layout != NULL) || (ext_populate != NULL)) ?
+						layout_copy_file(tmp, psz_fullpath) : CopyFileU(tmp, psz_fullpath, FALSE)) {
 						uprintf("  Replaced with local version %s", IsFileInDB(tmp)?"✓":"✗");
 						break;
 					}
@@ -882,7 +1067,13 @@ static int iso_extract_files(iso9660_t* p_iso, const char *psz_path)
 				uprintf("  File name sanitized to '%s'", psz_sanpath);
 			create_file = TRUE;
 			if (is_symlink) {
-				if (fs_type == FS_NTFS) {
+				if (ext_populate != NULL) {
+					// ext supports symlinks natively
+					uprintf("Symlinking: %s ➔ %s", psz_fullpath, p_statbuf->rr.psz_symlink);
+					if (!ext_add_entry(p_statbuf, psz_fullpath, FALSE, p_statbuf->rr.psz_symlink, NULL, 0))
+						goto out;
+					create_file = FALSE;
+				} else if (fs_type == FS_NTFS) {
 					// Replicate symlinks if NTFS is being used
 					static_sprintf(target_path, "%s/%s", psz_path, p_statbuf->rr.psz_symlink);
 					iso9660_stat_t* p_statbuf2 = iso9660_ifs_stat_translate(p_iso, target_path);
@@ -931,7 +1122,18 @@ static int iso_extract_files(iso9660_t* p_iso, const char *psz_path)
 					create_file = FALSE;
 				}
 			}
-			if (create_file) {
+			if (create_file && (ext_populate != NULL)) {
+				// ext has none of the FAT or NTFS file name restrictions
+				if (!((props.is_cfg || props.is_conf) ? ext_add_config(p_iso, p_statbuf, psz_fullpath, &props) :
+					ext_add_entry(p_statbuf, psz_fullpath, FALSE, NULL, NULL, 0)))
+					goto out;
+			} else if (create_file && (fat_layout != NULL)) {
+				if (!AddFAT32LayoutEntry(fat_layout, &psz_sanpath[strlen(psz_extract_dir)], FALSE,
+					is_symlink ? safe_strlen(p_statbuf->rr.psz_symlink) : file_length, p_statbuf->lsn,
+					is_symlink ? (uint8_t*)safe_strdup(p_statbuf->rr.psz_symlink) : NULL,
+					preserve_timestamps ? to_filetime(mktime(&p_statbuf->tm)) : NULL))
+					goto out;
+			} else if (create_file) {
 				file_handle = CreatePreallocatedFile(psz_sanpath, GENERIC_READ | GENERIC_WRITE,
 					FILE_SHARE_READ, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, file_length);
 				if (file_handle == INVALID_HANDLE_VALUE) {
@@ -958,11 +1160,13 @@ static int iso_extract_files(iso9660_t* p_iso, const char *psz_path)
 							goto out;
 						lsn = p_statbuf->lsn + (lsn_t)i;
 						nb = (size_t)MIN(ISO_BUFFER_SIZE / ISO_BLOCKSIZE, (file_length + ISO_BLOCKSIZE - 1) / ISO_BLOCKSIZE);
+						io_start = IoStatsNow();
 						if (iso9660_iso_seek_read(p_iso, buf, lsn, (long)nb) != (nb * ISO_BLOCKSIZE)) {
 							uprintf("  Error reading ISO9660 file %s at LSN %lu",
 								psz_iso_name, (long unsigned int)lsn);
 							goto out;
 						}
+						IoStatsAdd(IOSTAT_READ, nb * ISO_BLOCKSIZE, io_start);
 						buf_size = (DWORD)MIN(file_length, ISO_BUFFER_SIZE);
 						if (fd_md5sum != NULL)
 							hash_write[HASH_MD5](&ctx, buf, buf_size);
@@ -995,7 +1199,9 @@ static int iso_extract_files(iso9660_t* p_iso, const char *psz_path)
 			if (free_p_statbuf)
 				iso9660_stat_free(p_statbuf);
 			ISO_BLOCKING(safe_closehandle(file_handle));
-			if (props.is_cfg || props.is_conf)
+			if ((props.is_cfg || props.is_conf) && (fat_layout != NULL))
+				defer_fix_config(psz_sanpath, psz_path, psz_basename, &props);
+			else if ((props.is_cfg || props.is_conf) && (ext_populate == NULL))
 				fix_config(psz_sanpath, psz_path, psz_basename, &props);
 			safe_free(psz_sanpath);
 		}
@@ -1140,7 +1346,8 @@ BOOL ExtractISO(const char* src_iso, const char* dest_dir, BOOL scan)
 		iso_blocking_status = 0;
 		symlinked_syslinux[0] = 0;
 		StrArrayClear(&modified_files);
-		if (validate_md5sum) {
+		// There's no way to create or update md5sum.txt on ext through the Windows APIs
+		if (validate_md5sum && !IS_EXT(fs_type)) {
 			md5sum_totalbytes = 0;
 			// If there isn't an already existing md5sum.txt create one
 			if (img_report.has_md5sum != 1) {
@@ -1155,6 +1362,10 @@ BOOL ExtractISO(const char* src_iso, const char* dest_dir, BOOL scan)
 		}
 	}
 
+	// Direct ext population is only implemented for ISO9660
+	if (!scan_only && IS_EXT(fs_type))
+		goto try_iso;
+
 	// First try to open as UDF - fallback to ISO if it failed
 	p_udf = udf_open(src_iso);
 	if (p_udf == NULL)
@@ -1207,8 +1418,50 @@ try_iso:
 				(iso_extension_mask & ISO_EXTENSION_JOLIET)?"Joliet":"Rock Ridge");
 		else
 			uprintf("%sThis image will not be extracted using any ISO extensions", spacing);
+		if (IS_EXT(fs_type)) {
+			// There is no ext driver to go through, so populate the file system ourselves
+			ext_populate = OpenExtFsPopulate(SelectedDrive.DeviceNumber,
+				SelectedDrive.Partition[partition_index[PI_MAIN]].Offset, iso_read_layout, p_iso,
+				total_blocks * ISO_BLOCKSIZE);
+			if (ext_populate == NULL)
+				goto out;
+		} else if ((fs_type == FS_FAT32) && !write_as_esp && (fd_md5sum == NULL)) {
+			// For FAT32, lay out the content in memory first, so that it can be written to
+			// the volume sequentially, rather than through the file system driver.
+			fat_layout = CreateFAT32Layout(iso_read_layout, p_iso);
+		}
 	}
 	r = iso_extract_files(p_iso, "");
+	if (ext_populate != NULL) {
+		if (!CloseExtFsPopulate(ext_populate))
+			r = 1;
+		ext_populate = NULL;
+	}
+	if (fat_layout != NULL) {
+		if (r == 0) {
+			if (WriteFAT32Layout(fat_layout, SelectedDrive.DeviceNumber,
+				SelectedDrive.Partition[partition_index[PI_MAIN]].Offset)) {
+				static_sprintf(path, "%c:\\", dest_dir[0]);
+				if (RemountVolume(path, TRUE))
+					apply_deferred_configs(TRUE);
+				else
+					r = 1;
+			} else if (!IS_ERROR(ErrorStatus)) {
+				uprintf("Could not write FAT32 layout - Falling back to regular file copy");
+				FreeFAT32Layout(fat_layout);
+				fat_layout = NULL;
+				apply_deferred_configs(FALSE);
+				md5sum_totalbytes = 0;
+				md5sum_pos = md5sum_data;
+				r = iso_extract_files(p_iso, "");
+			} else {
+				r = 1;
+			}
+		}
+		FreeFAT32Layout(fat_layout);
+		fat_layout = NULL;
+		apply_deferred_configs(FALSE);
+	}
 
 out:
 	iso_blocking_status = -1;
@@ -1348,7 +1601,8 @@ out:
 		// Solus and other ISOs only provide EFI boot files in a FAT efi.img
 		// Also work around ISOs that have a borked symbolic link for bootx64.efi.
 		// See https://github.com/linuxmint/linuxmint/issues/622.
-		if (img_report.has_efi & 0xc000) {
+		// This doesn't apply to ext, which is only used for BIOS boot, and has no drive to copy to.
+		if ((img_report.has_efi & 0xc000) && !IS_EXT(fs_type)) {
 			if (img_report.has_efi & 0x4000) {
 				uprintf("Broken UEFI bootloader detected - Applying workaround:");
 				static_sprintf(path, "%s\\EFI\\boot\\bootx64.efi", dest_dir);
@@ -1644,43 +1898,72 @@ out:
 	return ret;
 }
 
-uint32_t GetInstallWimVersion(const char* iso)
+/*
+ * Read 'size' bytes, starting at 'offset', from a file in an ISO image, without
+ * having to extract or read the whole file. Returns the number of bytes read.
+ * NB: For ISO-9660, this assumes that the file extents are contiguous on the ISO.
+ */
+uint32_t ReadISOFileRange(const char* iso, const char* iso_file, uint64_t offset, uint32_t size, uint8_t* buf)
 {
-	char *wim_path = NULL, buf[UDF_BLOCKSIZE] = { 0 };
-	uint32_t* wim_header = (uint32_t*)buf, r = 0xffffffff;
+	char* path = NULL;
+	uint8_t* blocks = NULL;
+	uint32_t i, ret = 0, nblocks, start_offset = (uint32_t)(offset % ISO_BLOCKSIZE);
+	uint64_t start_block = offset / ISO_BLOCKSIZE;
+	int64_t file_length;
 	iso9660_t* p_iso = NULL;
 	udf_t* p_udf = NULL;
 	udf_dirent_t *p_udf_root = NULL, *p_udf_file = NULL;
-	iso9660_stat_t *p_statbuf = NULL;
+	iso9660_stat_t* p_statbuf = NULL;
 
-	wim_path = safe_strdup(&img_report.wininst_path[0][2]);
-	if (wim_path == NULL)
-		goto out;
+	if ((iso == NULL) || (iso_file == NULL) || (buf == NULL) || (size == 0) || (size > 1 * GB))
+		return 0;
+
+	path = safe_strdup(iso_file);
+	if (path == NULL)
+		return 0;
 	// UDF indiscriminately accepts slash or backslash delimiters,
 	// but ISO-9660 requires slash
-	to_unix_path(wim_path);
+	to_unix_path(path);
+	// NB: ISO_BLOCKSIZE = UDF_BLOCKSIZE
+	nblocks = (uint32_t)((start_offset + (uint64_t)size + ISO_BLOCKSIZE - 1) / ISO_BLOCKSIZE);
+	blocks = malloc((size_t)nblocks * ISO_BLOCKSIZE);
+	if (blocks == NULL) {
+		uprintf("Could not allocate buffer for file %s", path);
+		goto out;
+	}
+	cdio_loglevel_default = CDIO_LOG_WARN;
 
 	// First try to open as UDF - fallback to ISO if it failed
 	p_udf = udf_open(iso);
 	if (p_udf == NULL)
 		goto try_iso;
-
 	p_udf_root = udf_get_root(p_udf, true, 0);
 	if (p_udf_root == NULL) {
 		uprintf("Could not locate UDF root directory");
 		goto out;
 	}
-	p_udf_file = udf_fopen(p_udf_root, wim_path);
+	p_udf_file = udf_fopen(p_udf_root, path);
 	if (!p_udf_file) {
-		uprintf("Could not locate file %s in ISO image", wim_path);
+		uprintf("Could not locate file %s in ISO image", path);
 		goto out;
 	}
-	if (udf_read_block(p_udf_file, buf, 1) != UDF_BLOCKSIZE) {
-		uprintf("Error reading UDF file %s", wim_path);
+	file_length = udf_get_file_length(p_udf_file);
+	if (offset + size > (uint64_t)file_length) {
+		uprintf("Attempted to read past the end of UDF file %s", path);
 		goto out;
 	}
-	r = wim_header[3];
-	goto out;
+	if (udf_seek(p_udf_file, start_block * UDF_BLOCKSIZE) != DRIVER_OP_SUCCESS) {
+		uprintf("Could not seek UDF file %s", path);
+		goto out;
+	}
+	// Read block by block, so that we don't have to care about crossing extents
+	for (i = 0; i < nblocks; i++) {
+		if (udf_read_block(p_udf_file, &blocks[i * UDF_BLOCKSIZE], 1) <= 0) {
+			uprintf("Error reading UDF file %s", path);
+			goto out;
+		}
+	}
+	goto copy;
 
 try_iso:
 	p_iso = iso9660_open_ext(iso, ISO_EXTENSION_MASK);
@@ -1688,16 +1971,23 @@ try_iso:
 		uprintf("Could not open image '%s'", iso);
 		goto out;
 	}
-	p_statbuf = iso9660_ifs_stat_translate(p_iso, wim_path);
+	p_statbuf = iso9660_ifs_stat_translate(p_iso, path);
 	if (p_statbuf == NULL) {
-		uprintf("Could not get ISO-9660 file information for file %s", wim_path);
+		uprintf("Could not get ISO-9660 file information for file %s", path);
 		goto out;
 	}
-	if (iso9660_iso_seek_read(p_iso, buf, p_statbuf->lsn, 1) != ISO_BLOCKSIZE) {
-		uprintf("Error reading ISO-9660 file %s at LSN %d", wim_path, p_statbuf->lsn);
+	if (offset + size > p_statbuf->total_size) {
+		uprintf("Attempted to read past the end of ISO-9660 file %s", path);
 		goto out;
 	}
-	r = wim_header[3];
+	if (iso9660_iso_seek_read(p_iso, blocks, p_statbuf->lsn + (lsn_t)start_block, (long)nblocks) != (long)nblocks * ISO_BLOCKSIZE) {
+		uprintf("Error reading ISO-9660 file %s at LSN %d", path, p_statbuf->lsn + (lsn_t)start_block);
+		goto out;
+	}
+
+copy:
+	memcpy(buf, &blocks[start_offset], size);
+	ret = size;
 
 out:
 	iso9660_stat_free(p_statbuf);
@@ -1705,11 +1995,23 @@ out:
 	udf_dirent_free(p_udf_file);
 	iso9660_close(p_iso);
 	udf_close(p_udf);
-	safe_free(wim_path);
-	return bswap_uint32(r);
+	cdio_loglevel_default = usb_debug ? CDIO_LOG_INFO : CDIO_LOG_WARN;
+	safe_free(blocks);
+	safe_free(path);
+	return ret;
+}
+
+uint32_t GetInstallWimVersion(const char* iso)
+{
+	uint32_t wim_header[4];
+
+	if (ReadISOFileRange(iso, &img_report.wininst_path[0][2], 0, sizeof(wim_header), (uint8_t*)wim_header) != sizeof(wim_header))
+		return 0xffffffff;
+	return bswap_uint32(wim_header[3]);
 }
 
 #define ISO_NB_BLOCKS 16
+#define FAT_RUN_MAX_SIZE (1 * MB)
 typedef struct {
 	iso9660_t*      p_iso;
 	lsn_t           lsn;
@@ -1720,30 +2022,51 @@ typedef struct {
 
 /*
  * Read sectors from a FAT img file residing on an ISO-9660 filesystem.
+ * 'size' can span multiple sectors, for libfat's batched reads.
  * NB: This assumes that the img file sectors are contiguous on the ISO.
   */
-int iso9660_readfat(intptr_t pp, void *buf, size_t secsize, libfat_sector_t sec)
+int iso9660_readfat(intptr_t pp, void *buf, size_t size, libfat_sector_t sec)
 {
 	iso9660_readfat_private* p_private = (iso9660_readfat_private*)pp;
+	const size_t secsize = LIBFAT_SECTOR_SIZE;
+	uint64_t offset = sec * secsize;
+	size_t i;
 
 	if (sizeof(p_private->buf) % secsize != 0) {
 		uprintf("iso9660_readfat: Sector size %zu is not a divisor of %zu", secsize, sizeof(p_private->buf));
 		return 0;
 	}
+	if (size % secsize != 0) {
+		uprintf("iso9660_readfat: Read size %zu is not a multiple of the sector size", size);
+		return 0;
+	}
 
-	if ((sec < p_private->sec_start) || (sec >= p_private->sec_start + sizeof(p_private->buf) / secsize)) {
-		// Sector being queried is not in our multi block buffer -> Update it
-		p_private->sec_start = (((sec * secsize) / ISO_BLOCKSIZE) * ISO_BLOCKSIZE) / secsize;
-		if (iso9660_iso_seek_read(p_private->p_iso, p_private->buf,
-			p_private->lsn + (lsn_t)((p_private->sec_start * secsize) / ISO_BLOCKSIZE), ISO_NB_BLOCKS)
-			!= ISO_NB_BLOCKS * ISO_BLOCKSIZE) {
+	// Multi sector requests that are aligned to ISO blocks can be read in one go
+	if ((size > secsize) && (offset % ISO_BLOCKSIZE == 0) && (size % ISO_BLOCKSIZE == 0)) {
+		if (iso9660_iso_seek_read(p_private->p_iso, buf, p_private->lsn + (lsn_t)(offset / ISO_BLOCKSIZE),
+			(long)(size / ISO_BLOCKSIZE)) != (long)size) {
 			uprintf("Error reading ISO-9660 file %s at LSN %lu", img_report.efi_img_path,
-				(long unsigned int)(p_private->lsn + (p_private->sec_start * secsize) / ISO_BLOCKSIZE));
+				(long unsigned int)(p_private->lsn + offset / ISO_BLOCKSIZE));
 			return 0;
 		}
+		return (int)size;
+	}
+
+	for (i = 0; i < size / secsize; i++, sec++) {
+		if ((sec < p_private->sec_start) || (sec >= p_private->sec_start + sizeof(p_private->buf) / secsize)) {
+			// Sector being queried is not in our multi block buffer -> Update it
+			p_private->sec_start = (((sec * secsize) / ISO_BLOCKSIZE) * ISO_BLOCKSIZE) / secsize;
+			if (iso9660_iso_seek_read(p_private->p_iso, p_private->buf,
+				p_private->lsn + (lsn_t)((p_private->sec_start * secsize) / ISO_BLOCKSIZE), ISO_NB_BLOCKS)
+				!= ISO_NB_BLOCKS * ISO_BLOCKSIZE) {
+				uprintf("Error reading ISO-9660 file %s at LSN %lu", img_report.efi_img_path,
+					(long unsigned int)(p_private->lsn + (p_private->sec_start * secsize) / ISO_BLOCKSIZE));
+				return 0;
+			}
+		}
+		memcpy(&((uint8_t*)buf)[i * secsize], &p_private->buf[(sec - p_private->sec_start) * secsize], secsize);
 	}
-	memcpy(buf, &p_private->buf[(sec - p_private->sec_start)*secsize], secsize);
-	return (int)secsize;
+	return (int)size;
 }
 
 /*
@@ -1829,14 +2152,15 @@ BOOL DumpFatDir(const char* path, int32_t cluster)
 {
 	// We don't have concurrent calls to this function, so a static lf_fs is fine
 	static struct libfat_filesystem *lf_fs = NULL;
-	void* buf;
+	uint8_t* buf = NULL;
 	char *target = NULL, *name = NULL;
 	BOOL ret = FALSE;
 	HANDLE handle = NULL;
-	DWORD size, written;
+	DWORD size, written, buf_size;
+	uint32_t nsec;
 	libfat_diritem_t diritem = { 0 };
 	libfat_dirpos_t dirpos = { cluster, -1, 0 };
-	libfat_sector_t s;
+	libfat_sector_t s, next;
 	iso9660_t* p_iso = NULL;
 	iso9660_stat_t* p_statbuf = NULL;
 	iso9660_readfat_private* p_private = NULL;
@@ -1911,24 +2235,33 @@ BOOL DumpFatDir(const char* path, int32_t cluster)
 				}
 
 				written = 0;
+				buf_size = (DWORD)MIN(FAT_RUN_MAX_SIZE, HI_ALIGN_X_TO_Y(MAX(diritem.size, 1), LIBFAT_SECTOR_SIZE));
+				buf = malloc(buf_size);
+				if (buf == NULL) {
+					ErrorStatus = RUFUS_ERROR(ERROR_NOT_ENOUGH_MEMORY);
+					goto out;
+				}
 				s = libfat_clustertosector(lf_fs, dirpos.cluster);
 				while ((s != 0) && (s < 0xFFFFFFFFULL) && (written < diritem.size)) {
-					buf = libfat_get_sector(lf_fs, s);
-					if (buf == NULL)
+					// Read the data from as many contiguous clusters as we can in one go
+					next = libfat_nextrun(lf_fs, s, (uint32_t)MIN(buf_size,
+						HI_ALIGN_X_TO_Y(diritem.size - written, LIBFAT_SECTOR_SIZE)) / LIBFAT_SECTOR_SIZE, &nsec);
+					if (libfat_readrun(lf_fs, buf, s, nsec) < 0)
 						ErrorStatus = RUFUS_ERROR(ERROR_SECTOR_NOT_FOUND);
 					if (IS_ERROR(ErrorStatus))
 						goto out;
-					size = MIN(LIBFAT_SECTOR_SIZE, diritem.size - written);
+					size = MIN(nsec * LIBFAT_SECTOR_SIZE, diritem.size - written);
 					if (!WriteFileWithRetry(handle, buf, size, &size, WRITE_RETRIES) ||
-						(size != MIN(LIBFAT_SECTOR_SIZE, diritem.size - written))) {
+						(size != MIN(nsec * LIBFAT_SECTOR_SIZE, diritem.size - written))) {
 						uprintf("Could not write '%s': %s", target, WindowsErrorString());
 						break;
 					}
 					written += size;
-					s = libfat_nextsector(lf_fs, s);
-					// Trust me, you *REALLY* want to invoke libfat_flush() here
-					libfat_flush(lf_fs);
+					s = next;
 				}
+				// File data bypasses the cache, so it only ever holds directory and FAT sectors
+				libfat_flush(lf_fs);
+				safe_free(buf);
 				safe_closehandle(handle);
 				if (props.is_conf)
 					fix_config(target, NULL, NULL, &props);
@@ -1950,6 +2283,7 @@ out:
 		iso9660_close(p_iso);
 		safe_free(p_private);
 	}
+	safe_free(buf);
 	safe_closehandle(handle);
 	safe_free(name);
 	safe_free(target);
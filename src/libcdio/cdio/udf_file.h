@@ -88,6 +88,16 @@ extern "C" {
   ssize_t udf_read_block(const udf_dirent_t *p_udf_dirent, 
 			 void * buf, size_t count);
 
+  /**
+    Set the offset, in bytes, from which the next udf_read_block() call
+    will read. The offset should be a multiple of UDF_BLOCKSIZE.
+
+    Added for Rufus usage (ReadISOFileRange()) - not part of upstream
+    libcdio, so this must be carried over when updating libcdio.
+  */
+  driver_return_code_t udf_seek(const udf_dirent_t *p_udf_dirent,
+				uint64_t i_offset);
+
   /**
     Advances p_udf_direct to the the next directory entry in the
     pointed to by p_udf_dir. It also returns this as the value.  NULL
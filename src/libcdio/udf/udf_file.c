@@ -265,3 +265,19 @@ udf_read_block(const udf_dirent_t *p_udf_dirent, void * buf, size_t count)
     }
   }
 }
+
+/**
+  Set the offset, in bytes, from which the next call to udf_read_block()
+  for the file referenced by p_udf_dirent will read. The offset should be
+  a multiple of UDF_BLOCKSIZE.
+
+  Added for Rufus usage - not part of upstream libcdio.
+*/
+driver_return_code_t
+udf_seek(const udf_dirent_t *p_udf_dirent, uint64_t i_offset)
+{
+  if (!p_udf_dirent || i_offset > udf_get_file_length(p_udf_dirent))
+    return DRIVER_OP_ERROR;
+  p_udf_dirent->p_udf->i_position = (off_t)i_offset;
+  return DRIVER_OP_SUCCESS;
+}
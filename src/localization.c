@@ -31,6 +31,7 @@
 #include <stddef.h>
 
 #include "rufus.h"
+#include "missing.h"
 #include "resource.h"
 #include "msapi_utf8.h"
 #include "localization.h"
@@ -71,6 +72,15 @@ struct list_head locale_list = {NULL, NULL};
 char   *loc_filename = NULL, *embedded_loc_filename = "embedded.loc";
 static BOOL localization_initialized = FALSE;
 
+/* Locale table, built from the embedded loc data on first run, and then cached */
+const loc_table_header* loc_table = NULL;
+#define LOC_TABLE_PTR(type, offset) ((type*)((uint8_t*)loc_table + (offset)))
+#define LOC_TABLE_STR(offset) LOC_TABLE_PTR(char, loc_table->pool_offset + (offset))
+// Messages from the locale table point into read-only memory and must not be freed
+#define is_loc_table_str(s) ((loc_table != NULL) && ((uint8_t*)(s) >= (uint8_t*)loc_table) && \
+	((uint8_t*)(s) < (uint8_t*)loc_table + loc_table->size))
+#define safe_free_msg(p) do { if (!is_loc_table_str(p)) free(p); p = NULL; } while(0)
+
 /* Message table */
 char* default_msg_table[MSG_MAX-MSG_000] = {"%s", 0};
 char* current_msg_table[MSG_MAX-MSG_000] = {"%s", 0};
@@ -80,9 +90,9 @@ static void mtab_destroy(BOOL reinit)
 {
 	size_t j;
 	for (j=1; j<MSG_MAX-MSG_000; j++) {
-		safe_free(current_msg_table[j]);
+		safe_free_msg(current_msg_table[j]);
 		if (!reinit)
-			safe_free(default_msg_table[j]);
+			safe_free_msg(default_msg_table[j]);
 	}
 }
 
@@ -135,7 +145,7 @@ void add_message_command(loc_cmd* lcmd)
 		return;
 	}
 
-	safe_free(msg_table[lcmd->ctrl_id-MSG_000]);
+	safe_free_msg(msg_table[lcmd->ctrl_id-MSG_000]);
 	msg_table[lcmd->ctrl_id-MSG_000] = lcmd->txt[1];
 	lcmd->txt[1] = NULL;	// String would be freed after this call otherwise
 }
@@ -210,6 +220,8 @@ BOOL dispatch_loc_cmd(loc_cmd* lcmd)
 	size_t i;
 	static int dlg_index = 0;
 	loc_cmd* base_locale = NULL;
+	// The default locale is always the first one
+	loc_cmd* default_locale = list_entry(locale_list.next, loc_cmd, list);
 	const char* msg_prefix = "MSG_";
 
 	if (lcmd == NULL)
@@ -269,7 +281,16 @@ BOOL dispatch_loc_cmd(loc_cmd* lcmd)
 		base_locale = get_locale_from_name(lcmd->txt[0], FALSE);
 		if (base_locale != NULL) {
 			uprintf("localization: using locale base '%s'\n", lcmd->txt[0]);
-			get_loc_data_file(NULL, base_locale);
+			if ((base_locale == default_locale) && !(base_locale->ctrl_id & LOC_HAS_UI_COMMANDS)) {
+				// The messages from the default locale have already been parsed, and since
+				// there's nothing else we need from it, just duplicate them.
+				for (i = 1; i < MSG_MAX - MSG_000; i++) {
+					safe_free_msg(current_msg_table[i]);
+					current_msg_table[i] = safe_strdup(default_msg_table[i]);
+				}
+			} else {
+				get_loc_data_file(NULL, base_locale);
+			}
 		} else {
 			luprintf("locale base '%s' not found - ignoring", lcmd->txt[0]);
 		}
@@ -286,6 +307,570 @@ err:
 	return FALSE;
 }
 
+/*
+ * Validate a locale table (see build_loc_table() below) and, if valid,
+ * use it in place of the text localization data.
+ * All the offsets are checked here, so that lookups don't have to.
+ */
+BOOL set_loc_table(const uint8_t* buf, DWORD size)
+{
+	const loc_table_header* hdr = (const loc_table_header*)buf;
+	const loc_table_locale* loc;
+	const loc_table_cmd* cmd;
+	const uint32_t* msg;
+	uint32_t i, j;
+
+#define IN_TABLE(offset, count, type) ((uint64_t)(offset) + (uint64_t)(count) * sizeof(type) <= hdr->size)
+	if ((buf == NULL) || (size < sizeof(loc_table_header)) || (hdr->magic != LOC_TABLE_MAGIC) ||
+		(hdr->version != LOC_TABLE_VERSION) || (hdr->size != size)) {
+		uprintf("localization: invalid locale table header");
+		return FALSE;
+	}
+	if ((hdr->pool_size == 0) || (hdr->locale_count == 0) || !IN_TABLE(hdr->pool_offset, hdr->pool_size, char) ||
+		(buf[hdr->pool_offset + hdr->pool_size - 1] != 0) ||
+		!IN_TABLE(hdr->locale_offset, hdr->locale_count, loc_table_locale))
+		goto err;
+	loc = (const loc_table_locale*)&buf[hdr->locale_offset];
+	for (i = 0; i < hdr->locale_count; i++, loc++) {
+		if ((loc->name >= hdr->pool_size) || (loc->display_name >= hdr->pool_size) ||
+			((loc->base >= hdr->locale_count) && (loc->base != LOC_TABLE_NO_BASE)) || (loc->lcid_count > UINT8_MAX) ||
+			!IN_TABLE(loc->lcid_offset, loc->lcid_count, uint32_t) || !IN_TABLE(loc->cmd_offset, loc->cmd_count, loc_table_cmd) ||
+			!IN_TABLE(loc->msg_offset, hdr->msg_count, uint32_t))
+			goto err;
+		cmd = (const loc_table_cmd*)&buf[loc->cmd_offset];
+		for (j = 0; j < loc->cmd_count; j++) {
+			if (((cmd[j].command != LC_GROUP) && (cmd[j].command != LC_TEXT) && (cmd[j].command != LC_BASE)) ||
+				(cmd[j].txt[0] == 0) || (cmd[j].txt[0] >= hdr->pool_size) || (cmd[j].txt[1] >= hdr->pool_size))
+				goto err;
+		}
+		msg = (const uint32_t*)&buf[loc->msg_offset];
+		for (j = 0; j < hdr->msg_count; j++) {
+			if ((msg[j] >= hdr->pool_size) && (msg[j] != LOC_TABLE_UNDEFINED))
+				goto err;
+		}
+	}
+#undef IN_TABLE
+
+	loc_table = hdr;
+	loc_filename = embedded_loc_filename;
+	return TRUE;
+
+err:
+	uprintf("localization: the locale table is corrupted");
+	return FALSE;
+}
+
+/*
+ * Locale table construction, from the text localization data.
+ * Each locale gets the messages that the application would see once dispatch_loc_cmd()
+ * has processed its section, and only keeps the ones that differ from its base.
+ */
+#define LOC_MSG_COUNT (MSG_MAX - MSG_000)
+#define same_msg(s1, s2) (((s1) == (s2)) || (((s1) != NULL) && ((s2) != NULL) && (strcmp(s1, s2) == 0)))
+static char loc_undefined_msg[] = "";
+
+typedef struct loc_build_struct {
+	loc_cmd* locale;
+	struct list_head cmds;
+	char* msg[LOC_MSG_COUNT];
+	char* own[LOC_MSG_COUNT];	// NULL if inherited or loc_undefined_msg
+	int base;
+	int state;
+	BOOL applying;
+} loc_build;
+
+static int find_build_locale(loc_build* lb, int nb_locales, const char* name)
+{
+	int i;
+
+	for (i = 0; i < nb_locales; i++) {
+		if (safe_strcmp(lb[i].locale->txt[0], name) == 0)
+			return i;
+	}
+	return -1;
+}
+
+/*
+ * Apply the message commands of a locale, the same way dispatch_loc_cmd() does
+ */
+static void apply_build_locale(loc_build* lb, int nb_locales, int index, char** msg, BOOL is_default)
+{
+	loc_cmd* lcmd;
+	int id, base;
+
+	lb[index].applying = TRUE;
+	list_for_each_entry(lcmd, &lb[index].cmds, loc_cmd, list) {
+		loc_line_nr = lcmd->line_nr;
+		if (lcmd->command == LC_BASE) {
+			// Base commands are ignored when populating the default table
+			if (is_default)
+				continue;
+			base = find_build_locale(lb, nb_locales, lcmd->txt[0]);
+			if (base < 0) {
+				luprintf("locale base '%s' not found - ignoring", lcmd->txt[0]);
+			} else if ((base == 0) && !(lb[0].locale->ctrl_id & LOC_HAS_UI_COMMANDS)) {
+				memcpy(msg, lb[0].msg, sizeof(lb[0].msg));
+			} else if (lb[base].applying) {
+				luprintf("locale base '%s' is part of a loop - ignoring", lcmd->txt[0]);
+			} else {
+				apply_build_locale(lb, nb_locales, base, msg, FALSE);
+			}
+		} else if ((lcmd->command <= LC_TEXT) && (safe_strncmp(lcmd->txt[0], "MSG_", 4) == 0)) {
+			if (lcmd->command != LC_TEXT) {
+				luprint("only the [t]ext command can be applied to a message (MSG_###)\n");
+				continue;
+			}
+			id = atoi(&lcmd->txt[0][4]);
+			if (id == 0) {
+				luprintf("failed to convert the numeric value in '%s'\n", lcmd->txt[0]);
+				continue;
+			}
+			if ((id < 0) || (id >= LOC_MSG_COUNT)) {
+				uprintf("localization: invalid MSG_ index\n");
+				continue;
+			}
+			msg[id] = lcmd->txt[1];
+		}
+	}
+	lb[index].applying = FALSE;
+}
+
+/*
+ * Look up a message through the base chain, like get_loc_table_msg() will
+ */
+static char* lookup_build_msg(loc_build* lb, int index, int id)
+{
+	for (; index >= 0; index = lb[index].base) {
+		if (lb[index].own[id] != NULL)
+			return (lb[index].own[id] == loc_undefined_msg) ? NULL : lb[index].own[id];
+	}
+	return NULL;
+}
+
+/*
+ * Only keep the messages that differ from the ones the base locale provides.
+ * Bases are processed first, and a base that loops back is dropped.
+ */
+static void set_build_own_msgs(loc_build* lb, int index)
+{
+	int id;
+
+	if (lb[index].state != 0)
+		return;
+	lb[index].state = 1;
+	if (lb[index].base >= 0) {
+		if (lb[lb[index].base].state == 1) {
+			uprintf("localization: locale base '%s' is part of a loop - ignoring", lb[lb[index].base].locale->txt[0]);
+			lb[index].base = -1;
+		} else {
+			set_build_own_msgs(lb, lb[index].base);
+		}
+	}
+	for (id = 1; id < LOC_MSG_COUNT; id++) {
+		if (!same_msg(lb[index].msg[id], lookup_build_msg(lb, lb[index].base, id)))
+			lb[index].own[id] = (lb[index].msg[id] != NULL) ? lb[index].msg[id] : loc_undefined_msg;
+	}
+	lb[index].state = 2;
+}
+
+/*
+ * Add a string to the (NUL prefixed) pool of the table under construction, unless
+ * it's already there, and return its offset. Returns 0 for NULL or on error.
+ */
+static uint32_t add_pool_str(char* str, htab_table* htab, char** pool, uint32_t* pool_size, uint32_t* pool_max)
+{
+	uint32_t i, len;
+
+	if ((str == NULL) || (*pool == NULL))
+		return 0;
+	i = htab_hash(str, htab);
+	if (i == 0)
+		return 0;
+	if (htab->table[i].data != NULL)
+		return (uint32_t)(uintptr_t)htab->table[i].data;
+	len = (uint32_t)strlen(str) + 1;
+	if (*pool_size + len > *pool_max) {
+		*pool_max = max(2 * *pool_max, *pool_size + len);
+		*pool = (char*)_reallocf(*pool, *pool_max);
+		if (*pool == NULL)
+			return 0;
+	}
+	memcpy(&(*pool)[*pool_size], str, len);
+	htab->table[i].data = (void*)(uintptr_t)*pool_size;
+	*pool_size += len;
+	return (uint32_t)(uintptr_t)htab->table[i].data;
+}
+
+/*
+ * Parse all the locales from a text localization file (or from the in-memory data
+ * set with set_loc_data_buffer()) into a locale table, and use that table.
+ * This replaces the text data for everything that follows, and the table is kept
+ * for the lifetime of the application, as the message tables point into it.
+ */
+BOOL build_loc_table(const char* filename)
+{
+	BOOL r = FALSE;
+	htab_table htab = HTAB_EMPTY;
+	loc_build* lb = NULL;
+	loc_cmd *locale, *lcmd, *next;
+	loc_table_header* hdr;
+	loc_table_locale* loc;
+	loc_table_cmd* cmd;
+	uint8_t* table = NULL;
+	char* pool = NULL;
+	uint32_t *lcid, *msg, offset, pool_size = 1, pool_max = 64 * KB, nb_strs = 0;
+	int i, id, nb_locales = 0;
+
+	if (loc_table != NULL)
+		return TRUE;
+	if (!get_supported_locales(filename))
+		return FALSE;
+	list_for_each_entry(locale, &locale_list, loc_cmd, list)
+		nb_locales++;
+	lb = (loc_build*)calloc(nb_locales, sizeof(loc_build));
+	if (lb == NULL)
+		goto out;
+	i = 0;
+	list_for_each_entry(locale, &locale_list, loc_cmd, list) {
+		lb[i].locale = locale;
+		lb[i].base = -1;
+		list_init(&lb[i].cmds);
+		if (!get_loc_cmd_list(filename, locale, &lb[i].cmds))
+			goto out;
+		// Only the commands that get replayed or that provide messages matter
+		list_for_each_entry_safe(lcmd, next, &lb[i].cmds, loc_cmd, list) {
+			if ((lcmd->command != LC_GROUP) && (lcmd->command != LC_TEXT) && (lcmd->command != LC_BASE)) {
+				list_del(&lcmd->list);
+				free_loc_cmd(lcmd);
+			}
+		}
+		i++;
+	}
+
+	// The default locale is always the first one
+	apply_build_locale(lb, nb_locales, 0, lb[0].msg, TRUE);
+	for (i = 1; i < nb_locales; i++) {
+		apply_build_locale(lb, nb_locales, i, lb[i].msg, FALSE);
+		// Messages fall back to the locale that was last set as base
+		list_for_each_entry(lcmd, &lb[i].cmds, loc_cmd, list) {
+			if (lcmd->command == LC_BASE) {
+				id = find_build_locale(lb, nb_locales, lcmd->txt[0]);
+				if (id >= 0)
+					lb[i].base = id;
+			}
+		}
+	}
+	for (id = 1; id < LOC_MSG_COUNT; id++)
+		lb[0].own[id] = lb[0].msg[id];
+	lb[0].state = 2;
+	for (i = 1; i < nb_locales; i++)
+		set_build_own_msgs(lb, i);
+
+	// Lay out the header, the locale records and, for each locale, its LCIDs, commands and messages
+	offset = (uint32_t)(sizeof(loc_table_header) + nb_locales * sizeof(loc_table_locale));
+	for (i = 0; i < nb_locales; i++) {
+		offset += (uint32_t)((lb[i].locale->unum_size + LOC_MSG_COUNT) * sizeof(uint32_t));
+		nb_strs += 2 + LOC_MSG_COUNT;
+		list_for_each_entry(lcmd, &lb[i].cmds, loc_cmd, list) {
+			if ((lcmd->command == LC_BASE) || (safe_strncmp(lcmd->txt[0], "MSG_", 4) != 0)) {
+				offset += sizeof(loc_table_cmd);
+				nb_strs += 2;
+			}
+		}
+	}
+	table = (uint8_t*)calloc(offset, 1);
+	pool = (char*)calloc(pool_max, 1);
+	if ((table == NULL) || (pool == NULL) || !htab_create(nb_strs, &htab)) {
+		uprintf("localization: could not allocate locale table");
+		goto out;
+	}
+	hdr = (loc_table_header*)table;
+	hdr->magic = LOC_TABLE_MAGIC;
+	hdr->version = LOC_TABLE_VERSION;
+	hdr->msg_count = LOC_MSG_COUNT;
+	hdr->locale_count = (uint32_t)nb_locales;
+	hdr->locale_offset = sizeof(loc_table_header);
+	loc = (loc_table_locale*)&table[hdr->locale_offset];
+	offset = (uint32_t)(hdr->locale_offset + nb_locales * sizeof(loc_table_locale));
+	for (i = 0; i < nb_locales; i++, loc++) {
+		locale = lb[i].locale;
+		loc->lcid_count = locale->unum_size;
+		loc->lcid_offset = offset;
+		lcid = (uint32_t*)&table[offset];
+		memcpy(lcid, locale->unum, loc->lcid_count * sizeof(uint32_t));
+		offset += loc->lcid_count * sizeof(uint32_t);
+		loc->cmd_offset = offset;
+		cmd = (loc_table_cmd*)&table[offset];
+		list_for_each_entry(lcmd, &lb[i].cmds, loc_cmd, list) {
+			// The messages are stored separately
+			if ((lcmd->command != LC_BASE) && (safe_strncmp(lcmd->txt[0], "MSG_", 4) == 0))
+				continue;
+			cmd->command = lcmd->command;
+			cmd->line_nr = lcmd->line_nr;
+			cmd->txt[0] = add_pool_str(lcmd->txt[0], &htab, &pool, &pool_size, &pool_max);
+			cmd->txt[1] = add_pool_str(lcmd->txt[1], &htab, &pool, &pool_size, &pool_max);
+			cmd++;
+			loc->cmd_count++;
+		}
+		offset += (uint32_t)(loc->cmd_count * sizeof(loc_table_cmd));
+		loc->msg_offset = offset;
+		msg = (uint32_t*)&table[offset];
+		for (id = 1; id < LOC_MSG_COUNT; id++)
+			msg[id] = (lb[i].own[id] == loc_undefined_msg) ? LOC_TABLE_UNDEFINED :
+				add_pool_str(lb[i].own[id], &htab, &pool, &pool_size, &pool_max);
+		offset += LOC_MSG_COUNT * sizeof(uint32_t);
+		loc->name = add_pool_str(locale->txt[0], &htab, &pool, &pool_size, &pool_max);
+		loc->display_name = add_pool_str(locale->txt[1], &htab, &pool, &pool_size, &pool_max);
+		loc->flags = (uint32_t)locale->ctrl_id;
+		loc->base = (lb[i].base >= 0) ? (uint32_t)lb[i].base : LOC_TABLE_NO_BASE;
+		loc->line_nr = locale->line_nr;
+	}
+	if (pool == NULL)
+		goto out;
+	hdr->pool_offset = offset;
+	hdr->pool_size = pool_size;
+	hdr->size = offset + pool_size;
+	table = (uint8_t*)_reallocf(table, hdr->size);
+	if (table == NULL)
+		goto out;
+	memcpy(&table[offset], pool, pool_size);
+	r = set_loc_table(table, ((loc_table_header*)table)->size);
+
+out:
+	if (lb != NULL) {
+		for (i = 0; i < nb_locales; i++) {
+			if (lb[i].locale == NULL)
+				break;
+			list_for_each_entry_safe(lcmd, next, &lb[i].cmds, loc_cmd, list) {
+				list_del(&lcmd->list);
+				free_loc_cmd(lcmd);
+			}
+		}
+	}
+	htab_destroy(&htab);
+	safe_free(pool);
+	safe_free(lb);
+	if (!r)
+		safe_free(table);
+	return r;
+}
+
+/*
+ * Header for the cached locale table, so that we know which loc data it was built
+ * from, and that it wasn't altered since.
+ */
+typedef struct loc_table_cache_struct {
+	uint32_t	src_size;
+	uint32_t	table_size;
+	uint64_t	src_hash;
+	uint64_t	table_hash;
+} loc_table_cache;
+
+/*
+ * FNV-1a, on 64-bit words, with the high bits folded back after each round.
+ * This is only used to tell if the loc data or the cached table were modified.
+ */
+static uint64_t hash_loc_data(const uint8_t* buf, DWORD size)
+{
+	uint64_t w, h = 0xcbf29ce484222325ULL;
+	DWORD i;
+
+	for (i = 0; i + sizeof(w) <= size; i += sizeof(w)) {
+		memcpy(&w, &buf[i], sizeof(w));
+		h = (h ^ w) * 0x100000001b3ULL;
+		h ^= h >> 32;
+	}
+	for (; i < size; i++)
+		h = (h ^ buf[i]) * 0x100000001b3ULL;
+	return h;
+}
+
+/*
+ * Use a locale table for the in-memory loc data, which is only built on first run,
+ * or when the loc data changes, and cached as 'embedded.lct' in cache_dir otherwise.
+ */
+BOOL load_loc_table(const uint8_t* buf, DWORD size, const char* cache_dir)
+{
+	char path[MAX_PATH];
+	uint8_t* cache = NULL;
+	uint32_t cache_size = 0;
+	loc_table_cache hdr = { 0 };
+
+	set_loc_data_buffer(buf, size);
+	if (buf == NULL)
+		return FALSE;
+	hdr.src_size = size;
+	hdr.src_hash = hash_loc_data(buf, size);
+	static_sprintf(path, "%s\\embedded.lct", cache_dir);
+	if (_accessU(path, 0) == 0)
+		cache_size = read_file(path, &cache);
+	if (cache_size > sizeof(hdr)) {
+		hdr.table_size = cache_size - (uint32_t)sizeof(hdr);
+		hdr.table_hash = hash_loc_data(&cache[sizeof(hdr)], hdr.table_size);
+		if ((memcmp(cache, &hdr, sizeof(hdr)) == 0) && set_loc_table(&cache[sizeof(hdr)], hdr.table_size))
+			return TRUE;
+		uprintf("localization: discarding outdated locale table '%s'", path);
+	}
+	safe_free(cache);
+
+	uprintf("localization: building the locale table");
+	if (!build_loc_table(embedded_loc_filename))
+		return FALSE;
+	hdr.table_size = loc_table->size;
+	hdr.table_hash = hash_loc_data((const uint8_t*)loc_table, loc_table->size);
+	cache = (uint8_t*)malloc(sizeof(hdr) + loc_table->size);
+	if (cache != NULL) {
+		memcpy(cache, &hdr, sizeof(hdr));
+		memcpy(&cache[sizeof(hdr)], loc_table, loc_table->size);
+		IGNORE_RETVAL(_mkdirU(cache_dir));
+		if (write_file(path, cache, (uint32_t)sizeof(hdr) + loc_table->size) != sizeof(hdr) + loc_table->size)
+			DeleteFileU(path);
+		free(cache);
+	}
+	return TRUE;
+}
+
+/*
+ * Look up a message from the locale table, going through the base locales
+ * that the message may be inherited from.
+ */
+static char* get_loc_table_msg(uint32_t index, uint32_t msg_id)
+{
+	const loc_table_locale* loc;
+	uint32_t depth, offset;
+
+	// A base locale can't be listed more than once in a chain
+	for (depth = 0; (depth < loc_table->locale_count) && (index < loc_table->locale_count); depth++) {
+		loc = &LOC_TABLE_PTR(loc_table_locale, loc_table->locale_offset)[index];
+		offset = (msg_id < loc_table->msg_count) ? LOC_TABLE_PTR(uint32_t, loc->msg_offset)[msg_id] : 0;
+		if (offset == LOC_TABLE_UNDEFINED)
+			return NULL;
+		if (offset != 0)
+			return LOC_TABLE_STR(offset);
+		index = loc->base;
+	}
+	return NULL;
+}
+
+/*
+ * Replay the dialog commands of a locale from the locale table, as
+ * get_loc_data_file() would have dispatched them.
+ */
+static void replay_loc_table_cmds(uint32_t index, uint32_t depth)
+{
+	const loc_table_locale* loc = &LOC_TABLE_PTR(loc_table_locale, loc_table->locale_offset)[index];
+	const loc_table_cmd* cmd = LOC_TABLE_PTR(loc_table_cmd, loc->cmd_offset);
+	// The default locale is always the first one
+	loc_cmd* default_locale = list_entry(locale_list.next, loc_cmd, list);
+	loc_cmd *lcmd, *base_locale;
+	uint32_t i;
+
+	for (i = 0; i < loc->cmd_count; i++) {
+		loc_line_nr = cmd[i].line_nr;
+		if (cmd[i].command == LC_BASE) {
+			base_locale = get_locale_from_name(LOC_TABLE_STR(cmd[i].txt[0]), FALSE);
+			if (base_locale == NULL) {
+				luprintf("locale base '%s' not found - ignoring", LOC_TABLE_STR(cmd[i].txt[0]));
+				continue;
+			}
+			uprintf("localization: using locale base '%s'\n", base_locale->txt[0]);
+			// Same as dispatch_loc_cmd(), the default locale only needs replaying for its UI commands
+			if (((base_locale != default_locale) || (base_locale->ctrl_id & LOC_HAS_UI_COMMANDS)) &&
+				(depth < loc_table->locale_count))
+				replay_loc_table_cmds(base_locale->num[0], depth + 1);
+			continue;
+		}
+		lcmd = (loc_cmd*)calloc(sizeof(loc_cmd), 1);
+		if (lcmd == NULL) {
+			luprint("could not allocate command");
+			return;
+		}
+		lcmd->command = (uint8_t)cmd[i].command;
+		lcmd->ctrl_id = -1;
+		lcmd->line_nr = (uint16_t)cmd[i].line_nr;
+		lcmd->txt[0] = safe_strdup(LOC_TABLE_STR(cmd[i].txt[0]));
+		if (cmd[i].txt[1] != 0)
+			lcmd->txt[1] = safe_strdup(LOC_TABLE_STR(cmd[i].txt[1]));
+		dispatch_loc_cmd(lcmd);
+	}
+}
+
+/*
+ * Construct the list of available locales from the locale table.
+ * num[0] holds the index of the locale in the table.
+ */
+BOOL get_supported_locales_table(void)
+{
+	const loc_table_locale* loc = LOC_TABLE_PTR(loc_table_locale, loc_table->locale_offset);
+	loc_cmd* lcmd;
+	uint32_t i;
+
+	free_locale_list();
+	for (i = 0; i < loc_table->locale_count; i++, loc++) {
+		lcmd = (loc_cmd*)calloc(sizeof(loc_cmd), 1);
+		if (lcmd == NULL) {
+			uprintf("localization: could not allocate locale");
+			break;
+		}
+		lcmd->command = LC_LOCALE;
+		lcmd->ctrl_id = (int)loc->flags;
+		lcmd->line_nr = (uint16_t)loc->line_nr;
+		lcmd->num[0] = (int32_t)i;
+		lcmd->txt[0] = safe_strdup(LOC_TABLE_STR(loc->name));
+		lcmd->txt[1] = safe_strdup(LOC_TABLE_STR(loc->display_name));
+		lcmd->unum_size = (uint8_t)loc->lcid_count;
+		lcmd->unum = (uint32_t*)malloc(loc->lcid_count * sizeof(uint32_t));
+		if ((lcmd->txt[0] == NULL) || (lcmd->txt[1] == NULL) || (lcmd->unum == NULL)) {
+			uprintf("localization: could not allocate locale");
+			free_loc_cmd(lcmd);
+			break;
+		}
+		memcpy(lcmd->unum, LOC_TABLE_PTR(uint32_t, loc->lcid_offset), loc->lcid_count * sizeof(uint32_t));
+		// The locales were already reported when the table was built
+		list_add_tail(&lcmd->list, &locale_list);
+	}
+	return (i >= loc_table->locale_count);
+}
+
+/*
+ * Set up the message tables and dialog commands for a locale from the locale
+ * table. Messages are pointers into the table, so nothing needs parsing or copying.
+ */
+BOOL get_loc_data_table(loc_cmd* lcmd)
+{
+	// The default locale is always the first one
+	loc_cmd* default_locale = list_entry(locale_list.next, loc_cmd, list);
+	size_t i;
+
+	if ((lcmd == NULL) || list_empty(&locale_list)) {
+		uprintf("localization: no locale");
+		return FALSE;
+	}
+
+	if (msg_table == NULL) {
+		// Initialize the default message table (usually en-US)
+		uprintf("localization: initializing default message table");
+		for (i = 1; i < MSG_MAX - MSG_000; i++) {
+			safe_free_msg(default_msg_table[i]);
+			default_msg_table[i] = get_loc_table_msg(default_locale->num[0], (uint32_t)i);
+		}
+		msg_table = default_msg_table;
+	}
+	if (lcmd == default_locale) {
+		msg_table = default_msg_table;
+		return TRUE;
+	}
+
+	msg_table = current_msg_table;
+	free_dialog_list();
+	for (i = 1; i < MSG_MAX - MSG_000; i++) {
+		safe_free_msg(current_msg_table[i]);
+		current_msg_table[i] = get_loc_table_msg(lcmd->num[0], (uint32_t)i);
+	}
+	replay_loc_table_cmds(lcmd->num[0], 0);
+	return TRUE;
+}
+
 /*
  * Apply stored localization commands to a specific dialog
  * If hDlg is NULL, apply the commands against an active Window
@@ -671,3 +1256,118 @@ WORD get_language_id(loc_cmd* lcmd)
 		"This means that some controls may still be displayed using the system locale.", lcmd->txt[1]);
 	return MAKELANGID(LANG_NEUTRAL, SUBLANG_DEFAULT);
 }
+
+#if defined(_DEBUG) || defined(TEST) || defined(ALPHA)
+extern loc_cmd* selected_locale;
+
+/*
+ * Start over with the locales from either the locale table or a text loc file
+ */
+static BOOL reload_locales(const loc_table_header* table, const char* filename)
+{
+	exit_localization();
+	msg_table = NULL;
+	init_localization();
+	loc_table = table;
+	if (table != NULL)
+		loc_filename = embedded_loc_filename;
+	return get_supported_locales(filename);
+}
+
+/*
+ * Load a locale and return a dump of its attributes, messages and dialog commands
+ */
+static char* dump_locale(const loc_table_header* table, const char* filename, int index)
+{
+	const size_t size = 1 * MB;
+	char *dump = NULL, str[64];
+	loc_cmd* lcmd;
+	int i = 0;
+
+	if (!reload_locales(table, filename))
+		return NULL;
+	list_for_each_entry(lcmd, &locale_list, loc_cmd, list) {
+		if (i++ == index)
+			break;
+	}
+	if ((&lcmd->list == &locale_list) || (!get_loc_data_file(filename, lcmd)))
+		return NULL;
+	dump = (char*)calloc(size, 1);
+	if (dump == NULL)
+		return NULL;
+
+	safe_sprintf(dump, size, "l \"%s\" \"%s\" 0x%08X", lcmd->txt[0], lcmd->txt[1], lcmd->ctrl_id);
+	for (i = 0; i < lcmd->unum_size; i++) {
+		static_sprintf(str, " 0x%04X", lcmd->unum[i]);
+		safe_strcat(dump, size, str);
+	}
+	for (i = 1; i < MSG_MAX - MSG_000; i++) {
+		static_sprintf(str, "\nMSG_%03d ", i);
+		safe_strcat(dump, size, str);
+		safe_strcat(dump, size, (msg_table[i] == NULL) ? "<undefined>" : msg_table[i]);
+	}
+	for (i = 0; i < ARRAYSIZE(loc_dlg); i++) {
+		list_for_each_entry(lcmd, &loc_dlg[i].list, loc_cmd, list) {
+			static_sprintf(str, "\n%s %d ", control_id[i].name, lcmd->command);
+			safe_strcat(dump, size, str);
+			safe_strcat(dump, size, lcmd->txt[0]);
+			safe_strcat(dump, size, " ");
+			safe_strcat(dump, size, (lcmd->txt[1] == NULL) ? "<undefined>" : lcmd->txt[1]);
+		}
+	}
+	return dump;
+}
+
+/*
+ * Check that the locale table provides the same locales, messages and dialog
+ * commands as parsing the embedded loc data it was built from.
+ */
+int TestLocTable(void)
+{
+	const loc_table_header* table = loc_table;
+	const char* path = embedded_loc_filename;
+	char *locale_name, *table_dump, *text_dump;
+	int i, j, errors = 0;
+	size_t k;
+
+	// The embedded loc data is still set from startup, so the text path parses it from memory
+	if ((table == NULL) || (selected_locale == NULL)) {
+		uprintf("Locale table test: the locale table is not in use");
+		return -1;
+	}
+	locale_name = safe_strdup(selected_locale->txt[0]);
+
+	for (i = 0; ; i++) {
+		table_dump = dump_locale(table, NULL, i);
+		text_dump = dump_locale(NULL, path, i);
+		if ((table_dump == NULL) || (text_dump == NULL)) {
+			if ((table_dump != NULL) || (text_dump != NULL)) {
+				uprintf("Locale table test: locale #%d is only present in the %s", i, (table_dump != NULL) ? "table" : "text");
+				errors++;
+			}
+			safe_free(table_dump);
+			safe_free(text_dump);
+			break;
+		}
+		for (k = 0; (table_dump[k] != 0) && (table_dump[k] == text_dump[k]); k++);
+		if (table_dump[k] != text_dump[k]) {
+			// Report from the start of the line that differs
+			for (j = (int)k; (j > 0) && (text_dump[j - 1] != '\n'); j--);
+			uprintf("Locale table test: locale #%d differs at offset %d", i, (int)k);
+			uprintf("  text:  %.80s", &text_dump[j]);
+			uprintf("  table: %.80s", &table_dump[j]);
+			errors++;
+		}
+		safe_free(table_dump);
+		safe_free(text_dump);
+	}
+	uprintf("Locale table test: %d locales checked against '%s' - %d error(s)", i, path, errors);
+
+	// Restore the locale table and the selected locale
+	reload_locales(table, NULL);
+	selected_locale = get_locale_from_name(locale_name, TRUE);
+	get_loc_data_file(NULL, selected_locale);
+	free(locale_name);
+	return errors;
+}
+#endif
@@ -31,6 +31,8 @@
 // Attributes that can be set by a translation
 #define LOC_RIGHT_TO_LEFT       0x00000001
 #define LOC_NEEDS_UPDATE        0x00000002
+// Internal attribute, set for locales that contain dialog related commands
+#define LOC_HAS_UI_COMMANDS     0x00000004
 
 #define MSG_RTF                 0x10000000
 #define MSG_MASK                0x0FFFFFFF
@@ -128,6 +130,46 @@ typedef struct loc_cmd_struct {
 	struct list_head list;
 } loc_cmd;
 
+/*
+ * Locale table, as built from the text localization data by build_loc_table().
+ * All offsets are from the start of the table, except for strings, which are
+ * offsets into the (NUL prefixed) string pool.
+ */
+#define LOC_TABLE_MAGIC         0x544C5552	// "RULT"
+#define LOC_TABLE_VERSION       1
+#define LOC_TABLE_NO_BASE       0xFFFFFFFF
+#define LOC_TABLE_UNDEFINED     0xFFFFFFFF
+
+typedef struct loc_table_header_struct {
+	uint32_t	magic;
+	uint32_t	version;
+	uint32_t	size;
+	uint32_t	msg_count;
+	uint32_t	locale_count;
+	uint32_t	locale_offset;
+	uint32_t	pool_offset;
+	uint32_t	pool_size;
+} loc_table_header;
+
+typedef struct loc_table_locale_struct {
+	uint32_t	name;
+	uint32_t	display_name;
+	uint32_t	flags;		// LOC_xxx attributes
+	uint32_t	base;		// Locale to look up inherited messages from
+	uint32_t	line_nr;
+	uint32_t	lcid_count;
+	uint32_t	lcid_offset;
+	uint32_t	cmd_count;
+	uint32_t	cmd_offset;
+	uint32_t	msg_offset;	// One string per MSG_xxx, 0 if inherited or LOC_TABLE_UNDEFINED
+} loc_table_locale;
+
+typedef struct loc_table_cmd_struct {
+	uint32_t	command;	// LC_GROUP, LC_TEXT or LC_BASE
+	uint32_t	line_nr;
+	uint32_t	txt[2];
+} loc_table_cmd;
+
 typedef struct loc_parse_struct {
 	char  c;
 	enum  loc_command_type cmd;
@@ -151,6 +193,7 @@ extern char *default_msg_table[], *current_msg_table[], **msg_table;
 extern int loc_line_nr;
 extern char *loc_filename, *embedded_loc_filename;
 extern BOOL en_msg_mode;
+extern const loc_table_header* loc_table;
 
 void free_loc_cmd(loc_cmd* lcmd);
 BOOL dispatch_loc_cmd(loc_cmd* lcmd);
@@ -165,6 +208,13 @@ void free_dialog_list(void);
 char* lmprintf(uint32_t msg_id, ...);
 BOOL get_supported_locales(const char* filename);
 BOOL get_loc_data_file(const char* filename, loc_cmd* lcmd);
+BOOL get_loc_cmd_list(const char* filename, loc_cmd* lcmd, struct list_head* list);
+void set_loc_data_buffer(const uint8_t* buf, DWORD size);
+BOOL set_loc_table(const uint8_t* buf, DWORD size);
+BOOL build_loc_table(const char* filename);
+BOOL load_loc_table(const uint8_t* buf, DWORD size, const char* cache_dir);
+BOOL get_supported_locales_table(void);
+BOOL get_loc_data_table(loc_cmd* lcmd);
 void free_locale_list(void);
 loc_cmd* get_locale_from_lcid(int lcid, BOOL fallback);
 loc_cmd* get_locale_from_name(char* locale_name, BOOL fallback);
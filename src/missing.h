@@ -157,6 +157,79 @@ static __inline uint16_t remap16(uint16_t src, uint16_t* map, const BOOL reverse
 	return r;
 }
 
+/// <summary>
+/// Find the offset of the first byte that differs between two buffers.
+/// On x86_64, the bulk of the comparison is done 64 bytes at a time using SSE2.
+/// </summary>
+/// <param name="buf1">The first buffer.</param>
+/// <param name="buf2">The second buffer.</param>
+/// <param name="len">The number of bytes to compare.</param>
+/// <returns>The offset of the first mismatching byte, or len if the buffers are identical.</returns>
+static __inline size_t mismatch_offset(const uint8_t* buf1, const uint8_t* buf2, size_t len)
+{
+	size_t i = 0;
+#if defined(_M_X64) || defined(__x86_64__)
+	__m128i r0, r1, r2, r3;
+	for (; i + 64 <= len; i += 64) {
+		r0 = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)&buf1[i]), _mm_loadu_si128((const __m128i*)&buf2[i]));
+		r1 = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)&buf1[i + 16]), _mm_loadu_si128((const __m128i*)&buf2[i + 16]));
+		r2 = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)&buf1[i + 32]), _mm_loadu_si128((const __m128i*)&buf2[i + 32]));
+		r3 = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)&buf1[i + 48]), _mm_loadu_si128((const __m128i*)&buf2[i + 48]));
+		if (_mm_movemask_epi8(_mm_and_si128(_mm_and_si128(r0, r1), _mm_and_si128(r2, r3))) != 0xffff)
+			break;
+	}
+#else
+	for (; i + 8 <= len; i += 8) {
+		if (*(const uint64_t*)&buf1[i] != *(const uint64_t*)&buf2[i])
+			break;
+	}
+#endif
+	for (; (i < len) && (buf1[i] == buf2[i]); i++);
+	return i;
+}
+
+/// <summary>
+/// Check whether a buffer only contains zeroes, or only contains ones (as is the case for erased flash).
+/// On x86_64, the bulk of the check is done 64 bytes at a time using SSE2.
+/// </summary>
+/// <param name="buf">The buffer to check.</param>
+/// <param name="len">The number of bytes to check.</param>
+/// <returns>TRUE if all the bytes are either 0x00 or 0xff, FALSE otherwise.</returns>
+static __inline BOOL is_blank_buffer(const uint8_t* buf, size_t len)
+{
+	size_t i = 0;
+	const uint8_t fill = (len == 0) ? 0 : buf[0];
+#if defined(_M_X64) || defined(__x86_64__)
+	__m128i f, r0, r1, r2, r3;
+#else
+	const uint64_t fill64 = (fill == 0) ? 0 : UINT64_MAX;
+#endif
+
+	if ((fill != 0x00) && (fill != 0xff))
+		return FALSE;
+#if defined(_M_X64) || defined(__x86_64__)
+	f = _mm_set1_epi8((char)fill);
+	for (; i + 64 <= len; i += 64) {
+		r0 = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)&buf[i]), f);
+		r1 = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)&buf[i + 16]), f);
+		r2 = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)&buf[i + 32]), f);
+		r3 = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)&buf[i + 48]), f);
+		if (_mm_movemask_epi8(_mm_and_si128(_mm_and_si128(r0, r1), _mm_and_si128(r2, r3))) != 0xffff)
+			return FALSE;
+	}
+#else
+	for (; i + 8 <= len; i += 8) {
+		if (*(const uint64_t*)&buf[i] != fill64)
+			return FALSE;
+	}
+#endif
+	for (; i < len; i++) {
+		if (buf[i] != fill)
+			return FALSE;
+	}
+	return TRUE;
+}
+
 /* Why oh why does Microsoft have to make everybody suffer with their braindead use of Unicode? */
 #define _RT_ICON			MAKEINTRESOURCEA(3)
 #define _RT_DIALOG			MAKEINTRESOURCEA(5)
@@ -46,6 +46,79 @@ const struct {char c; int flag;} attr_parse[] = {
 	{ 'r', LOC_RIGHT_TO_LEFT },
 };
 
+/*
+ * In-memory localization data, such as the embedded.loc from our resources, that
+ * is read in place of the file when set. The loc_*() calls below act on it when
+ * they are handed LOC_BUF_FD, and are plain stdio calls otherwise.
+ */
+static const char* loc_buf = NULL;
+static long loc_buf_size = 0, loc_buf_pos = 0;
+#define LOC_BUF_FD ((FILE*)&loc_buf)
+// When set, the commands parsed by get_loc_data_line() are added to this list instead of being dispatched
+static struct list_head* loc_cmd_list = NULL;
+
+void set_loc_data_buffer(const uint8_t* buf, DWORD size)
+{
+	loc_buf = (const char*)buf;
+	loc_buf_size = (buf == NULL) ? 0 : (long)size;
+	loc_buf_pos = 0;
+}
+
+static __inline int loc_getc(FILE* fd)
+{
+	if (fd != LOC_BUF_FD)
+		return getc(fd);
+	return (loc_buf_pos < loc_buf_size) ? (uint8_t)loc_buf[loc_buf_pos++] : EOF;
+}
+
+static __inline long loc_ftell(FILE* fd)
+{
+	return (fd == LOC_BUF_FD) ? loc_buf_pos : ftell(fd);
+}
+
+static int loc_fseek(FILE* fd, long offset)
+{
+	if (fd != LOC_BUF_FD)
+		return fseek(fd, offset, SEEK_SET);
+	if ((offset < 0) || (offset > loc_buf_size))
+		return -1;
+	loc_buf_pos = offset;
+	return 0;
+}
+
+static size_t loc_fread(char* buf, size_t size, FILE* fd)
+{
+	if (fd != LOC_BUF_FD)
+		return fread(buf, 1, size, fd);
+	size = min(size, (size_t)(loc_buf_size - loc_buf_pos));
+	memcpy(buf, &loc_buf[loc_buf_pos], size);
+	loc_buf_pos += (long)size;
+	return size;
+}
+
+static char* loc_fgets(char* line, int size, FILE* fd)
+{
+	int i;
+
+	if (fd != LOC_BUF_FD)
+		return fgets(line, size, fd);
+	if ((size <= 0) || (loc_buf_pos >= loc_buf_size))
+		return NULL;
+	for (i = 0; (i < size - 1) && (loc_buf_pos < loc_buf_size); ) {
+		line[i] = loc_buf[loc_buf_pos++];
+		if (line[i++] == '\n')
+			break;
+	}
+	line[i] = 0;
+	return line;
+}
+
+static __inline void loc_fclose(FILE* fd)
+{
+	if (fd != LOC_BUF_FD)
+		fclose(fd);
+}
+
 /*
  * Fill a localization command buffer by parsing the line arguments
  * The command is allocated and must be freed (by calling free_loc_cmd)
@@ -192,16 +265,20 @@ static void get_loc_data_line(char* line)
 
 	lcmd = get_loc_cmd(t, &line[i]);
 
-	if ((lcmd != NULL) && (lcmd->command != LC_LOCALE))
-		// TODO: check return value?
-		dispatch_loc_cmd(lcmd);
-	else
+	if ((lcmd != NULL) && (lcmd->command != LC_LOCALE)) {
+		if (loc_cmd_list != NULL)
+			list_add_tail(&lcmd->list, loc_cmd_list);
+		else
+			// TODO: check return value?
+			dispatch_loc_cmd(lcmd);
+	} else {
 		free_loc_cmd(lcmd);
+	}
 }
 
 /*
  * Open a localization file and store its file name, with special case
- * when dealing with the embedded loc file.
+ * when dealing with the embedded loc file, or with in-memory data.
  */
 FILE* open_loc_file(const char* filename)
 {
@@ -215,6 +292,11 @@ FILE* open_loc_file(const char* filename)
 	if (loc_filename != embedded_loc_filename) {
 		safe_free(loc_filename);
 	}
+	if (loc_buf != NULL) {
+		loc_filename = embedded_loc_filename;
+		loc_buf_pos = 0;
+		return LOC_BUF_FD;
+	}
 	if (safe_strcmp(tmp_ext, &filename[safe_strlen(filename)-4]) == 0) {
 		loc_filename = embedded_loc_filename;
 	} else {
@@ -250,12 +332,16 @@ BOOL get_supported_locales(const char* filename)
 	int version_line_nr = 0;
 	uint32_t loc_base_major = -1, loc_base_minor = -1;
 
+	// The locale table, when in use, already has everything we need
+	if (loc_table != NULL)
+		return get_supported_locales_table();
+
 	fd = open_loc_file(filename);
 	if (fd == NULL)
 		goto out;
 
 	// Check that the file doesn't contain a BOM and was saved in DOS mode
-	i = fread(line, 1, sizeof(line), fd);
+	i = loc_fread(line, sizeof(line), fd);
 	if (i < sizeof(line)) {
 		uprintf("Invalid loc file: the file is too small!");
 		goto out;
@@ -270,19 +356,25 @@ BOOL get_supported_locales(const char* filename)
 		uprintf("Invalid loc file: the file MUST be saved in DOS mode (CR/LF)");
 		goto out;
 	}
-	fseek(fd, 0, SEEK_SET);
+	loc_fseek(fd, 0);
 
 	loc_line_nr = 0;
 	line[0] = 0;
 	free_locale_list();
 	do {
 		// adjust the last block
-		end_of_block = ftell(fd);
-		if (fgets(line, sizeof(line), fd) == NULL)
+		end_of_block = loc_ftell(fd);
+		if (loc_fgets(line, sizeof(line), fd) == NULL)
 			break;
 		loc_line_nr++;
 		// Skip leading spaces
 		i = strspn(line, space);
+		// Flag the locales that have UI commands, since these can't be skipped when used as base
+		if ((last_lcmd != NULL) && ((line[i] == 'g') || (line[i] == 'f') || ((line[i] == 't') &&
+			(strncmp(&line[i + 1 + strspn(&line[i + 1], space)], "MSG_", 4) != 0)))) {
+			last_lcmd->ctrl_id |= LOC_HAS_UI_COMMANDS;
+			continue;
+		}
 		if ((line[i] != 'l') && (line[i] != 'v') && (line[i] != 'a'))
 			continue;
 		// line[i] is not NUL so i+1 is safe to access
@@ -304,7 +396,7 @@ BOOL get_supported_locales(const char* filename)
 					last_lcmd->num[1] = (int32_t)end_of_block;
 				}
 			}
-			lcmd->num[0] = (int32_t)ftell(fd);
+			lcmd->num[0] = (int32_t)loc_ftell(fd);
 			// Add our locale command to the locale list
 			list_add_tail(&lcmd->list, &locale_list);
 			uprintf("localization: found locale '%s'\n", lcmd->txt[0]);
@@ -360,7 +452,7 @@ BOOL get_supported_locales(const char* filename)
 			list_del(&last_lcmd->list);
 			free_loc_cmd(last_lcmd);
 		} else {
-			last_lcmd->num[1] = (int32_t)ftell(fd);
+			last_lcmd->num[1] = (int32_t)loc_ftell(fd);
 		}
 	}
 	r = !list_empty(&locale_list);
@@ -369,64 +461,23 @@ BOOL get_supported_locales(const char* filename)
 
 out:
 	if (fd != NULL)
-		fclose(fd);
+		loc_fclose(fd);
 	return r;
 }
 
 /*
- * Parse a locale section in a localization file (UTF-8, no BOM)
- * NB: this call is reentrant for the "base" command support
+ * Parse the lines of a locale section, from an already opened localization file
  */
-BOOL get_loc_data_file(const char* filename, loc_cmd* lcmd)
+static BOOL parse_loc_section(FILE* fd, loc_cmd* lcmd)
 {
 	size_t bufsize = 1024;
-	static FILE* fd = NULL;
-	static BOOL populate_default = FALSE;
 	char *buf = NULL;
 	size_t i = 0;
 	int r = 0, line_nr_incr = 1;
 	int c = 0, eol_char = 0;
-	int start_line, old_loc_line_nr = 0;
-	BOOL ret = FALSE, eol = FALSE, escape_sequence = FALSE, reentrant = (fd != NULL);
-	long offset, cur_offset = -1, end_offset;
-	// The default locale is always the first one
-	loc_cmd* default_locale = list_entry(locale_list.next, loc_cmd, list);
-
-	if ((lcmd == NULL) || (default_locale == NULL)) {
-		uprintf("localization: no %slocale", (default_locale == NULL)?"default ":" ");
-		goto out;
-	}
-
-	if (msg_table == NULL) {
-		// Initialize the default message table (usually en-US)
-		msg_table = default_msg_table;
-		uprintf("localization: initializing default message table");
-		populate_default = TRUE;
-		get_loc_data_file(filename, default_locale);
-		populate_default = FALSE;
-	}
-
-	if (reentrant) {
-		// Called, from a 'b' command - no need to reopen the file,
-		// just save the current offset and current line number
-		cur_offset = ftell(fd);
-		old_loc_line_nr = loc_line_nr;
-	} else {
-		if ((filename == NULL) || (filename[0] == 0))
-			return FALSE;
-		if (!populate_default) {
-			if (lcmd == default_locale) {
-				// The default locale has already been populated => nothing to do
-				msg_table = default_msg_table;
-				return TRUE;
-			}
-			msg_table = current_msg_table;
-		}
-		free_dialog_list();
-		fd = open_loc_file(filename);
-		if (fd == NULL)
-			goto out;
-	}
+	int start_line;
+	BOOL ret = FALSE, eol = FALSE, escape_sequence = FALSE;
+	long offset, end_offset;
 
 	offset = (long)lcmd->num[0];
 	end_offset = (long)lcmd->num[1];
@@ -438,13 +489,16 @@ BOOL get_loc_data_file(const char* filename, loc_cmd* lcmd)
 		goto out;
 	}
 
-	if (fseek(fd, offset, SEEK_SET) != 0) {
+	if (loc_fseek(fd, offset) != 0) {
 		uprintf("localization: could not rewind\n");
 		goto out;
 	}
 
 	do {	// custom readline handling for string collation, realloc, line numbers, etc.
-		c = getc(fd);
+		c = loc_getc(fd);
+		// Keep track of our position ourselves, as calling ftell() for every character is costly
+		if (c != EOF)
+			offset++;
 		switch(c) {
 		case EOF:
 			buf[i] = 0;
@@ -530,7 +584,7 @@ BOOL get_loc_data_file(const char* filename, loc_cmd* lcmd)
 			}
 			break;
 		}
-		if ((c == EOF) || (ftell(fd) > end_offset))
+		if ((c == EOF) || (offset > end_offset))
 			break;
 		// Have at least 2 chars extra, for \r\n sequences
 		if (i >= bufsize-2) {
@@ -548,19 +602,99 @@ BOOL get_loc_data_file(const char* filename, loc_cmd* lcmd)
 	} while(1);
 	ret = TRUE;
 
+out:
+	safe_free(buf);
+	return ret;
+}
+
+/*
+ * Parse a locale section in a localization file (UTF-8, no BOM)
+ * NB: this call is reentrant for the "base" command support
+ */
+BOOL get_loc_data_file(const char* filename, loc_cmd* lcmd)
+{
+	static FILE* fd = NULL;
+	static BOOL populate_default = FALSE;
+	int old_loc_line_nr = 0;
+	BOOL ret = FALSE, reentrant = (fd != NULL);
+	long cur_offset = -1;
+	// The default locale is always the first one
+	loc_cmd* default_locale = list_entry(locale_list.next, loc_cmd, list);
+
+	if (loc_table != NULL)
+		return get_loc_data_table(lcmd);
+
+	if ((lcmd == NULL) || (default_locale == NULL)) {
+		uprintf("localization: no %slocale", (default_locale == NULL)?"default ":" ");
+		goto out;
+	}
+
+	if (msg_table == NULL) {
+		// Initialize the default message table (usually en-US)
+		msg_table = default_msg_table;
+		uprintf("localization: initializing default message table");
+		populate_default = TRUE;
+		get_loc_data_file(filename, default_locale);
+		populate_default = FALSE;
+	}
+
+	if (reentrant) {
+		// Called, from a 'b' command - no need to reopen the file,
+		// just save the current offset and current line number
+		cur_offset = loc_ftell(fd);
+		old_loc_line_nr = loc_line_nr;
+	} else {
+		if ((filename == NULL) || (filename[0] == 0))
+			return FALSE;
+		if (!populate_default) {
+			if (lcmd == default_locale) {
+				// The default locale has already been populated => nothing to do
+				msg_table = default_msg_table;
+				return TRUE;
+			}
+			msg_table = current_msg_table;
+		}
+		free_dialog_list();
+		fd = open_loc_file(filename);
+		if (fd == NULL)
+			goto out;
+	}
+
+	ret = parse_loc_section(fd, lcmd);
+
 out:
 	// Don't close on a reentrant call
 	if (reentrant) {
-		if ((cur_offset < 0) || (fseek(fd, cur_offset, SEEK_SET) != 0)) {
+		if ((cur_offset < 0) || (loc_fseek(fd, cur_offset) != 0)) {
 			uprintf("localization: unable to reset reentrant position\n");
 			ret = FALSE;
 		}
 		loc_line_nr = old_loc_line_nr;
 	} else if (fd != NULL) {
-		fclose(fd);
+		loc_fclose(fd);
 		fd = NULL;
 	}
-	safe_free(buf);
+	return ret;
+}
+
+/*
+ * Parse a locale section into a list of commands, that are not dispatched.
+ * The commands must be freed by the caller (by calling free_loc_cmd).
+ */
+BOOL get_loc_cmd_list(const char* filename, loc_cmd* lcmd, struct list_head* list)
+{
+	FILE* fd;
+	BOOL ret;
+
+	if ((lcmd == NULL) || (list == NULL))
+		return FALSE;
+	fd = open_loc_file(filename);
+	if (fd == NULL)
+		return FALSE;
+	loc_cmd_list = list;
+	ret = parse_loc_section(fd, lcmd);
+	loc_cmd_list = NULL;
+	loc_fclose(fd);
 	return ret;
 }
 
@@ -889,6 +1023,57 @@ out:
 	return ret;
 }
 
+/*
+ * Parse an UTF-16 XML buffer and return the data for the 'n'th occurrence of 'token', which
+ * can be an element (<TOKEN>data</TOKEN>) or an attribute (<TOKEN="data">). Elements are
+ * processed individually so, unlike with get_token_data_file(), the XML may be on a single line.
+ * The returned string is UTF-8 and MUST be freed by the caller
+ */
+char* get_token_data_xml(const char* token, unsigned int n, const wchar_t* xml)
+{
+	unsigned int j = 0;
+	wchar_t *wtoken = NULL, *wdata = NULL, *wline = NULL;
+	const wchar_t *p, *next;
+	size_t len, token_len, line_size = 0;
+	char* ret = NULL;
+
+	if ((token == NULL) || (xml == NULL) || (n == 0))
+		return NULL;
+
+	wtoken = utf8_to_wchar(token);
+	if (wtoken == NULL) {
+		uprintf(conversion_error, token);
+		goto out;
+	}
+	token_len = wcslen(wtoken);
+
+	for (p = wcschr(xml, L'<'); p != NULL; p = next) {
+		next = wcschr(&p[1], L'<');
+		// Only duplicate the elements that start with our token
+		if (_wcsnicmp(&p[1 + wcsspn(&p[1], wspace)], wtoken, token_len) != 0)
+			continue;
+		len = (next == NULL) ? wcslen(p) : (size_t)(next - p);
+		if (len + 1 > line_size) {
+			line_size = len + 1;
+			wline = (wchar_t*)_reallocf(wline, line_size * sizeof(wchar_t));
+			if (wline == NULL)
+				goto out;
+		}
+		memcpy(wline, p, len * sizeof(wchar_t));
+		wline[len] = 0;
+		wdata = get_token_data_line(wtoken, wline);
+		if ((wdata != NULL) && (++j == n)) {
+			ret = wchar_to_utf8(wdata);
+			break;
+		}
+	}
+
+out:
+	safe_free(wline);
+	safe_free(wtoken);
+	return ret;
+}
+
 static __inline char* get_sanitized_token_data_buffer(const char* token, unsigned int n, const char* buffer, size_t buffer_size)
 {
 	size_t i;
@@ -962,166 +1147,416 @@ void parse_update(char* buf, size_t len)
 }
 
 /*
- * Insert entry 'data' under section 'section' of a config file
- * Section must include the relevant delimiters (eg '[', ']') if needed
+ * In-memory config file rewriting.
+ * Rather than having each token replacement or section insertion re-read and re-write
+ * the whole file, cfg_open() reads the lines of a config file once, the cfg_*() calls
+ * below apply their modifications in memory, and cfg_close() writes the file back, only
+ * once and only if it was modified. File can be ANSI or UNICODE and the output uses the
+ * same encoding/BOM as the input. If any modification requested dos2unix, CRs are removed
+ * from the whole output.
  */
-char* insert_section_data(const char* filename, const char* section, const char* data, BOOL dos2unix)
+#define CFG_LINE_INCREMENT 64
+static BOOL cfg_insert_line(cfg_file* cfg, uint32_t index, wchar_t* line)
 {
-	const wchar_t* outmode[] = { L"w", L"w, ccs=UTF-8", L"w, ccs=UTF-16LE" };
-	wchar_t *wsection = NULL, *wfilename = NULL, *wtmpname = NULL, *wdata = NULL, bom = 0;
-	wchar_t buf[1024];
-	FILE *fd_in = NULL, *fd_out = NULL;
-	size_t i, size;
-	int mode = 0;
-	char *ret = NULL, tmp[2];
+	wchar_t** new_line;
+
+	if_not_assert(index <= cfg->nb_lines)
+		return FALSE;
+	if (cfg->nb_lines >= cfg->max_lines) {
+		new_line = (wchar_t**)realloc(cfg->line, (cfg->max_lines + CFG_LINE_INCREMENT) * sizeof(wchar_t*));
+		if (new_line == NULL) {
+			uprintf("Could not allocate space for config file lines\n");
+			return FALSE;
+		}
+		cfg->line = new_line;
+		cfg->max_lines += CFG_LINE_INCREMENT;
+	}
+	memmove(&cfg->line[index + 1], &cfg->line[index], (cfg->nb_lines - index) * sizeof(wchar_t*));
+	cfg->line[index] = line;
+	cfg->nb_lines++;
+	return TRUE;
+}
 
-	if ((filename == NULL) || (section == NULL) || (data == NULL))
-		return NULL;
-	if ((filename[0] == 0) || (section[0] == 0) || (data[0] == 0))
+static void cfg_free(cfg_file* cfg)
+{
+	uint32_t i;
+
+	if (cfg == NULL)
+		return;
+	for (i = 0; i < cfg->nb_lines; i++)
+		free(cfg->line[i]);
+	safe_free(cfg->line);
+	safe_free(cfg->filename);
+	safe_free(cfg->wfilename);
+	free(cfg);
+}
+
+/*
+ * Read a config file into memory, for modification with the cfg_*() calls.
+ * Returns NULL if the file can't be read or is empty.
+ */
+cfg_file* cfg_open(const char* filename)
+{
+	wchar_t buf[1024], *line = NULL, *new_line, bom = 0;
+	size_t len = 0, buf_len;
+	FILE* fd = NULL;
+	cfg_file* cfg = NULL;
+
+	if ((filename == NULL) || (filename[0] == 0))
 		return NULL;
 
-	wfilename = utf8_to_wchar(filename);
-	if (wfilename == NULL) {
+	cfg = (cfg_file*)calloc(1, sizeof(cfg_file));
+	if (cfg == NULL)
+		return NULL;
+	cfg->filename = safe_strdup(filename);
+	cfg->wfilename = utf8_to_wchar(filename);
+	if ((cfg->filename == NULL) || (cfg->wfilename == NULL)) {
 		uprintf(conversion_error, filename);
-		goto out;
-	}
-	wsection = utf8_to_wchar(section);
-	if (wsection == NULL) {
-		uprintf(conversion_error, section);
-		goto out;
-	}
-	wdata = utf8_to_wchar(data);
-	if (wdata == NULL) {
-		uprintf(conversion_error, data);
-		goto out;
+		goto err;
 	}
 
-	fd_in = _wfopen(wfilename, L"r, ccs=UNICODE");
-	if (fd_in == NULL) {
+	fd = _wfopen(cfg->wfilename, L"r, ccs=UNICODE");
+	if (fd == NULL) {
 		uprintf("Could not open file '%s'\n", filename);
-		goto out;
+		goto err;
 	}
-	// Check the input file's BOM and create an output file with the same
-	if (fread(&bom, sizeof(bom), 1, fd_in) != 1) {
-		uprintf("Could not read file '%s'\n", filename);
-		goto out;
+	// Check the input file's BOM, so that we can create an output file with the same
+	if (fread(&bom, sizeof(bom), 1, fd) != 1) {
+		if (!feof(fd))
+			uprintf("Could not read file '%s'\n", filename);
+		goto err;
 	}
 	switch(bom) {
 	case 0xFEFF:
-		mode = 2;	// UTF-16 (LE)
+		cfg->mode = 2;	// UTF-16 (LE)
 		break;
 	case 0xBBEF:	// Yeah, the UTF-8 BOM is really 0xEF,0xBB,0xBF, but
-		mode = 1;	// find me a non UTF-8 file that actually begins with "ï»"
+		cfg->mode = 1;	// find me a non UTF-8 file that actually begins with "ï»"
 		break;
 	default:
-		mode = 0;	// ANSI
+		cfg->mode = 0;	// ANSI
 		break;
 	}
-	fseek(fd_in, 0, SEEK_SET);
-//	duprintf("'%s' was detected as %s\n", filename,
-//		(mode==0)?"ANSI/UTF8 (no BOM)":((mode==1)?"UTF8 (with BOM)":"UTF16 (with BOM"));
-
-	wtmpname = (wchar_t*)calloc(wcslen(wfilename)+2, sizeof(wchar_t));
-	if (wtmpname == NULL) {
-		uprintf("Could not allocate space for temporary output name\n");
-		goto out;
-	}
-	wcscpy(wtmpname, wfilename);
-	wtmpname[wcslen(wtmpname)] = '~';
+	fseek(fd, 0, SEEK_SET);
 
-	fd_out = _wfopen(wtmpname, outmode[mode]);
-	if (fd_out == NULL) {
-		uprintf("Could not open temporary output file '%s~'\n", filename);
-		goto out;
+	// Read individual lines, reassembling the ones that don't fit in our buffer
+	while (fgetws(buf, ARRAYSIZE(buf), fd) != NULL) {
+		buf_len = wcslen(buf);
+		new_line = (wchar_t*)realloc(line, (len + buf_len + 1) * sizeof(wchar_t));
+		if (new_line == NULL) {
+			uprintf("Could not allocate space for config file line\n");
+			goto err;
+		}
+		line = new_line;
+		wcscpy(&line[len], buf);
+		len += buf_len;
+		if ((buf_len == ARRAYSIZE(buf) - 1) && (buf[buf_len - 1] != L'\n'))
+			continue;
+		if (!cfg_insert_line(cfg, cfg->nb_lines, line))
+			goto err;
+		line = NULL;
+		len = 0;
 	}
+	if ((line != NULL) && !cfg_insert_line(cfg, cfg->nb_lines, line))
+		goto err;
+	fclose(fd);
+	return cfg;
 
-	// Process individual lines. NUL is always appended.
-	while (fgetws(buf, ARRAYSIZE(buf), fd_in) != NULL) {
+err:
+	free(line);
+	if (fd != NULL)
+		fclose(fd);
+	cfg_free(cfg);
+	return NULL;
+}
 
-		i = 0;
+/*
+ * Same as cfg_open(), for config data that is already in memory, such as the content of
+ * a file from an ISO. The data is decoded as the CRT decodes a file that is opened with
+ * ccs=UNICODE, according to its BOM, and with CRLF line endings converted to LF.
+ * Returns NULL if the data can't be decoded or is empty.
+ */
+cfg_file* cfg_open_buffer(const uint8_t* buf, size_t size)
+{
+	wchar_t *wbuf = NULL, *line;
+	size_t i, j, k, len = 0;
+	cfg_file* cfg = NULL;
+	int r;
 
-		// Skip leading spaces
-		i += wcsspn(&buf[i], wspace);
+	if ((buf == NULL) || (size < sizeof(wchar_t)))
+		return NULL;
 
-		// Our token should begin a line
-		if (_wcsnicmp(&buf[i], wsection, wcslen(wsection)) != 0) {
-			fputws(buf, fd_out);
-			continue;
+	cfg = (cfg_file*)calloc(1, sizeof(cfg_file));
+	wbuf = (wchar_t*)malloc(size * sizeof(wchar_t));
+	if ((cfg == NULL) || (wbuf == NULL))
+		goto err;
+	if ((buf[0] == 0xFF) && (buf[1] == 0xFE)) {
+		cfg->mode = 2;
+		for (i = 2; i + 1 < size; i += 2)
+			wbuf[len++] = (wchar_t)(buf[i] | (buf[i + 1] << 8));
+	} else if ((size >= 3) && (buf[0] == 0xEF) && (buf[1] == 0xBB) && (buf[2] == 0xBF)) {
+		cfg->mode = 1;
+		if (size > 3) {
+			r = MultiByteToWideChar(CP_UTF8, 0, (const char*)&buf[3], (int)(size - 3), wbuf, (int)size);
+			if (r <= 0) {
+				uprintf("Could not convert config file data: %s", WindowsErrorString());
+				goto err;
+			}
+			len = (size_t)r;
 		}
+	} else {
+		// In text mode, the CRT stops reading ANSI files at the first Ctrl-Z
+		for (i = 0; (i < size) && (buf[i] != 0x1A); i++)
+			wbuf[len++] = buf[i];
+	}
 
-		// Section was found, output it
-		fputws(buf, fd_out);
-		// Now output the new data
-		// coverity[invalid_type]
-		fwprintf_s(fd_out, L"%s\n", wdata);
-		ret = (char*)data;
+	for (i = 0; i < len; i = j) {
+		for (j = i; (j < len) && (wbuf[j] != L'\n'); j++);
+		if (j < len)
+			j++;
+		line = (wchar_t*)malloc((j - i + 1) * sizeof(wchar_t));
+		if (line == NULL) {
+			uprintf("Could not allocate space for config file line\n");
+			goto err;
+		}
+		for (k = 0; i < j; i++) {
+			if ((wbuf[i] == L'\r') && (i + 1 < j) && (wbuf[i + 1] == L'\n'))
+				continue;
+			line[k++] = wbuf[i];
+		}
+		line[k] = 0;
+		if (!cfg_insert_line(cfg, cfg->nb_lines, line)) {
+			free(line);
+			goto err;
+		}
 	}
+	free(wbuf);
+	return cfg;
 
-out:
-	if (fd_in != NULL) fclose(fd_in);
-	if (fd_out != NULL) fclose(fd_out);
+err:
+	free(wbuf);
+	cfg_free(cfg);
+	return NULL;
+}
 
-	// If an insertion occurred, delete existing file and use the new one
-	if (ret != NULL && wtmpname != NULL && wfilename != NULL) {
-		// We're in Windows text mode => Remove CRs if requested
-		fd_in = _wfopen(wtmpname, L"rb");
-		fd_out = _wfopen(wfilename, L"wb");
-		// Don't check fds
-		if ((fd_in != NULL) && (fd_out != NULL)) {
-			size = (mode==2)?2:1;
-			while(fread(tmp, size, 1, fd_in) == 1) {
-				if ((!dos2unix) || (tmp[0] != 0x0D))
-					fwrite(tmp, size, 1, fd_out);
+/*
+ * Encode the lines of an in-memory config file the same way the CRT does when writing the
+ * file in text mode, i.e. with CRLF line endings and the BOM that was found in the input,
+ * unless dos2unix was requested, in which case all the CRs are removed. This way the file
+ * only needs to be written once.
+ * Characters that can't be represented in an ANSI file are written as UTF-8, which is what
+ * any file without a BOM, that we are expected to modify, uses anyway.
+ * Returns the size of the allocated buffer, or 0 on error.
+ */
+static size_t cfg_encode(cfg_file* cfg, uint8_t** buf)
+{
+	static const uint8_t bom[3][3] = { { 0 }, { 0xEF, 0xBB, 0xBF }, { 0xFF, 0xFE } };
+	static const size_t bom_size[3] = { 0, 3, 2 };
+	wchar_t *wbuf = NULL, *s;
+	size_t i, j, n, len = 0, size = 0;
+	uint32_t l;
+	int r;
+
+	*buf = NULL;
+	for (l = 0; l < cfg->nb_lines; l++)
+		len += wcslen(cfg->line[l]);
+	// Worst case is every character being a LF that gets expanded
+	wbuf = (wchar_t*)malloc((2 * len + 1) * sizeof(wchar_t));
+	if (wbuf == NULL)
+		goto out;
+	for (l = 0, j = 0; l < cfg->nb_lines; l++) {
+		for (s = cfg->line[l]; *s != 0; s++) {
+			if (cfg->dos2unix && (*s == L'\r'))
+				continue;
+			if (!cfg->dos2unix && (*s == L'\n'))
+				wbuf[j++] = L'\r';
+			wbuf[j++] = *s;
+		}
+	}
+	len = j;
+
+	// UTF-8 uses at most 3 bytes per UTF-16 code unit
+	*buf = (uint8_t*)malloc(bom_size[cfg->mode] + 3 * len + 1);
+	if (*buf == NULL)
+		goto out;
+	memcpy(*buf, bom[cfg->mode], bom_size[cfg->mode]);
+	size = bom_size[cfg->mode];
+	switch (cfg->mode) {
+	case 2:
+		for (i = 0; i < len; i++) {
+			(*buf)[size++] = (uint8_t)wbuf[i];
+			(*buf)[size++] = (uint8_t)(wbuf[i] >> 8);
+		}
+		break;
+	case 1:
+		if (len == 0)
+			break;
+		r = WideCharToMultiByte(CP_UTF8, 0, wbuf, (int)len, (char*)&(*buf)[size], (int)(3 * len), NULL, NULL);
+		if (r <= 0)
+			goto err;
+		size += r;
+		break;
+	default:
+		for (i = 0; i < len; i += n) {
+			if (wbuf[i] < 0x100) {
+				(*buf)[size++] = (uint8_t)wbuf[i];
+				n = 1;
+				continue;
 			}
-			fclose(fd_in);
-			fclose(fd_out);
-		} else {
-			uprintf("Could not write '%s' - original file has been left unmodified\n", filename);
-			ret = NULL;
-			if (fd_in != NULL) fclose(fd_in);
-			if (fd_out != NULL) fclose(fd_out);
+			for (n = 1; (i + n < len) && (wbuf[i + n] >= 0x100); n++);
+			r = WideCharToMultiByte(CP_UTF8, 0, &wbuf[i], (int)n, (char*)&(*buf)[size], (int)(3 * n), NULL, NULL);
+			if (r <= 0)
+				goto err;
+			size += r;
 		}
+		break;
+	}
+	goto out;
+
+err:
+	uprintf("Could not convert config file data: %s", WindowsErrorString());
+	safe_free(*buf);
+	size = 0;
+out:
+	free(wbuf);
+	return size;
+}
+
+/*
+ * Write a modified config file back to disk, in a single pass, and release all resources.
+ * Returns FALSE if a modified file could not be written.
+ */
+BOOL cfg_close(cfg_file* cfg)
+{
+	FILE* fd = NULL;
+	uint8_t* buf = NULL;
+	size_t size;
+	BOOL ret = FALSE;
+
+	if (cfg == NULL)
+		return FALSE;
+	if (!cfg->modified) {
+		ret = TRUE;
+		goto out;
+	}
+
+	size = cfg_encode(cfg, &buf);
+	if (buf == NULL)
+		goto write_error;
+	fd = _wfopen(cfg->wfilename, L"wb");
+	if ((fd == NULL) || (fwrite(buf, 1, size, fd) != size))
+		goto write_error;
+	ret = TRUE;
+	goto out;
+
+write_error:
+	uprintf("Could not write '%s'\n", cfg->filename);
+out:
+	if (fd != NULL)
+		fclose(fd);
+	safe_free(buf);
+	cfg_free(cfg);
+	return ret;
+}
+
+/*
+ * Release an in-memory config file that was opened with cfg_open_buffer(), and return its
+ * modified data, encoded as cfg_close() would have written it, in an allocated buffer.
+ * Returns the size of the data, or 0 (with a NULL buffer) if it was not modified.
+ */
+size_t cfg_close_buffer(cfg_file* cfg, uint8_t** buf)
+{
+	size_t size = 0;
+
+	*buf = NULL;
+	if (cfg == NULL)
+		return 0;
+	if (cfg->modified)
+		size = cfg_encode(cfg, buf);
+	cfg_free(cfg);
+	return size;
+}
+
+/*
+ * Insert entry 'data' under section 'section' of an in-memory config file
+ * Section must include the relevant delimiters (eg '[', ']') if needed
+ * Returns a pointer to data if insertion occurred, NULL otherwise
+ */
+char* cfg_insert_section_data(cfg_file* cfg, const char* section, const char* data, BOOL dos2unix)
+{
+	wchar_t *wsection = NULL, *wdata = NULL, *wline;
+	size_t section_len, data_len;
+	uint32_t i;
+	char* ret = NULL;
+
+	if ((cfg == NULL) || (section == NULL) || (data == NULL))
+		return NULL;
+	if ((section[0] == 0) || (data[0] == 0))
+		return NULL;
+
+	wsection = utf8_to_wchar(section);
+	if (wsection == NULL) {
+		uprintf(conversion_error, section);
+		goto out;
+	}
+	wdata = utf8_to_wchar(data);
+	if (wdata == NULL) {
+		uprintf(conversion_error, data);
+		goto out;
+	}
+	section_len = wcslen(wsection);
+	data_len = wcslen(wdata);
+
+	for (i = 0; i < cfg->nb_lines; i++) {
+		// Our section should begin a line, after optional leading spaces
+		if (_wcsnicmp(&cfg->line[i][wcsspn(cfg->line[i], wspace)], wsection, section_len) != 0)
+			continue;
+		// Section was found, add the new data after it
+		wline = (wchar_t*)malloc((data_len + 2) * sizeof(wchar_t));
+		if (wline == NULL)
+			break;
+		wcscpy(wline, wdata);
+		wline[data_len] = L'\n';
+		wline[data_len + 1] = 0;
+		if (!cfg_insert_line(cfg, ++i, wline)) {
+			free(wline);
+			break;
+		}
+		ret = (char*)data;
+	}
+
+out:
+	if (ret != NULL) {
+		cfg->modified = TRUE;
+		cfg->dos2unix |= dos2unix;
 	}
-	if (wtmpname != NULL)
-		_wunlink(wtmpname);
-	safe_free(wfilename);
-	safe_free(wtmpname);
 	safe_free(wsection);
 	safe_free(wdata);
-
 	return ret;
 }
 
 /*
  * Search for a specific 'src' substring data for all occurrences of 'token', and replace
- * it with 'rep'. File can be ANSI or UNICODE and is overwritten. Parameters are UTF-8.
+ * it with 'rep', in an in-memory config file. Parameters are UTF-8.
  * The parsed line is of the form: [ ]token[ ]data
  * Returns a pointer to rep if replacement occurred, NULL otherwise
  * TODO: We might have to end up with a regexp engine, so that we can do stuff like: "foo*" -> "bar\1"
  */
 #define MAX_OCCURRENCES 4
-char* replace_in_token_data(const char* filename, const char* token, const char* src, const char* rep, BOOL dos2unix)
+char* cfg_replace_in_token_data(cfg_file* cfg, const char* token, const char* src, const char* rep, BOOL dos2unix)
 {
-	const wchar_t* outmode[] = { L"w", L"w, ccs=UTF-8", L"w, ccs=UTF-16LE" };
-	wchar_t *wtoken = NULL, *wfilename = NULL, *wtmpname = NULL, *wsrc = NULL, *wrep = NULL, bom = 0;
-	wchar_t buf[1024], *torep[MAX_OCCURRENCES + 1] = { NULL };
-	FILE *fd_in = NULL, *fd_out = NULL;
-	size_t i, j, p[MAX_OCCURRENCES + 1] = { 0 }, ns, size;
-	int mode = 0;
-	char *ret = NULL, tmp[2];
+	wchar_t *wtoken = NULL, *wsrc = NULL, *wrep = NULL, *wline, *new_line, *s, *p, *d;
+	size_t i, n, ns, token_len, src_len, rep_len;
+	uint32_t l;
+	char* ret = NULL;
 
-	if ((filename == NULL) || (token == NULL) || (src == NULL) || (rep == NULL))
+	if ((cfg == NULL) || (token == NULL) || (src == NULL) || (rep == NULL))
 		return NULL;
-	if ((filename[0] == 0) || (token[0] == 0) || (src[0] == 0))
+	if ((token[0] == 0) || (src[0] == 0))
 		return NULL;
 	if (strcmp(src, rep) == 0)	// No need for processing is source is same as replacement
 		return NULL;
 
-	wfilename = utf8_to_wchar(filename);
-	if (wfilename == NULL) {
-		uprintf(conversion_error, filename);
-		goto out;
-	}
 	wtoken = utf8_to_wchar(token);
 	if (wtoken == NULL) {
 		uprintf(conversion_error, token);
@@ -1137,136 +1572,115 @@ char* replace_in_token_data(const char* filename, const char* token, const char*
 		uprintf(conversion_error, rep);
 		goto out;
 	}
+	token_len = wcslen(wtoken);
+	src_len = wcslen(wsrc);
+	rep_len = wcslen(wrep);
 
-	fd_in = _wfopen(wfilename, L"r, ccs=UNICODE");
-	if (fd_in == NULL) {
-		uprintf("Could not open file '%s'\n", filename);
-		goto out;
-	}
-	// Check the input file's BOM and create an output file with the same
-	if (fread(&bom, sizeof(bom), 1, fd_in) != 1) {
-		if (!feof(fd_in))
-			uprintf("Could not read file '%s'\n", filename);
-		goto out;
-	}
-	switch(bom) {
-	case 0xFEFF:
-		mode = 2;	// UTF-16 (LE)
-		break;
-	case 0xBBEF:	// Yeah, the UTF-8 BOM is really 0xEF,0xBB,0xBF, but
-		mode = 1;	// find me a non UTF-8 file that actually begins with "ï»"
-		break;
-	default:
-		mode = 0;	// ANSI
-		break;
-	}
-	fseek(fd_in, 0, SEEK_SET);
-//	duprintf("'%s' was detected as %s\n", filename,
-//		(mode==0)?"ANSI/UTF8 (no BOM)":((mode==1)?"UTF8 (with BOM)":"UTF16 (with BOM"));
-
-	wtmpname = (wchar_t*)calloc(wcslen(wfilename)+2, sizeof(wchar_t));
-	if (wtmpname == NULL) {
-		uprintf("Could not allocate space for temporary output name\n");
-		goto out;
-	}
-	wcscpy(wtmpname, wfilename);
-	wtmpname[wcslen(wtmpname)] = '~';
-
-	fd_out = _wfopen(wtmpname, outmode[mode]);
-	if (fd_out == NULL) {
-		uprintf("Could not open temporary output file '%s~'\n", filename);
-		goto out;
-	}
-
-	// Process individual lines. NUL is always appended.
-	while (fgetws(buf, ARRAYSIZE(buf), fd_in) != NULL) {
-
-		i = 0;
+	for (l = 0; l < cfg->nb_lines; l++) {
+		wline = cfg->line[l];
 
 		// Skip leading spaces
-		i += wcsspn(&buf[i], wspace);
+		i = wcsspn(wline, wspace);
 
 		// Our token should begin a line
-		if (_wcsnicmp(&buf[i], wtoken, wcslen(wtoken)) != 0) {
-			fputws(buf, fd_out);
+		if (_wcsnicmp(&wline[i], wtoken, token_len) != 0)
 			continue;
-		}
 
 		// Token was found, move past token
-		i += wcslen(wtoken);
+		i += token_len;
 
 		// Skip whitespaces after token (while making sure there's at least one)
-		ns = wcsspn(&buf[i], wspace);
-		if (ns == 0) {
-			fputws(buf, fd_out);
+		ns = wcsspn(&wline[i], wspace);
+		if (ns == 0)
 			continue;
-		}
 		i += ns;
 
-		// p[x] = starting position of the fragment with the replaceable string
-		p[0] = 0;
-		for (j = 0; j < MAX_OCCURRENCES; j++) {
-			torep[j] = wcsstr(&buf[i], wsrc);
-			if (torep[j] == NULL)
+		// Count the replaceable strings
+		for (n = 0, p = &wline[i]; n < MAX_OCCURRENCES; n++, p += src_len) {
+			p = wcsstr(p, wsrc);
+			if (p == NULL)
 				break;
-			// Next fragment will start after current + replaced string
-			i = (torep[j] - buf) + wcslen(wsrc);
-			p[j + 1] = i;
-			// Truncate each fragment to before the replaced string
-			*torep[j] = 0;
 		}
 
-		// No replaceable string found => output as is
-		if (torep[0] == NULL) {
-			fputws(buf, fd_out);
+		// No replaceable string found => leave line as is
+		if (n == 0)
 			continue;
-		}
 
-		// Output all the truncated fragments + replaced strings
-		for (j = 0; torep[j] != NULL; j++)
-			// coverity[invalid_type]
-			fwprintf_s(fd_out, L"%s%s", &buf[p[j]], wrep);
+		new_line = (wchar_t*)malloc((wcslen(wline) - n * src_len + n * rep_len + 1) * sizeof(wchar_t));
+		if (new_line == NULL) {
+			uprintf("Could not allocate space for config file line\n");
+			break;
+		}
 
-		// Output the last fragment
-		// coverity[invalid_type]
-		fwprintf_s(fd_out, L"%s", &buf[p[j]]);
+		// Copy all the fragments + replaced strings, then the last fragment
+		for (s = wline, p = &wline[i], d = new_line; n > 0; n--) {
+			p = wcsstr(p, wsrc);
+			memcpy(d, s, (p - s) * sizeof(wchar_t));
+			d += p - s;
+			memcpy(d, wrep, rep_len * sizeof(wchar_t));
+			d += rep_len;
+			p += src_len;
+			s = p;
+		}
+		wcscpy(d, s);
 
+		free(cfg->line[l]);
+		cfg->line[l] = new_line;
 		ret = (char*)rep;
 	}
 
 out:
-	if (fd_in != NULL) fclose(fd_in);
-	if (fd_out != NULL) fclose(fd_out);
+	if (ret != NULL) {
+		cfg->modified = TRUE;
+		cfg->dos2unix |= dos2unix;
+	}
+	safe_free(wtoken);
+	safe_free(wsrc);
+	safe_free(wrep);
+	return ret;
+}
 
-	// If a replacement occurred, delete existing file and use the new one
-	if (ret != NULL && wtmpname != NULL && wfilename != NULL) {
-		// We're in Windows text mode => Remove CRs if requested
-		fd_in = _wfopen(wtmpname, L"rb");
-		fd_out = _wfopen(wfilename, L"wb");
-		// Don't check fds
-		if ((fd_in != NULL) && (fd_out != NULL)) {
-			size = (mode==2)?2:1;
-			while(fread(tmp, size, 1, fd_in) == 1) {
-				if ((!dos2unix) || (tmp[0] != 0x0D))
-					fwrite(tmp, size, 1, fd_out);
-			}
-			fclose(fd_in);
-			fclose(fd_out);
-		} else {
-			uprintf("Could not write '%s' - original file has been left unmodified.\n", filename);
-			ret = NULL;
-			if (fd_in != NULL) fclose(fd_in);
-			if (fd_out != NULL) fclose(fd_out);
-		}
-	}
-	if (wtmpname != NULL)
-		_wunlink(wtmpname);
-	safe_free(wfilename);
-	safe_free(wtmpname);
-	safe_free(wtoken);
-	safe_free(wsrc);
-	safe_free(wrep);
+/*
+ * Insert entry 'data' under section 'section' of a config file
+ * Section must include the relevant delimiters (eg '[', ']') if needed
+ * File can be ANSI or UNICODE and is overwritten. Parameters are UTF-8.
+ * Returns a pointer to data if insertion occurred, NULL otherwise
+ */
+char* insert_section_data(const char* filename, const char* section, const char* data, BOOL dos2unix)
+{
+	cfg_file* cfg;
+	char* ret;
+
+	if ((filename == NULL) || (section == NULL) || (data == NULL))
+		return NULL;
+	if ((filename[0] == 0) || (section[0] == 0) || (data[0] == 0))
+		return NULL;
+	cfg = cfg_open(filename);
+	ret = cfg_insert_section_data(cfg, section, data, dos2unix);
+	if (!cfg_close(cfg))
+		ret = NULL;
+	return ret;
+}
 
+/*
+ * Search for a specific 'src' substring data for all occurrences of 'token', and replace
+ * it with 'rep'. File can be ANSI or UNICODE and is overwritten. Parameters are UTF-8.
+ * Returns a pointer to rep if replacement occurred, NULL otherwise
+ * When applying multiple modifications to the same file, use cfg_open()/cfg_close() instead.
+ */
+char* replace_in_token_data(const char* filename, const char* token, const char* src, const char* rep, BOOL dos2unix)
+{
+	cfg_file* cfg;
+	char* ret;
+
+	if ((filename == NULL) || (token == NULL) || (src == NULL) || (rep == NULL))
+		return NULL;
+	if ((filename[0] == 0) || (token[0] == 0) || (src[0] == 0) || (strcmp(src, rep) == 0))
+		return NULL;
+	cfg = cfg_open(filename);
+	ret = cfg_replace_in_token_data(cfg, token, src, rep, dos2unix);
+	if (!cfg_close(cfg))
+		ret = NULL;
 	return ret;
 }
 
@@ -1796,3 +2210,453 @@ uint8_t* GetPeSignatureData(uint8_t* buf)
 
 	return (uint8_t*)cert;
 }
+
+#if defined(_DEBUG) || defined(TEST) || defined(ALPHA)
+/*
+ * The original versions of insert_section_data() and replace_in_token_data(), which
+ * rewrite the whole file for every modification, kept as a reference for the in-memory
+ * config rewriting test below.
+ */
+static char* legacy_insert_section_data(const char* filename, const char* section, const char* data, BOOL dos2unix)
+{
+	const wchar_t* outmode[] = { L"w", L"w, ccs=UTF-8", L"w, ccs=UTF-16LE" };
+	wchar_t *wsection = NULL, *wfilename = NULL, *wtmpname = NULL, *wdata = NULL, bom = 0;
+	wchar_t buf[1024];
+	FILE *fd_in = NULL, *fd_out = NULL;
+	size_t i, size;
+	int mode = 0;
+	char *ret = NULL, tmp[2];
+
+	if ((filename == NULL) || (section == NULL) || (data == NULL))
+		return NULL;
+	if ((filename[0] == 0) || (section[0] == 0) || (data[0] == 0))
+		return NULL;
+
+	wfilename = utf8_to_wchar(filename);
+	if (wfilename == NULL) {
+		uprintf(conversion_error, filename);
+		goto out;
+	}
+	wsection = utf8_to_wchar(section);
+	if (wsection == NULL) {
+		uprintf(conversion_error, section);
+		goto out;
+	}
+	wdata = utf8_to_wchar(data);
+	if (wdata == NULL) {
+		uprintf(conversion_error, data);
+		goto out;
+	}
+
+	fd_in = _wfopen(wfilename, L"r, ccs=UNICODE");
+	if (fd_in == NULL) {
+		uprintf("Could not open file '%s'\n", filename);
+		goto out;
+	}
+	// Check the input file's BOM and create an output file with the same
+	if (fread(&bom, sizeof(bom), 1, fd_in) != 1) {
+		uprintf("Could not read file '%s'\n", filename);
+		goto out;
+	}
+	switch(bom) {
+	case 0xFEFF:
+		mode = 2;	// UTF-16 (LE)
+		break;
+	case 0xBBEF:	// Yeah, the UTF-8 BOM is really 0xEF,0xBB,0xBF, but
+		mode = 1;	// find me a non UTF-8 file that actually begins with "ï»"
+		break;
+	default:
+		mode = 0;	// ANSI
+		break;
+	}
+	fseek(fd_in, 0, SEEK_SET);
+//	duprintf("'%s' was detected as %s\n", filename,
+//		(mode==0)?"ANSI/UTF8 (no BOM)":((mode==1)?"UTF8 (with BOM)":"UTF16 (with BOM"));
+
+	wtmpname = (wchar_t*)calloc(wcslen(wfilename)+2, sizeof(wchar_t));
+	if (wtmpname == NULL) {
+		uprintf("Could not allocate space for temporary output name\n");
+		goto out;
+	}
+	wcscpy(wtmpname, wfilename);
+	wtmpname[wcslen(wtmpname)] = '~';
+
+	fd_out = _wfopen(wtmpname, outmode[mode]);
+	if (fd_out == NULL) {
+		uprintf("Could not open temporary output file '%s~'\n", filename);
+		goto out;
+	}
+
+	// Process individual lines. NUL is always appended.
+	while (fgetws(buf, ARRAYSIZE(buf), fd_in) != NULL) {
+
+		i = 0;
+
+		// Skip leading spaces
+		i += wcsspn(&buf[i], wspace);
+
+		// Our token should begin a line
+		if (_wcsnicmp(&buf[i], wsection, wcslen(wsection)) != 0) {
+			fputws(buf, fd_out);
+			continue;
+		}
+
+		// Section was found, output it
+		fputws(buf, fd_out);
+		// Now output the new data
+		// coverity[invalid_type]
+		fwprintf_s(fd_out, L"%s\n", wdata);
+		ret = (char*)data;
+	}
+
+out:
+	if (fd_in != NULL) fclose(fd_in);
+	if (fd_out != NULL) fclose(fd_out);
+
+	// If an insertion occurred, delete existing file and use the new one
+	if (ret != NULL && wtmpname != NULL && wfilename != NULL) {
+		// We're in Windows text mode => Remove CRs if requested
+		fd_in = _wfopen(wtmpname, L"rb");
+		fd_out = _wfopen(wfilename, L"wb");
+		// Don't check fds
+		if ((fd_in != NULL) && (fd_out != NULL)) {
+			size = (mode==2)?2:1;
+			while(fread(tmp, size, 1, fd_in) == 1) {
+				if ((!dos2unix) || (tmp[0] != 0x0D))
+					fwrite(tmp, size, 1, fd_out);
+			}
+			fclose(fd_in);
+			fclose(fd_out);
+		} else {
+			uprintf("Could not write '%s' - original file has been left unmodified\n", filename);
+			ret = NULL;
+			if (fd_in != NULL) fclose(fd_in);
+			if (fd_out != NULL) fclose(fd_out);
+		}
+	}
+	if (wtmpname != NULL)
+		_wunlink(wtmpname);
+	safe_free(wfilename);
+	safe_free(wtmpname);
+	safe_free(wsection);
+	safe_free(wdata);
+
+	return ret;
+}
+
+static char* legacy_replace_in_token_data(const char* filename, const char* token, const char* src, const char* rep, BOOL dos2unix)
+{
+	const wchar_t* outmode[] = { L"w", L"w, ccs=UTF-8", L"w, ccs=UTF-16LE" };
+	wchar_t *wtoken = NULL, *wfilename = NULL, *wtmpname = NULL, *wsrc = NULL, *wrep = NULL, bom = 0;
+	wchar_t buf[1024], *torep[MAX_OCCURRENCES + 1] = { NULL };
+	FILE *fd_in = NULL, *fd_out = NULL;
+	size_t i, j, p[MAX_OCCURRENCES + 1] = { 0 }, ns, size;
+	int mode = 0;
+	char *ret = NULL, tmp[2];
+
+	if ((filename == NULL) || (token == NULL) || (src == NULL) || (rep == NULL))
+		return NULL;
+	if ((filename[0] == 0) || (token[0] == 0) || (src[0] == 0))
+		return NULL;
+	if (strcmp(src, rep) == 0)	// No need for processing is source is same as replacement
+		return NULL;
+
+	wfilename = utf8_to_wchar(filename);
+	if (wfilename == NULL) {
+		uprintf(conversion_error, filename);
+		goto out;
+	}
+	wtoken = utf8_to_wchar(token);
+	if (wtoken == NULL) {
+		uprintf(conversion_error, token);
+		goto out;
+	}
+	wsrc = utf8_to_wchar(src);
+	if (wsrc == NULL) {
+		uprintf(conversion_error, src);
+		goto out;
+	}
+	wrep = utf8_to_wchar(rep);
+	if (wrep == NULL) {
+		uprintf(conversion_error, rep);
+		goto out;
+	}
+
+	fd_in = _wfopen(wfilename, L"r, ccs=UNICODE");
+	if (fd_in == NULL) {
+		uprintf("Could not open file '%s'\n", filename);
+		goto out;
+	}
+	// Check the input file's BOM and create an output file with the same
+	if (fread(&bom, sizeof(bom), 1, fd_in) != 1) {
+		if (!feof(fd_in))
+			uprintf("Could not read file '%s'\n", filename);
+		goto out;
+	}
+	switch(bom) {
+	case 0xFEFF:
+		mode = 2;	// UTF-16 (LE)
+		break;
+	case 0xBBEF:	// Yeah, the UTF-8 BOM is really 0xEF,0xBB,0xBF, but
+		mode = 1;	// find me a non UTF-8 file that actually begins with "ï»"
+		break;
+	default:
+		mode = 0;	// ANSI
+		break;
+	}
+	fseek(fd_in, 0, SEEK_SET);
+//	duprintf("'%s' was detected as %s\n", filename,
+//		(mode==0)?"ANSI/UTF8 (no BOM)":((mode==1)?"UTF8 (with BOM)":"UTF16 (with BOM"));
+
+	wtmpname = (wchar_t*)calloc(wcslen(wfilename)+2, sizeof(wchar_t));
+	if (wtmpname == NULL) {
+		uprintf("Could not allocate space for temporary output name\n");
+		goto out;
+	}
+	wcscpy(wtmpname, wfilename);
+	wtmpname[wcslen(wtmpname)] = '~';
+
+	fd_out = _wfopen(wtmpname, outmode[mode]);
+	if (fd_out == NULL) {
+		uprintf("Could not open temporary output file '%s~'\n", filename);
+		goto out;
+	}
+
+	// Process individual lines. NUL is always appended.
+	while (fgetws(buf, ARRAYSIZE(buf), fd_in) != NULL) {
+
+		i = 0;
+
+		// Skip leading spaces
+		i += wcsspn(&buf[i], wspace);
+
+		// Our token should begin a line
+		if (_wcsnicmp(&buf[i], wtoken, wcslen(wtoken)) != 0) {
+			fputws(buf, fd_out);
+			continue;
+		}
+
+		// Token was found, move past token
+		i += wcslen(wtoken);
+
+		// Skip whitespaces after token (while making sure there's at least one)
+		ns = wcsspn(&buf[i], wspace);
+		if (ns == 0) {
+			fputws(buf, fd_out);
+			continue;
+		}
+		i += ns;
+
+		// p[x] = starting position of the fragment with the replaceable string
+		p[0] = 0;
+		for (j = 0; j < MAX_OCCURRENCES; j++) {
+			torep[j] = wcsstr(&buf[i], wsrc);
+			if (torep[j] == NULL)
+				break;
+			// Next fragment will start after current + replaced string
+			i = (torep[j] - buf) + wcslen(wsrc);
+			p[j + 1] = i;
+			// Truncate each fragment to before the replaced string
+			*torep[j] = 0;
+		}
+
+		// No replaceable string found => output as is
+		if (torep[0] == NULL) {
+			fputws(buf, fd_out);
+			continue;
+		}
+
+		// Output all the truncated fragments + replaced strings
+		for (j = 0; torep[j] != NULL; j++)
+			// coverity[invalid_type]
+			fwprintf_s(fd_out, L"%s%s", &buf[p[j]], wrep);
+
+		// Output the last fragment
+		// coverity[invalid_type]
+		fwprintf_s(fd_out, L"%s", &buf[p[j]]);
+
+		ret = (char*)rep;
+	}
+
+out:
+	if (fd_in != NULL) fclose(fd_in);
+	if (fd_out != NULL) fclose(fd_out);
+
+	// If a replacement occurred, delete existing file and use the new one
+	if (ret != NULL && wtmpname != NULL && wfilename != NULL) {
+		// We're in Windows text mode => Remove CRs if requested
+		fd_in = _wfopen(wtmpname, L"rb");
+		fd_out = _wfopen(wfilename, L"wb");
+		// Don't check fds
+		if ((fd_in != NULL) && (fd_out != NULL)) {
+			size = (mode==2)?2:1;
+			while(fread(tmp, size, 1, fd_in) == 1) {
+				if ((!dos2unix) || (tmp[0] != 0x0D))
+					fwrite(tmp, size, 1, fd_out);
+			}
+			fclose(fd_in);
+			fclose(fd_out);
+		} else {
+			uprintf("Could not write '%s' - original file has been left unmodified.\n", filename);
+			ret = NULL;
+			if (fd_in != NULL) fclose(fd_in);
+			if (fd_out != NULL) fclose(fd_out);
+		}
+	}
+	if (wtmpname != NULL)
+		_wunlink(wtmpname);
+	safe_free(wfilename);
+	safe_free(wtmpname);
+	safe_free(wtoken);
+	safe_free(wsrc);
+	safe_free(wrep);
+
+	return ret;
+}
+
+/*
+ * Check that batching the config file modifications in memory produces the same files as
+ * applying them one at a time with the original code, for all the encodings and line
+ * endings we support. Note that the original code processes long lines in 1023 characters
+ * chunks (which the new code doesn't), and that it leaves the CRs in when the last of the
+ * modifications didn't request dos2unix, which fix_config() never does.
+ */
+int TestConfigRewrite(void)
+{
+	static const char* cfg_data[] = {
+		"default vesamenu.c32",
+		"label live",
+		"  menu label ^Try Ubuntu without installing",
+		"  kernel /casper/vmlinuz",
+		"  append  file=/cdrom/preseed/ubuntu.seed boot=casper initrd=/casper/initrd quiet splash --- "
+			"root=live:CDLABEL=Ubuntu\\x2024.04 CDLABEL=Ubuntu\\x2024.04",
+		"menuentry \"Try Ubuntu\" {",
+		"\tlinux\t/casper/vmlinuz file=/cdrom/preseed/ubuntu.seed maybe-ubiquity boot=casper quiet ---",
+		"\tsearch --no-floppy --set=root --label Ubuntu\\x2024.04",
+		"\tlinuxefi /images/pxeboot/vmlinuz inst.stage2=hd:LABEL=Ubuntu\\x2024.04 inst.stage2=a "
+			"inst.stage2=b inst.stage2=c inst.stage2=d quiet",
+		"}",
+		"[grub]",
+		"set root=cd9660:/dev/iso9660/Ubuntu 24.04",
+		"appendix Ubuntu\\x2024.04 does not start with a token",
+		"\t options  Caf\xc3\xa9 \xe2\x82\xac Ubuntu\\x2024.04",
+		"  append",
+	};
+	static const struct {
+		const char* token;
+		const char* src;
+		const char* rep;
+	} op[] = {
+		{ "append", "file=/cdrom/preseed", "persistent file=/cdrom/preseed" },
+		{ "linux", "maybe-ubiquity", "" },
+		{ "linux", "/casper/vmlinuz", "/casper/vmlinuz persistent" },
+		{ "options", "Ubuntu\\x2024.04", "UBUNTU\\x2024.0" },
+		{ "append", "Ubuntu\\x2024.04", "UBUNTU\\x2024.0" },
+		{ "search", "Ubuntu\\x2024.04", "UBUNTU\\x2024.0" },
+		{ "linuxefi", "inst.stage2", "inst.repo" },
+		{ "set", "cd9660:/dev/iso9660/Ubuntu 24.04", "msdosfs:/dev/msdosfs/UBUNTU 24.0" },
+		{ "missing", "foo", "bar" },
+		{ "[grub]", NULL, "set timeout=5" },
+	};
+	static const uint8_t bom[3][3] = { { 0 }, { 0xEF, 0xBB, 0xBF }, { 0xFF, 0xFE } };
+	static const char* mode_name[3] = { "ANSI", "UTF-8", "UTF-16" };
+	char path[2][MAX_PATH] = { "", "" }, *data = NULL, *r[2];
+	wchar_t* wdata = NULL;
+	uint8_t *buf = NULL, *file[2] = { NULL, NULL }, *mem = NULL;
+	uint32_t size[2];
+	size_t len, mem_size;
+	cfg_file* cfg;
+	int i, j, mode, crlf, dos2unix, errors = 0;
+
+	if ((GetTempFileNameU(temp_dir, APPLICATION_NAME, 0, path[0]) == 0) ||
+		(GetTempFileNameU(temp_dir, APPLICATION_NAME, 0, path[1]) == 0))
+		goto out;
+	data = (char*)malloc(4 * KB);
+	buf = (uint8_t*)malloc(8 * KB);
+	if ((data == NULL) || (buf == NULL))
+		goto out;
+
+	for (mode = 0; mode < 3; mode++) {
+		for (crlf = 0; crlf < 2; crlf++) {
+			for (dos2unix = 0; dos2unix < 2; dos2unix++) {
+				// Create the same source file for both versions
+				data[0] = 0;
+				for (i = 0; i < ARRAYSIZE(cfg_data); i++) {
+					strcat(data, cfg_data[i]);
+					if (i < ARRAYSIZE(cfg_data) - 1)
+						strcat(data, crlf ? "\r\n" : "\n");
+				}
+				len = (mode == 0) ? 0 : ((mode == 1) ? 3 : 2);
+				memcpy(buf, bom[mode], len);
+				if (mode == 2) {
+					wdata = utf8_to_wchar(data);
+					if (wdata == NULL)
+						goto out;
+					memcpy(&buf[len], wdata, wcslen(wdata) * sizeof(wchar_t));
+					len += wcslen(wdata) * sizeof(wchar_t);
+					safe_free(wdata);
+				} else {
+					memcpy(&buf[len], data, strlen(data));
+					len += strlen(data);
+				}
+				for (j = 0; j < 2; j++) {
+					if (write_file(path[j], buf, (uint32_t)len) != len)
+						goto out;
+				}
+
+				// The in-memory version, that is used for ext, must produce the same data
+				cfg = cfg_open_buffer(buf, len);
+				for (i = 0; (cfg != NULL) && (i < ARRAYSIZE(op)); i++) {
+					if (op[i].src == NULL)
+						cfg_insert_section_data(cfg, op[i].token, op[i].rep, dos2unix);
+					else
+						cfg_replace_in_token_data(cfg, op[i].token, op[i].src, op[i].rep, dos2unix);
+				}
+				mem_size = cfg_close_buffer(cfg, &mem);
+
+				cfg = cfg_open(path[1]);
+				for (i = 0; i < ARRAYSIZE(op); i++) {
+					if (op[i].src == NULL) {
+						r[0] = legacy_insert_section_data(path[0], op[i].token, op[i].rep, dos2unix);
+						r[1] = cfg_insert_section_data(cfg, op[i].token, op[i].rep, dos2unix);
+					} else {
+						r[0] = legacy_replace_in_token_data(path[0], op[i].token, op[i].src, op[i].rep, dos2unix);
+						r[1] = cfg_replace_in_token_data(cfg, op[i].token, op[i].src, op[i].rep, dos2unix);
+					}
+					if ((r[0] == NULL) != (r[1] == NULL)) {
+						uprintf("Config rewrite %s/%s/%d: Operation %d returned different results", mode_name[mode],
+							crlf ? "CRLF" : "LF", dos2unix, i);
+						errors++;
+					}
+				}
+				if (!cfg_close(cfg))
+					errors++;
+
+				for (j = 0; j < 2; j++)
+					size[j] = read_file(path[j], &file[j]);
+				if ((size[0] == 0) || (size[0] != size[1]) || (memcmp(file[0], file[1], size[0]) != 0)) {
+					uprintf("Config rewrite %s/%s/%d: FAIL", mode_name[mode], crlf ? "CRLF" : "LF", dos2unix);
+					errors++;
+				} else if ((mem_size != size[1]) || (memcmp(mem, file[1], mem_size) != 0)) {
+					uprintf("Config rewrite %s/%s/%d: FAIL (in-memory)", mode_name[mode], crlf ? "CRLF" : "LF", dos2unix);
+					errors++;
+				} else {
+					uprintf("Config rewrite %s/%s/%d: PASS", mode_name[mode], crlf ? "CRLF" : "LF", dos2unix);
+				}
+				for (j = 0; j < 2; j++)
+					safe_free(file[j]);
+				safe_free(mem);
+			}
+		}
+	}
+
+out:
+	for (j = 0; j < 2; j++) {
+		if (path[j][0] != 0)
+			DeleteFileU(path[j]);
+	}
+	free(data);
+	free(buf);
+	return errors;
+}
+#endif
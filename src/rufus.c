@@ -129,7 +129,7 @@ BOOL usb_debug, use_fake_units, preserve_timestamps = FALSE, fast_zeroing = FALS
 BOOL zero_drive = FALSE, list_non_usb_removable_drives = FALSE, enable_file_indexing, large_drive = FALSE;
 BOOL write_as_image = FALSE, write_as_esp = FALSE, use_vds = FALSE, ignore_boot_marker = FALSE;
 BOOL appstore_version = FALSE, is_vds_available = TRUE, persistent_log = FALSE, has_ffu_support = FALSE;
-BOOL expert_mode = FALSE, use_rufus_mbr = TRUE;
+BOOL expert_mode = FALSE, use_rufus_mbr = TRUE, verify_write = FALSE;
 float fScale = 1.0f;
 int dialog_showing = 0, selection_default = BT_IMAGE, persistence_unit_selection = -1, imop_win_sel = 0;
 int default_fs, fs_type, boot_type, partition_type, target_type;
@@ -186,6 +186,13 @@ static void SetAllowedFileSystems(void)
 		break;
 	case BT_IMAGE:
 		allowed_filesystem[FS_NTFS] = TRUE;
+		// Linux ISOs that boot through GRUB 2 in BIOS mode can also be extracted to ext2/ext3,
+		// since GRUB can read it. UEFI firmwares can't, and we don't populate ext4 (extents).
+		if ((image_path != NULL) && img_report.is_iso && img_report.has_grub2 && !HAS_WINDOWS(img_report) &&
+			!HAS_SYSLINUX(img_report) && !HAS_REACTOS(img_report) && (target_type == TT_BIOS)) {
+			allowed_filesystem[FS_EXT2] = TRUE;
+			allowed_filesystem[FS_EXT3] = TRUE;
+		}
 		// Don't allow anything besides NTFS if the image has a >4GB file or explicitly requires NTFS
 		if ((image_path != NULL) && (img_report.has_4GB_file || img_report.needs_ntfs))
 			break;
@@ -954,6 +961,8 @@ BOOL CALLBACK LogCallback(HWND hDlg, UINT message, WPARAM wParam, LPARAM lParam)
 
 		// Increase the size of our log textbox to MAX_LOG_SIZE (unsigned word)
 		PostMessage(hLog, EM_LIMITTEXT, MAX_LOG_SIZE , 0);
+		// Display the messages that were logged before we were created
+		PostMessage(hDlg, UM_LOG_UPDATE, 0, 0);
 		// Set the font to Unicode so that we can display anything
 		hDC = GetDC(NULL);
 		lfHeight = -MulDiv(9, GetDeviceCaps(hDC, LOGPIXELSY), 72);
@@ -975,6 +984,9 @@ BOOL CALLBACK LogCallback(HWND hDlg, UINT message, WPARAM wParam, LPARAM lParam)
 		style &= ~(ES_RIGHT);
 		SetWindowLongPtr(hLog, GWL_STYLE, style);
 		break;
+	case UM_LOG_UPDATE:
+		FlushLog();
+		return TRUE;
 	case WM_COMMAND:
 		switch (LOWORD(wParam)) {
 		case IDCANCEL:
@@ -988,6 +1000,7 @@ BOOL CALLBACK LogCallback(HWND hDlg, UINT message, WPARAM wParam, LPARAM lParam)
 			SetWindowTextA(hLog, "");
 			return TRUE;
 		case IDC_LOG_SAVE:
+			FlushLog();
 			log_size = GetWindowTextLengthU(hLog);
 			if (log_size <= 0)
 				break;
@@ -2272,6 +2285,7 @@ static INT_PTR CALLBACK MainCallback(HWND hDlg, UINT message, WPARAM wParam, LPA
 			}
 
 			// Save or append the current log to %LocalAppData%\Rufus\rufus.log
+			FlushLog();
 			log_size = GetWindowTextLengthU(hLog);
 			if ((!user_deleted_rufus_dir) && (log_size > 0) && ((log_buffer = (char*)malloc(log_size + 2)) != NULL)) {
 				log_size = GetDlgItemTextU(hLogDialog, IDC_LOG_EDIT, log_buffer, log_size);
@@ -2519,9 +2533,9 @@ static INT_PTR CALLBACK MainCallback(HWND hDlg, UINT message, WPARAM wParam, LPA
 			return (INT_PTR)TRUE;
 		case IDC_SELECT:
 			// Ctrl-SELECT is used to select an additional archive of files to extract
-			// For now only zip archives are supported.
+			// For now only zip and 7z archives are supported.
 			if (GetKeyState(VK_CONTROL) & 0x8000) {
-				EXT_DECL(arch_ext, NULL, __VA_GROUP__("*.zip"), __VA_GROUP__(lmprintf(MSG_309)));
+				EXT_DECL(arch_ext, NULL, __VA_GROUP__("*.zip;*.7z"), __VA_GROUP__(lmprintf(MSG_309)));
 				archive_path = FileDialog(FALSE, NULL, &arch_ext, NULL);
 				if (archive_path != NULL) {
 					uprintf("Using archive: %s (%s)", _filenameU(archive_path),
@@ -2538,7 +2552,7 @@ static INT_PTR CALLBACK MainCallback(HWND hDlg, UINT message, WPARAM wParam, LPA
 					img_provided = FALSE;	// One off thing...
 				} else {
 					char* old_image_path = image_path;
-					char extensions[128] = "*.iso;*.img;*.vhd;*.vhdx;*.usb;*.bz2;*.bzip2;*.gz;*.lzma;*.xz;*.Z;*.zip;*.zst;*.wic;*.wim;*.esd;*.vtsi";
+					char extensions[128] = "*.iso;*.img;*.vhd;*.vhdx;*.usb;*.bz2;*.bzip2;*.gz;*.lzma;*.xz;*.Z;*.zip;*.7z;*.zst;*.wic;*.wim;*.esd;*.vtsi";
 					if (has_ffu_support)
 						strcat(extensions, ";*.ffu");
 					// If declared globaly, lmprintf(MSG_280) would be called on each message...
@@ -3213,7 +3227,7 @@ int WINAPI WinMain(HINSTANCE hInstance, HINSTANCE hPrevInstance, LPSTR lpCmdLine
 	int wait_for_mutex = 0, forced_windows_version = 0;
 	uint32_t wue_options;
 	FILE* fd;
-	BOOL attached_console = FALSE, external_loc_file = FALSE, lgp_set = FALSE, automount = TRUE;
+	BOOL attached_console = FALSE, lgp_set = FALSE, automount = TRUE;
 	BOOL disable_hogger = FALSE, previous_enable_HDDs = FALSE, vc = IsRegistryNode(REGKEY_HKCU, vs_reg);
 	BOOL alt_pressed = FALSE, alt_command = FALSE;
 	BYTE *loc_data;
@@ -3532,6 +3546,8 @@ skip_args_processing:
 	expert_mode = ReadSettingBool(SETTING_EXPERT_MODE);
 	ignore_boot_marker = ReadSettingBool(SETTING_IGNORE_BOOT_MARKER);
 	persistent_log = ReadSettingBool(SETTING_PERSISTENT_LOG);
+	SetLogFile(ReadSettingStr(SETTING_LOG_FILE));
+	verify_write = ReadSettingBool(SETTING_ENABLE_WRITE_VERIFICATION);
 	save_image_type = ReadSettingStr(SETTING_PREFERRED_SAVE_IMAGE_TYPE);
 	// This restores the Windows User Experience/unattend.xml mask from the saved user
 	// settings, and is designed to work even if we add new options later.
@@ -3557,28 +3573,14 @@ skip_args_processing:
 	if (GetFileAttributesU(loc_file) == INVALID_FILE_ATTRIBUTES) {
 		uprintf("loc file not found in current directory - embedded one will be used");
 
+		// The embedded loc data is read in place from our resources and, on first run, built
+		// into a locale table that we cache, so that neither startup nor switching languages
+		// has to go through the text. Without a table, the text is still parsed from memory.
 		loc_data = (BYTE*)GetResource(hMainInstance, MAKEINTRESOURCEA(IDR_LC_RUFUS_LOC), _RT_RCDATA, "embedded.loc", &loc_size, FALSE);
-		if ( (GetTempFileNameU(temp_dir, APPLICATION_NAME, 0, loc_file) == 0) || (loc_file[0] == 0) ) {
-			// If we don't have a working temp API, forget it
-			uprintf("FATAL: Unable to create temp loc file: %s", WindowsErrorString());
-			MessageBoxA(NULL, "Unable to create temporary localization file. This application will now exit.",
-				"Fatal error", MB_ICONSTOP | MB_SYSTEMMODAL);
-			goto out;
-		}
-
-		hFile = CreateFileU(loc_file, GENERIC_READ|GENERIC_WRITE, FILE_SHARE_READ,
-			NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
-		if ((hFile == INVALID_HANDLE_VALUE) || (!WriteFileWithRetry(hFile, loc_data, loc_size, &size, WRITE_RETRIES))) {
-			uprintf("FATAL: Unable to extract loc file '%s': %s", loc_file, WindowsErrorString());
-			safe_closehandle(hFile);
-			MessageBoxA(NULL, "Unable to extract localization file. This application will now exit.",
-				"Fatal error", MB_ICONSTOP | MB_SYSTEMMODAL);
-			goto out;
-		}
-		uprintf("localization: extracted data to '%s'", loc_file);
-		safe_closehandle(hFile);
+		static_strcpy(loc_file, embedded_loc_filename);
+		static_sprintf(tmp_path, "%s\\%s", app_data_dir, FILES_DIR);
+		load_loc_table(loc_data, loc_size, tmp_path);
 	} else {
-		external_loc_file = TRUE;
 		// We do want to report if an external loc file is being used, in the UI log
 		ubprintf("Using external loc file '%s'", loc_file);
 	}
@@ -3740,10 +3742,28 @@ relaunch:
 		}
 #if defined(_DEBUG) || defined(TEST) || defined(ALPHA)
 extern int TestHashes(void);
+extern int BenchmarkMD5SumIndex(void);
+extern int BenchmarkBlockDevices(void);
+extern int TestLocTable(void);
+extern int TestConfigRewrite(void);
+extern int TestWimChunks(void);
+extern int TestBzip2(void);
+extern int BenchmarkGunzip(void);
+extern int TestWimXml(void);
+extern int TestFAT32Layout(void);
 		// Ctrl-T => Alternate Test mode that doesn't require a full rebuild
 		if ((ctrl_without_focus || ((GetKeyState(VK_CONTROL) & 0x8000) && (msg.message == WM_KEYDOWN)))
 			&& (msg.wParam == 'T')) {
 			TestHashes();
+			BenchmarkMD5SumIndex();
+			BenchmarkBlockDevices();
+			TestLocTable();
+			TestConfigRewrite();
+			TestWimChunks();
+			TestBzip2();
+			BenchmarkGunzip();
+			TestWimXml();
+			TestFAT32Layout();
 			continue;
 		}
 #endif
@@ -3990,6 +4010,13 @@ extern int TestHashes(void);
 				existing_key = FALSE;
 				continue;
 			}
+			// Alt-Y => Read back and verify the data after writing an image
+			if ((msg.message == WM_SYSKEYDOWN) && (msg.wParam == 'Y')) {
+				verify_write = !verify_write;
+				WriteSettingBool(SETTING_ENABLE_WRITE_VERIFICATION, verify_write);
+				PrintStatusTimeout(lmprintf(MSG_352), verify_write);
+				continue;
+			}
 			// Alt-Z => Zero the drive
 			if ((msg.message == WM_SYSKEYDOWN) && (msg.wParam == 'Z')) {
 				zero_drive = TRUE;
@@ -4082,10 +4109,6 @@ out:
 	// Kill the update check thread if running
 	if (update_check_thread != NULL)
 		TerminateThread(update_check_thread, 1);
-	if ((!external_loc_file) && (loc_file[0] != 0)) {
-		if (!DeleteFileU(loc_file))
-			uprintf("Could not delete '%s': %s", loc_file, WindowsErrorString());
-	}
 	DestroyAllTooltips();
 	ClrAlertPromptHook();
 	exit_localization();
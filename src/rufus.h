@@ -196,6 +196,8 @@ static __inline void static_repchr(char* p, char s, char r) {
 
 extern void uprintf(const char *format, ...);
 extern void uprintfs(const char *str);
+extern void FlushLog(void);
+extern BOOL SetLogFile(const char* path);
 #define vuprintf(...) do { if (verbose) uprintf(__VA_ARGS__); } while(0)
 #define vvuprintf(...) do { if (verbose > 1) uprintf(__VA_ARGS__); } while(0)
 #define suprintf(...) do { if (!bSilent) uprintf(__VA_ARGS__); } while(0)
@@ -223,6 +225,7 @@ enum user_message_type {
 	UM_SELECT_ISO,
 	UM_TIMER_START,
 	UM_FORMAT_START,
+	UM_LOG_UPDATE,
 	// Start of the WM IDs for the language menu items
 	UM_LANGUAGE_MENU = WM_APP + 0x100
 };
@@ -515,6 +518,15 @@ typedef struct {
 #define ALIGNED(m) __declspec(align(m))
 #endif
 
+/* I/O statistics stages (see IoStatsAdd()) */
+enum iostat_stage {
+	IOSTAT_READ = 0,
+	IOSTAT_WRITE,
+	IOSTAT_CPU,		// Hashing, decompression, etc.
+	IOSTAT_MAX
+};
+#define IOSTAT_BUCKETS      24
+
 /* Hash definitions */
 enum hash_type {
 	HASH_MD5 = 0,
@@ -699,6 +711,18 @@ extern void StrArrayClear(StrArray* arr);
 extern void StrArrayDestroy(StrArray* arr);
 #define IsStrArrayEmpty(arr) (arr.Index == 0)
 
+/* In-memory config file, for batched modifications */
+typedef struct {
+	char* filename;
+	wchar_t* wfilename;
+	wchar_t** line;
+	uint32_t nb_lines;
+	uint32_t max_lines;
+	int mode;		// 0 = ANSI, 1 = UTF-8 with BOM, 2 = UTF-16LE
+	BOOL modified;
+	BOOL dos2unix;
+} cfg_file;
+
 /*
  * Globals
  */
@@ -777,6 +801,7 @@ extern BOOL ExtractISO(const char* src_iso, const char* dest_dir, BOOL scan);
 extern BOOL ExtractZip(const char* src_zip, const char* dest_dir);
 extern int64_t ExtractISOFile(const char* iso, const char* iso_file, const char* dest_file, DWORD attributes);
 extern uint32_t ReadISOFileToBuffer(const char* iso, const char* iso_file, uint8_t** buf);
+extern uint32_t ReadISOFileRange(const char* iso, const char* iso_file, uint64_t offset, uint32_t size, uint8_t* buf);
 extern BOOL CopySKUSiPolicy(const char* drive_name);
 extern BOOL HasEfiImgBootLoaders(void);
 extern BOOL DumpFatDir(const char* path, int32_t cluster);
@@ -811,8 +836,15 @@ extern char* get_token_data_file_indexed(const char* token, const char* filename
 #define get_token_data_file(token, filename) get_token_data_file_indexed(token, filename, 1)
 extern char* set_token_data_file(const char* token, const char* data, const char* filename);
 extern char* get_token_data_buffer(const char* token, unsigned int n, const char* buffer, size_t buffer_size);
+extern char* get_token_data_xml(const char* token, unsigned int n, const wchar_t* xml);
 extern char* insert_section_data(const char* filename, const char* section, const char* data, BOOL dos2unix);
 extern char* replace_in_token_data(const char* filename, const char* token, const char* src, const char* rep, BOOL dos2unix);
+extern cfg_file* cfg_open(const char* filename);
+extern cfg_file* cfg_open_buffer(const uint8_t* buf, size_t size);
+extern BOOL cfg_close(cfg_file* cfg);
+extern size_t cfg_close_buffer(cfg_file* cfg, uint8_t** buf);
+extern char* cfg_insert_section_data(cfg_file* cfg, const char* section, const char* data, BOOL dos2unix);
+extern char* cfg_replace_in_token_data(cfg_file* cfg, const char* token, const char* src, const char* rep, BOOL dos2unix);
 extern char* replace_char(const char* src, const char c, const char* rep);
 extern char* remove_substr(const char* src, const char* sub);
 extern void parse_update(char* buf, size_t len);
@@ -826,6 +858,11 @@ extern LONG ValidateSignature(HWND hDlg, const char* path);
 extern BOOL ValidateOpensslSignature(BYTE* pbBuffer, DWORD dwBufferLen, BYTE* pbSignature, DWORD dwSigLen);
 extern BOOL ParseSKUSiPolicy(void);
 extern BOOL IsFontAvailable(const char* font_name);
+extern uint64_t IoStatsNow(void);
+extern void IoStatsStart(const char* operation);
+extern void IoStatsAdd(int stage, uint64_t size, uint64_t start);
+extern void IoStatsRetry(void);
+extern void IoStatsReport(void);
 extern BOOL WriteFileWithRetry(HANDLE hFile, LPCVOID lpBuffer, DWORD nNumberOfBytesToWrite,
 	LPDWORD lpNumberOfBytesWritten, DWORD nNumRetries);
 extern HANDLE CreateFileWithTimeout(LPCSTR lpFileName, DWORD dwDesiredAccess, DWORD dwShareMode,
@@ -835,6 +872,7 @@ extern BOOL SetThreadAffinity(DWORD_PTR* thread_affinity, size_t num_threads);
 extern BOOL DetectSHA1Acceleration(void);
 extern BOOL DetectSHA256Acceleration(void);
 extern BOOL HashFile(const unsigned type, const char* path, uint8_t* sum);
+extern uint32_t HashFiles(const unsigned type, const char* const* path, const uint32_t count, uint8_t* sum, BOOL* hashed);
 extern BOOL PE256Buffer(uint8_t* buf, uint32_t len, uint8_t* hash);
 extern void UpdateMD5Sum(const char* dest_dir, const char* md5sum_name);
 extern BOOL HashBuffer(const unsigned type, const uint8_t* buf, const size_t len, uint8_t* sum);
@@ -64,11 +64,268 @@ typedef struct {
 } debug_info_t;
 #pragma pack(pop)
 
+/*
+ * Log messages are queued by uprintf() into a lock-free ring that any thread can
+ * write into. A logger thread then sends them to the debug output and the optional
+ * log file, and batches them for the log window, which the UI thread updates at
+ * most once every LOG_UPDATE_INTERVAL ms. This way, threads that log a lot, such
+ * as the ISO extraction one, no longer have to wait on the UI for every line.
+ */
+#define LOG_RING_SIZE           4096	// Must be a power of two
+#define LOG_UPDATE_INTERVAL     50
+
+typedef struct {
+	volatile LONG seq;
+	FILETIME timestamp;
+	char* msg;
+} log_record_t;
+
+static log_record_t log_ring[LOG_RING_SIZE];
+static volatile LONG log_enqueue_pos = 0, log_state = 0, log_signaled = 0;
+static LONG log_dequeue_pos = 0;
+static HANDLE log_event = NULL, log_file = INVALID_HANDLE_VALUE;
+// Serializes the consumers of the ring, and protects the pending log window text
+static CRITICAL_SECTION log_lock;
+static wchar_t* log_pending = NULL;
+static size_t log_pending_len = 0, log_pending_max = 0;
+static BOOL log_posted = FALSE, log_file_bol = TRUE;
+
+static BOOL LogEnqueue(char* msg)
+{
+	log_record_t* rec;
+	LONG pos, diff;
+
+	// See Dmitry Vyukov's bounded MPMC queue: each slot has a sequence number
+	// that tells producers and consumer whose turn it is to use the slot.
+	pos = log_enqueue_pos;
+	while (1) {
+		rec = &log_ring[pos & (LOG_RING_SIZE - 1)];
+		diff = rec->seq - pos;
+		if (diff == 0) {
+			if (InterlockedCompareExchange(&log_enqueue_pos, pos + 1, pos) == pos)
+				break;
+		} else if (diff < 0) {
+			// Ring is full
+			return FALSE;
+		}
+		pos = log_enqueue_pos;
+	}
+	GetSystemTimeAsFileTime(&rec->timestamp);
+	rec->msg = msg;
+	InterlockedExchange(&rec->seq, pos + 1);
+	if (InterlockedExchange(&log_signaled, 1) == 0)
+		SetEvent(log_event);
+	return TRUE;
+}
+
+// Must be called with log_lock held
+static char* LogDequeue(FILETIME* timestamp)
+{
+	log_record_t* rec = &log_ring[log_dequeue_pos & (LOG_RING_SIZE - 1)];
+	char* msg;
+
+	if (rec->seq != log_dequeue_pos + 1)
+		return NULL;
+	// Don't let the reads of the record be reordered before the one of its sequence
+	MemoryBarrier();
+	msg = rec->msg;
+	*timestamp = rec->timestamp;
+	InterlockedExchange(&rec->seq, log_dequeue_pos + LOG_RING_SIZE);
+	log_dequeue_pos++;
+	return msg;
+}
+
+// Move all the queued messages to the debug output, the log file and the pending log window text
+static void LogDrain(void)
+{
+	char *msg, ts[32];
+	wchar_t *wmsg, *new_pending;
+	size_t len;
+	DWORD size;
+	FILETIME ft, local_ft;
+	SYSTEMTIME st;
+
+	EnterCriticalSection(&log_lock);
+	while ((msg = LogDequeue(&ft)) != NULL) {
+		wmsg = utf8_to_wchar(msg);
+		if (wmsg != NULL) {
+			// coverity[dont_call]
+			OutputDebugStringW(wmsg);
+			len = wcslen(wmsg);
+			if (log_pending_len + len + 1 > log_pending_max) {
+				log_pending_max = MAX(2 * log_pending_max, log_pending_len + len + 1);
+				new_pending = realloc(log_pending, log_pending_max * sizeof(wchar_t));
+				if (new_pending == NULL) {
+					// Drop what we had rather than the new message
+					safe_free(log_pending);
+					log_pending_len = 0;
+					log_pending_max = 0;
+				} else {
+					log_pending = new_pending;
+				}
+			}
+			if (log_pending != NULL) {
+				wmemcpy(&log_pending[log_pending_len], wmsg, len + 1);
+				log_pending_len += len;
+			}
+			free(wmsg);
+		}
+		if (log_file != INVALID_HANDLE_VALUE) {
+			// Only timestamp the start of lines, since uprintfs() can output partial ones
+			if (log_file_bol && FileTimeToLocalFileTime(&ft, &local_ft) && FileTimeToSystemTime(&local_ft, &st)) {
+				static_sprintf(ts, "[%02d:%02d:%02d.%03d] ", st.wHour, st.wMinute, st.wSecond, st.wMilliseconds);
+				WriteFile(log_file, ts, (DWORD)strlen(ts), &size, NULL);
+			}
+			len = strlen(msg);
+			WriteFile(log_file, msg, (DWORD)len, &size, NULL);
+			log_file_bol = (len != 0) && (msg[len - 1] == '\n');
+		}
+		free(msg);
+	}
+	LeaveCriticalSection(&log_lock);
+}
+
+// Ask the UI thread to append the pending text to the log window. Returns FALSE if there is nothing to post.
+static BOOL LogPostPending(void)
+{
+	BOOL r = FALSE;
+
+	EnterCriticalSection(&log_lock);
+	if ((log_pending_len != 0) && (hLog != NULL)) {
+		r = TRUE;
+		if (!log_posted)
+			log_posted = PostMessage(GetParent(hLog), UM_LOG_UPDATE, 0, 0);
+	}
+	LeaveCriticalSection(&log_lock);
+	return r;
+}
+
+static DWORD WINAPI LogThread(LPVOID param)
+{
+	uint64_t now, last_post = 0;
+	DWORD timeout = INFINITE;
+
+	while (1) {
+		WaitForSingleObject(log_event, timeout);
+		InterlockedExchange(&log_signaled, 0);
+		LogDrain();
+		// Rate limit the log window updates
+		now = GetTickCount64();
+		timeout = INFINITE;
+		if (now < last_post + LOG_UPDATE_INTERVAL) {
+			if (log_pending_len != 0)
+				timeout = (DWORD)(last_post + LOG_UPDATE_INTERVAL - now);
+		} else if (LogPostPending()) {
+			last_post = now;
+		}
+	}
+	return 0;
+}
+
+// Set up the log ring and start the logger thread on first use. Returns FALSE if we must log synchronously.
+static BOOL LogInit(void)
+{
+	LONG i, state = InterlockedCompareExchange(&log_state, 1, 0);
+	HANDLE hThread = NULL;
+
+	if (state == 0) {
+		for (i = 0; i < LOG_RING_SIZE; i++)
+			log_ring[i].seq = i;
+		InitializeCriticalSection(&log_lock);
+		log_event = CreateEvent(NULL, FALSE, FALSE, NULL);
+		if (log_event != NULL)
+			hThread = CreateThread(NULL, 0, LogThread, NULL, 0, NULL);
+		safe_closehandle(hThread);
+		state = (log_event != NULL && hThread != NULL) ? 2 : 3;
+		InterlockedExchange(&log_state, state);
+	}
+	while (state == 1) {
+		SwitchToThread();
+		state = log_state;
+	}
+	return (state == 2);
+}
+
+static void LogPush(const char* str)
+{
+	wchar_t* wstr;
+	char* msg;
+
+	if (LogInit() && ((msg = _strdup(str)) != NULL)) {
+		while (!LogEnqueue(msg)) {
+			// The ring is full, so give the logger thread some time to catch up
+			if (InterlockedExchange(&log_signaled, 1) == 0)
+				SetEvent(log_event);
+			Sleep(1);
+		}
+		return;
+	}
+
+	wstr = utf8_to_wchar(str);
+	// coverity[dont_call]
+	OutputDebugStringW(wstr);
+	if ((hLog != NULL) && (hLog != INVALID_HANDLE_VALUE)) {
+		Edit_SetSel(hLog, MAX_LOG_SIZE, MAX_LOG_SIZE);
+		Edit_ReplaceSel(hLog, wstr);
+		Edit_Scroll(hLog, Edit_GetLineCount(hLog), 0);
+	}
+	free(wstr);
+}
+
+/*
+ * Append all the queued log messages to the log window. This is called by the UI thread
+ * when the logger thread asks for it, but can also be used to make sure that the log
+ * window is up to date, e.g. before saving its content.
+ */
+void FlushLog(void)
+{
+	wchar_t* text;
+
+	if (log_state < 2)
+		return;
+	LogDrain();
+	EnterCriticalSection(&log_lock);
+	text = log_pending;
+	log_pending = NULL;
+	log_pending_len = 0;
+	log_pending_max = 0;
+	log_posted = FALSE;
+	LeaveCriticalSection(&log_lock);
+	if ((text != NULL) && (hLog != NULL) && (hLog != INVALID_HANDLE_VALUE)) {
+		Edit_SetSel(hLog, MAX_LOG_SIZE, MAX_LOG_SIZE);
+		Edit_ReplaceSel(hLog, text);
+		// Make sure the message scrolls into view
+		Edit_Scroll(hLog, Edit_GetLineCount(hLog), 0);
+	}
+	free(text);
+}
+
+// Also send the log, with timestamps, to the file at 'path' (or stop doing so if path is NULL or empty)
+BOOL SetLogFile(const char* path)
+{
+	HANDLE hFile = INVALID_HANDLE_VALUE;
+
+	if (!LogInit())
+		return FALSE;
+	if ((path != NULL) && (path[0] != 0)) {
+		hFile = CreateFileU(path, FILE_APPEND_DATA, FILE_SHARE_READ, NULL, OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+		if (hFile == INVALID_HANDLE_VALUE) {
+			uprintf("Could not open log file '%s': %s", path, WindowsErrorString());
+			return FALSE;
+		}
+	}
+	EnterCriticalSection(&log_lock);
+	safe_closehandle(log_file);
+	log_file = hFile;
+	log_file_bol = TRUE;
+	LeaveCriticalSection(&log_lock);
+	return TRUE;
+}
+
 void uprintf(const char *format, ...)
 {
-	static char buf[4096];
+	char buf[4096];
 	char* p = buf;
-	wchar_t* wbuf;
 	va_list args;
 	int n;
 
@@ -85,32 +342,12 @@ void uprintf(const char *format, ...)
 	*p++ = '\n';
 	*p   = '\0';
 
-	wbuf = utf8_to_wchar(buf);
-	// Send output to Windows debug facility
-	// coverity[dont_call]
-	OutputDebugStringW(wbuf);
-	if ((hLog != NULL) && (hLog != INVALID_HANDLE_VALUE)) {
-		// Send output to our log Window
-		Edit_SetSel(hLog, MAX_LOG_SIZE, MAX_LOG_SIZE);
-		Edit_ReplaceSel(hLog, wbuf);
-		// Make sure the message scrolls into view
-		Edit_Scroll(hLog, Edit_GetLineCount(hLog), 0);
-	}
-	free(wbuf);
+	LogPush(buf);
 }
 
 void uprintfs(const char* str)
 {
-	wchar_t* wstr;
-	wstr = utf8_to_wchar(str);
-	// coverity[dont_call]
-	OutputDebugStringW(wstr);
-	if ((hLog != NULL) && (hLog != INVALID_HANDLE_VALUE)) {
-		Edit_SetSel(hLog, MAX_LOG_SIZE, MAX_LOG_SIZE);
-		Edit_ReplaceSel(hLog, wstr);
-		Edit_Scroll(hLog, Edit_GetLineCount(hLog), 0);
-	}
-	free(wstr);
+	LogPush(str);
 }
 
 uint32_t read_file(const char* path, uint8_t** buf)
@@ -556,9 +793,10 @@ BOOL WriteFileWithRetry(HANDLE hFile, LPCVOID lpBuffer, DWORD nNumberOfBytesToWr
 	LPDWORD lpNumberOfBytesWritten, DWORD nNumRetries)
 {
 	DWORD nTry;
-	BOOL readFilePointer;
+	BOOL r, readFilePointer;
 	LARGE_INTEGER liFilePointer, liZero = { { 0,0 } };
 	DWORD NumberOfBytesWritten;
+	uint64_t start;
 
 	if (lpNumberOfBytesWritten == NULL)
 		lpNumberOfBytesWritten = &NumberOfBytesWritten;
@@ -576,7 +814,12 @@ BOOL WriteFileWithRetry(HANDLE hFile, LPCVOID lpBuffer, DWORD nNumberOfBytesToWr
 			uprintf("Could not set file pointer - Aborting");
 			break;
 		}
-		if (WriteFile(hFile, lpBuffer, nNumberOfBytesToWrite, lpNumberOfBytesWritten, NULL)) {
+		if (nTry > 1)
+			IoStatsRetry();
+		start = IoStatsNow();
+		r = WriteFile(hFile, lpBuffer, nNumberOfBytesToWrite, lpNumberOfBytesWritten, NULL);
+		IoStatsAdd(IOSTAT_WRITE, r ? *lpNumberOfBytesWritten : 0, start);
+		if (r) {
 			LastWriteError = 0;
 			if (nNumberOfBytesToWrite == *lpNumberOfBytesWritten)
 				return TRUE;
@@ -604,6 +847,129 @@ BOOL WriteFileWithRetry(HANDLE hFile, LPCVOID lpBuffer, DWORD nNumberOfBytesToWr
 	return FALSE;
 }
 
+/*
+ * I/O statistics
+ *
+ * Lightweight instrumentation of the time spent reading, writing and processing data
+ * (hashing, decompression...) during an operation, along with histograms of the sizes
+ * and latencies of the individual requests. Samples can be added from any thread and
+ * are only collected between IoStatsStart() and IoStatsReport(), which dumps them as
+ * JSON to the log.
+ */
+#define IOSTAT_MIN_SIZE_LOG2    9	// The first size bucket is for requests below 1 KB
+static const char* iostat_stage_name[IOSTAT_MAX] = { "read", "write", "cpu" };
+static struct {
+	char operation[32];
+	uint64_t start;
+	volatile LONG active, retries;
+	volatile LONG64 count[IOSTAT_MAX], bytes[IOSTAT_MAX], time[IOSTAT_MAX], max_time[IOSTAT_MAX];
+	volatile LONG64 size_hist[IOSTAT_MAX][IOSTAT_BUCKETS], time_hist[IOSTAT_MAX][IOSTAT_BUCKETS];
+} iostats = { 0 };
+static LARGE_INTEGER iostats_freq = { { 0, 0 } };
+
+static __inline int IoStatsBucket(uint64_t val, int min_log2)
+{
+	int i;
+
+	for (i = 0, val >>= min_log2; (val > 1) && (i < IOSTAT_BUCKETS - 1); i++, val >>= 1);
+	return i;
+}
+
+/*
+ * Returns a timestamp in microseconds, for use with IoStatsAdd(), or for timing I/O outside
+ * of the statistics, which is why it doesn't depend on the statistics being collected.
+ */
+uint64_t IoStatsNow(void)
+{
+	LARGE_INTEGER li;
+
+	if (((iostats_freq.QuadPart == 0) && !QueryPerformanceFrequency(&iostats_freq)) ||
+		!QueryPerformanceCounter(&li))
+		return 0;
+	return (uint64_t)((li.QuadPart / iostats_freq.QuadPart) * 1000000ULL +
+		((li.QuadPart % iostats_freq.QuadPart) * 1000000ULL) / iostats_freq.QuadPart);
+}
+
+/* Start collecting the I/O statistics for a new operation */
+void IoStatsStart(const char* operation)
+{
+	if ((iostats_freq.QuadPart == 0) && !QueryPerformanceFrequency(&iostats_freq))
+		return;
+	InterlockedExchange(&iostats.active, 0);
+	memset((void*)&iostats, 0, sizeof(iostats));
+	static_strcpy(iostats.operation, operation);
+	InterlockedExchange(&iostats.active, 1);
+	iostats.start = IoStatsNow();
+}
+
+/* Record a request of 'size' bytes for 'stage', that started at 'start' (from IoStatsNow()) */
+void IoStatsAdd(int stage, uint64_t size, uint64_t start)
+{
+	LONG64 t, max;
+
+	if (!iostats.active || (start == 0) || (stage < 0) || (stage >= IOSTAT_MAX))
+		return;
+	t = (LONG64)(IoStatsNow() - start);
+	InterlockedIncrement64(&iostats.count[stage]);
+	InterlockedExchangeAdd64(&iostats.bytes[stage], (LONG64)size);
+	InterlockedExchangeAdd64(&iostats.time[stage], t);
+	InterlockedIncrement64(&iostats.size_hist[stage][IoStatsBucket(size, IOSTAT_MIN_SIZE_LOG2)]);
+	InterlockedIncrement64(&iostats.time_hist[stage][IoStatsBucket(t, 0)]);
+	for (max = iostats.max_time[stage]; (t > max) &&
+		(InterlockedCompareExchange64(&iostats.max_time[stage], t, max) != max); max = iostats.max_time[stage]);
+}
+
+void IoStatsRetry(void)
+{
+	if (iostats.active)
+		InterlockedIncrement(&iostats.retries);
+}
+
+/* Stop collecting the I/O statistics and dump them to the log, as JSON */
+void IoStatsReport(void)
+{
+	char* json;
+	size_t pos = 0, size = 16 * KB;
+	uint64_t duration;
+	int i, j;
+
+	if (!iostats.active)
+		return;
+	duration = IoStatsNow() - iostats.start;
+	InterlockedExchange(&iostats.active, 0);
+	json = malloc(size);
+	if (json == NULL)
+		return;
+
+#define JSON_APPEND(...) do { safe_sprintf(&json[pos], size - pos, __VA_ARGS__); pos += strlen(&json[pos]); } while (0)
+	JSON_APPEND("{\"operation\":\"%s\",\"duration_us\":%llu,\"retries\":%ld,\"stages\":{",
+		iostats.operation, duration, iostats.retries);
+	for (i = 0; i < IOSTAT_MAX; i++) {
+		JSON_APPEND("%s\"%s\":{\"count\":%lld,\"bytes\":%lld,\"time_us\":%lld,\"max_time_us\":%lld,"
+			"\"bytes_per_sec\":%llu,\"size_histogram\":{", (i == 0) ? "" : ",", iostat_stage_name[i],
+			iostats.count[i], iostats.bytes[i], iostats.time[i], iostats.max_time[i],
+			(iostats.time[i] == 0) ? 0ULL : (uint64_t)iostats.bytes[i] * 1000000ULL / (uint64_t)iostats.time[i]);
+		// Histogram keys are the lower bound of each bucket (in bytes, or in microseconds)
+		for (j = 0; j < IOSTAT_BUCKETS; j++) {
+			if (iostats.size_hist[i][j] != 0)
+				JSON_APPEND("%s\"%llu\":%lld", (json[pos - 1] == '{') ? "" : ",",
+					(j == 0) ? 0ULL : 1ULL << (j + IOSTAT_MIN_SIZE_LOG2), iostats.size_hist[i][j]);
+		}
+		JSON_APPEND("},\"latency_histogram_us\":{");
+		for (j = 0; j < IOSTAT_BUCKETS; j++) {
+			if (iostats.time_hist[i][j] != 0)
+				JSON_APPEND("%s\"%llu\":%lld", (json[pos - 1] == '{') ? "" : ",",
+					(j == 0) ? 0ULL : 1ULL << j, iostats.time_hist[i][j]);
+		}
+		JSON_APPEND("}}");
+	}
+	JSON_APPEND("}}\r\n");
+#undef JSON_APPEND
+	uprintf("I/O statistics:");
+	uprintfs(json);
+	free(json);
+}
+
 // A WaitForSingleObject() equivalent that doesn't block Windows messages
 // This is needed, for instance, if you are waiting for a thread that may issue uprintf's
 DWORD WaitForSingleObjectWithMessages(HANDLE hHandle, DWORD dwMilliseconds)
@@ -924,10 +1290,11 @@ static void update_progress(const uint64_t processed_bytes)
 	UpdateProgressWithInfo(OP_EXTRACT_ZIP, MSG_348, processed_bytes, archive_size);
 }
 
-// Extract content from a zip archive onto the designated directory or drive
+// Extract content from a zip or 7z archive onto the designated directory or drive
 BOOL ExtractZip(const char* src_zip, const char* dest_dir)
 {
 	int64_t extracted_bytes = 0;
+	int type;
 
 	if (src_zip == NULL)
 		return FALSE;
@@ -935,7 +1302,9 @@ BOOL ExtractZip(const char* src_zip, const char* dest_dir)
 	if (bled_init(256 * KB, NULL, NULL, NULL, update_progress, print_extracted_file, &ErrorStatus) != 0)
 		return FALSE;
 	uprintf("● Copying files from '%s'", src_zip);
-	extracted_bytes = bled_uncompress_to_dir(src_zip, dest_dir, BLED_COMPRESSION_ZIP);
+	// Zip archives may have data ahead of their first entry, so only 7z is identified from its content
+	type = (bled_probe(src_zip) == BLED_COMPRESSION_7ZIP) ? BLED_COMPRESSION_7ZIP : BLED_COMPRESSION_ZIP;
+	extracted_bytes = bled_uncompress_to_dir(src_zip, dest_dir, type);
 	bled_exit();
 	return (extracted_bytes > 0);
 }
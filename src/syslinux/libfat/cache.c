@@ -17,9 +17,22 @@
  */
 
 #include <stdlib.h>
+#include <string.h>
 #include <malloc.h>
 #include "libfatint.h"
 
+static struct libfat_sector *libfat_find_sector(struct libfat_filesystem *fs,
+						libfat_sector_t n)
+{
+    struct libfat_sector *ls;
+
+    for (ls = fs->sectors; ls; ls = ls->next) {
+	if (ls->n == n)
+	    return ls;
+    }
+    return NULL;
+}
+
 /*
  * NB: We need to align our sector buffers to at least the 8-byte mark, as some Windows
  * disk devices, notably O2Micro PCI-E SD card readers, return ERROR_INVALID_PARAMETER
@@ -32,10 +45,9 @@ void *libfat_get_sector(struct libfat_filesystem *fs, libfat_sector_t n)
 {
     struct libfat_sector *ls;
 
-    for (ls = fs->sectors; ls; ls = ls->next) {
-	if (ls->n == n)
-	    return ls->data;	/* Found in cache */
-    }
+    ls = libfat_find_sector(fs, n);
+    if (ls)
+	return ls->data;	/* Found in cache */
 
     /* Not found in cache */
     ls = _mm_malloc(sizeof(struct libfat_sector) + LIBFAT_SECTOR_SIZE, 16);
@@ -60,6 +72,54 @@ void *libfat_get_sector(struct libfat_filesystem *fs, libfat_sector_t n)
     return ls->data;
 }
 
+int libfat_prefetch(struct libfat_filesystem *fs, libfat_sector_t n,
+		    uint32_t count)
+{
+    struct libfat_sector *ls;
+    char *buf;
+    uint32_t i;
+    int added = 0;
+
+    if (count == 0 || libfat_find_sector(fs, n))
+	return 0;
+
+    buf = _mm_malloc((size_t)count * LIBFAT_SECTOR_SIZE, 16);
+    if (!buf)
+	return -1;
+
+    if (libfat_readrun(fs, buf, n, count) < 0) {
+	_mm_free(buf);
+	return -1;
+    }
+
+    for (i = 0; i < count; i++) {
+	if (libfat_find_sector(fs, n + i))
+	    continue;		/* Don't duplicate cached sectors */
+	ls = _mm_malloc(sizeof(struct libfat_sector) + LIBFAT_SECTOR_SIZE, 16);
+	if (!ls)
+	    break;
+	memcpy(ls->data, &buf[(size_t)i * LIBFAT_SECTOR_SIZE], LIBFAT_SECTOR_SIZE);
+	ls->n = n + i;
+	ls->next = fs->sectors;
+	fs->sectors = ls;
+	added++;
+    }
+
+    _mm_free(buf);
+    return added;
+}
+
+int libfat_readrun(struct libfat_filesystem *fs, void *buf,
+		   libfat_sector_t s, uint32_t nsec)
+{
+    size_t size = (size_t)nsec * LIBFAT_SECTOR_SIZE;
+
+    if (nsec == 0 || size > 0x7FFFFFFF)
+	return -1;
+
+    return (fs->read(fs->readptr, buf, size, s) == (int)size) ? 0 : -1;
+}
+
 void libfat_flush(struct libfat_filesystem *fs)
 {
     struct libfat_sector *ls, *lsnext;
@@ -42,14 +42,15 @@ static struct fat_dirent* get_next_dirent(struct libfat_filesystem *fs,
     return dep;
 }
 
-static void fill_utf16(wchar_t *name, unsigned char *entry)
+/* Fill up to 'max' characters of a name from the 13 characters of an LFN entry */
+static void fill_utf16(wchar_t *name, unsigned char *entry, int max)
 {
     int i;
-    for (i = 0; i < 5; i++)
+    for (i = 0; i < 5 && i < max; i++)
 	name[i] = read16((le16_t*)&entry[1 + 2 * i]);
-    for (i = 5; i < 11; i++)
+    for (i = 5; i < 11 && i < max; i++)
 	name[i] = read16((le16_t*)&entry[4 + 2 * i]);
-    for (i = 11; i < 13; i++)
+    for (i = 11; i < 13 && i < max; i++)
 	name[i] = read16((le16_t*)&entry[6 + 2 * i]);
 }
 
@@ -91,16 +92,14 @@ int libfat_dumpdir(struct libfat_filesystem *fs, libfat_dirpos_t *dp,
     j = -1;
     while (dep->attribute == 0x0F) {	/* LNF (Long File Name) entry */
 	i = dep->name[0];
-	if ((j < 0) && ((i & 0xF0) != 0x40))  /* End of LFN marker was not found */
+	if ((j < 0) && ((i & 0xE0) != 0x40))  /* End of LFN marker was not found */
 	    break;
-	/* Isolate and check the sequence number, which should be decrementing */
-	i = (i & 0x0F) - 1;
-	if ((j >= 0) && (i != j - 1))
+	/* Isolate and check the sequence number (1 to 20), which should be decrementing */
+	i = (i & 0x1F) - 1;
+	if ((i < 0) || (13 * i >= (int)ARRAYSIZE(di->name) - 1) || ((j >= 0) && (i != j - 1)))
 	    return -3;
 	j = i;
-	if (i > ARRAYSIZE(di->name) - 13)
-	    i = ARRAYSIZE(di->name) - 13;
-	fill_utf16(&di->name[13 * i], dep->name);
+	fill_utf16(&di->name[13 * i], dep->name, (int)ARRAYSIZE(di->name) - 1 - 13 * i);
 	dep = get_next_dirent(fs, &dp->sector, &dp->offset);
 	if (!dep)
 	    return -1;
@@ -118,9 +117,9 @@ int libfat_dumpdir(struct libfat_filesystem *fs, libfat_dirpos_t *dp,
 	    di->name[j] = dep->name[i];
 	    /* Caseflags: bit 3 = lowercase basename, bit 4 = lowercase extension */
 	    if ((di->name[j] >= 'A') && (di->name[j] <= 'Z')) {
-		if ((dep->caseflags & 0x02) && (i < 8))
+		if ((dep->caseflags & 0x08) && (i < 8))
 		    di->name[j] += 0x20;
-		if ((dep->caseflags & 0x04) && (i >= 8))
+		if ((dep->caseflags & 0x10) && (i >= 8))
 		    di->name[j] += 0x20;
 	    }
 	    j++;
@@ -42,6 +42,27 @@ libfat_sector_t libfat_clustertosector(const struct libfat_filesystem *fs,
  * Returns 0 on end of file and -1 on error.
  */
 
+/*
+ * Get a FAT sector. On a cache miss, also read the FAT sectors that follow
+ * in the same request, since walking a cluster chain is likely to need them.
+ */
+#define LIBFAT_FAT_PREFETCH	64	/* in sectors */
+
+static void *libfat_get_fat_sector(struct libfat_filesystem *fs,
+				   libfat_sector_t n)
+{
+    libfat_sector_t count;
+
+    if (n >= fs->fat && n < fs->fatend) {
+	count = fs->fatend - n;
+	if (count > LIBFAT_FAT_PREFETCH)
+	    count = LIBFAT_FAT_PREFETCH;
+	/* On error, libfat_get_sector() will retry with a single sector */
+	libfat_prefetch(fs, n, (uint32_t)count);
+    }
+    return libfat_get_sector(fs, n);
+}
+
 libfat_sector_t libfat_nextsector(struct libfat_filesystem * fs,
 				  libfat_sector_t s)
 {
@@ -76,7 +97,7 @@ libfat_sector_t libfat_nextsector(struct libfat_filesystem * fs,
 	/* Get first byte */
 	fatoffset = cluster + (cluster >> 1);
 	fatsect = fs->fat + (fatoffset >> LIBFAT_SECTOR_SHIFT);
-	fsdata = libfat_get_sector(fs, fatsect);
+	fsdata = libfat_get_fat_sector(fs, fatsect);
 	if (!fsdata)
 	    return -1;
 	nextcluster = fsdata[fatoffset & LIBFAT_SECTOR_MASK];
@@ -84,7 +105,7 @@ libfat_sector_t libfat_nextsector(struct libfat_filesystem * fs,
 	/* Get second byte */
 	fatoffset++;
 	fatsect = fs->fat + (fatoffset >> LIBFAT_SECTOR_SHIFT);
-	fsdata = libfat_get_sector(fs, fatsect);
+	fsdata = libfat_get_fat_sector(fs, fatsect);
 	if (!fsdata)
 	    return -1;
 	nextcluster |= fsdata[fatoffset & LIBFAT_SECTOR_MASK] << 8;
@@ -102,7 +123,7 @@ libfat_sector_t libfat_nextsector(struct libfat_filesystem * fs,
     case FAT16:
 	fatoffset = cluster << 1;
 	fatsect = fs->fat + (fatoffset >> LIBFAT_SECTOR_SHIFT);
-	fsdata = libfat_get_sector(fs, fatsect);
+	fsdata = libfat_get_fat_sector(fs, fatsect);
 	if (!fsdata)
 	    return -1;
 	nextcluster =
@@ -115,7 +136,7 @@ libfat_sector_t libfat_nextsector(struct libfat_filesystem * fs,
     case FAT28:
 	fatoffset = cluster << 2;
 	fatsect = fs->fat + (fatoffset >> LIBFAT_SECTOR_SHIFT);
-	fsdata = libfat_get_sector(fs, fatsect);
+	fsdata = libfat_get_fat_sector(fs, fatsect);
 	if (!fsdata)
 	    return -1;
 	nextcluster =
@@ -132,3 +153,20 @@ libfat_sector_t libfat_nextsector(struct libfat_filesystem * fs,
 
     return libfat_clustertosector(fs, nextcluster);
 }
+
+libfat_sector_t libfat_nextrun(struct libfat_filesystem *fs,
+			       libfat_sector_t s, uint32_t maxsec,
+			       uint32_t *nsec)
+{
+    libfat_sector_t next;
+    uint32_t n = 0;
+
+    /* Sectors within a cluster are contiguous, so only cluster ends hit the FAT */
+    do {
+	n++;
+	next = libfat_nextsector(fs, s + n - 1);
+    } while (n < maxsec && next == s + n);
+
+    *nsec = n;
+    return next;
+}
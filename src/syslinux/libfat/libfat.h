@@ -81,6 +81,31 @@ libfat_sector_t libfat_clustertosector(const struct libfat_filesystem *fs,
 libfat_sector_t libfat_nextsector(struct libfat_filesystem *fs,
 				  libfat_sector_t s);
 
+/*
+ * Get the length of the run of physically contiguous sectors that starts at s,
+ * following the FAT chain, up to maxsec sectors. The length is returned in
+ * *nsec, and the return value is the sector that follows the run, with the
+ * same semantics as libfat_nextsector().
+ */
+libfat_sector_t libfat_nextrun(struct libfat_filesystem *fs,
+			       libfat_sector_t s, uint32_t maxsec,
+			       uint32_t *nsec);
+
+/*
+ * Read nsec contiguous sectors starting at s with a single call to the read
+ * function, bypassing the cache. Returns 0 on success and -1 on error.
+ */
+int libfat_readrun(struct libfat_filesystem *fs, void *buf,
+		   libfat_sector_t s, uint32_t nsec);
+
+/*
+ * Read count sectors starting at n with a single call to the read function,
+ * and add them to the cache. Returns the number of sectors that were added
+ * (0 if sector n was already cached) or -1 on error.
+ */
+int libfat_prefetch(struct libfat_filesystem *fs, libfat_sector_t n,
+		    uint32_t count);
+
 /*
  * Flush all cached sectors for this filesystem.
  */
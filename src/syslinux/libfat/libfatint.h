@@ -54,6 +54,7 @@ struct libfat_filesystem {
     int32_t rootcluster;	/* Root directory cluster */
 
     libfat_sector_t fat;	/* Start of FAT */
+    libfat_sector_t fatend;	/* End of the first FAT */
     libfat_sector_t rootdir;	/* Start of root directory */
     libfat_sector_t data;	/* Start of data area */
     libfat_sector_t end;	/* End of filesystem */
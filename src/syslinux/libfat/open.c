@@ -66,6 +66,7 @@ libfat_open(int (*readfunc) (intptr_t, void *, size_t, libfat_sector_t),
     if (!fatsize)
 	fatsize = read32(&bs->u.fat32.bpb_fatsz32);
 
+    fs->fatend = fs->fat + fatsize;
     fs->rootdir = fs->fat + (libfat_sector_t)fatsize * read8(&bs->bsFATs);
 
     rootdirsize = ((read16(&bs->bsRootDirEnts) << 5) + LIBFAT_SECTOR_MASK)
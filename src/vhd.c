@@ -96,100 +96,128 @@ typedef struct {
 	uint8_t type;
 } comp_assoc;
 
+// Formats that can't be reliably identified from their content alone
 static comp_assoc file_assoc[] = {
-	{ ".zip", BLED_COMPRESSION_ZIP },
-	{ ".Z", BLED_COMPRESSION_LZW },
-	{ ".gz", BLED_COMPRESSION_GZIP },
 	{ ".lzma", BLED_COMPRESSION_LZMA },
-	{ ".bz2", BLED_COMPRESSION_BZIP2 },
-	{ ".xz", BLED_COMPRESSION_XZ },
-	{ ".vtsi", BLED_COMPRESSION_VTSI },
-	{ ".zst", BLED_COMPRESSION_ZSTD },
 	{ ".ffu", BLED_COMPRESSION_MAX },
-	{ ".vhd", BLED_COMPRESSION_MAX + 1 },
-	{ ".vhdx", BLED_COMPRESSION_MAX + 2 },
 };
 
+// Identify the format of an image from its content rather than its name, so that
+// misnamed images still get decompressed, and raw images named .gz or .xz don't.
+// Must be called between bled_init() and bled_exit().
+static uint8_t GetImageFormat(const char* path)
+{
+	char *ext = NULL, header[16] = { 0 }, footer[8] = { 0 };
+	int i, type;
+	FILE* fd;
+
+	fd = fopenU(path, "rb");
+	if (fd == NULL) {
+		uprintf("Could not open %s: %d", path, errno);
+		return BLED_COMPRESSION_NONE;
+	}
+	IGNORE_RETVAL(fread(header, 1, sizeof(header), fd));
+	if (_fseeki64(fd, -VHD_FOOTER_SIZE, SEEK_END) == 0)
+		IGNORE_RETVAL(fread(footer, 1, sizeof(footer), fd));
+	fclose(fd);
+
+	if (memcmp(header, VHDX_SIGNATURE, 8) == 0)
+		return BLED_COMPRESSION_MAX + 2;
+	// Fixed VHDs only have a footer, dynamic ones also have a copy of it at the start
+	if (memcmp(footer, VHD_FOOTER_COOKIE, 8) == 0 || memcmp(header, VHD_FOOTER_COOKIE, 8) == 0)
+		return BLED_COMPRESSION_MAX + 1;
+	if (memcmp(&header[4], FFU_SIGNATURE, 12) == 0)
+		return BLED_COMPRESSION_MAX;
+	// WIM images are handled separately, by IsBootableImage()
+	if (*((uint64_t*)header) == WIM_MAGIC)
+		return BLED_COMPRESSION_NONE;
+
+	type = bled_probe(path);
+	if (type > BLED_COMPRESSION_NONE)
+		return (uint8_t)type;
+
+	if (safe_strlen(path) > 4)
+		for (ext = (char*)&path[safe_strlen(path) - 1]; (*ext != '.') && (ext != path); ext--);
+	for (i = 0; i < ARRAYSIZE(file_assoc); i++) {
+		if (safe_stricmp(ext, file_assoc[i].ext) == 0)
+			return file_assoc[i].type;
+	}
+	return BLED_COMPRESSION_NONE;
+}
+
 // Look for a boot marker in the MBR area of the image
 static int8_t IsCompressedBootableImage(const char* path)
 {
-	char *ext = NULL, *physical_disk = NULL;
+	char *physical_disk = NULL;
 	unsigned char *buf = NULL;
-	int i;
 	FILE* fd = NULL;
 	BOOL r = 0;
 	int64_t dc = 0;
 
-	img_report.compression_type = BLED_COMPRESSION_NONE;
-	if (safe_strlen(path) > 4)
-		for (ext = (char*)&path[safe_strlen(path) - 1]; (*ext != '.') && (ext != path); ext--);
+	ErrorStatus = 0;
+	bled_init(0, uprintf, NULL, NULL, NULL, NULL, &ErrorStatus);
+	img_report.compression_type = GetImageFormat(path);
+	if (img_report.compression_type == BLED_COMPRESSION_NONE)
+		goto out;
 
-	for (i = 0; i < ARRAYSIZE(file_assoc); i++) {
-		if (safe_stricmp(ext, file_assoc[i].ext) == 0) {
-			img_report.compression_type = file_assoc[i].type;
-			buf = malloc(MBR_SIZE);
-			if (buf == NULL)
-				return 0;
-			ErrorStatus = 0;
-			if (img_report.compression_type < BLED_COMPRESSION_MAX) {
-				bled_init(0, uprintf, NULL, NULL, NULL, NULL, &ErrorStatus);
-				dc = bled_uncompress_to_buffer(path, (char*)buf, MBR_SIZE, file_assoc[i].type);
-				bled_exit();
-			} else if (img_report.compression_type == BLED_COMPRESSION_MAX) {
-				// Dism, through FfuProvider.dll, can mount a .ffu as a physicaldrive, which we
-				// could then use to poke the MBR as we do for VHD... Except Microsoft did design
-				// dism to FAIL AND EXIT, after mounting the ffu as a virtual drive, if it doesn't
-				// find something that looks like Windows at the specified image index... which it
-				// usually won't in our case. So, curse Microsoft and their incredible short-
-				// sightedness (or, most likely in this case, intentional malice, by BREACHING the
-				// OS contract to keep useful disk APIs for their usage, and their usage only).
-				// Then again, considering that .ffu's are GPT based, the marker should always be
-				// present, so just check for the FFU signature and pretend there's a marker then.
-				if (has_ffu_support) {
-					fd = fopenU(path, "rb");
-					if (fd != NULL) {
-						img_report.is_vhd = TRUE;
-						dc = fread(buf, 1, MBR_SIZE, fd);
-						fclose(fd);
-						// The signature may not be constant, but since the only game in town to
-						// create FFU is dism, and dism appears to use "SignedImage " always,.we
-						// might as well use this to our advantage.
-						if (strncmp(&buf[4], "SignedImage ", 12) == 0) {
-							// At this stage, the buffer is only used for marker validation.
-							buf[0x1FE] = 0x55;
-							buf[0x1FF] = 0xAA;
-						}
-					} else
-						uprintf("Could not open %s: %d", path, errno);
-				} else {
-					uprintf("  An FFU image was selected, but this system does not have FFU support!");
-				}
-			} else {
-				physical_disk = VhdMountImage(path);
-				if (physical_disk != NULL) {
-					img_report.is_vhd = TRUE;
-					fd = fopenU(physical_disk, "rb");
-					if (fd != NULL) {
-						dc = fread(buf, 1, MBR_SIZE, fd);
-						fclose(fd);
-					}
+	buf = malloc(MBR_SIZE);
+	if (buf == NULL)
+		goto out;
+	if (img_report.compression_type < BLED_COMPRESSION_MAX) {
+		// This only decodes the first sector, without allocating the full window of the stream
+		dc = bled_uncompress_to_buffer(path, (char*)buf, MBR_SIZE, img_report.compression_type);
+	} else if (img_report.compression_type == BLED_COMPRESSION_MAX) {
+		// Dism, through FfuProvider.dll, can mount a .ffu as a physicaldrive, which we
+		// could then use to poke the MBR as we do for VHD... Except Microsoft did design
+		// dism to FAIL AND EXIT, after mounting the ffu as a virtual drive, if it doesn't
+		// find something that looks like Windows at the specified image index... which it
+		// usually won't in our case. So, curse Microsoft and their incredible short-
+		// sightedness (or, most likely in this case, intentional malice, by BREACHING the
+		// OS contract to keep useful disk APIs for their usage, and their usage only).
+		// Then again, considering that .ffu's are GPT based, the marker should always be
+		// present, so just check for the FFU signature and pretend there's a marker then.
+		if (has_ffu_support) {
+			fd = fopenU(path, "rb");
+			if (fd != NULL) {
+				img_report.is_vhd = TRUE;
+				dc = fread(buf, 1, MBR_SIZE, fd);
+				fclose(fd);
+				// The signature may not be constant, but since the only game in town to
+				// create FFU is dism, and dism appears to use "SignedImage " always,.we
+				// might as well use this to our advantage.
+				if (strncmp(&buf[4], FFU_SIGNATURE, 12) == 0) {
+					// At this stage, the buffer is only used for marker validation.
+					buf[0x1FE] = 0x55;
+					buf[0x1FF] = 0xAA;
 				}
-				VhdUnmountImage();
-			}
-			if (dc != MBR_SIZE) {
-				free(buf);
-				return FALSE;
+			} else
+				uprintf("Could not open %s: %d", path, errno);
+		} else {
+			uprintf("  An FFU image was selected, but this system does not have FFU support!");
+		}
+	} else {
+		physical_disk = VhdMountImage(path);
+		if (physical_disk != NULL) {
+			img_report.is_vhd = TRUE;
+			fd = fopenU(physical_disk, "rb");
+			if (fd != NULL) {
+				dc = fread(buf, 1, MBR_SIZE, fd);
+				fclose(fd);
 			}
-			if ((buf[0x1FE] == 0x55) && (buf[0x1FF] == 0xAA))
-				r = 1;
-			else if (ignore_boot_marker)
-				r = 2;
-			free(buf);
-			return r;
 		}
+		VhdUnmountImage();
 	}
+	if (dc != MBR_SIZE)
+		goto out;
+	if ((buf[0x1FE] == 0x55) && (buf[0x1FF] == 0xAA))
+		r = 1;
+	else if (ignore_boot_marker)
+		r = 2;
 
-	return FALSE;
+out:
+	bled_exit();
+	free(buf);
+	return r;
 }
 
 // 0: non-bootable, 1: bootable, 2: forced bootable
@@ -198,9 +226,10 @@ int8_t IsBootableImage(const char* path)
 	HANDLE handle = INVALID_HANDLE_VALUE;
 	LARGE_INTEGER liImageSize;
 	DWORD size;
-	uint64_t wim_magic = 0;
+	uint64_t wim_magic = 0, uncompressed_size = 0;
 	LARGE_INTEGER ptr = { 0 };
 	int8_t is_bootable_img;
+	int r;
 
 	uprintf("Disk image analysis:");
 	handle = CreateFileU(path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
@@ -220,6 +249,17 @@ int8_t IsBootableImage(const char* path)
 		goto out;
 	}
 	img_report.image_size = (uint64_t)liImageSize.QuadPart;
+	if ((img_report.compression_type != BLED_COMPRESSION_NONE) && (img_report.compression_type < BLED_COMPRESSION_MAX)) {
+		// Only an exact size can be used to check that the image fits the target
+		bled_init(0, uprintf, NULL, NULL, NULL, NULL, &ErrorStatus);
+		r = bled_get_uncompressed_size(path, img_report.compression_type, &uncompressed_size);
+		bled_exit();
+		if (r >= 0)
+			uprintf("  Uncompressed size: %s%s", SizeToHumanReadable(uncompressed_size, FALSE, FALSE),
+				(r == 0) ? " (estimated)" : "");
+		if (r == 1)
+			img_report.projected_size = uncompressed_size;
+	}
 	size = sizeof(wim_magic);
 	IGNORE_RETVAL(SetFilePointerEx(handle, ptr, NULL, FILE_BEGIN));
 	img_report.is_windows_img = ReadFile(handle, &wim_magic, size, &size, NULL) && (wim_magic == WIM_MAGIC);
@@ -708,20 +748,446 @@ BOOL WimExtractFile_7z(const char* image, int index, const char* src, const char
 	return TRUE;
 }
 
+// Parameters for the threads that decompress a range of chunks from a WIM resource
+typedef struct {
+	const uint8_t* src;			// Start of the compressed chunks (after the chunk table)
+	const uint64_t* offsets;	// Offsets of the compressed chunks from src, with an extra end offset
+	uint8_t* dst;
+	uint64_t size;				// Uncompressed size of the resource
+	uint32_t chunk_size;
+	uint32_t first_chunk;
+	uint32_t last_chunk;
+	int type;
+} wim_chunk_job;
+
+static DWORD WINAPI WimUncompressChunksThread(LPVOID param)
+{
+	wim_chunk_job* job = (wim_chunk_job*)param;
+	uint64_t pos;
+	size_t src_len, dst_len;
+	uint32_t i;
+
+	for (i = job->first_chunk; i < job->last_chunk; i++) {
+		if (IS_ERROR(ErrorStatus))
+			return 1;
+		pos = (uint64_t)i * job->chunk_size;
+		dst_len = (size_t)min(job->chunk_size, job->size - pos);
+		src_len = (size_t)(job->offsets[i + 1] - job->offsets[i]);
+		// Chunks that don't compress are stored as is
+		if (src_len == dst_len) {
+			memcpy(&job->dst[pos], &job->src[job->offsets[i]], dst_len);
+		} else if ((src_len > dst_len) || (bled_uncompress_wim_chunk(&job->src[job->offsets[i]],
+			src_len, &job->dst[pos], dst_len, job->type) != (int64_t)dst_len)) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+static BOOL WimReadAt(HANDLE hFile, uint64_t offset, void* buf, uint32_t size)
+{
+	LARGE_INTEGER li;
+	DWORD rsize = 0;
+
+	li.QuadPart = offset;
+	return SetFilePointerEx(hFile, li, NULL, FILE_BEGIN) && ReadFile(hFile, buf, size, &rsize, NULL) && (rsize == size);
+}
+
+/// <summary>
+/// Read a resource from a WIM file into memory, decompressing it if needed.
+/// The chunks of compressed resources are independent, so they get spread
+/// over as many threads as there are cores.
+/// </summary>
+/// <param name="hFile">A handle to the WIM file.</param>
+/// <param name="header">The WIM header, which provides the compression type and chunk size.</param>
+/// <param name="reshdr">The header of the resource to read.</param>
+/// <returns>An allocated buffer of reshdr->original_size bytes, or NULL on error. Must be freed by the caller.</returns>
+static uint8_t* WimReadResource(HANDLE hFile, const WIM_HEADER* header, const WIM_RESHDR* reshdr)
+{
+	BOOL r = FALSE;
+	SYSTEM_INFO si;
+	HANDLE thread[MAXIMUM_WAIT_OBJECTS] = { 0 };
+	wim_chunk_job job[MAXIMUM_WAIT_OBJECTS];
+	uint64_t res_size = 0, table_size, *offsets = NULL;
+	uint32_t i, num_chunks, num_threads, chunk_size, entry_size;
+	uint8_t *buf = NULL, *cbuf = NULL;
+	DWORD exit_code;
+	int type;
+
+	for (i = 0; i < sizeof(reshdr->size); i++)
+		res_size |= ((uint64_t)reshdr->size[i]) << (8 * i);
+	if ((reshdr->flags & (WIM_RESHDR_FLAG_SPANNED | WIM_RESHDR_FLAG_SOLID)) || (res_size == 0) ||
+		(reshdr->original_size == 0) || (res_size > WIM_MAX_RESOURCE_SIZE) || (reshdr->original_size > WIM_MAX_RESOURCE_SIZE)) {
+		uprintf("  Unsupported WIM resource");
+		return NULL;
+	}
+	buf = malloc((size_t)reshdr->original_size);
+	if (buf == NULL)
+		goto out;
+
+	if (!(reshdr->flags & WIM_RESHDR_FLAG_COMPRESSED)) {
+		r = (res_size == reshdr->original_size) && WimReadAt(hFile, reshdr->offset, buf, (uint32_t)res_size);
+		goto out;
+	}
+
+	if (header->flags & WIM_HDR_FLAG_COMPRESS_XPRESS) {
+		type = BLED_WIM_CHUNK_XPRESS;
+	} else if (header->flags & WIM_HDR_FLAG_COMPRESS_LZX) {
+		type = BLED_WIM_CHUNK_LZX;
+	} else {
+		uprintf("  Unsupported WIM compression");
+		goto out;
+	}
+	chunk_size = (header->chunk_size == 0) ? WIM_DEFAULT_CHUNK_SIZE : header->chunk_size;
+	if (chunk_size > 2 * MB)
+		goto out;
+
+	// Compressed resources start with a table of the offsets of all the chunks
+	// but the first, which are relative to the end of the table
+	num_chunks = (uint32_t)((reshdr->original_size + chunk_size - 1) / chunk_size);
+	entry_size = (reshdr->original_size > UINT32_MAX) ? sizeof(uint64_t) : sizeof(uint32_t);
+	table_size = (uint64_t)(num_chunks - 1) * entry_size;
+	if (table_size >= res_size)
+		goto out;
+	cbuf = malloc((size_t)res_size);
+	offsets = malloc(((size_t)num_chunks + 1) * sizeof(uint64_t));
+	if ((cbuf == NULL) || (offsets == NULL) || !WimReadAt(hFile, reshdr->offset, cbuf, (uint32_t)res_size))
+		goto out;
+	offsets[0] = 0;
+	for (i = 1; i < num_chunks; i++)
+		offsets[i] = (entry_size == sizeof(uint64_t)) ? ((uint64_t*)cbuf)[i - 1] : ((uint32_t*)cbuf)[i - 1];
+	offsets[num_chunks] = res_size - table_size;
+	for (i = 0; i < num_chunks; i++) {
+		if (offsets[i + 1] < offsets[i]) {
+			uprintf("  Corrupted WIM chunk table");
+			goto out;
+		}
+	}
+
+	GetSystemInfo(&si);
+	num_threads = min(min(si.dwNumberOfProcessors, num_chunks), MAXIMUM_WAIT_OBJECTS);
+	if (num_threads == 0)
+		num_threads = 1;
+	for (i = 0; i < num_threads; i++) {
+		job[i].src = &cbuf[table_size];
+		job[i].offsets = offsets;
+		job[i].dst = buf;
+		job[i].size = reshdr->original_size;
+		job[i].chunk_size = chunk_size;
+		job[i].first_chunk = (uint32_t)(((uint64_t)num_chunks * i) / num_threads);
+		job[i].last_chunk = (uint32_t)(((uint64_t)num_chunks * (i + 1)) / num_threads);
+		job[i].type = type;
+	}
+	// The first range is processed by the current thread. If we can't create a thread for
+	// any of the other ranges, we also process that range from the current thread.
+	r = TRUE;
+	for (i = 1; i < num_threads; i++) {
+		thread[i] = CreateThread(NULL, 0, WimUncompressChunksThread, &job[i], 0, NULL);
+		if ((thread[i] == NULL) && (WimUncompressChunksThread(&job[i]) != 0))
+			r = FALSE;
+	}
+	if (WimUncompressChunksThread(&job[0]) != 0)
+		r = FALSE;
+	for (i = 1; i < num_threads; i++) {
+		if (thread[i] == NULL)
+			continue;
+		if ((WaitForSingleObject(thread[i], INFINITE) != WAIT_OBJECT_0) ||
+			!GetExitCodeThread(thread[i], &exit_code) || (exit_code != 0))
+			r = FALSE;
+		CloseHandle(thread[i]);
+	}
+	if (!r)
+		uprintf("  Could not decompress WIM resource");
+
+out:
+	free(offsets);
+	free(cbuf);
+	if (!r)
+		safe_free(buf);
+	return buf;
+}
+
+/// <summary>
+/// Look up a file in the directory tree of a WIM metadata resource.
+/// </summary>
+/// <param name="meta">The uncompressed metadata resource.</param>
+/// <param name="meta_size">The size of the metadata resource.</param>
+/// <param name="path">The path of the file, relative to the root of the image.</param>
+/// <returns>A pointer to the SHA-1 of the file's unnamed data stream, or NULL if the file was not found.</returns>
+static const uint8_t* WimLookupPath(const uint8_t* meta, uint64_t meta_size, const char* path)
+{
+	static const uint8_t zero_hash[20] = { 0 };
+	const uint8_t* hash = NULL;
+	wchar_t *wpath = NULL, *name, *next;
+	uint64_t offset, len = 0, stream_len;
+	uint16_t i, num_streams;
+	size_t name_len;
+
+	if (meta_size < WIM_DENTRY_NAME + 8)
+		return NULL;
+	// The directory tree starts with the root, after the 8-byte aligned security data
+	offset = *(uint32_t*)meta;
+	offset = (offset == 0) ? 8 : HI_ALIGN_X_TO_Y(offset, 8);
+	if (offset > meta_size - WIM_DENTRY_NAME)
+		return NULL;
+	len = *(uint64_t*)&meta[offset];
+	wpath = utf8_to_wchar(path);
+	if (wpath == NULL)
+		return NULL;
+
+	for (name = wpath; ; name = next) {
+		while ((*name == L'\\') || (*name == L'/'))
+			name++;
+		if (*name == 0)
+			break;
+		for (next = name; (*next != 0) && (*next != L'\\') && (*next != L'/'); next++);
+		name_len = next - name;
+
+		// Go through the entries of the current directory, which end with a zero length one
+		offset = *(uint64_t*)&meta[offset + WIM_DENTRY_SUBDIR_OFFSET];
+		if (offset == 0)
+			goto out;
+		while (1) {
+			if (offset > meta_size - 8)
+				goto out;
+			len = *(uint64_t*)&meta[offset];
+			if ((len < WIM_DENTRY_NAME) || (len > meta_size - offset))
+				goto out;
+			if ((*(uint16_t*)&meta[offset + WIM_DENTRY_NAME_NBYTES] == name_len * sizeof(wchar_t)) &&
+				(WIM_DENTRY_NAME + name_len * sizeof(wchar_t) <= len) &&
+				(_wcsnicmp((const wchar_t*)&meta[offset + WIM_DENTRY_NAME], name, name_len) == 0))
+				break;
+			// Skip to the next entry, which follows the extra stream entries of this one
+			num_streams = *(uint16_t*)&meta[offset + WIM_DENTRY_NUM_STREAMS];
+			offset += HI_ALIGN_X_TO_Y(len, 8);
+			for (i = 0; i < num_streams; i++) {
+				if (offset > meta_size - 8)
+					goto out;
+				stream_len = *(uint64_t*)&meta[offset];
+				if ((stream_len < 8) || (stream_len > meta_size - offset))
+					goto out;
+				offset += HI_ALIGN_X_TO_Y(stream_len, 8);
+			}
+		}
+	}
+
+	if (*(uint32_t*)&meta[offset + WIM_DENTRY_ATTRIBUTES] & FILE_ATTRIBUTE_DIRECTORY)
+		goto out;
+	// Newer images may store the unnamed data stream as an extra stream entry without a name
+	num_streams = *(uint16_t*)&meta[offset + WIM_DENTRY_NUM_STREAMS];
+	if ((num_streams == 0) || (memcmp(&meta[offset + WIM_DENTRY_HASH], zero_hash, sizeof(zero_hash)) != 0)) {
+		hash = &meta[offset + WIM_DENTRY_HASH];
+		goto out;
+	}
+	offset += HI_ALIGN_X_TO_Y(len, 8);
+	for (i = 0; i < num_streams; i++) {
+		if (offset > meta_size - WIM_STREAM_NAME)
+			goto out;
+		stream_len = *(uint64_t*)&meta[offset];
+		if ((stream_len < WIM_STREAM_NAME) || (stream_len > meta_size - offset))
+			goto out;
+		if (*(uint16_t*)&meta[offset + WIM_STREAM_NAME_NBYTES] == 0) {
+			hash = &meta[offset + WIM_STREAM_HASH];
+			break;
+		}
+		offset += HI_ALIGN_X_TO_Y(stream_len, 8);
+	}
+
+out:
+	free(wpath);
+	return hash;
+}
+
+/// <summary>
+/// Extract a file from a WIM image without relying on wimgapi.dll or 7-Zip.
+/// Only uncompressed, XPRESS or LZX compressed, single part images are supported.
+/// </summary>
+/// <param name="image">The path to the WIM file.</param>
+/// <param name="index">The (non-zero) index of the image to extract from.</param>
+/// <param name="src">The path of the file in the image.</param>
+/// <param name="dst">The path of the file to create.</param>
+/// <param name="bSilent">Whether to suppress informational messages.</param>
+/// <returns>TRUE on success, FALSE on error.</returns>
+BOOL WimExtractFile_Native(const char* image, int index, const char* src, const char* dst, BOOL bSilent)
+{
+	static const uint8_t zero_hash[20] = { 0 };
+	BOOL r = FALSE;
+	HANDLE hFile = INVALID_HANDLE_VALUE, hDst = INVALID_HANDLE_VALUE;
+	WIM_HEADER header;
+	WIM_LOOKUP_ENTRY* table = NULL;
+	const uint8_t* hash;
+	uint8_t *meta = NULL, *data = NULL;
+	uint32_t i, num_entries;
+	DWORD size = 0, data_size = 0;
+	int n;
+
+	if ((image == NULL) || (src == NULL) || (dst == NULL) || (index <= 0))
+		return FALSE;
+
+	suprintf("Opening: %s:[%d] (native)", image, index);
+	hFile = CreateFileU(image, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (hFile == INVALID_HANDLE_VALUE) {
+		suprintf("  Could not open image: %s", WindowsErrorString());
+		goto out;
+	}
+	if (!ReadFile(hFile, &header, sizeof(header), &size, NULL) || (size != sizeof(header)) ||
+		(header.magic != WIM_MAGIC)) {
+		suprintf("  Invalid WIM header");
+		goto out;
+	}
+	if ((header.total_parts > 1) || ((header.flags & WIM_HDR_FLAG_COMPRESSION) &&
+		!(header.flags & (WIM_HDR_FLAG_COMPRESS_XPRESS | WIM_HDR_FLAG_COMPRESS_LZX)))) {
+		suprintf("  Split or LZMS compressed images are not supported");
+		goto out;
+	}
+
+	table = (WIM_LOOKUP_ENTRY*)WimReadResource(hFile, &header, &header.offset_table);
+	if (table == NULL)
+		goto out;
+	num_entries = (uint32_t)(header.offset_table.original_size / sizeof(WIM_LOOKUP_ENTRY));
+
+	// The metadata resources are listed in the lookup table in image order
+	for (i = 0, n = 0; i < num_entries; i++) {
+		if ((table[i].reshdr.flags & WIM_RESHDR_FLAG_METADATA) && (++n == index))
+			break;
+	}
+	if (i >= num_entries) {
+		suprintf("  Could not find image index %d", index);
+		goto out;
+	}
+	meta = WimReadResource(hFile, &header, &table[i].reshdr);
+	if (meta == NULL)
+		goto out;
+
+	suprintf("Extracting: %s (From %s)", dst, src);
+	hash = WimLookupPath(meta, table[i].reshdr.original_size, src);
+	if (hash == NULL) {
+		suprintf("  Could not find '%s' in image", src);
+		goto out;
+	}
+	// Empty files have a zeroed hash and no resource
+	if (memcmp(hash, zero_hash, sizeof(zero_hash)) != 0) {
+		for (i = 0; (i < num_entries) && (memcmp(table[i].hash, hash, sizeof(table[i].hash)) != 0); i++);
+		if (i >= num_entries) {
+			suprintf("  Could not find the data for '%s'", src);
+			goto out;
+		}
+		data = WimReadResource(hFile, &header, &table[i].reshdr);
+		if (data == NULL)
+			goto out;
+		data_size = (DWORD)table[i].reshdr.original_size;
+	}
+
+	hDst = CreateFileU(dst, GENERIC_WRITE, FILE_SHARE_READ, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+	if ((hDst == INVALID_HANDLE_VALUE) || ((data_size != 0) &&
+		(!WriteFile(hDst, data, data_size, &size, NULL) || (size != data_size)))) {
+		suprintf("  Could not extract file: %s", WindowsErrorString());
+		goto out;
+	}
+	r = TRUE;
+
+out:
+	safe_closehandle(hFile);
+	if (hDst != INVALID_HANDLE_VALUE) {
+		CloseHandle(hDst);
+		if (!r)
+			DeleteFileU(dst);
+	}
+	free(table);
+	free(meta);
+	free(data);
+	return r;
+}
+
 // Extract a file from a WIM image
 BOOL WimExtractFile(const char* image, int index, const char* src, const char* dst, BOOL bSilent)
 {
-	if ((wim_flags == 0) && (!WIM_HAS_EXTRACT(WimExtractCheck(TRUE))))
-		return FALSE;
 	if ((image == NULL) || (src == NULL) || (dst == NULL))
 		return FALSE;
 
+	// Try our own extraction first, as it runs in-process and uses all cores.
+	// It does not handle LZMS (ESD) or split images, which we leave to 7-Zip
+	// or wimgapi.dll.
+	if (WimExtractFile_Native(image, index, src, dst, bSilent))
+		return TRUE;
+	if ((wim_flags == 0) && (!WIM_HAS_EXTRACT(WimExtractCheck(TRUE))))
+		return FALSE;
+
 	// Prefer 7-Zip as, unsurprisingly, it's faster than the Microsoft way,
 	// but allow fallback if 7-Zip doesn't succeed
 	return ( ((wim_flags & WIM_HAS_7Z_EXTRACT) && WimExtractFile_7z(image, index, src, dst, bSilent))
 		  || ((wim_flags & WIM_HAS_API_EXTRACT) && WimExtractFile_API(image, index, src, dst, bSilent)) );
 }
 
+/// <summary>
+/// Read the XML data of a WIM image directly, without having to extract it through
+/// the WIM API or 7-Zip, or to mount the ISO that contains the image.
+/// </summary>
+/// <param name="image">The path to the WIM file, or to the ISO that contains it.</param>
+/// <param name="wim_path">The path of the WIM file in the ISO, or NULL if image is a WIM file.</param>
+/// <returns>An allocated, NUL terminated, UTF-16 XML string or NULL on error. Must be freed by the caller.</returns>
+wchar_t* WimGetXmlData(const char* image, const char* wim_path)
+{
+	BOOL r = FALSE;
+	HANDLE hFile = INVALID_HANDLE_VALUE;
+	LARGE_INTEGER li;
+	WIM_HEADER header = { 0 };
+	uint64_t xml_size = 0;
+	uint8_t* buf = NULL;
+	DWORD size = 0;
+	int i;
+
+	if (image == NULL)
+		return NULL;
+
+	if (wim_path == NULL) {
+		hFile = CreateFileU(image, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+		if (hFile == INVALID_HANDLE_VALUE) {
+			uprintf("  Could not open image '%s': %s", image, WindowsErrorString());
+			goto out;
+		}
+		if (!ReadFile(hFile, &header, sizeof(header), &size, NULL) || (size != sizeof(header)))
+			goto out;
+	} else if (ReadISOFileRange(image, wim_path, 0, sizeof(header), (uint8_t*)&header) != sizeof(header)) {
+		goto out;
+	}
+	if (header.magic != WIM_MAGIC) {
+		uprintf("  Invalid WIM header");
+		goto out;
+	}
+	for (i = 0; i < sizeof(header.xml_data.size); i++)
+		xml_size |= ((uint64_t)header.xml_data.size[i]) << (8 * i);
+	// The XML data should never be compressed, but better safe than sorry
+	if ((header.xml_data.flags & WIM_RESHDR_FLAG_COMPRESSED) || (xml_size < 2) || (xml_size > 16 * MB)) {
+		uprintf("  Unsupported WIM XML data");
+		goto out;
+	}
+
+	buf = malloc((size_t)xml_size + sizeof(wchar_t));
+	if (buf == NULL)
+		goto out;
+	if (wim_path == NULL) {
+		li.QuadPart = header.xml_data.offset;
+		if (!SetFilePointerEx(hFile, li, NULL, FILE_BEGIN) ||
+			!ReadFile(hFile, buf, (DWORD)xml_size, &size, NULL) || (size != xml_size))
+			goto out;
+	} else if (ReadISOFileRange(image, wim_path, header.xml_data.offset, (uint32_t)xml_size, buf) != xml_size) {
+		goto out;
+	}
+	// The data is UTF-16, so we need to terminate it with a wide NUL
+	buf[xml_size] = 0;
+	buf[xml_size + 1] = 0;
+	r = TRUE;
+
+out:
+	if (!r) {
+		uprintf("  Could not read WIM XML data from '%s'", (wim_path == NULL) ? image : wim_path);
+		safe_free(buf);
+	}
+	safe_closehandle(hFile);
+	return (wchar_t*)buf;
+}
+
 /// <summary>
 /// Find if a specific index belongs to a WIM image.
 /// </summary>
@@ -1194,3 +1660,702 @@ out:
 		safe_free(img_save.ImagePath);
 	}
 }
+
+#if defined(_DEBUG) || defined(TEST) || defined(ALPHA)
+extern const char test_msg[];
+extern uint8_t* to_bin(const char* str);
+
+#define WIM_TEST_CHUNK_SIZE     3000
+#define WIM_TEST_ITERATIONS     2000
+#define BZ2_TEST_SIZE1          250000
+#define BZ2_TEST_SIZE2          5000
+#define BZ2_TEST_OFFSET2        3353
+#define BZ2_TEST_ITERATIONS     20
+#define GZ_TEST_SIZE            65536
+#define GZ_TEST_MEMBERS         5000
+#define WIM_TEST_XML_OFFSET     5000
+
+/* Generate test data that mixes text, x86 CALL instructions (for the LZX E8 translation) and zeroes */
+static void CodecTestData(uint8_t* buf, size_t size, uint32_t seed)
+{
+	size_t i, j, n, msg_len = strlen(test_msg);
+	uint32_t x = seed;
+
+	for (i = 0; i < size; i += n) {
+		x = x * 1103515245 + 12345;
+		switch ((x >> 16) % 4) {
+		case 0:
+		case 1:
+			n = MIN(size - i, ((x >> 8) % 64) + 1);
+			memcpy(&buf[i], &test_msg[(x >> 4) % (msg_len - 64)], n);
+			break;
+		case 2:
+			buf[i++] = 0xE8;
+			x = x * 1103515245 + 12345;
+			n = MIN(size - i, 4);
+			for (j = 0; j < n; j++)
+				buf[i + j] = (uint8_t)(x >> (8 * j));
+			break;
+		default:
+			n = MIN(size - i, ((x >> 20) % 300) + 1);
+			memset(&buf[i], 0, n);
+			break;
+		}
+	}
+}
+
+/*
+ * Chunks of WIM_TEST_CHUNK_SIZE bytes from CodecTestData(), compressed with an XPRESS Huffman
+ * and an LZX encoder. The LZX ones cover verbatim, aligned offset and uncompressed blocks.
+ */
+static const struct {
+	const char* name;
+	int type;
+	uint32_t seed;
+	const char* data;
+} wim_test_chunk[] = {
+	{ "XPRESS", BLED_WIM_CHUNK_XPRESS, 1,
+		"0909000900090099000000000000000903000090000006960909000090000090000909098999000008909997000009905069456655607555"
+		"0665556878000008000090909900000000000009000009900000000000009098090000900000900000000090000000000000009000000009"
+		"0009099095900000000000000099000000000000090000500000000000000000000000000000000008000000000000000600000000000000"
+		"8909000000000080090000000000006007080000000000007708000000000080769709808000800007880008000000800000000000000000"
+		"0000000000000000000000000000000000000000000000000000000000000000d787addb72e89a06438d35c9f28e7808591386757290fa18"
+		"e0103ab6ca513a8cffbaff1002489fa530b16c7a443208c67b0ec4d266492b63cbc21999d2518f6ac1c51255240c7f94c5ea24f97b53b73a"
+		"12109b45929c79504ac7c434cad19d21af7507d83754d4f66deded9624477911cd605742454045de32cf105d8a95bd4c36d9591b9749e98c"
+		"d7c6b9be02ee4c2810cec814ba327cf80070f5a17df5d3f4731eeef0301079eb68ee7ac4dcdf87e69d70fabbabbfd1b3fcc6b243ccf64251"
+		"617fb276da631bd34efb24b2250d1f187cbe2e9a301027afbe4cac9166bcc17b6ced841066597c65144cdd34130be28c4c0a2ce58eb204d1"
+		"e218deb7e451b72b103cf0db5822775736439bad20a6824d58ea9d5f0696f5340b9c66426763e7f55c07e36f99386b3adc324a55f36f53a7"
+		"698b1a8ddbfec57e104ac944f70de310915eff6601b67c188fbe7b1086b33ccc615e8ec3662747a638159d577a1d3ba34b868cabfd3c10f7"
+		"4e0d3de4cf9ce317d183554a70a0b0b5d4895df296a70a27a24f53e2931ab02ea2eb00fd10000000000000" },
+	{ "LZX verbatim", BLED_WIM_CHUNK_LZX, 2,
+		"bb20008200005401005000005a3cb40a3f2d29155e085694ada408113e22bff7f79cfc3bffeeec39ad544d2056690bad264d89885a8be591"
+		"f68b622108ad0000040000d401000841a19890eef5927175a551421b89bd225a06db4ddc988cb85120b3449643d9d7dea91bb1ed68cd2b6e"
+		"3a7cb8445da85d478944001000000000b30aa001e63d9812bf524ea99843b9e2ac8c6eaccffe008a2209c2442022b0f33d800820a1d2330f"
+		"639fb69011165820db506bf64902f80533090ad03c0fe4537c2370d8a10f0ee280004243711446d367e60b9b890ce403791ca0110222a3c0"
+		"c2c8a5602b2a9b190304164c1b77243a449e4dc69a5808ad4a220510d2ae760c590a1226f904f4f1e47e9de03c80ac945486e16822008e18"
+		"25336954360c503ce2443c26f82cb58d929275410574d85b53a182b34123b0a746730325f256b00cc6441515c396b53f198881352a4a8479"
+		"3c786ce029d2a00422100004423ee9786e2b5a618b246f56a231e6e95ccc1457adb02495fb826b163a362e3fea17e79d11e17f8a2a841544"
+		"274e15ce788c9c80a52161967c20fd5989115e0fb0fb863c241444e082f96901e6eab17415a1aa70c5e68e2235d751bd7cad3872eb218b07"
+		"c5028280ad3128b1b8e02a1253e6b22831eaae7b48b22157f1a626124f0313622251a531f51679c7c260d46191ad546eea740068" },
+	{ "LZX aligned", BLED_WIM_CHUNK_LZX, 3,
+		"bb40db86b26d00001400506400004c6062e9c8e8fc84213dc6904512e64bf515c98c8c889df9f74abedbdfddde677bdfbe5bd7dc0bc5e88c"
+		"9d45856412d5f9102915095d272a90106995bb74739780300000510000100000e5134b9eefcba82b5f4a116649698da26efadc04760699e7"
+		"63df198623986e8479e5c1da04b39bcf34825052f29411f9523ebc1040900000000046060680968059504a40812420d047e1b173ebd43e76"
+		"53b7f2ffc020f89b23df34c08c82007482747d02412802a4801a212010ce80506021200e86639c126490792a85c1194891d003aad6007412"
+		"7bbc427346a9238e11088ad53cbd1e1404664229138015aba02d8874509652f00896311d17678148081fa553e32141776ac471e4d85e305d"
+		"4037ae9404d8643060667b196295b366a70a816973b444b5044ef11908c04c8699bda2e4f22c4b6f9f49ae2d8b746847445fd246b5448263"
+		"fa94d401fe14240af54b688ac58928403781596d8a61aa7e82cdabad09832a2c607da824109e8b98e5474da8583504a8c355217606b66221"
+		"9996422416e6245082525a44b470b36637ab73d4828b30d265f49ba7457d80f5712a198eed015dc0110626766b0f66b46f032f1fe3e269de"
+		"843e461e6c08507f2db09b80f58e6ced5987b0c6269d428b726a8c78be675b6a623717f3a6a3cb287d416211d7a54a2217c69a58feba7598"
+		"9c33e25a0925469459ba480482d2d8b33966dd6bcbe8f7c1d95ca9336de248d0e77a22aaf8a9662ec32582982ab26b65f3a8000133da7e28"
+		"181073b9aeab1beac624f9327c59ae4616db3c9366f80419c32843e1b0d8334bbe3129679d8613972202ee5eabc3628029320187376b9aed"
+		"00e0284a17b0e475e1cd92badf522ecfae4cc4d98a0b1d0041c293b10a73483be02e7bc4aadf11ca2065df5f420aa8272b4a75ca357a157c"
+		"99af58482caf03138955e0a44a67548b0c01bda0f73e391b57a2240b926d9fe997a0957b78d8008a" },
+	{ "LZX mixed", BLED_WIM_CHUNK_LZX, 4,
+		"3e2000820000350100606000954e7e0ca602e8eb669405e323d21b4326f010277bfb7bdfe67bfbf6e7da7b9ed21594244928518ad474545a"
+		"3a8550848885924814f7126710b00000090000a30300e202ea85a5d72ae9840aa3b0276ae2cda8ecaaedac39d89da92ea34dbd5bb85b6647"
+		"dd4d08a588983cfce945104555bca2ea228549f400180000000008009001d3639193fd7effa504620649840828c001448284a0041040700c"
+		"555014f091188de09900835104c051052d0cafa59d51184cf2a097c05cdd7fac18663015decf305000904526fe58080314a0d01833899892"
+		"a8a4208254222490e33763452c0ccea88cd22e2cd9a831c574d3373d205d912b6d2c1507712021e22a5c192c2e349e9a152e63951cca1a1a"
+		"1505830ca435d94d2966800d21a578088687b84088b085e66c2493981aa051d68fb53908f311d8447b43276baeef5841132e89dc10d76b28"
+		"c2a25e830c73014784a268610f888074651b0887ccc844ce87146e071951a08a4f438b201475c61116d530f7401692d64638915ce40429ce"
+		"1a2552311a807444c508b20b87b37352331f4e95257d4463c11de18ba27be771211a0ac453a3d81833431aabcc202d26ae27d4367cc000e0"
+		"a800000020000000250000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000"
+		"0000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000"
+		"0000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000"
+		"0000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000"
+		"0000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000682c20736f20"
+		"706f77657266756c20616e6420736f207769736520686520636f75e8f671c7cf6865206461726b2073696465206f662074686520466f7263"
+		"652069732061207061746877617920746f200000000000000000000000000000000000000000000000000000000000000000000000000000"
+		"0000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000"
+		"0000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000"
+		"0000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000"
+		"00000000000000000000000000e882b7f0f30000000000000000000000000000000000000000000000000000000000000000000000000000"
+		"0000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000"
+		"0000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000"
+		"0000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000"
+		"0000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000"
+		"0000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000"
+		"0000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000"
+		"000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000000e8ef"
+		"e064a0003e401c97b16900477300003763076e0012e58a5ac489ca9679ee6a1dcd756e6defa45d4b060dd1f8c4277e67415a9eb7af6f6d3c"
+		"fdbf9be936eb16a9fab95994900e9d4e5884ed4bba90a12c716439dda4d61054b0b05b2290de7c659a4555d000808d0000c05819b81f16be"
+		"8cca1a2618e5f1a1031f5bb466d3de7beb506eb5db75efb866bd527b1e3e46af8e00ba5bec1d3c6f9c45e6e7f3dc666df7f3993959e12d18"
+		"5fb28aea8b14c53040a30040000024002304cd0e09043e047c08fd85fbfd85c202a0d4cc18530fae0faf28ac5a234d8ef01c028191592f8d"
+		"cdf23767a5c9fec1f56fb47a020dab9f21fb874d91d002d433f3c000de29a80374008b8c014c2111523a3044105104086b9a04477563e2c2"
+		"ae7413630ce03749263fa0aea31859a93cc04f35014b2934c0cd3d9b14806c7002fd327c55b560e25e55376505095019a898356451530cb1"
+		"1ea2649521c4e00d78755b35b00585eb8ac6c09a3ef2186bb7369740cb8d06178eff8009202e140f11860009961976541168076f8fab0b63"
+		"bdba208811e0007fedabd07108db0ea93e0a70a4f96ff00dc7519aa5018081945a5056c68a224927ae45c69900ec" },
+};
+
+/* Check the WIM chunk decoders against known data, and report their throughput */
+int TestWimChunks(void)
+{
+	int i, j, errors = 0;
+	int64_t r;
+	size_t src_len;
+	uint64_t start, duration;
+	uint8_t *src = NULL, *dst = NULL, *expected = NULL;
+
+	dst = malloc(WIM_TEST_CHUNK_SIZE);
+	expected = malloc(WIM_TEST_CHUNK_SIZE);
+	if ((dst == NULL) || (expected == NULL)) {
+		errors++;
+		goto out;
+	}
+
+	for (i = 0; i < ARRAYSIZE(wim_test_chunk); i++) {
+		src_len = strlen(wim_test_chunk[i].data) / 2;
+		src = to_bin(wim_test_chunk[i].data);
+		if (src == NULL) {
+			errors++;
+			continue;
+		}
+		CodecTestData(expected, WIM_TEST_CHUNK_SIZE, wim_test_chunk[i].seed);
+		memset(dst, 0xAA, WIM_TEST_CHUNK_SIZE);
+		r = bled_uncompress_wim_chunk(src, src_len, dst, WIM_TEST_CHUNK_SIZE, wim_test_chunk[i].type);
+		if ((r != WIM_TEST_CHUNK_SIZE) || (memcmp(dst, expected, WIM_TEST_CHUNK_SIZE) != 0)) {
+			uprintf("WIM %s chunk: FAIL", wim_test_chunk[i].name);
+			errors++;
+			safe_free(src);
+			continue;
+		}
+		// A truncated chunk must not decode to the original data
+		r = bled_uncompress_wim_chunk(src, src_len / 2, dst, WIM_TEST_CHUNK_SIZE, wim_test_chunk[i].type);
+		if ((r == WIM_TEST_CHUNK_SIZE) && (memcmp(dst, expected, WIM_TEST_CHUNK_SIZE) == 0)) {
+			uprintf("WIM %s chunk: FAIL (truncated chunk was accepted)", wim_test_chunk[i].name);
+			errors++;
+			safe_free(src);
+			continue;
+		}
+		start = IoStatsNow();
+		for (j = 0; j < WIM_TEST_ITERATIONS; j++)
+			bled_uncompress_wim_chunk(src, src_len, dst, WIM_TEST_CHUNK_SIZE, wim_test_chunk[i].type);
+		duration = MAX(IoStatsNow() - start, 1);
+		uprintf("WIM %s chunk: PASS (%.1f MB/s)", wim_test_chunk[i].name,
+			(double)WIM_TEST_CHUNK_SIZE * WIM_TEST_ITERATIONS / duration);
+		safe_free(src);
+	}
+
+out:
+	free(dst);
+	free(expected);
+	return errors;
+}
+
+/*
+ * Two concatenated bzip2 streams: a three block one (bzip2 -1) of BZ2_TEST_SIZE1 bytes of
+ * test_msg repeated, then one (bzip2 -9) of BZ2_TEST_SIZE2 bytes from CodecTestData(), seed 6,
+ * that starts at BZ2_TEST_OFFSET2.
+ */
+static const char bz2_test_data[] =
+	"425a6831314159265359b6e1e79f002ba31f804085000085744e803fefdfa0600abf00000000000000000000018c262683046219184c3184"
+	"c4d0608c4323098630989a0c1188646130c613134182310c8c2618c262683046219184c0a5440810ca312621a1e9a9dea0f6a836a83faf75"
+	"419a22e550609166a0fc541f7541c541a541fe541b4a0cd419541ad418a83fda83e541f9a834507f75060a0eaa0e141e8a0c412792834a83"
+	"2a83f4a0c283150715074507c541aa839283ad419a8335066a0cd41cd41fa5061418507c541c941b141ff2835506141d141d6a0e55069506"
+	"0a0ef5076a8335075506ca0cd419a8394a0f4a83b2835a83ad418a830a0c51172a837507128355078541a2837a837506b5068a0dea0cd41a"
+	"28315062a0f4a8315072a832a833507c541f45077a839a837507dea0c68a0e950715068a0c4a0e75069506541cd41c283b541f1506f507ad"
+	"41e8a83ba839283a1419a83e541d941c541c283f6a0f4a83ba83dea0eb507bd41c2836a22ed507250775066a0fe248b5506114a5e5506141"
+	"daa0dd5060a0e8a0eca0d6a0f4a83eca0c941cea0d6a0fc541d950615077a22eb506d507f0a0c283c54195078507b2837a83a141f6941850"
+	"7928392833506541e9506141caa0cd41e950692835a88b6a83bd418506d506aa0d141bd41c5419541a541a5418506ea830a830a0c2837541"
+	"8a832a0cd418a83b5093f95062a0f0a0c54195062941e1419a83caa0cca0d141e75062a0f1507ad419941f2a0e4a0ca835a838a838541a54"
+	"1f2a0c2834507bd418a8335078a837506ca0cd41de507eaa0eb507f35069283d550735079ca0e8a0f3a835a838a839941a283c4a0c541d94"
+	"1ed445c2834507ad41eaa0f54a0ca83f0245e6a0d6a0d2507ba836941d65069141d2a0d6a0eb50794a0caa0f3541eb283048b95418a127c5"
+	"419922c5419a83250609161418a8312830507a28325064a0c0a0d6a0cd41de5062a0e75075a83aa834283ba835a83a283ef506541f4245f6"
+	"a8375078a83dd41eca0e65079ca0c141c283f3507d6a0d6a0d45066a0f1507cd41fb541d141e248b84a0f6a834a83c2832a0fdaa0c528345"
+	"072a83b2837a83a2831507d9419a830a0e4a0ed506aa0fcd41eca0dd41cd41f7941c941ba832a0e4a0cd41a28365061418a83aa8385066a0"
+	"daa0c541bd41e141bd41f2a0c450685070a0e448b6a838a835507088b2a0f5a5079122dc48bbca0ca8335065418507dd41fb541f3507a541"
+	"dd41caa0ca83b922e141eea83e95073941f5a831283ed507f9445c541de50724a0ee506a50695066a0c141d6a0eca0faa83e9245d2a0dea0"
+	"e0a0e2506b5069245bca0f8506aa0e141aaa0da5068a0f6a834a83e6a0cd4195060a0f5506b5068a0d6a0d4a0d141e55066a0f25062a0e55"
+	"070a0cd41f9506aa8365073506552562a0dea0e7506541e141a28315075541a541b2836a831506141cd5073a832a0c541a522a6aa0fa2833"
+	"2835a839941b2834a507bd418a8345070a0d941c2a0f0a0dea0fed507b541b2836a83c4a0c52837507350614195066a0c541eaa0d941e012"
+	"6b445e9506d44599418a8315076507f55079541d541caa0c141a541b2a0d541ff98a0ac9329acbc3e64ef004109cfc02042800042ba27401"
+	"ff7efd030055f8000000000000000000000c613134182310c8c2618c262683046219184c3184c4d0608c4323098630989a0c1188646130c6"
+	"13134182310c8c26052a20408651880a3d23f4d4eea0f6a836507b1418245c54182459a83f0a0fbca0dd41a283fca8369419a832506aa0c2"
+	"83ff541f3507e541a541ff1418541fe541c541e950601279541a2832507f2a0c54185070a0e9507c541ad41caa0eaa0ca832a0ca832a0e75"
+	"07f2a0c5418a83e2a0e5506ca83ffd41ad418a83a541d541c941a2830a83ba83b2832a0eb506ca0ca8335072541e95076a83550755061418"
+	"a83048b92837a838941ad41e0a0d2a0dd41bd41aa834a837a832a0d2a0c2830a0f4506141caa0c9419507c283e95077a839d41bd41f8a834"
+	"a83a2838506aa0c2a0e6a0d1419a839d41c541d941f0a0dea0f5507a4a0ef5072a83a2a0ca83e6a0ed5070a0e2a0fed41e8a0ef507ba83ad"
+	"41eea0e2a0d891765072a83bd419a83ef445ad4181252f25062a0ed506f2830a83a541daa0d541e8a0fb5419541cea0d541f950762831283"
+	"b922eaa0d941f7a83150785066a0f1507b541ba83a2a0fb4a0c541e55072a832a0cd41e8a0c541c9419507a2834941ad445b283ba831506c"
+	"a0d6a0d2a0dd41c283250695068a0c541b941828315062a0dca0c28335066a0c283b024fdd4185078a830a0cd4188a0f1506541e4a0cca0d"
+	"2a0f3506141e141eaa0cca0f9a8395419a8355070a0e0a0d2a0f9a8315069507ba8315066a0f0a0dea0daa0ca83bca0fe283ad41fb506928"
+	"3d65073a83ce5074a83cd41aa8385073541a541e25062a0ed507b122e2a0d2a0f5507ad41eb4a0cd41f9a88bcea0d541a4a0f7a836941d65"
+	"0694a0e8a0d6a0eaa0f25419941e7283d6506288b928315513e2a0ca22c2832a0caa0c51162a0c54185418541e9506550655060a8355066a"
+	"0eea830a0e6a0eaa0eb5068a83bd41aa83a541f8a833507d288beca0dea0f0a0f7a83daa0e6a83ce50615071507e941f5a835506a5419507"
+	"8507cd41fd283a541e11170941eca0d141e2a0cd41fd94188a0d2a0e4a0ed506ea0e9506141f6a832a0c541caa0eca0d6a0fd283daa0dea0"
+	"e7507e25072a83f5c2834a839d419506b506f5062a0c283b541caa0ca836506141ba83e9506ea0f9a8314a0d150715072922d941c2835a83"
+	"8922cd41ed141e7445bd445e25066a0ca8335062a0fcd41fd283e541dd41e2a0e55066a0ef245c541f6941f5a839ca0f55062507dd41fe12"
+	"2e141de50724a0eea835541a5419a830a83ad41daa0fad41f4445d141ba838541c4a0d541a222de507c541ad41c541aca0d95069507b541a"
+	"283e54195066a0c2a0f5a8355069506b506aa834a83c941950795418507250715066a0fdd41a941b541cea0caa4ac541ba839a8335078a83"
+	"4a8315075941a541b541b2830a0c541ce50735066a0c283450a9ad41f4a832a8355073541b541a4507bd418a834a838a836a838941e2a0dd"
+	"41fc941eca0daa0daa0f12831141bd41cea0c5419a832a0c283d6a0daa0f0849a922f4506c48b32830a0c283b541ff6a0f2a83ad41c94185"
+	"41a2836941ad41fe98a0ac9329acb8a5e72c8014ec0fc02042800042ba27401ff7efd03004bf80000000000000000003184c4d0608c43230"
+	"98630989a0c1188646130c613134182310c8c2618c262683046219184c3184c4d0608c432309814a881024f1462044f28f354f043da83621"
+	"ed506122e2830916683ee43ed506e43421fba0d9419a0c886a43141ff683e283f141a507fa430a0fdd07141de831093d2834219a83f5418a"
+	"0c5063821d283f941a5072a0eb419219a0c90c90e741a7ea833418a0fe5072a0dd41ffa835a0c5074a0ea439d068430a0f043b10c90eb41b"
+	"5064866839283bd076a0d683a90c10c506122e541bd071506b41e6a0d283721bd06a434a0de832434a0c10c10ef41821ca83221921fc21f3"
+	"a0f141ce837a0fbd06941d0870435a0c283990d0866839d07141d887f086f41ea43bd41e28395074506487c5076a0e087141fda0ee43c507"
+	"b90eb41ef41c506c917621ca83c506683ed48b5a0c0a52f4218a0ed41bd4185074a0ed41a90ee43eb4195073a0d683f043b5418a83c245d4"
+	"86c43ed418a0f3419a0f341ed41bd074507d5418a0f4a0e5419a0cd077a0c507221921dc869506b245b5078218a0d886b41a506e43821910"
+	"d2834218a0dea0c5418a0c506e218219a0cd06283b424ff283141e6830433418aa0f341921e8432a0d283e443043cd07a90cd41f141ca833"
+	"41a90e087021a507c5062834a0f7218a0cd07921bd06d419a0f1507a7ea83b507f8435a83d6a0e941dea0eb41dc86a43821d141a5079a831"
+	"41e941ec917141a507a90f5a0ef283341f8245f2a0d4869507bd06ca0eb5068507421ad07521e8a0cd41f2a83d6a0c522e4430893f9419a4"
+	"58a0c90cd418a458a0c50614185077a0ca832a0c141a90cd078506283990ea43ad068a0f141a90e941f7a0cd07cd22fa90de83c90f7a0f6a"
+	"0e6a0f95418507141f9a0fa506b41a941921e487c507f443a5079a45c2a0f621a10f3419a0fed418aa0d283910ed41b90e941821f5a0c90c"
+	"5072a0ec435a0fc90f6a0de839d07dd41ca837a0cd072a0c90d2836a0c5060875a0e283243621821b90f341b90f8a0c141a2838a0e5116c4"
+	"3821ad071116683d5507a522dc91785066832433418a0fbd07f6a0f821dc878a0e5419a0f1117141ef507ce839d41f4218a83eb41fb48b82"
+	"1e2a0e5283c28355069419a0c283ad076a0fa507ce917421bd070a0e2a0d486948b7507f2835a0e2835a836506941ed41a10f8219a0cd061"
+	"41eb41a90d2835a0d541a507a10c90f4a0c10e4438a0cd07e6835a836a0e741914ac506f41cc86683cd069418a0eb506941b506c43043141"
+	"cea0e643341821a5454d683e7419506b41cd41b5068a83de83141a507141b50715079a0dc87fca83d886d41b5079a831541bd073a0c50668"
+	"3243141eb41b5079093548bbd06c9166a0c10c10ed41fed07a5075a0e5418506941b541ad07ff1772453850905a35c39b0425a6839314159"
+	"265359bb9db50a000303ffffd999270042879b84df7e7e84ffffdfeda0c45438868c46a20c200860c5e05c294002eba698a4a560d4d53d21"
+	"a4da9ea7a8da8da8f4807a4641a64068f4d400034c46400640c4d1a69bd24122424644434c13d269a0d320340001900311a0681a03434680"
+	"0d070000d0003406400000d0001a6800000000d001249a14d53c34c8d09190d000681a0000032068007a8000000a3bbe544ef1826c9be27b"
+	"3b4f820c178fe7c07089f03000719180ca21e31a79ec963145969d7666994403384c440bb2b1300a94f46a33dca48a32b45eec693089a499"
+	"168d36e7302e9339356c7b6590a13a81b5d237c314055361d9161a36e69a302e9715185a2ba9b63454528cc144170a54a45428da4c80d080"
+	"6e4285dd0b4139d9859b39ef2b312ed0b8585faa04301a849449cb00150b864d997a399b84159b0c2c0280321f301fc7a9b94dca8e35899d"
+	"af8dadca50d00f7502d36bead7b2c80d86be36e175a929091846418c63cd6535acc92340c74332571199f96a4649927d2ad0b9c646664491"
+	"180d5906072297c268b1304c91697d64280f690c298a116352ee1ac16a32c8c883231f0530409684dc198752243e8bf96b45e45d471150e1"
+	"61982b6195531635487238054d6646953895dc5884eb0a4c5039746e4959724efca8d95a66cd33eed2f434b528032084c1a686ac6082601b"
+	"0d4d058ecbe8aa20e5e2321470e2530b69948e29823a7249e9595f9aaaf5e43c6c8b68331483f70ca30870b97c98f2cea419a6f0ea5d5c5a"
+	"89d371c0856a44dfc2a0a0c2fc744ca2c52f55ed694f4ec45a7916e931571598027856c28c8731a8ddc7abd6d32bdad62c356019f9e1aeb8"
+	"b580ca26804f7f70548ab44918089f6be3a2489228a724bb90e0a2531e2e94da821309a85209290c31874b117608404b52dcc32ed12fe3cc"
+	"c155df016c20541de2e2801618c88d782300cd13933467470d8334b5bb33a72c60c2265c2062155284d11208436165f5bbe4556499825a0a"
+	"2d7b779ff763575499899d6bdd55e8425f336d62d55530a588120bf0add8ea4fe90c3a9b3b48bb3c6b2d45fd936b67b11affc892ec8597d0"
+	"d5b8788bcbb870918c5fe2ee48a70a121773b6a140";
+
+/*
+ * Decode a bzip2 test stream, either from buffer to buffer, which uses the single threaded
+ * decoder, or through temporary files, which uses the multithreaded one on a multi CPU system.
+ */
+static int64_t Bzip2TestDecode(const uint8_t* src, size_t src_len, uint8_t* dst, size_t dst_len,
+	BOOL use_files, char path[2][MAX_PATH])
+{
+	int64_t r;
+	uint8_t* buf = NULL;
+	uint32_t size;
+
+	if (!use_files)
+		return bled_uncompress_from_buffer_to_buffer((const char*)src, src_len, (char*)dst, dst_len,
+			BLED_COMPRESSION_BZIP2);
+	if (write_file(path[0], src, (uint32_t)src_len) != src_len)
+		return -1;
+	r = bled_uncompress(path[0], path[1], BLED_COMPRESSION_BZIP2);
+	if (r < 0)
+		return r;
+	size = read_file(path[1], &buf);
+	if ((size != r) || (size > dst_len))
+		r = -1;
+	else
+		memcpy(dst, buf, size);
+	free(buf);
+	return r;
+}
+
+int TestBzip2(void)
+{
+	const char* mode_name[2] = { "buffer", "file" };
+	char path[2][MAX_PATH] = { "", "" };
+	int i, j, mode, errors = 0;
+	int64_t r;
+	size_t src_len = strlen(bz2_test_data) / 2, msg_len = strlen(test_msg);
+	size_t dst_len = BZ2_TEST_SIZE1 + BZ2_TEST_SIZE2;
+	uint64_t start, duration;
+	uint8_t *src = NULL, *bad = NULL, *dst = NULL, *expected = NULL;
+	// Offsets of a byte to alter, from the end when negative, that must make the decoding fail
+	static const struct {
+		const char* name;
+		int offset;
+	} bad_data[] = {
+		{ "block CRC", 10 },
+		{ "first stream CRC", BZ2_TEST_OFFSET2 - 2 },
+		{ "last stream CRC", -2 },
+	};
+
+	src = to_bin(bz2_test_data);
+	bad = malloc(src_len);
+	dst = malloc(dst_len);
+	expected = malloc(dst_len);
+	if ((src == NULL) || (bad == NULL) || (dst == NULL) || (expected == NULL) ||
+		(GetTempFileNameU(temp_dir, APPLICATION_NAME, 0, path[0]) == 0) ||
+		(GetTempFileNameU(temp_dir, APPLICATION_NAME, 0, path[1]) == 0) ||
+		(bled_init(0, NULL, NULL, NULL, NULL, NULL, NULL) != 0)) {
+		uprintf("bzip2: Could not set up the test");
+		errors++;
+		goto out;
+	}
+	for (i = 0; i < BZ2_TEST_SIZE1; i += j) {
+		j = MIN((int)msg_len, BZ2_TEST_SIZE1 - i);
+		memcpy(&expected[i], test_msg, j);
+	}
+	CodecTestData(&expected[BZ2_TEST_SIZE1], BZ2_TEST_SIZE2, 6);
+
+	for (mode = 0; mode < 2; mode++) {
+		memset(dst, 0xAA, dst_len);
+		r = Bzip2TestDecode(src, src_len, dst, dst_len, mode, path);
+		if ((r != (int64_t)dst_len) || (memcmp(dst, expected, dst_len) != 0)) {
+			uprintf("bzip2 (%s): FAIL", mode_name[mode]);
+			errors++;
+			continue;
+		}
+		for (i = 0; i < ARRAYSIZE(bad_data); i++) {
+			memcpy(bad, src, src_len);
+			bad[(bad_data[i].offset < 0) ? src_len + bad_data[i].offset : bad_data[i].offset] ^= 0x01;
+			if (Bzip2TestDecode(bad, src_len, dst, dst_len, mode, path) >= 0) {
+				uprintf("bzip2 (%s): FAIL (altered %s was accepted)", mode_name[mode], bad_data[i].name);
+				errors++;
+			}
+		}
+		if (Bzip2TestDecode(src, BZ2_TEST_OFFSET2 / 2, dst, dst_len, mode, path) >= 0) {
+			uprintf("bzip2 (%s): FAIL (truncated stream was accepted)", mode_name[mode]);
+			errors++;
+		}
+		start = IoStatsNow();
+		for (j = 0; j < BZ2_TEST_ITERATIONS; j++)
+			Bzip2TestDecode(src, src_len, dst, dst_len, mode, path);
+		duration = MAX(IoStatsNow() - start, 1);
+		uprintf("bzip2 (%s): PASS (%.1f MB/s)", mode_name[mode], (double)dst_len * BZ2_TEST_ITERATIONS / duration);
+	}
+	bled_exit();
+
+out:
+	if (path[0][0] != 0)
+		DeleteFileU(path[0]);
+	if (path[1][0] != 0)
+		DeleteFileU(path[1]);
+	free(src);
+	free(bad);
+	free(dst);
+	free(expected);
+	return errors;
+}
+
+/*
+ * gzip -9 of GZ_TEST_SIZE bytes from CodecTestData(), seed 7, and of test_msg. The latter is
+ * repeated GZ_TEST_MEMBERS times, to time the setup of the decoder for each member, as with
+ * zip archives that hold many small files.
+ */
+static const char gz_test_data[] =
+	"1f8b0800000000000203ed5d776014c51a875024c64610c4f6d84707439050a548958e42a437b9e436b92397bb7085708212410de8c30798"
+	"008280887402a252444444292a5d44444025097cc642794a91f67637b9bbbdbdd9dd994db936f317e5ee76e79baffcbe3a3646c7a4e9ec86"
+	"749d93b15b98549dd9c9e812e0487f7b63786766b5c97aa33e9681db103be959a3dd10c3d82c4c9a259db526394c8cceac676cde5f67643e"
+	"6561d28d369631b04ca2c561d2338e72aa0b66b1d1f90eb35967775875a658a627cb24b089ba54d6fdeba0b7195bc394d907be66d8f1ac99"
+	"4961d934c6ce3dc362666dc2b3745656cf6dc7e2b03349564b2aa3771acdc9b10d6cdca6f917654c6c326be636d84d67e5fed6dfa44b76b0"
+	"461b935e8e2ec961dcf87a46778e303a9e741cb55298be16ab9eb12409f4f63af4e0db9c0c1360ec95637028ff5de54f183dff319b51cfba"
+	"3ed6dd624d6419a30d295e46c87a61a701e2de393a96b216f63271243470f2cb4bb6703849569d513817fe6f268b8dfb3f9dc9e48ce1ff89"
+	"5333565ba1068a8d8d2dd20adc2f70acfc5a85f65395845ffddc615c397307f8fec91d0f434edcac19fa64f7b17bf8c06ed0d93dfa4e463f"
+	"05918cb848ceff0541151899be33be641f69e04866e025282dcdca9aed464e9e528c2613a7d10dc654c628fc27f4ccc9a90d959df9dbbd88"
+	"8f3c4c3de3b438f893b072b4d75985f7b75b75c9acdec96f87fb90daf14b7849c28df0e0074bef95fb4f11ab1a2c8e64839d315becb14c2f"
+	"3b678cb83f718fb4d92d56a7f0e3bd59bd914917f8c6aef8445ffe675834334a2ca731d160b2588d3ab38dd74a895656676719130c78fdc2"
+	"7376076771595e8a78f2e88457959c024f42a7eb5538b36cd07116de9168e0369162b6a49b58558110984864d4834c13d93842a6f23b31f3"
+	"3bb3f2344c60193756414095243284c20cf4221d474bfe2b2839505338f0cd6f9bab7873b958d9f1cf19c221b38e4c2fee075c8ca90edf6c"
+	"6c9195332716fe29d5a84733953189e55958c426017286cac65a10269eef0542c430e9066e7b0255ed0e6f23c30a92a23742d7c809c7c49a"
+	"03c5068a1a04165fceac0d1b73df1a2c92b240e37d0497428dcf5b0e54606b0a5dc260a16c03670ed874cf9fc1d8fbccdb72df2f32842ae6"
+	"90c5c359b22649cbce30101d3dfe223731f3fb9d432819427289dc5793d16e64554090ccafc878d1289ca18657428bba04905b50ab903de6"
+	"8e8efe15f636a77eed0de3a7f4590d7959d7ab79e3241fc84305a864dd71c248838e20d041f8cb6ea80795de9ad21cc1aa31fc170a7d797a"
+	"72a1ba7c503edc7ffba7be21bb5ddeedb530467392c9c192fbc09071b5c75209b99e3b91d74bd9e079057c8aa9bbe70d19394b1cfd548c07"
+	"c804aa94045d2168a7fc6209570656f70e31587d690d8daa2cfc9dca5cc99af3fc9b477742caf553d1320e188a0ba4e1202b995c807deecc"
+	"7888be999322845038761c644eb258d562909810549a330cf503ecf8d7a267c39c87c73e32ad1b5a6b85de66657257d4dcc2ddcfbcb8dbc5"
+	"11f7cddbf283d47f4286a52936257240308d3da7a24d9ccbc089a295d3d222ff9e92303496f7091b1305992a840536dd78ce4fe4b8c46a2b"
+	"4a6e71f2698861121c9c7a2ef5f75281a56035fdf00274aa37b673409153522822813941c417e87c30a93d6f77aa5a528985d87cf4937291"
+	"8e9bf688700866bd8f5cbe1e617d785a41dae88bd3c216bbbd7d313f42ceaebb2c074c7b3d769f275e15f2ca95b44c49ce259749c58bbf1a"
+	"54c1266e93a2d43baedfe80ea487a174edbb76ac1b69319150ffc0f30bba82210cc08d4acd8722e3e1f2276ef9a04ad18e5c35998f612b0d"
+	"ee3a74b46f241c985cb161a889cd2bfb96ae1011572529a7e81341f9b53fac119532984c7c4162d10fab14a40be54159195b5e74210da56f"
+	"0520195f9c303e2e649842d526ab4832d4fc7776869c2e0e12b9f8b2550f2b9cb1476df5d13db0ea8b7e39d42fa64be40bca5b2dfce8bd0b"
+	"7dc06f27263d5ecce015595da6141ac19eb6fbe687dc21c987ed24411d48dcb6e770893f1edfcff1ae142a318fc2a7d6100a1a3588820951"
+	"ad0fc1a67f9e9a4ebc21f90a68afc00874b96bfd670246c4d7be6fac5e763722166ed1e61315115b1d60c2ca2e9d2e5275a6aa5ec8a2e252"
+	"f11af8cbea4906ad68bfe42dfdb573d94b357ef5f7ca171b8ba264781ea7dfd15d10353104def2eaaaf238cf943065447e448b1b5c18522b"
+	"2b7cb066917945a689a15ed4813db0a660d26158d2c2791d325f7d344edef7a6ece4a3d1eb54ece2b428f646c1a2bd8713a06fcaec275db5"
+	"413e880e59b2836be0dc08ad5437ea5de15a6a8f91733928a795d6b16285bcd12d7f924fc1d3d90767144574c8ba5f11a5d47e268bbc7f20"
+	"b72739f134491b5785e428078203911d341f9a4fb12349bd3c599f872ba44c56668cbf21fc7e1c74a1a786aacf2416266ebbd98460ee021c"
+	"db9e1b89475d68d221a79a86790c1a83fa6e970e1a4dee37c21f4c8cedea437e5ef63848d97ae92a7e5a193d270159a08e0eabf88e5a8085"
+	"dfbcbc1772a31aefc50af70961b94041d7dc696b454e830ed7be1b8b8e08141464081c95d222533314a9a0b84f610c91f2376526187850b6"
+	"ec4414050e85c8ddafcc84a65b676c76cf0370337b9faf9f6289ec5b28fa4a0d76d45d81fe2fc58c2f65f47071a69d5dd7d774f7af04e926"
+	"f45a9b45a9e3a9e2782a1602c306b8f06990992f7f6b36a87df868ae9ceaf52dca01f3a9e87b42972391be1d89438a7087381a4f3bdde990"
+	"aa434734fc4a65229fd283ca3855164cb667d8a5c94383f5ddf79d848a4aa13ac4f83471893e6cb916f3322a504121095da5bce44265e143"
+	"019291ab2e3ae1602782d18a019467a2ab5416c6404dee8c894b733ced8c507eaaa16961dc15b2a6ce4f94383ff40442082a3d316bd60959"
+	"1e1235fe41cc86b1935d49124a37bae82aee522c5b0dd8b7262d2e0fcaa3219c9b8fdde5e4fb0b70f0e063ef017bfc68ae7cb3763809052a"
+	"a14e5545180293d9d9ce2ba5fa043eaaa25afb50ca9bfc4fcb752bb18ae0e1c76f4fdfa25c21b3549a5014ca6528ed7016a2a597120529d0"
+	"5d32eff92354e22e2c834e8da86735e4850fe66ffbaa1e7e93b8ef3bc9c973890759648681ab7e51fbdcd442a545c8703b2ec2b7a1294b2a"
+	"d719a99597f9c19cfb4be9f4ce387127d5bd7e73e3b1455ba412e5342849c9bed7c4162286699ed96ea5a81958734b67e97b831873c82807"
+	"d255f23ab5cab487b6c1ee0def56c71aa2e7dbf4a59483237e1bacf41fcedd8e3e1ea6d1ebde402d9d4392a40164af9bd3a224b0a72fc8e3"
+	"ffaed68d21eb49a34fb9dfc31dab40b50579fbf4819ea406cb77ffab4fe552627a63f1aea183d78745cf8197ccad5220b9429f76854c0f1f"
+	"343f7e04324677bf4a747da1ec4078587be652f854d9c0c44f1ebf569c2985dca91c8b6cb506a95c9430bf7028ea97108b55b38a2f0e8d2e"
+	"3fb159fb36f80d109906515710e47f13bf0c529c8911011a58d3438fcedb57534d43175d65b60827cf23b2afb8179784ba911af1a6b34339"
+	"c11d0fd21898c7efa56211407cf56df4c69412fb3592a251df165392e6760fb0815dccd5ba04d71b41c3db1f4d21225183f3f9b3e185a59b"
+	"7a63c46b651e0cce7fdea075ebc58ea129a0e42014bd0d931f6faa71b465a1af01154d2f4dc46b01a2cce359ea25a248372c1cac81795afd"
+	"5be228bec611d80cde87e1b1c8a4b6941ffd76da2d4ebf758e92a1784bc32c1efcfa4a4ade005f327aad7ac4d50cd5894cb2a51522099db5"
+	"3a31022f302c071640dffef501a54a031e6604f111aad700c9c20385582c9cbf917387aa023e91f1fc8fa16b5eca0fff702355113894ca7a"
+	"d5d003e2060c2dfb2b410846568b67ae7388d0a5d3e0a7db376fc3dfb1f74f43e69d885bf63c3710c2b85dbb767a13eacb6d15a7b8eae602"
+	"f84025061e566da85f1e953851f13a54e9e657a6edb9bcd26f18e53c9e6494424ea9786ff2e8f87bfbfb64df60cce5e37be174ee019dbc1b"
+	"5de64413db7c19b9727b5ae1a90a37cdfce307a8fbc72b8b426c5fcf76b1fc0cd3db14e4c0faf797aca0360fb19040590e88c14ab8d8aeec"
+	"de0d85e68b5a2f9442da6287102e4dfe711d66be9f3283f742179fe397aac2effbaa1e97bdb8280c092a1e0e0535decd9d032fef5f9e4719"
+	"2df00e0a2f91a671567a1152833f4fbdd7197fceaddb37f0f4b0c8a7fc082e3bc2ee7d8325676add019979f587c3a93b36ff4b2db6e2df00"
+	"21472c41d260f2a94fb743f6a0a1eb61c191937f8530cb6ae3449cd8582820c188cf47466bf48863980407f4aad1ff164915b7f7d32b1d78"
+	"fe386150922a612422249bbf2f216c194b243a7eac61a892bbe598f83ec8f0b98d1a17d37a170607b752bbf5c5a78d5dd25018d6e0cc3e4c"
+	"dcfa5915b83873ea55f4d8cf58662065037f2decebd2b554837b5400344a4d48c32e070bdfe380fc0fa20e50ae54559a5abba84137afd758"
+	"b546f6e0f6e39125d6101d7bdf5f1e4c224525644f53cf8b8aecbdff2bb6110929ad054ddc3f2a311cb4760ef1cb65ea58c527c5d3e0360b"
+	"79133741175a51b65dd32873683a74bca39b77e7a76bffd0a7e7438f207e14ce0e7d6671c9d01e773e9a7a32d5cd8dca1fd0d69b05ce0dab"
+	"b743ad35cd371763922a7f6065a5e2314f5f2196041b6ac4fccba5abd4c62851abcae38fda7b4eeb03f4d57e2d187500ee9d5fa799207562"
+	"9d0d8fed9d3e4030f6c14873ce38420bddb1b924e21820afee7b850c0c1bf3b51e593f8275814498c5a190f14d84a5f408c1e5bd8f5fd134"
+	"5205f6e7b718a31df608460cbf4b19beaaba39cd4f472553bf0727467c5813e0ec9258583ee27a0fc89a5e7b3816b2f6cc0a772a8e7022e9"
+	"da80179f58a993e439486a0e4babe705ae7fdcc8a1c05d8a5774068a54690ac58a5c41c997f0e676f971bf48bc870dbcc313e89055506308"
+	"4edb83f95be4f29af04bd77283f066799606707ab4c3483f8d5c8631ab9eea2e314af09921338e02ed82e72f8c0ff6281ce6bd60d4ad2a13"
+	"2b403ad24bf27decbbb391ae897ad7364c6fdaa63bacbfdd8c667b82c236621774f3164f3da455e86990ffb2c7961605f054ecb5ea7c0164"
+	"8094c54f64c3a5ad0da6147e560e4384b7655b1c077f63d500884e107a6fbadd894a1e3e919b251c4a86b9c792ab40ea8507ae08dc5e2872"
+	"60ac7fe801f86ff9afd6e30f6fe54e232489b4a6c1e9969457ca11677adca20a996f7e9789d10506f1f37b44ab3bda21c3588b2297d09b06"
+	"e588937da3fa58f538a12fb741d5fdcbdb41ba49df4b75ba3c44b4dfb343feb771b388de1a5126360a931a566aa66d94a228be2a83a9e1a5"
+	"47ba39552ff57004cfe98bef92b7681c35ecd24a5021a760ad80dee0d63a475b19fc807dfd35be5f6329569c1ce62d1d3c0cb79f1c865897"
+	"c44393f8825a38cf51ecca854679bb2fa3a2b67032abd583f26a3fe8348c1680cf9b25d09dcfbfae16fc15a91cb5ea0558c86c30e15fea00"
+	"3f4f39590e3f222dc805f11c3518b43bafa55ba1c0d5fdbf3da4e1020f680d3582b31f8ae8ce022df7db1552bab46c67e49aecd738158a89"
+	"cf340cd9230bf104290269b8ac60109ccdfd22cadb589058f040d9ca1759358ce03444a47a4c4658a34bf5b230940de52d415046e270d3c1"
+	"d4ed285c1274a9a1c64d4b0122f755486b5cfd010ccbaa8c56bb61775fc2b2e6d523b40c8c749982a07631bbf7ab50e413c1a8b81eafc1d2"
+	"f75b6e91d25a4ec9ab44a855018177bd135e8e1daaf7b7c5138e9562604bdcdbed643f4965dd6f8b233f4cb966b8cfe3c47d55e5520cde74"
+	"e342e74421b4a1140650663beca89ec6248c8659cec26e6d8cd6ac8f1b97c1b9ab73567b4908cef7616afbfe25356345e3ed87f0d3a387fe"
+	"5628d083d7eebc311a6aa69e5b0e839f9af7317e510ae40c9a33238c65d02b7901ab169f5f0507dbd7de8b59f4e56d15f16ed615a4cfdf78"
+	"50ecc142e5f70b62e0afbcfda384c89aeb129a312347a7c0e98f7ff98e2c38e2a1934a69a9bcf90a4c082d8d3d52fb059beaefbaac061861"
+	"46ec4707b14780f80cbe9cb970dc3df0c6e0d17fc2b688895b3166967aabc6703c9515fadc4670f3e8f0bb28871663f1fa4e85d0bfcf3ed3"
+	"0a1364f95a7b893ad696d930c1dc5df3aa43ea95f3776b007a5efe055ca8b3204ad95bd5e4e7489d12a8b7226754288addee23f17d39b296"
+	"c44fc50f7ab082938a60702daccbb7650c9e06792ddb9a7b587068b34d4bb3afdb5a87eab12be501700695115ea8c80f88d436615c6bb6d3"
+	"1036120c4f77bebf0947c0f04a8484f2357860a873d7592d5deac1b8591f652081624566052b00e5657ac81b3cf52534525d3eef0e6ba346"
+	"54863b87563d6fd39a7f2f9d4320bb81576a44099433c68fe20458e5ad8e0a72716876eaf99b8547246f8567ea46b686fc8c71db29784431"
+	"92a6192b3ad28a79216003af6ebcbe04efbd300b807cb68333c5d325c11203a59241251d1b485cc524d13f3ed89cecb26f9cf0b08fe65005"
+	"869e2f43eb21972620b324b0b365d736212c31ea0a179a5e3ed039a49d5024676bd6d37ac60e0d27ecf915ce9abbdd433e2b4224167ea045"
+	"4ab13a1125424f0d52c061fbedf69a5742652f2ddb1e1a50cacf9085f0da0beb4db1e1cd82caa1be007ef1ff035a4226cb00000100";
+static const char gz_test_msg[] =
+	"1f8b08000000000002035d52c18edd3008fc156ebd44f9855e565577d543a5b6da332f26090a3111b637cadf17fcde76abbd19330cc3c013"
+	"27b8b401bd91c14a685057826ab850ba40677842ab2bfc145c1a7181df9e7de5425fe1d991da96b542d63ac273fd52e20508a5aa5d9de785"
+	"12c3a94d125412894e0f24c22f765ea185721a3f77393110feb9c10fb5143a822e4a06280a879e647313c09c223e5d91ab87a9b76a1e04fc"
+	"9bdae42f05ceb334cad3fd7be7c4d32a6a8cb9447a32c24a203cd3388ef0dda9d069dbb4ba882deb2994167a17914255e11464583fbaba83"
+	"1936a2a3a33453e939344a80376d1566d31dd2c57919bb8f1f4c0feabb608ed90faceb8957c8db315fcec0c2959db4e81e2d73145ae46f04"
+	"2d67accd50bafa1b4de898ff7c8ab1eeaa2416e30a425b777936e46e7044a2a5e75c422f1de05cddab3e5b6d28720d01f581add0101c897d"
+	"7b7ff2ac569b6ba040c40161bf8c20c2e330af669f2c8eecfad77ecb740e212b7fc66d2c6eb9ffeebeba9e2ce2c6fae998669efa9077d30b"
+	"bef954ce61e561afafd26fe4d6fa5906452199c7bf64d782a6e7020000";
+
+int BenchmarkGunzip(void)
+{
+	int i, j, errors = 0;
+	int64_t r;
+	size_t msg_len = strlen(test_msg), len, data_len = strlen(gz_test_data) / 2;
+	size_t member_len = strlen(gz_test_msg) / 2;
+	uint64_t start, duration;
+	uint8_t *data = NULL, *member = NULL, *members = NULL, *dst = NULL;
+	uint8_t *expected_data = NULL, *expected_members = NULL;
+	struct {
+		const char* name;
+		uint8_t* src;
+		size_t src_len;
+		uint8_t* expected;
+		size_t size;
+		int iterations;
+	} gz_test[2] = {
+		{ "single stream", NULL, 0, NULL, GZ_TEST_SIZE, 200 },
+		{ "small members", NULL, 0, NULL, 0, 5 },
+	};
+
+	data = to_bin(gz_test_data);
+	member = to_bin(gz_test_msg);
+	members = malloc(member_len * GZ_TEST_MEMBERS);
+	expected_data = malloc(GZ_TEST_SIZE);
+	expected_members = malloc(msg_len * GZ_TEST_MEMBERS);
+	dst = malloc(MAX(GZ_TEST_SIZE, msg_len * GZ_TEST_MEMBERS));
+	if ((data == NULL) || (member == NULL) || (members == NULL) || (expected_data == NULL) ||
+		(expected_members == NULL) || (dst == NULL) ||
+		(bled_init(0, NULL, NULL, NULL, NULL, NULL, NULL) != 0)) {
+		uprintf("gzip: Could not set up the benchmark");
+		errors++;
+		goto out;
+	}
+	CodecTestData(expected_data, GZ_TEST_SIZE, 7);
+	for (i = 0; i < GZ_TEST_MEMBERS; i++) {
+		memcpy(&members[i * member_len], member, member_len);
+		memcpy(&expected_members[i * msg_len], test_msg, msg_len);
+	}
+	gz_test[0].src = data;
+	gz_test[0].src_len = data_len;
+	gz_test[0].expected = expected_data;
+	gz_test[1].src = members;
+	gz_test[1].src_len = member_len * GZ_TEST_MEMBERS;
+	gz_test[1].expected = expected_members;
+	gz_test[1].size = msg_len * GZ_TEST_MEMBERS;
+
+	for (i = 0; i < ARRAYSIZE(gz_test); i++) {
+		len = gz_test[i].size;
+		memset(dst, 0xAA, len);
+		r = bled_uncompress_from_buffer_to_buffer((const char*)gz_test[i].src, gz_test[i].src_len,
+			(char*)dst, len, BLED_COMPRESSION_GZIP);
+		if ((r != (int64_t)len) || (memcmp(dst, gz_test[i].expected, len) != 0)) {
+			uprintf("gzip (%s): FAIL", gz_test[i].name);
+			errors++;
+			continue;
+		}
+		start = IoStatsNow();
+		for (j = 0; j < gz_test[i].iterations; j++)
+			bled_uncompress_from_buffer_to_buffer((const char*)gz_test[i].src, gz_test[i].src_len,
+				(char*)dst, len, BLED_COMPRESSION_GZIP);
+		duration = MAX(IoStatsNow() - start, 1);
+		uprintf("gzip (%s): %.1f MB/s", gz_test[i].name, (double)len * gz_test[i].iterations / duration);
+	}
+	// The CRC of the last member must still be checked
+	members[gz_test[1].src_len - 8] ^= 0x01;
+	if (bled_uncompress_from_buffer_to_buffer((const char*)members, gz_test[1].src_len, (char*)dst,
+		gz_test[1].size, BLED_COMPRESSION_GZIP) >= 0) {
+		uprintf("gzip: FAIL (altered CRC was accepted)");
+		errors++;
+	}
+	bled_exit();
+
+out:
+	free(data);
+	free(member);
+	free(members);
+	free(expected_data);
+	free(expected_members);
+	free(dst);
+	return errors;
+}
+
+/*
+ * XML data of a WIM with two images, as found in an install.wim. Only the first image has a
+ * DISPLAYNAME and the second one has a non ASCII name, which must be converted to UTF-8.
+ */
+static const wchar_t wim_test_xml[] = L"\xfeff<WIM><TOTALBYTES>4171225730</TOTALBYTES>"
+	L"<IMAGE INDEX=\"1\"><DIRCOUNT>21107</DIRCOUNT><WINDOWS><ARCH>9</ARCH><EDITIONID>Core</EDITIONID>"
+	L"<VERSION><MAJOR>10</MAJOR><MINOR>0</MINOR><BUILD>26100</BUILD><SPBUILD>1742</SPBUILD></VERSION>"
+	L"</WINDOWS><NAME>Windows 11 Home</NAME><DESCRIPTION>Windows 11 Home</DESCRIPTION>"
+	L"<DISPLAYNAME>Windows 11 Famille</DISPLAYNAME></IMAGE>"
+	L"<IMAGE INDEX=\"2\"><DIRCOUNT>21452</DIRCOUNT><WINDOWS><ARCH>9</ARCH><EDITIONID>Education</EDITIONID>"
+	L"<VERSION><MAJOR>10</MAJOR><MINOR>0</MINOR><BUILD>22631</BUILD><SPBUILD>2861</SPBUILD></VERSION>"
+	L"</WINDOWS><NAME>Windows 11 \u00c9ducation</NAME><DESCRIPTION>Windows 11 \u00c9ducation</DESCRIPTION>"
+	L"</IMAGE></WIM>";
+
+/* Write a WIM made of header, filler data up to WIM_TEST_XML_OFFSET and xml, and read its XML data back */
+static wchar_t* WimTestGetXmlData(const char* path, const WIM_HEADER* header, DWORD header_size, const wchar_t* xml)
+{
+	DWORD xml_size = (DWORD)(wcslen(xml) * sizeof(wchar_t)), size = WIM_TEST_XML_OFFSET + xml_size;
+	DWORD write_size = (header_size < sizeof(WIM_HEADER)) ? header_size : size;
+	uint8_t* buf = malloc(size);
+	wchar_t* r = NULL;
+
+	if (buf == NULL)
+		return NULL;
+	CodecTestData(buf, WIM_TEST_XML_OFFSET, 8);
+	memcpy(buf, header, header_size);
+	memcpy(&buf[WIM_TEST_XML_OFFSET], xml, xml_size);
+	if (write_file(path, buf, write_size) == write_size)
+		r = WimGetXmlData(path, NULL);
+	free(buf);
+	return r;
+}
+
+int TestWimXml(void)
+{
+	const char* layout_name[2] = { "single line", "multiline" };
+	char path[MAX_PATH] = "", *data;
+	wchar_t *xml[2] = { NULL, NULL }, *wim_xml;
+	size_t i, j, xml_size;
+	int layout, layout_errors, errors = 0;
+	WIM_HEADER header = { 0 }, bad_header;
+	static const struct {
+		const char* token;
+		unsigned int n;
+		const char* data;
+	} wim_test_token[] = {
+		{ "IMAGE INDEX", 1, "1" },
+		{ "IMAGE INDEX", 2, "2" },
+		{ "IMAGE INDEX", 3, NULL },
+		{ "DISPLAYNAME", 1, "Windows 11 Famille" },
+		{ "DISPLAYNAME", 2, NULL },
+		{ "DESCRIPTION", 2, "Windows 11 \xc3\x89""ducation" },
+		{ "EDITIONID", 2, "Education" },
+		{ "MAJOR", 1, "10" },
+		{ "MINOR", 2, "0" },
+		{ "BUILD", 1, "26100" },
+		{ "BUILD", 2, "22631" },
+		{ "SPBUILD", 2, "2861" },
+	};
+	// Alterations of the header or of the file, that must make the read fail
+	static const char* bad_wim[] = { "invalid magic", "compressed XML data", "XML data past the end", "truncated header" };
+
+	// The same XML, split with a new line and an indent between each element, as in pretty printed XML
+	xml_size = wcslen(wim_test_xml);
+	xml[0] = (wchar_t*)wim_test_xml;
+	xml[1] = calloc(4 * xml_size, sizeof(wchar_t));
+	if ((xml[1] == NULL) || (GetTempFileNameU(temp_dir, APPLICATION_NAME, 0, path) == 0)) {
+		uprintf("WIM XML: Could not set up the test");
+		errors++;
+		goto out;
+	}
+	for (i = 0, j = 0; i < xml_size; i++) {
+		if ((i > 0) && (wim_test_xml[i] == L'<') && (wim_test_xml[i - 1] == L'>')) {
+			xml[1][j++] = L'\r';
+			xml[1][j++] = L'\n';
+			xml[1][j++] = L'\t';
+		}
+		xml[1][j++] = wim_test_xml[i];
+	}
+
+	header.magic = WIM_MAGIC;
+	header.header_size = sizeof(WIM_HEADER);
+	header.version = 0x10d00;
+	header.chunk_size = 32 * KB;
+	header.part_number = 1;
+	header.total_parts = 1;
+	header.image_count = 2;
+	header.xml_data.offset = WIM_TEST_XML_OFFSET;
+	for (layout = 0; layout < 2; layout++) {
+		xml_size = wcslen(xml[layout]) * sizeof(wchar_t);
+		for (i = 0; i < sizeof(header.xml_data.size); i++)
+			header.xml_data.size[i] = (uint8_t)(xml_size >> (8 * i));
+		header.xml_data.original_size = xml_size;
+		layout_errors = errors;
+		wim_xml = WimTestGetXmlData(path, &header, sizeof(header), xml[layout]);
+		if ((wim_xml == NULL) || (wcscmp(wim_xml, xml[layout]) != 0)) {
+			uprintf("WIM XML (%s): FAIL", layout_name[layout]);
+			errors++;
+			free(wim_xml);
+			continue;
+		}
+		for (i = 0; i < ARRAYSIZE(wim_test_token); i++) {
+			data = get_token_data_xml(wim_test_token[i].token, wim_test_token[i].n, wim_xml);
+			if ((data == NULL) ? (wim_test_token[i].data != NULL) :
+				((wim_test_token[i].data == NULL) || (strcmp(data, wim_test_token[i].data) != 0))) {
+				uprintf("WIM XML (%s): FAIL (%s #%u is '%s')", layout_name[layout], wim_test_token[i].token,
+					wim_test_token[i].n, (data == NULL) ? "<NULL>" : data);
+				errors++;
+			}
+			free(data);
+		}
+		free(wim_xml);
+		uprintf("WIM XML (%s): %s", layout_name[layout], (errors == layout_errors) ? "PASS" : "FAIL");
+	}
+
+	for (i = 0; i < ARRAYSIZE(bad_wim); i++) {
+		bad_header = header;
+		switch (i) {
+		case 0:
+			bad_header.magic ^= 0x01;
+			break;
+		case 1:
+			bad_header.xml_data.flags |= WIM_RESHDR_FLAG_COMPRESSED;
+			break;
+		case 2:
+			bad_header.xml_data.offset += 2;
+			break;
+		}
+		wim_xml = WimTestGetXmlData(path, &bad_header, (i == 3) ? sizeof(header) / 2 : sizeof(header), xml[1]);
+		if (wim_xml != NULL) {
+			uprintf("WIM XML: FAIL (%s was accepted)", bad_wim[i]);
+			errors++;
+			free(wim_xml);
+		}
+	}
+
+out:
+	if (path[0] != 0)
+		DeleteFileU(path);
+	free(xml[1]);
+	return errors;
+}
+#endif
@@ -30,6 +30,10 @@
 #pragma once
 
 #define WIM_MAGIC							0x0000004D4957534DULL	// "MSWIM\0\0\0"
+#define VHD_FOOTER_COOKIE					"conectix"
+#define VHD_FOOTER_SIZE						512
+#define VHDX_SIGNATURE						"vhdxfile"
+#define FFU_SIGNATURE						"SignedImage "
 #define WIM_HAS_API_EXTRACT					1
 #define WIM_HAS_7Z_EXTRACT					2
 #define WIM_HAS_API_APPLY					4
@@ -103,6 +107,64 @@ typedef struct
 	};
 } STOPGAP_CREATE_VIRTUAL_DISK_PARAMETERS;
 
+#define WIM_HDR_FLAG_COMPRESSION			0x00000002
+#define WIM_HDR_FLAG_COMPRESS_XPRESS		0x00020000
+#define WIM_HDR_FLAG_COMPRESS_LZX			0x00040000
+#define WIM_HDR_FLAG_COMPRESS_LZMS			0x00080000
+#define WIM_DEFAULT_CHUNK_SIZE				32768
+#define WIM_MAX_RESOURCE_SIZE				(1 * GB)
+
+#define WIM_RESHDR_FLAG_METADATA			0x02
+#define WIM_RESHDR_FLAG_COMPRESSED			0x04
+#define WIM_RESHDR_FLAG_SPANNED				0x08
+#define WIM_RESHDR_FLAG_SOLID				0x10
+
+// Offsets of the fields we use in WIM directory entries and their extra stream entries
+#define WIM_DENTRY_ATTRIBUTES				8
+#define WIM_DENTRY_SUBDIR_OFFSET			16
+#define WIM_DENTRY_HASH						64
+#define WIM_DENTRY_NUM_STREAMS				96
+#define WIM_DENTRY_NAME_NBYTES				100
+#define WIM_DENTRY_NAME						102
+#define WIM_STREAM_HASH						16
+#define WIM_STREAM_NAME_NBYTES				36
+#define WIM_STREAM_NAME						38
+
+// WIM header, from the WIM format specifications that come with the WAIK
+#pragma pack(push, 1)
+typedef struct {
+	uint8_t		size[7];		// 56-bit size of the resource, as stored in the WIM
+	uint8_t		flags;
+	uint64_t	offset;
+	uint64_t	original_size;
+} WIM_RESHDR;
+
+typedef struct {
+	uint64_t	magic;
+	uint32_t	header_size;
+	uint32_t	version;
+	uint32_t	flags;
+	uint32_t	chunk_size;
+	GUID		guid;
+	uint16_t	part_number;
+	uint16_t	total_parts;
+	uint32_t	image_count;
+	WIM_RESHDR	offset_table;
+	WIM_RESHDR	xml_data;
+	WIM_RESHDR	boot_metadata;
+	uint32_t	boot_index;
+	WIM_RESHDR	integrity;
+	uint8_t		unused[60];
+} WIM_HEADER;
+
+typedef struct {
+	WIM_RESHDR	reshdr;
+	uint16_t	part_number;
+	uint32_t	refcnt;
+	uint8_t		hash[20];
+} WIM_LOOKUP_ENTRY;
+#pragma pack(pop)
+
 // From https://docs.microsoft.com/en-us/previous-versions/msdn10/dd834960(v=msdn.10)
 // as well as https://msfn.org/board/topic/150700-wimgapi-wimmountimage-progressbar/
 enum WIMMessage {
@@ -131,11 +193,13 @@ extern uint8_t WimExtractCheck(BOOL bSilent);
 extern BOOL WimExtractFile(const char* wim_image, int index, const char* src, const char* dst, BOOL bSilent);
 extern BOOL WimExtractFile_API(const char* image, int index, const char* src, const char* dst, BOOL bSilent);
 extern BOOL WimExtractFile_7z(const char* image, int index, const char* src, const char* dst, BOOL bSilent);
+extern BOOL WimExtractFile_Native(const char* image, int index, const char* src, const char* dst, BOOL bSilent);
 extern BOOL WimApplyImage(const char* image, int index, const char* dst);
 extern char* WimMountImage(const char* image, int index);
 extern BOOL WimUnmountImage(const char* image, int index, BOOL commit);
 extern char* WimGetExistingMountPoint(const char* image, int index);
 extern BOOL WimIsValidIndex(const char* image, int index);
+extern wchar_t* WimGetXmlData(const char* image, const char* wim_path);
 extern int8_t IsBootableImage(const char* path);
 extern char* VhdMountImageAndGetSize(const char* path, uint64_t* disksize);
 #define VhdMountImage(path) VhdMountImageAndGetSize(path, NULL)
@@ -90,6 +90,17 @@ static __inline VOID CloseFileAsync(HANDLE h)
 	free(fd);
 }
 
+/// <summary>
+/// Set the offset at which the next asynchronous read or write operation takes place.
+/// </summary>
+/// <param name="h">An async handle, created by a call to CreateFileAsync()</param>
+/// <param name="ullOffset">The offset, in bytes, from the start of the file or device</param>
+static __inline VOID SetFileOffsetAsync(HANDLE h, ULONG64 ullOffset)
+{
+	ASYNC_FD* fd = (ASYNC_FD*)h;
+	fd->Overlapped.Offset = ullOffset;
+}
+
 /// <summary>
 /// Initiate a read operation for asynchronous I/O.
 /// </summary>
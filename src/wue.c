@@ -415,25 +415,35 @@ out:
 	return r;
 }
 
+/// <summary>
+/// Get the data for the 'index'th occurrence of 'token' from an install[.wim|.esd] XML index
+/// that was either read in memory, or extracted to a file.
+/// </summary>
+static __inline char* GetXmlTokenData(const char* token, const wchar_t* xml_data, const char* xml_file, int index)
+{
+	return (xml_data != NULL) ? get_token_data_xml(token, index, xml_data) : get_token_data_file_indexed(token, xml_file, index);
+}
+
 /// <summary>
 /// Populate the img_report Window version from an install[.wim|.esd] XML index
 /// </summary>
+/// <param name="xml_data">The UTF-16 XML index data, or NULL to use xml_file.</param>
 /// <param name="xml_file">The path of the extracted index XML.</param>
 /// <param name="index">The index of the occurrence to look for.</param>
-static void PopulateWindowsVersionFromXml(const char* xml_file, int index)
+static void PopulateWindowsVersionFromXml(const wchar_t* xml_data, const char* xml_file, int index)
 {
 	char* val;
 
-	val = get_token_data_file_indexed("MAJOR", xml_file, index);
+	val = GetXmlTokenData("MAJOR", xml_data, xml_file, index);
 	img_report.win_version.major = (uint16_t)safe_atoi(val);
 	free(val);
-	val = get_token_data_file_indexed("MINOR", xml_file, index);
+	val = GetXmlTokenData("MINOR", xml_data, xml_file, index);
 	img_report.win_version.minor = (uint16_t)safe_atoi(val);
 	free(val);
-	val = get_token_data_file_indexed("BUILD", xml_file, index);
+	val = GetXmlTokenData("BUILD", xml_data, xml_file, index);
 	img_report.win_version.build = (uint16_t)safe_atoi(val);
 	free(val);
-	val = get_token_data_file_indexed("SPBUILD", xml_file, index);
+	val = GetXmlTokenData("SPBUILD", xml_data, xml_file, index);
 	img_report.win_version.revision = (uint16_t)safe_atoi(val);
 	free(val);
 	// Adjust versions so that we produce a more accurate report in the log
@@ -475,9 +485,19 @@ BOOL PopulateWindowsVersion(void)
 {
 	char *mounted_iso, mounted_image_path[128];
 	char xml_file[MAX_PATH] = "";
+	wchar_t* xml_data;
 
 	memset(&img_report.win_version, 0, sizeof(img_report.win_version));
 
+	// Try to read the XML index straight from the image first, as this is a lot faster
+	xml_data = WimGetXmlData(image_path, img_report.is_windows_img ? NULL : &img_report.wininst_path[0][2]);
+	if (xml_data != NULL) {
+		PopulateWindowsVersionFromXml(xml_data, NULL, 1);
+		free(xml_data);
+		if ((img_report.win_version.major != 0) && (img_report.win_version.build != 0))
+			return TRUE;
+	}
+
 	if ((WindowsVersion.Version < WINDOWS_8) || ((WimExtractCheck(TRUE) & 4) == 0))
 		return FALSE;
 
@@ -506,7 +526,7 @@ BOOL PopulateWindowsVersion(void)
 		goto out;
 	}
 
-	PopulateWindowsVersionFromXml(xml_file, 1);
+	PopulateWindowsVersionFromXml(NULL, xml_file, 1);
 
 out:
 	DeleteFileU(xml_file);
@@ -552,9 +572,10 @@ int SetWinToGoIndex(void)
 	char* mounted_iso, mounted_image_path[128];
 	char xml_file[MAX_PATH] = "";
 	char* install_names[MAX_WININST];
+	wchar_t* xml_data = NULL;
 	StrArray version_name, version_index;
 	int i;
-	BOOL bNonStandard = FALSE;
+	BOOL bNonStandard = FALSE, bMounted = FALSE;
 
 	// Sanity checks
 	wintogo_index = -1;
@@ -575,34 +596,39 @@ int SetWinToGoIndex(void)
 			wininst_index = 0;
 	}
 
-	// If we're not using a straight install.wim, we need to mount the ISO to access it
-	if (!img_report.is_windows_img) {
-		mounted_iso = VhdMountImage(image_path);
-		if (mounted_iso == NULL) {
-			uprintf("Could not mount ISO for Windows To Go selection");
-			return -1;
+	// Try to read the XML index straight from the image first, so that we don't have to mount the ISO
+	xml_data = WimGetXmlData(image_path, img_report.is_windows_img ? NULL : &img_report.wininst_path[wininst_index][2]);
+	if (xml_data == NULL) {
+		// If we're not using a straight install.wim, we need to mount the ISO to access it
+		if (!img_report.is_windows_img) {
+			mounted_iso = VhdMountImage(image_path);
+			if (mounted_iso == NULL) {
+				uprintf("Could not mount ISO for Windows To Go selection");
+				return -1;
+			}
+			bMounted = TRUE;
+			static_sprintf(mounted_image_path, "%s%s", mounted_iso, &img_report.wininst_path[wininst_index][2]);
 		}
-		static_sprintf(mounted_image_path, "%s%s", mounted_iso, &img_report.wininst_path[wininst_index][2]);
-	}
 
-	// Now take a look at the XML file in install.wim to list our versions
-	if ((GetTempFileNameU(temp_dir, APPLICATION_NAME, 0, xml_file) == 0) || (xml_file[0] == 0)) {
-		// Last ditch effort to get a tmp file - just extract it to the current directory
-		static_strcpy(xml_file, ".\\RufVXml.tmp");
-	}
-	// GetTempFileName() may leave a file behind
-	DeleteFileU(xml_file);
+		// Now take a look at the XML file in install.wim to list our versions
+		if ((GetTempFileNameU(temp_dir, APPLICATION_NAME, 0, xml_file) == 0) || (xml_file[0] == 0)) {
+			// Last ditch effort to get a tmp file - just extract it to the current directory
+			static_strcpy(xml_file, ".\\RufVXml.tmp");
+		}
+		// GetTempFileName() may leave a file behind
+		DeleteFileU(xml_file);
 
-	// Must use the Windows WIM API as 7z messes up the XML
-	if (!WimExtractFile_API(img_report.is_windows_img ? image_path : mounted_image_path,
-		0, "[1].xml", xml_file, FALSE)) {
-		uprintf("Could not acquire WIM index");
-		goto out;
+		// Must use the Windows WIM API as 7z messes up the XML
+		if (!WimExtractFile_API(img_report.is_windows_img ? image_path : mounted_image_path,
+			0, "[1].xml", xml_file, FALSE)) {
+			uprintf("Could not acquire WIM index");
+			goto out;
+		}
 	}
 
 	StrArrayCreate(&version_name, 16);
 	StrArrayCreate(&version_index, 16);
-	for (i = 0; StrArrayAdd(&version_index, get_token_data_file_indexed("IMAGE INDEX", xml_file, i + 1), FALSE) >= 0; i++) {
+	for (i = 0; StrArrayAdd(&version_index, GetXmlTokenData("IMAGE INDEX", xml_data, xml_file, i + 1), FALSE) >= 0; i++) {
 		// Some people are apparently creating *unofficial* Windows ISOs that don't have DISPLAYNAME elements.
 		// If we are parsing such an ISO, try to fall back to using DESCRIPTION. Of course, since we don't use
 		// a formal XML parser, if an ISO mixes entries with both DISPLAYNAME and DESCRIPTION and others with
@@ -610,9 +636,9 @@ int SetWinToGoIndex(void)
 		// But hey, there's only so far I'm willing to go to help people who, not content to have demonstrated
 		// their utter ignorance on development matters, are also trying to lecture experienced developers
 		// about specific "noob mistakes"... that don't exist in the code they are trying to criticize.
-		if (StrArrayAdd(&version_name, get_token_data_file_indexed("DISPLAYNAME", xml_file, i + 1), FALSE) < 0) {
+		if (StrArrayAdd(&version_name, GetXmlTokenData("DISPLAYNAME", xml_data, xml_file, i + 1), FALSE) < 0) {
 			bNonStandard = TRUE;
-			if (StrArrayAdd(&version_name, get_token_data_file_indexed("DESCRIPTION", xml_file, i + 1), FALSE) < 0) {
+			if (StrArrayAdd(&version_name, GetXmlTokenData("DESCRIPTION", xml_data, xml_file, i + 1), FALSE) < 0) {
 				uprintf("Warning: Could not find a description for image index %d", i + 1);
 				StrArrayAdd(&version_name, "Unknown Windows Version", TRUE);
 			}
@@ -632,7 +658,7 @@ int SetWinToGoIndex(void)
 		wintogo_index = atoi(version_index.String[i - 1]);
 	if (i > 0) {
 		// re-populate the version data from the selected XML index
-		PopulateWindowsVersionFromXml(xml_file, i);
+		PopulateWindowsVersionFromXml(xml_data, xml_file, i);
 		// If we couldn't obtain the major and build, we have a problem
 		if (img_report.win_version.major == 0 || img_report.win_version.build == 0)
 			uprintf("Warning: Could not obtain version information from XML index (Nonstandard Windows image?)");
@@ -656,8 +682,10 @@ int SetWinToGoIndex(void)
 	StrArrayDestroy(&version_index);
 
 out:
-	DeleteFileU(xml_file);
-	if (!img_report.is_windows_img)
+	safe_free(xml_data);
+	if (xml_file[0] != 0)
+		DeleteFileU(xml_file);
+	if (bMounted)
 		VhdUnmountImage();
 	return wintogo_index;
 }